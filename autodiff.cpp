@@ -0,0 +1,755 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "autodiff.h"
+#include "tree.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Operand of a tape entry which the operation doesn't have
+const size_t NO_OPERAND = (size_t) -1;
+
+const size_t TAPE_MIN_SIZE = 64;
+
+/// Walks of trees not deeper than this don't allocate memory for the stack
+const size_t AD_INLINE_FRAMES = 64;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+struct grad_ctx_t
+{
+    const char   *vars;
+    const double *point;
+    size_t        n_vars;
+
+    bool oom;
+};
+
+/// Operation which operands are being evaluated
+struct dual_frame_t
+{
+    const tree::node_t *node;
+    tree::dual_t        left;   ///< Left operand when it is evaluated
+    bool                right;  ///< Right operand is being evaluated
+};
+
+/// Operation which operands are being evaluated, tangents of its operands are in the scratch of its depth
+struct grad_frame_t
+{
+    const tree::node_t *node;
+    double              left;
+    bool                right;
+};
+
+/// Operation which operands are being written to the tape
+struct tape_frame_t
+{
+    const tree::node_t *node;
+    size_t              left;   ///< Entry of the left operand when it is written
+    bool                right;  ///< Right operand is being written
+};
+
+static tree::dual_t dual_subtree (const tree::node_t *node, char var, double x);
+static tree::dual_t dual_leaf    (const tree::node_t *node, char var, double x);
+static tree::dual_t dual_op      (tree::op_t op, tree::dual_t lhs, tree::dual_t rhs);
+
+static double grad_subtree (const tree::node_t *node, grad_ctx_t *ctx, double *tan);
+static double grad_leaf    (const tree::node_t *node, const grad_ctx_t *ctx, double *tan);
+static double grad_op      (tree::op_t op, double lhs, const double *lhs_tan,
+                                           double rhs, const double *rhs_tan,
+                                                       double *tan, size_t n_vars);
+
+static size_t tape_push    (tree::tape_t *tape, const tree::node_t *node);
+static size_t tape_append  (tree::tape_t *tape, const tree::node_t *node, size_t lhs, size_t rhs);
+static bool   tape_reserve (tree::tape_t *tape);
+
+static void tape_forward  (const tree::tape_t *tape, const char *vars, const double *point, double *vals);
+static void tape_backward (const tree::tape_t *tape, const char *vars, const double *vals,
+                                                     double *adjs, double *grad);
+
+static double pow_der (double base, double power, double val, double base_der, double power_der);
+
+static bool is_zero (double val);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief f(x) and f'(x) in one pass over the tree (forward mode, dual numbers)
+ *
+ * No derivative tree is built. Variables other than var evaluate to NAN, as in calc_tree.
+ */
+tree::dual_t tree::eval_with_derivative (const tree_t *tree, char var, double x)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    return dual_subtree (tree->head_node, var, x);
+}
+
+tree::dual_t tree::eval_with_derivative (const node_t *node, char var, double x)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    return dual_subtree (node, var, x);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Value and gradient over several variables in one pass (vector forward mode)
+ *
+ * @param vars  names of the variables, point[i] is the value of vars[i]
+ * @param[out] grad grad[i] = df / d vars[i], strlen (vars) elements
+ */
+tree::tree_err_t tree::eval_with_gradient (const tree_t *tree, const char *vars, const double *point,
+                                                                       double *value, double *grad)
+{
+    assert (tree  != nullptr && "invalid pointer");
+    assert (vars  != nullptr && "invalid pointer");
+    assert (point != nullptr && "invalid pointer");
+    assert (value != nullptr && "invalid pointer");
+    assert (grad  != nullptr && "invalid pointer");
+
+    grad_ctx_t ctx = {vars, point, strlen (vars), false};
+
+    *value = grad_subtree (tree->head_node, &ctx, grad);
+
+    return ctx.oom ? OOM : OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::tape_ctor (tape_t *tape, const tree_t *tree)
+{
+    assert (tape != nullptr && "invalid pointer");
+    assert (tree != nullptr && "invalid pointer");
+
+    *tape = {};
+
+    if (tape_push (tape, tree->head_node) == NO_OPERAND)
+    {
+        tape_dtor (tape);
+        return OOM;
+    }
+
+    return OK;
+}
+
+void tree::tape_dtor (tape_t *tape)
+{
+    assert (tape != nullptr && "invalid pointer");
+
+    free (tape->entries);
+    *tape = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Value and full gradient by reverse mode: one forward pass and one backward sweep
+ *
+ * Cost doesn't depend on the number of variables, unlike eval_with_gradient.
+ *
+ * @param vars  names of the variables, point[i] is the value of vars[i]
+ * @param[out] grad grad[i] = df / d vars[i], strlen (vars) elements
+ */
+tree::tree_err_t tree::eval_gradient (const tape_t *tape, const char *vars, const double *point,
+                                                                  double *value, double *grad)
+{
+    assert (tape  != nullptr && "invalid pointer");
+    assert (vars  != nullptr && "invalid pointer");
+    assert (point != nullptr && "invalid pointer");
+    assert (value != nullptr && "invalid pointer");
+    assert (grad  != nullptr && "invalid pointer");
+    assert (tape->size > 0 && "empty tape");
+
+    double *vals = (double *) calloc (2 * tape->size, sizeof (double));
+    if (vals == nullptr) return OOM;
+
+    double *adjs = vals + tape->size;
+
+    tape_forward  (tape, vars, point, vals);
+    tape_backward (tape, vars, vals, adjs, grad);
+
+    *value = vals[tape->size - 1];
+
+    free (vals);
+    return OK;
+}
+
+tree::tree_err_t tree::eval_gradient (const tree_t *tree, const char *vars, const double *point,
+                                                                  double *value, double *grad)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    tape_t tape = {};
+    tree_err_t err = tape_ctor (&tape, tree);
+    if (err != OK) return err;
+
+    err = eval_gradient (&tape, vars, point, value, grad);
+
+    tape_dtor (&tape);
+    return err;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order evaluation with explicit stack like calc_subtree
+ */
+static tree::dual_t dual_subtree (const tree::node_t *node, char var, double x)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    dual_frame_t  inline_frames[AD_INLINE_FRAMES];
+    dual_frame_t *frames   = inline_frames;
+    size_t        capacity = AD_INLINE_FRAMES;
+    size_t        size     = 0;
+
+    tree::dual_t val = {NAN, NAN};
+
+    while (true)
+    {
+        while (node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    if (frames != inline_frames) free (frames);
+                    return {NAN, NAN};
+                }
+
+                frames = (dual_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, {NAN, NAN}, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        val = dual_leaf (node, var, x);
+
+        while (size > 0 && frames[size - 1].right)
+        {
+            size--;
+            val = dual_op (frames[size].node->op, frames[size].left, val);
+        }
+
+        if (size == 0) break;
+
+        frames[size - 1].left  = val;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return val;
+}
+
+static tree::dual_t dual_leaf (const tree::node_t *node, char var, double x)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            return {node->val, 0};
+
+        case tree::node_type_t::VAR:
+            if (node->var == var) return {x, 1};
+            else                  return {NAN, 0};
+
+        case tree::node_type_t::OP:
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    return {NAN, NAN};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static tree::dual_t dual_op (tree::op_t op, tree::dual_t lhs, tree::dual_t rhs)
+{
+    double val = NAN;
+
+    switch (op)
+    {
+        case tree::op_t::ADD: return {lhs.val + rhs.val, lhs.der + rhs.der};
+        case tree::op_t::SUB: return {lhs.val - rhs.val, lhs.der - rhs.der};
+        case tree::op_t::MUL: return {lhs.val * rhs.val, lhs.der * rhs.val + lhs.val * rhs.der};
+
+        case tree::op_t::DIV:
+            val = lhs.val / rhs.val;
+            return {val, (lhs.der - val * rhs.der) / rhs.val};
+
+        case tree::op_t::SIN: return {sin (rhs.val),  cos (rhs.val) * rhs.der};
+        case tree::op_t::COS: return {cos (rhs.val), -sin (rhs.val) * rhs.der};
+        case tree::op_t::LOG: return {log (rhs.val),  rhs.der / rhs.val};
+
+        case tree::op_t::EXP:
+            val = exp (rhs.val);
+            return {val, val * rhs.der};
+
+        case tree::op_t::POW:
+            val = pow (lhs.val, rhs.val);
+            return {val, pow_der (lhs.val, rhs.val, val, lhs.der, rhs.der)};
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    return {NAN, NAN};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order evaluation with explicit stack like calc_subtree, tangents of operands
+ *        of the operation at depth i are in the i-th part of one scratch buffer
+ *
+ * @param[out] tan derivatives of the subtree by every variable of ctx
+ * @return Value of the subtree (on OOM ctx->oom is set)
+ */
+static double grad_subtree (const tree::node_t *node, grad_ctx_t *ctx, double *tan)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (tan  != nullptr && "invalid pointer");
+
+    size_t n_vars = ctx->n_vars;
+
+    grad_frame_t  inline_frames[AD_INLINE_FRAMES];
+    grad_frame_t *frames   = inline_frames;
+    size_t        capacity = AD_INLINE_FRAMES;
+    size_t        size     = 0;
+
+    double *scratch = (double *) calloc (capacity * 2 * n_vars + 1, sizeof (double));
+    if (scratch == nullptr)
+    {
+        ctx->oom = true;
+        return NAN;
+    }
+
+    double val = NAN;
+
+    // Left and right operand tangents of the operation at depth i
+    #define FRAME_TAN(i) (scratch + (i) * 2 * n_vars)
+
+    // Result of the subtree goes to tangents of its operation or to tan for the root
+    #define TARGET_TAN                                                                          \
+        ((size == 0)                  ? tan                                :                    \
+         (frames[size - 1].right)     ? FRAME_TAN (size - 1) + n_vars      : FRAME_TAN (size - 1))
+
+    while (!ctx->oom)
+    {
+        while (node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ctx->oom = true;
+                    break;
+                }
+
+                frames = (grad_frame_t *) new_frames;
+
+                double *new_scratch = (double *) realloc (scratch, (capacity * 2 * n_vars + 1) * sizeof (double));
+                if (new_scratch == nullptr)
+                {
+                    ctx->oom = true;
+                    break;
+                }
+
+                scratch = new_scratch;
+            }
+
+            frames[size++] = {node, NAN, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (ctx->oom) break;
+
+        val = grad_leaf (node, ctx, TARGET_TAN);
+
+        while (size > 0 && frames[size - 1].right)
+        {
+            grad_frame_t *frame = frames + --size;
+
+            val = grad_op (frame->node->op, frame->left, FRAME_TAN (size), val, FRAME_TAN (size) + n_vars,
+                                                                           TARGET_TAN, n_vars);
+        }
+
+        if (size == 0) break;
+
+        frames[size - 1].left  = val;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    #undef TARGET_TAN
+    #undef FRAME_TAN
+
+    free (scratch);
+    if (frames != inline_frames) free (frames);
+
+    return (ctx->oom) ? NAN : val;
+}
+
+static double grad_leaf (const tree::node_t *node, const grad_ctx_t *ctx, double *tan)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (tan  != nullptr && "invalid pointer");
+
+    memset (tan, 0, ctx->n_vars * sizeof (double));
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            return node->val;
+
+        case tree::node_type_t::VAR:
+        {
+            const char *var_pos = strchr (ctx->vars, node->var);
+            if (var_pos == nullptr || node->var == '\0') return NAN;
+
+            size_t indx = (size_t) (var_pos - ctx->vars);
+            tan[indx] = 1;
+            return ctx->point[indx];
+        }
+
+        case tree::node_type_t::OP:
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    return NAN;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static double grad_op (tree::op_t op, double lhs, const double *lhs_tan,
+                                      double rhs, const double *rhs_tan,
+                                                  double *tan, size_t n_vars)
+{
+    double val = NAN;
+    double mlt = NAN;
+
+    switch (op)
+    {
+        case tree::op_t::ADD:
+            for (size_t i = 0; i < n_vars; ++i) tan[i] = lhs_tan[i] + rhs_tan[i];
+            return lhs + rhs;
+
+        case tree::op_t::SUB:
+            for (size_t i = 0; i < n_vars; ++i) tan[i] = lhs_tan[i] - rhs_tan[i];
+            return lhs - rhs;
+
+        case tree::op_t::MUL:
+            for (size_t i = 0; i < n_vars; ++i) tan[i] = lhs_tan[i] * rhs + lhs * rhs_tan[i];
+            return lhs * rhs;
+
+        case tree::op_t::DIV:
+            val = lhs / rhs;
+            for (size_t i = 0; i < n_vars; ++i) tan[i] = (lhs_tan[i] - val * rhs_tan[i]) / rhs;
+            return val;
+
+        case tree::op_t::POW:
+            val = pow (lhs, rhs);
+            for (size_t i = 0; i < n_vars; ++i) tan[i] = pow_der (lhs, rhs, val, lhs_tan[i], rhs_tan[i]);
+            return val;
+
+        case tree::op_t::SIN: val = sin (rhs); mlt =  cos (rhs); break;
+        case tree::op_t::COS: val = cos (rhs); mlt = -sin (rhs); break;
+        case tree::op_t::EXP: val = exp (rhs); mlt = val;        break;
+        case tree::op_t::LOG: val = log (rhs); mlt = 1 / rhs;    break;
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    // Unary ops: chain rule with one multiplier
+    for (size_t i = 0; i < n_vars; ++i) tan[i] = mlt * rhs_tan[i];
+    return val;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order linearization with explicit stack like calc_subtree
+ *
+ * @return Index of the subtree result or NO_OPERAND on OOM
+ */
+static size_t tape_push (tree::tape_t *tape, const tree::node_t *node)
+{
+    assert (tape != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    tape_frame_t  inline_frames[AD_INLINE_FRAMES];
+    tape_frame_t *frames   = inline_frames;
+    size_t        capacity = AD_INLINE_FRAMES;
+    size_t        size     = 0;
+
+    size_t indx = NO_OPERAND;
+
+    while (true)
+    {
+        bool ok = true;
+
+        while (node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (tape_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, NO_OPERAND, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        indx = tape_append (tape, node, NO_OPERAND, NO_OPERAND);
+
+        while (indx != NO_OPERAND && size > 0 && frames[size - 1].right)
+        {
+            size--;
+            indx = tape_append (tape, frames[size].node, frames[size].left, indx);
+        }
+
+        if (indx == NO_OPERAND || size == 0) break;
+
+        frames[size - 1].left  = indx;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return (size == 0) ? indx : NO_OPERAND;
+}
+
+/**
+ * @param lhs, rhs Entries of the operands, NO_OPERAND for leaves and lhs of unary operations
+ *
+ * @return Index of the new entry or NO_OPERAND on OOM
+ */
+static size_t tape_append (tree::tape_t *tape, const tree::node_t *node, size_t lhs, size_t rhs)
+{
+    assert (tape != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    tree::tape_entry_t entry = {node->type, tree::op_t::ADD, '\0', false, NAN, lhs, rhs};
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            entry.val = node->val;
+            break;
+
+        case tree::node_type_t::VAR:
+            entry.var     = node->var;
+            entry.has_var = true;
+            break;
+
+        case tree::node_type_t::OP:
+            entry.op      = node->op;
+            entry.has_var = (lhs != NO_OPERAND && tape->entries[lhs].has_var) || tape->entries[rhs].has_var;
+            break;
+
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    if (!tape_reserve (tape)) return NO_OPERAND;
+
+    tape->entries[tape->size] = entry;
+    return tape->size++;
+}
+
+static bool tape_reserve (tree::tape_t *tape)
+{
+    assert (tape != nullptr && "invalid pointer");
+
+    if (tape->size < tape->capacity) return true;
+
+    size_t new_capacity = tape->capacity ? 2 * tape->capacity : TAPE_MIN_SIZE;
+
+    tree::tape_entry_t *new_entries = (tree::tape_entry_t *)
+                                realloc (tape->entries, new_capacity * sizeof (tree::tape_entry_t));
+    if (new_entries == nullptr) return false;
+
+    tape->entries  = new_entries;
+    tape->capacity = new_capacity;
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void tape_forward (const tree::tape_t *tape, const char *vars, const double *point, double *vals)
+{
+    assert (tape  != nullptr && "invalid pointer");
+    assert (vars  != nullptr && "invalid pointer");
+    assert (point != nullptr && "invalid pointer");
+    assert (vals  != nullptr && "invalid pointer");
+
+    for (size_t i = 0; i < tape->size; ++i)
+    {
+        const tree::tape_entry_t *entry = tape->entries + i;
+
+        if (entry->type == tree::node_type_t::VAL)
+        {
+            vals[i] = entry->val;
+            continue;
+        }
+
+        if (entry->type == tree::node_type_t::VAR)
+        {
+            const char *var_pos = strchr (vars, entry->var);
+            vals[i] = (var_pos && entry->var != '\0') ? point[var_pos - vars] : NAN;
+            continue;
+        }
+
+        double lhs = entry->lhs == NO_OPERAND ? NAN : vals[entry->lhs];
+        double rhs = vals[entry->rhs];
+
+        switch (entry->op)
+        {
+            case tree::op_t::ADD: vals[i] = lhs + rhs;       break;
+            case tree::op_t::SUB: vals[i] = lhs - rhs;       break;
+            case tree::op_t::MUL: vals[i] = lhs * rhs;       break;
+            case tree::op_t::DIV: vals[i] = lhs / rhs;       break;
+            case tree::op_t::SIN: vals[i] = sin (rhs);       break;
+            case tree::op_t::COS: vals[i] = cos (rhs);       break;
+            case tree::op_t::EXP: vals[i] = exp (rhs);       break;
+            case tree::op_t::LOG: vals[i] = log (rhs);       break;
+            case tree::op_t::POW: vals[i] = pow (lhs, rhs);  break;
+
+            default:
+                assert (0 && "Unexpected op type");
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Adjoints are propagated from the result to operands, only into variable dependent entries
+ */
+static void tape_backward (const tree::tape_t *tape, const char *vars, const double *vals,
+                                                     double *adjs, double *grad)
+{
+    assert (tape != nullptr && "invalid pointer");
+    assert (vars != nullptr && "invalid pointer");
+    assert (vals != nullptr && "invalid pointer");
+    assert (adjs != nullptr && "invalid pointer");
+    assert (grad != nullptr && "invalid pointer");
+
+    memset (grad, 0, strlen (vars) * sizeof (double));
+    adjs[tape->size - 1] = 1;
+
+    for (size_t i = tape->size; i-- > 0; )
+    {
+        const tree::tape_entry_t *entry = tape->entries + i;
+        double adj = adjs[i];
+
+        if (!entry->has_var || is_zero (adj)) continue;
+
+        if (entry->type == tree::node_type_t::VAR)
+        {
+            const char *var_pos = strchr (vars, entry->var);
+            if (var_pos != nullptr && entry->var != '\0') grad[var_pos - vars] += adj;
+            continue;
+        }
+
+        size_t l = entry->lhs;
+        size_t r = entry->rhs;
+
+        // Adjoints of constant operands are never read, so they are written unconditionally
+        switch (entry->op)
+        {
+            case tree::op_t::ADD: adjs[l] += adj; adjs[r] += adj; break;
+            case tree::op_t::SUB: adjs[l] += adj; adjs[r] -= adj; break;
+
+            case tree::op_t::MUL:
+                adjs[l] += adj * vals[r];
+                adjs[r] += adj * vals[l];
+                break;
+
+            case tree::op_t::DIV:
+                adjs[l] += adj / vals[r];
+                adjs[r] -= adj * vals[i] / vals[r];
+                break;
+
+            case tree::op_t::SIN: adjs[r] += adj * cos (vals[r]); break;
+            case tree::op_t::COS: adjs[r] -= adj * sin (vals[r]); break;
+            case tree::op_t::EXP: adjs[r] += adj * vals[i];       break;
+            case tree::op_t::LOG: adjs[r] += adj / vals[r];       break;
+
+            case tree::op_t::POW:
+                if (tape->entries[l].has_var) adjs[l] += adj * pow_der (vals[l], vals[r], vals[i], 1, 0);
+                if (tape->entries[r].has_var) adjs[r] += adj * pow_der (vals[l], vals[r], vals[i], 0, 1);
+                break;
+
+            default:
+                assert (0 && "Unexpected op type");
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief d (base ^ power) = power * base^(power-1) * base' + base^power * log (base) * power'
+ *
+ * Terms with zero derivative are skipped, so constant powers of negative bases stay finite.
+ */
+static double pow_der (double base, double power, double val, double base_der, double power_der)
+{
+    double der = 0;
+
+    if (!is_zero (base_der))  der += power * pow (base, power - 1) * base_der;
+    if (!is_zero (power_der)) der += val * log (base) * power_der;
+
+    return der;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool is_zero (double val)
+{
+    return fpclassify (val) == FP_ZERO;
+}
@@ -0,0 +1,56 @@
+#ifndef AUTODIFF_H
+#define AUTODIFF_H
+
+#include "tree.h"
+
+namespace tree
+{
+    /// Value of the function and its derivative at one point
+    struct dual_t
+    {
+        double val;
+        double der;
+    };
+
+    /// One operation of the linearized tree, operands are indices of earlier entries
+    struct tape_entry_t
+    {
+        node_type_t type;
+        op_t        op;
+        char        var;
+        bool        has_var;    ///< Subtree depends on some variable (otherwise no adjoint is needed)
+
+        double val;
+
+        size_t lhs;
+        size_t rhs;
+    };
+
+    /**
+     * @brief Post-order linearization of the tree for reverse-mode differentiation
+     *
+     * Built once, may be evaluated at many points. Result is the last entry.
+     */
+    struct tape_t
+    {
+        tape_entry_t *entries  = nullptr;
+        size_t        capacity = 0;
+        size_t        size     = 0;
+    };
+
+    dual_t eval_with_derivative (const tree_t *tree, char var, double x);
+    dual_t eval_with_derivative (const node_t *node, char var, double x);
+
+    tree_err_t eval_with_gradient (const tree_t *tree, const char *vars, const double *point,
+                                                              double *value, double *grad);
+
+    tree_err_t tape_ctor (tape_t *tape, const tree_t *tree);
+    void       tape_dtor (tape_t *tape);
+
+    tree_err_t eval_gradient (const tape_t *tape, const char *vars, const double *point,
+                                                       double *value, double *grad);
+    tree_err_t eval_gradient (const tree_t *tree, const char *vars, const double *point,
+                                                       double *value, double *grad);
+}
+
+#endif
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+#include "batch.h"
+#include "common.h"
+#include "diff_calc.h"
+#include "file.h"
+#include "flat_tree.h"
+#include "lib/log.h"
+#include "scheduler.h"
+#include "tree.h"
+#include "tree_parsing.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const size_t BATCH_WINDOW_PER_THREAD = 16;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Output of one line, slot i % window holds line i
+struct slot_t
+{
+    char  *result;
+    size_t size;
+    bool   ready;
+    bool   failed;
+};
+
+/**
+ * @brief Workers take lines in input order, but don't take line i until line i - window
+ *        is written, so results which wait for output never take more than window slots
+ */
+struct batch_ctx_t
+{
+    const struct text         *text;
+    const batch::batch_opts_t *opts;
+
+    slot_t *slots;
+    size_t  window;
+
+    std::atomic<size_t> next_line;
+    size_t              n_written;   ///< Guarded by mutex
+
+    std::mutex              mutex;
+    std::condition_variable slot_ready;
+    std::condition_variable slot_free;
+};
+
+static void work         (batch_ctx_t *ctx);
+static bool process_line (const batch::batch_opts_t *opts, const char *line, FILE *stream);
+static bool is_blank     (const char *line);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+int batch::run (FILE *input, FILE *output, const batch_opts_t *opts)
+{
+    assert (input  != nullptr && "invalid pointer");
+    assert (output != nullptr && "invalid pointer");
+
+    batch_opts_t default_opts = {};
+    if (opts == nullptr) opts = &default_opts;
+
+    struct text *text = read_text (input);
+    if (text == nullptr)
+    {
+        LOG (log::ERR, "Failed to read batch input");
+        return ERROR;
+    }
+
+    unsigned n_threads = opts->n_threads ? opts->n_threads : sched::hardware_threads ();
+    size_t   window    = opts->window    ? opts->window    : BATCH_WINDOW_PER_THREAD * n_threads;
+
+    slot_t *slots = (slot_t *) calloc (window, sizeof (slot_t));
+    if (slots == nullptr)
+    {
+        free_text (text);
+        return ERROR;
+    }
+
+    batch_ctx_t ctx = {};
+    ctx.text   = text;
+    ctx.opts   = opts;
+    ctx.slots  = slots;
+    ctx.window = window;
+
+    std::thread *workers = new std::thread[n_threads];
+    for (unsigned i = 0; i < n_threads; ++i) workers[i] = std::thread (work, &ctx);
+
+    int n_failed = 0;
+
+    // Calling thread writes results as soon as the next one in input order is ready
+    for (size_t line = 0; line < text->n_lines; ++line)
+    {
+        slot_t *slot = slots + line % window;
+
+        {
+            std::unique_lock<std::mutex> lock (ctx.mutex);
+            ctx.slot_ready.wait (lock, [slot] { return slot->ready; });
+        }
+
+        if (slot->result != nullptr) fwrite (slot->result, 1, slot->size, output);
+        if (slot->failed)            n_failed++;
+
+        free (slot->result);
+        *slot = {};
+
+        {
+            std::lock_guard<std::mutex> lock (ctx.mutex);
+            ctx.n_written++;
+        }
+
+        ctx.slot_free.notify_all ();
+    }
+
+    for (unsigned i = 0; i < n_threads; ++i) workers[i].join ();
+
+    delete[] workers;
+    free (slots);
+    free_text (text);
+
+    fflush (output);
+    return n_failed;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static void work (batch_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    while (true)
+    {
+        size_t line = ctx->next_line.fetch_add (1);
+        if (line >= ctx->text->n_lines) return;
+
+        slot_t *slot = ctx->slots + line % ctx->window;
+
+        {
+            std::unique_lock<std::mutex> lock (ctx->mutex);
+            ctx->slot_free.wait (lock, [ctx, line] { return line < ctx->n_written + ctx->window; });
+        }
+
+        char  *result = nullptr;
+        size_t size   = 0;
+        bool   failed = true;
+
+        FILE *stream = open_memstream (&result, &size);
+        if (stream != nullptr)
+        {
+            failed = !process_line (ctx->opts, ctx->text->lines[line].content, stream);
+            fclose (stream);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (ctx->mutex);
+
+            slot->result = result;
+            slot->size   = size;
+            slot->failed = failed;
+            slot->ready  = true;
+        }
+
+        ctx->slot_ready.notify_one ();
+    }
+}
+
+/**
+ * @brief Parse -> calc_diff -> simplify -> store of one line, nodes live in the arena of the worker
+ *
+ * @return false if line is malformed or OOM
+ */
+static bool process_line (const batch::batch_opts_t *opts, const char *line, FILE *stream)
+{
+    assert (opts   != nullptr && "invalid pointer");
+    assert (line   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    if (is_blank (line))
+    {
+        fputc ('\n', stream);
+        return true;
+    }
+
+    tree::parse_error_t error = {};
+    tree::node_t *expr = tree::parse_dump (line, &error);
+
+    if (expr == nullptr)
+    {
+        if (error.err == tree::INVALID_DUMP)
+            fprintf (stream, "error: %zu: expected %s\n", error.offset, error.expected);
+        else
+            fprintf (stream, "error: out of memory\n");
+
+        return false;
+    }
+
+    tree::node_t *diff = tree::calc_diff (expr, opts->var, nullptr, false, nullptr, opts->simplify);
+    tree::del_node (expr);
+
+    tree::flat_tree_t flat = {};
+
+    if (diff == nullptr || tree::flatten (diff, &flat) != tree::OK)
+    {
+        fprintf (stream, "error: out of memory\n");
+
+        tree::del_node (diff);
+        return false;
+    }
+
+    if (opts->eval) fprintf (stream, "%.17g\t", tree::calc_tree (&flat, opts->eval_x));
+    tree::store (&flat, stream);
+
+    tree::flat_dtor (&flat);
+    tree::del_node (diff);
+
+    return true;
+}
+
+static bool is_blank (const char *line)
+{
+    assert (line != nullptr && "invalid pointer");
+
+    for (; *line != '\0'; ++line)
+    {
+        if (*line != ' ' && *line != '\t' && *line != '\r') return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+namespace batch
+{
+    struct batch_opts_t
+    {
+        unsigned n_threads = 0;       ///< Worker threads, 0 means all hardware threads
+        size_t   window    = 0;       ///< Lines being processed or waiting for output, 0 means 16 per thread
+
+        char   var      = 'x';
+        bool   simplify = true;
+        bool   eval     = false;      ///< Append value of derivative at eval_x
+        double eval_x   = 0;
+    };
+
+    /**
+     * @brief Differentiate every line of input and write results to output in input order
+     *
+     * Line i of output is the derivative of line i of input in parse_dump syntax (preceded by
+     * its value at x = opts->eval_x and a tab if opts->eval), "error: <offset>: expected <token>"
+     * if line can't be parsed or empty line for empty one.
+     *
+     * @param opts nullptr means default options
+     *
+     * @return Number of lines which failed or ERROR if input can't be read
+     */
+    int run (FILE *input, FILE *output, const batch_opts_t *opts = nullptr);
+}
+
+#endif
@@ -0,0 +1,463 @@
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "codegen.h"
+#include "cse.h"
+#include "lib/log.h"
+#include "tree.h"
+#include "tree_vm.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const size_t NATIVE_PATH_LEN = 1024;
+
+const char NATIVE_CACHE_SUBDIR[] = "matangpt";
+
+/// Flags are a part of the cache key, changing them recompiles every expression
+const char *const NATIVE_CFLAGS[] = {"-O2", "-fPIC", "-shared", "-fno-math-errno"};
+
+const size_t NATIVE_N_CFLAGS = sizeof (NATIVE_CFLAGS) / sizeof (NATIVE_CFLAGS[0]);
+
+/// Part of the cache key, must be changed with the generated source (emit_plan, emit_instr...)
+const char NATIVE_CODEGEN_VERSION[] = "codegen-1";
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+static void emit_plan  (const tree::cse_plan_t *plan, FILE *stream, const char *name);
+static void emit_instr (const tree::cse_instr_t *instr, FILE *stream);
+static void emit_val   (double val, FILE *stream);
+
+static bool cache_dir    (const tree::native_opts_t *opts, char *dir);
+static bool mkdir_p      (char *path);
+static bool run_compiler (const char *compiler, const char *src_path, const char *so_path);
+static bool write_file   (const char *path, const char *data, size_t size);
+
+static bool load_native (tree::native_t *native, const char *so_path);
+
+static uint64_t fnv1a (uint64_t hash, const char *data, size_t size);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::codegen_c (const tree_t *tree, FILE *stream, const char *name)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    return codegen_c (tree->head_node, stream, name);
+}
+
+/**
+ * @brief Emit C translation unit with `double name (double x)` and
+ *        `void name_array (const double *xs, double *out, size_t n)`
+ *
+ * Body is the CSE plan of the tree, one const temporary per distinct subexpression.
+ */
+tree::tree_err_t tree::codegen_c (const node_t *node, FILE *stream, const char *name)
+{
+    assert (node   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+    assert (name   != nullptr && "invalid pointer");
+
+    cse_plan_t plan = {};
+
+    tree_err_t err = cse_plan (node, &plan);
+    if (err != OK) return err;
+
+    emit_plan (&plan, stream, name);
+
+    cse_plan_dtor (&plan);
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Compile tree to a shared object in the cache directory and load it
+ *
+ * Object is named by structure hash of the tree (see subtree_hash), codegen version and compiler
+ * command, so the same expression compiled again (even by another run) is only loaded and
+ * its source is not even generated.
+ */
+tree::tree_err_t tree::compile_native (const tree_t *tree, native_t *native, const native_opts_t *opts)
+{
+    assert (tree   != nullptr && "invalid pointer");
+    assert (native != nullptr && "invalid pointer");
+
+    const native_opts_t default_opts = {};
+    if (opts == nullptr) opts = &default_opts;
+
+    assert (opts->compiler != nullptr && "invalid pointer");
+
+    *native = {};
+
+    // subtree_hash gives 0 when it has no memory for the walk
+    uint64_t tree_hash = subtree_hash (tree->head_node);
+    if (tree_hash == 0) return OOM;
+
+    uint64_t hash = fnv1a (0xCBF29CE484222325ull, (const char *) &tree_hash, sizeof (tree_hash));
+    hash = fnv1a (hash, NATIVE_CODEGEN_VERSION, sizeof (NATIVE_CODEGEN_VERSION) - 1);
+    hash = fnv1a (hash, opts->compiler, strlen (opts->compiler));
+    for (size_t i = 0; i < NATIVE_N_CFLAGS; ++i)
+    {
+        hash = fnv1a (hash, NATIVE_CFLAGS[i], strlen (NATIVE_CFLAGS[i]));
+    }
+
+    char dir     [NATIVE_PATH_LEN] = "";
+    char so_path [NATIVE_PATH_LEN] = "";
+    char src_path[NATIVE_PATH_LEN] = "";
+    char tmp_path[NATIVE_PATH_LEN] = "";
+
+    bool paths_ok = cache_dir (opts, dir);
+
+    pid_t pid = getpid ();
+
+    paths_ok = paths_ok &&
+        snprintf (so_path,  NATIVE_PATH_LEN, "%s/expr_%016" PRIx64 ".so",   dir, hash)      < (int) NATIVE_PATH_LEN &&
+        snprintf (src_path, NATIVE_PATH_LEN, "%s/expr_%016" PRIx64 ".%d.c", dir, hash, pid) < (int) NATIVE_PATH_LEN &&
+        snprintf (tmp_path, NATIVE_PATH_LEN, "%s.%d.tmp",                   so_path, pid)   < (int) NATIVE_PATH_LEN;
+
+    if (!paths_ok)
+    {
+        LOG (log::ERR, "can't use native cache directory '%s'", dir);
+        return COMPILE_FAILURE;
+    }
+
+    if (access (so_path, R_OK) == 0 && load_native (native, so_path))
+    {
+        native->from_cache = true;
+        return OK;
+    }
+
+    char  *src      = nullptr;
+    size_t src_size = 0;
+
+    FILE *src_stream = open_memstream (&src, &src_size);
+    if (src_stream == nullptr) return OOM;
+
+    tree_err_t err = codegen_c (tree, src_stream);
+    fclose (src_stream);
+
+    if (err != OK)
+    {
+        free (src);
+        return err;
+    }
+
+    LOG (log::INF, "compiling %s", so_path);
+
+    // Concurrent runs compile to own temporary names, rename makes the object visible atomically
+    bool compiled = write_file (src_path, src, src_size) &&
+                    run_compiler (opts->compiler, src_path, tmp_path) &&
+                    rename (tmp_path, so_path) == 0;
+
+    free (src);
+    unlink (src_path);
+
+    if (!compiled)
+    {
+        unlink (tmp_path);
+        return COMPILE_FAILURE;
+    }
+
+    return load_native (native, so_path) ? OK : COMPILE_FAILURE;
+}
+
+void tree::native_dtor (native_t *native)
+{
+    assert (native != nullptr && "invalid pointer");
+
+    if (native->handle != nullptr) dlclose (native->handle);
+    *native = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+double tree::calc_tree (const native_t *native, double x)
+{
+    assert (native       != nullptr && "invalid pointer");
+    assert (native->func != nullptr && "native code is not loaded");
+
+    return native->func (x);
+}
+
+tree::tree_err_t tree::calc_tree_batch (const native_t *native, const double *xs, double *out, size_t n)
+{
+    assert (native             != nullptr && "invalid pointer");
+    assert (native->array_func != nullptr && "native code is not loaded");
+    assert ((xs  != nullptr || n == 0) && "invalid pointer");
+    assert ((out != nullptr || n == 0) && "invalid pointer");
+
+    native->array_func (xs, out, n);
+
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static void emit_plan (const tree::cse_plan_t *plan, FILE *stream, const char *name)
+{
+    assert (plan   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+    assert (name   != nullptr && "invalid pointer");
+
+    fprintf (stream, "#include <math.h>\n"
+                     "#include <stddef.h>\n"
+                     "\n"
+                     "static inline double %s_body (double x)\n"
+                     "{\n"
+                     "    (void) x;\n"
+                     "\n", name);
+
+    for (size_t i = 0; i < plan->code_size; ++i)
+    {
+        fprintf (stream, "    const double t%zu = ", i);
+        emit_instr (plan->code + i, stream);
+        fprintf (stream, ";\n");
+    }
+
+    fprintf (stream, "\n"
+                     "    return t%zu;\n"
+                     "}\n"
+                     "\n"
+                     "double %s (double x)\n"
+                     "{\n"
+                     "    return %s_body (x);\n"
+                     "}\n"
+                     "\n"
+                     "void %s_array (const double *restrict xs, double *restrict out, size_t n)\n"
+                     "{\n"
+                     "    for (size_t i = 0; i < n; ++i) out[i] = %s_body (xs[i]);\n"
+                     "}\n", plan->code_size - 1, name, name, name, name);
+}
+
+#define BINARY_OP(op, fmt)                                              \
+    case tree::vm_op_t::op:                                             \
+        fprintf (stream, fmt, instr->lhs, instr->rhs);                  \
+        break;
+
+#define UNARY_OP(op, func)                                              \
+    case tree::vm_op_t::op:                                             \
+        fprintf (stream, func " (t%u)", instr->rhs);                    \
+        break;
+
+/// Same operations as calc_subtree, so native code gives the same values
+static void emit_instr (const tree::cse_instr_t *instr, FILE *stream)
+{
+    assert (instr  != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    switch (instr->op)
+    {
+        case tree::vm_op_t::CONST:   emit_val (instr->val, stream); break;
+        case tree::vm_op_t::VAR_X:   fprintf (stream, "x");         break;
+        case tree::vm_op_t::VAR_NAN: fprintf (stream, "NAN");       break;
+
+        BINARY_OP (ADD, "t%u + t%u")
+        BINARY_OP (SUB, "t%u - t%u")
+        BINARY_OP (DIV, "t%u / t%u")
+        BINARY_OP (MUL, "t%u * t%u")
+        BINARY_OP (POW, "pow (t%u, t%u)")
+
+        UNARY_OP (SIN, "sin")
+        UNARY_OP (COS, "cos")
+        UNARY_OP (EXP, "exp")
+        UNARY_OP (LOG, "log")
+
+        default:
+            assert (0 && "Unexpected instruction");
+    }
+}
+
+#undef BINARY_OP
+#undef UNARY_OP
+
+/// Hex float literal keeps every bit of the constant
+static void emit_val (double val, FILE *stream)
+{
+    assert (stream != nullptr && "invalid pointer");
+
+    if (isnan (val))
+    {
+        fprintf (stream, "NAN");
+    }
+    else if (isinf (val))
+    {
+        fprintf (stream, val > 0 ? "INFINITY" : "(-INFINITY)");
+    }
+    else
+    {
+        fprintf (stream, signbit (val) ? "(%a)" : "%a", val);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Fill dir (NATIVE_PATH_LEN bytes) with the cache directory, create it if needed
+ */
+static bool cache_dir (const tree::native_opts_t *opts, char *dir)
+{
+    assert (opts != nullptr && "invalid pointer");
+    assert (dir  != nullptr && "invalid pointer");
+
+    int len = 0;
+
+    const char *xdg_cache = getenv ("XDG_CACHE_HOME");
+    const char *home      = getenv ("HOME");
+
+    if (opts->cache_dir != nullptr)
+    {
+        len = snprintf (dir, NATIVE_PATH_LEN, "%s", opts->cache_dir);
+    }
+    else if (xdg_cache != nullptr && xdg_cache[0] != '\0')
+    {
+        len = snprintf (dir, NATIVE_PATH_LEN, "%s/%s", xdg_cache, NATIVE_CACHE_SUBDIR);
+    }
+    else if (home != nullptr && home[0] != '\0')
+    {
+        len = snprintf (dir, NATIVE_PATH_LEN, "%s/.cache/%s", home, NATIVE_CACHE_SUBDIR);
+    }
+    else
+    {
+        len = snprintf (dir, NATIVE_PATH_LEN, "/tmp/%s", NATIVE_CACHE_SUBDIR);
+    }
+
+    if (len < 0 || len >= (int) NATIVE_PATH_LEN) return false;
+
+    return mkdir_p (dir);
+}
+
+static bool mkdir_p (char *path)
+{
+    assert (path != nullptr && "invalid pointer");
+
+    for (char *slash = strchr (path + 1, '/'); ; slash = strchr (slash + 1, '/'))
+    {
+        if (slash != nullptr) *slash = '\0';
+
+        bool ok = mkdir (path, 0755) == 0 || errno == EEXIST;
+
+        if (slash == nullptr) return ok;
+        *slash = '/';
+
+        if (!ok) return false;
+    }
+}
+
+static bool run_compiler (const char *compiler, const char *src_path, const char *so_path)
+{
+    assert (compiler != nullptr && "invalid pointer");
+    assert (src_path != nullptr && "invalid pointer");
+    assert (so_path  != nullptr && "invalid pointer");
+
+    const char *argv[NATIVE_N_CFLAGS + 6] = {};
+
+    size_t argc = 0;
+    argv[argc++] = compiler;
+    for (size_t i = 0; i < NATIVE_N_CFLAGS; ++i) argv[argc++] = NATIVE_CFLAGS[i];
+    argv[argc++] = "-o";
+    argv[argc++] = so_path;
+    argv[argc++] = src_path;
+    argv[argc++] = "-lm";
+    argv[argc]   = nullptr;
+
+    pid_t pid = fork ();
+    if (pid < 0) return false;
+
+    if (pid == 0)
+    {
+        execvp (compiler, const_cast<char *const *> (argv));   // execvp doesn't modify arguments
+        _exit (127);
+    }
+
+    int status = 0;
+    while (waitpid (pid, &status, 0) < 0)
+    {
+        if (errno != EINTR) return false;
+    }
+
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+        LOG (log::ERR, "'%s' failed to compile %s", compiler, src_path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool write_file (const char *path, const char *data, size_t size)
+{
+    assert (path != nullptr && "invalid pointer");
+    assert (data != nullptr && "invalid pointer");
+
+    FILE *file = fopen (path, "w");
+    if (file == nullptr) return false;
+
+    bool ok = fwrite (data, 1, size, file) == size;
+
+    return fclose (file) == 0 && ok;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool load_native (tree::native_t *native, const char *so_path)
+{
+    assert (native  != nullptr && "invalid pointer");
+    assert (so_path != nullptr && "invalid pointer");
+
+    void *handle = dlopen (so_path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+    {
+        LOG (log::ERR, "dlopen: %s", dlerror ());
+        return false;
+    }
+
+    void *func       = dlsym (handle, "f");
+    void *array_func = dlsym (handle, "f_array");
+
+    if (func == nullptr || array_func == nullptr)
+    {
+        LOG (log::ERR, "%s has no expression functions", so_path);
+
+        dlclose (handle);
+        return false;
+    }
+
+    native->handle = handle;
+
+    // Object to function pointer conversion is conditionally supported, so copy the bits
+    memcpy (&native->func,       &func,       sizeof (native->func));
+    memcpy (&native->array_func, &array_func, sizeof (native->array_func));
+
+    return true;
+}
+
+static uint64_t fnv1a (uint64_t hash, const char *data, size_t size)
+{
+    assert (data != nullptr && "invalid pointer");
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001B3ull;
+    }
+
+    return hash;
+}
@@ -0,0 +1,44 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <stdio.h>
+
+#include "tree.h"
+
+namespace tree
+{
+    typedef double (*native_f)(double x);
+    typedef void   (*native_array_f)(const double *xs, double *out, size_t n);
+
+    struct native_opts_t
+    {
+        const char *cache_dir = nullptr;   ///< nullptr means $XDG_CACHE_HOME/matangpt (~/.cache/matangpt)
+        const char *compiler  = "cc";
+    };
+
+    /**
+     * @brief Tree compiled to machine code by the system compiler and loaded as shared object
+     */
+    struct native_t
+    {
+        void *handle = nullptr;
+
+        native_f       func       = nullptr;   ///< double f (double x)
+        native_array_f array_func = nullptr;   ///< out[i] = f (xs[i])
+
+        bool from_cache = false;   ///< Shared object was compiled by some previous run
+    };
+
+    tree_err_t codegen_c (const tree_t *tree, FILE *stream, const char *name = "f");
+    tree_err_t codegen_c (const node_t *node, FILE *stream, const char *name = "f");
+
+    tree_err_t compile_native (const tree_t *tree, native_t *native, const native_opts_t *opts = nullptr);
+
+    void native_dtor (native_t *native);
+
+    double calc_tree (const native_t *native, double x);
+
+    tree_err_t calc_tree_batch (const native_t *native, const double *xs, double *out, size_t n);
+}
+
+#endif
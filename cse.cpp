@@ -0,0 +1,527 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cse.h"
+#include "lib/log.h"
+#include "tree.h"
+#include "tree_vm.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Plans with more temporaries keep them in heap
+const size_t CSE_STACK_TMPS = 512;
+
+const size_t CSE_MIN_CAPACITY = 64;
+
+const unsigned CSE_NONE = (unsigned) -1;
+
+/// Plans of trees not deeper than this don't allocate memory for the walk
+const size_t CSE_INLINE_FRAMES = 64;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+struct cse_node_entry_t
+{
+    const tree::node_t *node;
+    unsigned            tmp;
+};
+
+/**
+ * @brief Two tables: temporaries by expression (op + operand temporaries, so structurally
+ *        equal subtrees meet here) and by node pointer (shared nodes are walked once)
+ */
+struct cse_ctx_t
+{
+    tree::cse_plan_t *plan;
+    size_t            capacity;
+    size_t           *sizes;    ///< Tree size of every temporary
+
+    unsigned *exprs;
+    size_t    exprs_capacity;
+
+    cse_node_entry_t *nodes;
+    size_t            nodes_capacity;
+    size_t            nodes_size;
+};
+
+/// Operation which operands are being planned, left is temporary of the left one when it is planned
+struct plan_frame_t
+{
+    const tree::node_t *node;
+    unsigned            left;
+    bool                right;  ///< Right operand is being planned
+};
+
+static unsigned plan_subtree (cse_ctx_t *ctx, const tree::node_t *node);
+static unsigned plan_known   (const cse_ctx_t *ctx, const tree::node_t *node);
+static unsigned plan_node    (cse_ctx_t *ctx, const tree::node_t *node, unsigned lhs, unsigned rhs);
+static unsigned plan_instr   (cse_ctx_t *ctx, tree::cse_instr_t instr);
+
+static bool exprs_rehash (cse_ctx_t *ctx, size_t capacity);
+static bool nodes_insert (cse_ctx_t *ctx, const tree::node_t *node, unsigned tmp);
+
+static uint64_t instr_hash  (const tree::cse_instr_t *instr);
+static bool     instr_equal (const tree::cse_instr_t *lhs, const tree::cse_instr_t *rhs);
+static uint64_t ptr_hash    (const tree::node_t *node);
+
+static tree::vm_op_t to_vm_op (tree::op_t op);
+
+static double run_plan (const tree::cse_plan_t *plan, double x, double *tmps);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::cse_plan (const tree_t *tree, cse_plan_t *plan)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    return cse_plan (tree->head_node, plan);
+}
+
+/**
+ * @brief Common subexpression elimination: structurally equal subtrees get one temporary
+ *
+ * ADD and MUL operands are ordered, so a + b and b + a are one temporary too.
+ */
+tree::tree_err_t tree::cse_plan (const node_t *node, cse_plan_t *plan)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (plan != nullptr && "invalid pointer");
+
+    *plan = {};
+
+    cse_ctx_t ctx = {};
+    ctx.plan     = plan;
+    ctx.capacity = CSE_MIN_CAPACITY;
+
+    plan->code = (cse_instr_t *) calloc (ctx.capacity, sizeof (cse_instr_t));
+    ctx.sizes  = (size_t *)      calloc (ctx.capacity, sizeof (size_t));
+
+    unsigned root = CSE_NONE;
+
+    if (plan->code != nullptr && ctx.sizes != nullptr && exprs_rehash (&ctx, 2 * CSE_MIN_CAPACITY))
+    {
+        root = plan_subtree (&ctx, node);
+    }
+
+    if (root != CSE_NONE)
+    {
+        assert (root == plan->code_size - 1 && "result must be the last temporary");
+
+        plan->n_nodes   = ctx.sizes[root];
+        plan->n_deduped = plan->n_nodes - plan->code_size;
+
+        LOG (log::DBG, "CSE: %zu nodes -> %zu temporaries, %zu deduplicated",
+                                            plan->n_nodes, plan->code_size, plan->n_deduped);
+    }
+
+    free (ctx.sizes);
+    free (ctx.exprs);
+    free (ctx.nodes);
+
+    if (root == CSE_NONE)
+    {
+        cse_plan_dtor (plan);
+        return OOM;
+    }
+
+    return OK;
+}
+
+void tree::cse_plan_dtor (cse_plan_t *plan)
+{
+    assert (plan != nullptr && "invalid pointer");
+
+    free (plan->code);
+    *plan = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+double tree::calc_tree (const cse_plan_t *plan, double x)
+{
+    assert (plan       != nullptr && "invalid pointer");
+    assert (plan->code != nullptr && "plan is not built");
+
+    if (plan->code_size <= CSE_STACK_TMPS)
+    {
+        double tmps[CSE_STACK_TMPS];
+        return run_plan (plan, x, tmps);
+    }
+
+    double *tmps = (double *) calloc (plan->code_size, sizeof (double));
+    if (tmps == nullptr) return NAN;
+
+    double res = run_plan (plan, x, tmps);
+
+    free (tmps);
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order walk with explicit stack like calc_subtree, shared nodes which already have
+ *        a temporary aren't walked again
+ *
+ * @return Temporary of the subtree or CSE_NONE on OOM
+ */
+static unsigned plan_subtree (cse_ctx_t *ctx, const tree::node_t *node)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    plan_frame_t  inline_frames[CSE_INLINE_FRAMES];
+    plan_frame_t *frames   = inline_frames;
+    size_t        capacity = CSE_INLINE_FRAMES;
+    size_t        size     = 0;
+
+    unsigned tmp = CSE_NONE;
+
+    while (true)
+    {
+        bool ok = true;
+
+        while ((tmp = plan_known (ctx, node)) == CSE_NONE && node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (plan_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, 0, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        if (tmp == CSE_NONE) tmp = plan_node (ctx, node, 0, 0);
+
+        while (tmp != CSE_NONE && size > 0 && frames[size - 1].right)
+        {
+            size--;
+            tmp = plan_node (ctx, frames[size].node, frames[size].left, tmp);
+        }
+
+        if (tmp == CSE_NONE || size == 0) break;
+
+        frames[size - 1].left  = tmp;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return (size == 0) ? tmp : CSE_NONE;
+}
+
+/**
+ * @return Temporary of already planned shared node or CSE_NONE
+ */
+static unsigned plan_known (const cse_ctx_t *ctx, const tree::node_t *node)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    if (node->ref_cnt <= 1 || ctx->nodes_capacity == 0) return CSE_NONE;
+
+    size_t mask = ctx->nodes_capacity - 1;
+
+    for (size_t indx = ptr_hash (node) & mask; ctx->nodes[indx].node != nullptr; indx = (indx + 1) & mask)
+    {
+        if (ctx->nodes[indx].node == node) return ctx->nodes[indx].tmp;
+    }
+
+    return CSE_NONE;
+}
+
+/**
+ * @param lhs, rhs Temporaries of the operands (ignored for leaves and lhs of unary operations)
+ *
+ * @return Temporary of the node or CSE_NONE on OOM
+ */
+static unsigned plan_node (cse_ctx_t *ctx, const tree::node_t *node, unsigned lhs, unsigned rhs)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    tree::cse_instr_t instr = {tree::vm_op_t::CONST, 0, 0, 0};
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            instr.val = node->val;
+            break;
+
+        case tree::node_type_t::VAR:
+            instr.op = (node->var == 'x') ? tree::vm_op_t::VAR_X : tree::vm_op_t::VAR_NAN;
+            break;
+
+        case tree::node_type_t::OP:
+            instr.op  = to_vm_op (node->op);
+            instr.lhs = (node->left != nullptr) ? lhs : 0;
+            instr.rhs = rhs;
+
+            if ((instr.op == tree::vm_op_t::ADD || instr.op == tree::vm_op_t::MUL) && instr.lhs > instr.rhs)
+            {
+                unsigned tmp = instr.lhs;
+                instr.lhs    = instr.rhs;
+                instr.rhs    = tmp;
+            }
+            break;
+
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    unsigned tmp = plan_instr (ctx, instr);
+
+    if (tmp != CSE_NONE && node->ref_cnt > 1 && !nodes_insert (ctx, node, tmp)) return CSE_NONE;
+
+    return tmp;
+}
+
+/**
+ * @return Temporary with the same instruction (new one if there is no such) or CSE_NONE on OOM
+ */
+static unsigned plan_instr (cse_ctx_t *ctx, tree::cse_instr_t instr)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    tree::cse_plan_t *plan = ctx->plan;
+
+    size_t mask = ctx->exprs_capacity - 1;
+    size_t indx = instr_hash (&instr) & mask;
+
+    for (; ctx->exprs[indx] != CSE_NONE; indx = (indx + 1) & mask)
+    {
+        if (instr_equal (plan->code + ctx->exprs[indx], &instr)) return ctx->exprs[indx];
+    }
+
+    if (plan->code_size == ctx->capacity)
+    {
+        size_t new_capacity = 2 * ctx->capacity;
+
+        tree::cse_instr_t *new_code  = (tree::cse_instr_t *) realloc (plan->code, new_capacity *
+                                                                             sizeof (tree::cse_instr_t));
+        if (new_code == nullptr) return CSE_NONE;
+        plan->code = new_code;
+
+        size_t *new_sizes = (size_t *) realloc (ctx->sizes, new_capacity * sizeof (size_t));
+        if (new_sizes == nullptr) return CSE_NONE;
+        ctx->sizes = new_sizes;
+
+        ctx->capacity = new_capacity;
+    }
+
+    unsigned tmp = (unsigned) plan->code_size++;
+    plan->code[tmp] = instr;
+
+    ctx->sizes[tmp] = 1;
+    if (instr.op >= tree::vm_op_t::ADD)
+    {
+        ctx->sizes[tmp] += ctx->sizes[instr.rhs];
+
+        bool is_unary = instr.op == tree::vm_op_t::SIN || instr.op == tree::vm_op_t::COS ||
+                        instr.op == tree::vm_op_t::EXP || instr.op == tree::vm_op_t::LOG;
+
+        if (!is_unary) ctx->sizes[tmp] += ctx->sizes[instr.lhs];
+    }
+
+    ctx->exprs[indx] = tmp;
+
+    if (2 * plan->code_size > ctx->exprs_capacity && !exprs_rehash (ctx, 2 * ctx->exprs_capacity))
+    {
+        return CSE_NONE;
+    }
+
+    return tmp;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool exprs_rehash (cse_ctx_t *ctx, size_t capacity)
+{
+    unsigned *new_exprs = (unsigned *) malloc (capacity * sizeof (unsigned));
+    if (new_exprs == nullptr) return false;
+
+    for (size_t i = 0; i < capacity; ++i) new_exprs[i] = CSE_NONE;
+
+    free (ctx->exprs);
+    ctx->exprs          = new_exprs;
+    ctx->exprs_capacity = capacity;
+
+    size_t mask = capacity - 1;
+
+    for (size_t tmp = 0; tmp < ctx->plan->code_size; ++tmp)
+    {
+        size_t indx = instr_hash (ctx->plan->code + tmp) & mask;
+        while (ctx->exprs[indx] != CSE_NONE) indx = (indx + 1) & mask;
+
+        ctx->exprs[indx] = (unsigned) tmp;
+    }
+
+    return true;
+}
+
+static bool nodes_insert (cse_ctx_t *ctx, const tree::node_t *node, unsigned tmp)
+{
+    if (2 * (ctx->nodes_size + 1) > ctx->nodes_capacity)
+    {
+        size_t new_capacity = ctx->nodes_capacity ? 2 * ctx->nodes_capacity : CSE_MIN_CAPACITY;
+
+        cse_node_entry_t *new_nodes = (cse_node_entry_t *) calloc (new_capacity, sizeof (cse_node_entry_t));
+        if (new_nodes == nullptr) return false;
+
+        for (size_t i = 0; i < ctx->nodes_capacity; ++i)
+        {
+            if (ctx->nodes[i].node == nullptr) continue;
+
+            size_t indx = ptr_hash (ctx->nodes[i].node) & (new_capacity - 1);
+            while (new_nodes[indx].node != nullptr) indx = (indx + 1) & (new_capacity - 1);
+
+            new_nodes[indx] = ctx->nodes[i];
+        }
+
+        free (ctx->nodes);
+        ctx->nodes          = new_nodes;
+        ctx->nodes_capacity = new_capacity;
+    }
+
+    size_t mask = ctx->nodes_capacity - 1;
+    size_t indx = ptr_hash (node) & mask;
+
+    while (ctx->nodes[indx].node != nullptr) indx = (indx + 1) & mask;
+
+    ctx->nodes[indx] = {node, tmp};
+    ctx->nodes_size++;
+
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static uint64_t instr_hash (const tree::cse_instr_t *instr)
+{
+    uint64_t val_bits = 0;
+    memcpy (&val_bits, &instr->val, sizeof (double));
+
+    uint64_t hash = (uint64_t) instr->op;
+    hash = (hash ^ instr->lhs) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ instr->rhs) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ val_bits)   * 0x9E3779B97F4A7C15ull;
+
+    return hash ^ (hash >> 29);
+}
+
+static bool instr_equal (const tree::cse_instr_t *lhs, const tree::cse_instr_t *rhs)
+{
+    return lhs->op  == rhs->op  &&
+           lhs->lhs == rhs->lhs &&
+           lhs->rhs == rhs->rhs &&
+           memcmp (&lhs->val, &rhs->val, sizeof (double)) == 0;
+}
+
+static uint64_t ptr_hash (const tree::node_t *node)
+{
+    uint64_t hash = (uintptr_t) node * 0x9E3779B97F4A7C15ull;
+
+    return hash ^ (hash >> 29);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+#define OP_CASE(op_type)                                \
+    case tree::op_t::op_type: return tree::vm_op_t::op_type;
+
+static tree::vm_op_t to_vm_op (tree::op_t op)
+{
+    switch (op)
+    {
+        OP_CASE (ADD)
+        OP_CASE (SUB)
+        OP_CASE (DIV)
+        OP_CASE (MUL)
+        OP_CASE (SIN)
+        OP_CASE (COS)
+        OP_CASE (EXP)
+        OP_CASE (POW)
+        OP_CASE (LOG)
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    return tree::vm_op_t::VAR_NAN;
+}
+
+#undef OP_CASE
+
+// -------------------------------------------------------------------------------------------------
+
+#define BINARY_OP(op_type, expr)                                \
+    case tree::vm_op_t::op_type:                                \
+        tmps[i] = expr;                                         \
+        break;
+
+#define LHS tmps[instr->lhs]
+#define RHS tmps[instr->rhs]
+
+static double run_plan (const tree::cse_plan_t *plan, double x, double *tmps)
+{
+    assert (plan != nullptr && "invalid pointer");
+    assert (tmps != nullptr && "invalid pointer");
+
+    for (size_t i = 0; i < plan->code_size; ++i)
+    {
+        const tree::cse_instr_t *instr = plan->code + i;
+
+        switch (instr->op)
+        {
+            case tree::vm_op_t::CONST:   tmps[i] = instr->val; break;
+            case tree::vm_op_t::VAR_X:   tmps[i] = x;          break;
+            case tree::vm_op_t::VAR_NAN: tmps[i] = NAN;        break;
+
+            BINARY_OP (ADD, LHS + RHS)
+            BINARY_OP (SUB, LHS - RHS)
+            BINARY_OP (DIV, LHS / RHS)
+            BINARY_OP (MUL, LHS * RHS)
+            BINARY_OP (POW, pow (LHS, RHS))
+
+            BINARY_OP (SIN, sin (RHS))
+            BINARY_OP (COS, cos (RHS))
+            BINARY_OP (EXP, exp (RHS))
+            BINARY_OP (LOG, log (RHS))
+
+            default:
+                assert (0 && "Unexpected instruction");
+        }
+    }
+
+    return tmps[plan->code_size - 1];
+}
+
+#undef BINARY_OP
+#undef LHS
+#undef RHS
@@ -0,0 +1,40 @@
+#ifndef CSE_H
+#define CSE_H
+
+#include "tree.h"
+#include "tree_vm.h"
+
+namespace tree
+{
+    /// t[i] = op (t[lhs], t[rhs]), CONST instruction loads val
+    struct cse_instr_t
+    {
+        vm_op_t  op;
+        unsigned lhs;
+        unsigned rhs;
+        double   val;
+    };
+
+    /**
+     * @brief Evaluation plan: every distinct subexpression is one temporary
+     *
+     * Temporary i is defined by code[i] from earlier ones, result is the last temporary.
+     */
+    struct cse_plan_t
+    {
+        cse_instr_t *code      = nullptr;
+        size_t       code_size = 0;
+
+        size_t n_nodes   = 0;   ///< Nodes of the tree, shared subtrees are counted at every use
+        size_t n_deduped = 0;   ///< Nodes which don't need own calculation (n_nodes - code_size)
+    };
+
+    tree_err_t cse_plan (const tree_t *tree, cse_plan_t *plan);
+    tree_err_t cse_plan (const node_t *node, cse_plan_t *plan);
+
+    void cse_plan_dtor (cse_plan_t *plan);
+
+    double calc_tree (const cse_plan_t *plan, double x);
+}
+
+#endif
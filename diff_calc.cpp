@@ -2,93 +2,78 @@
 #include <cmath>
 #include <cstddef>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
 
 #include "tree.h"
 #include "tree_dsl.h"
 #include "diff_calc.h"
 #include "tree_output.h"
+#include "rewrite.h"
+#include "lib/log.h"
 
 // ----------------------------------------------------------------------------
 // CONST SECTION
 // ----------------------------------------------------------------------------
 
-///@brief Floating point calculations accuracy
-const double DBL_ERROR = 1e-11;
+///@brief Differentiate hash consed copy of the source, so subtree copies are just references
+#define INTERN_SUBTREES
+
+const size_t DIFF_MEMO_MIN_CAPACITY = 64;
+
+/// Evaluation of trees not deeper than this doesn't allocate memory
+const size_t CALC_INLINE_FRAMES = 64;
+
+/// Differentiation of trees not deeper than this doesn't allocate memory for the walk
+const size_t DIFF_INLINE_FRAMES = 64;
 
 // ----------------------------------------------------------------------------
 // STATIC HEADER SECTION
 // ----------------------------------------------------------------------------
 
-static tree::node_t *diff_subtree (tree::node_t *node, char var, render::render_t *render);
-static tree::node_t *diff_op      (tree::node_t *node, char var, render::render_t *render);
+static tree::node_t *diff_subtree  (tree::node_t *node, char var, render::render_t *render,
+                                                                   tree::diff_cache_t *cache);
+static bool          diff_operands (const tree::node_t *node, bool *left, bool *right);
+static tree::node_t *diff_node     (tree::node_t *node, tree::node_t *d_left, tree::node_t *d_right, char var,
+                                                        render::render_t *render, tree::diff_cache_t *cache);
+static tree::node_t *diff_op       (tree::node_t *node, tree::node_t *d_left, tree::node_t *d_right);
 
-static bool simplify_const_subtree     (tree::node_t *node);
-static bool simplify_primitive_subtree (tree::node_t *node);
-
-static bool simplify_primitive_add     (tree::node_t *node);
-static bool simplify_primitive_sub     (tree::node_t *node);
-static bool simplify_primitive_add_sub (tree::node_t *node);
-static bool simplify_primitive_mul     (tree::node_t *node);
-static bool simplify_primitive_div     (tree::node_t *node);
-static bool simplify_primitive_sin     (tree::node_t *node);
-static bool simplify_primitive_cos     (tree::node_t *node);
-static bool simplify_primitive_exp     (tree::node_t *node);
-static bool simplify_primitive_pow     (tree::node_t *node);
-static bool simplify_primitive_log     (tree::node_t *node);
+static uint64_t      diff_memo_hash   (const tree::node_t *node, char var);
+static tree::node_t *diff_memo_find   (tree::diff_cache_t *cache, tree::node_t *node, char var);
+static void          diff_memo_insert (tree::diff_cache_t *cache, tree::node_t *node, char var,
+                                                                  tree::node_t *res);
 
 static double calc_subtree (const tree::node_t *node, double x);
+static double calc_node    (const tree::node_t *node, double left, double right, double x);
 
 static void rename_variable (tree::node_t *node, char old_var, char new_var);
 
 static bool is_const_subtree (tree::node_t *start_node);
 
-static bool iseq (double lhs, double rhs);
-
 // ----------------------------------------------------------------------------
 // DEFINE SECTION
 // ----------------------------------------------------------------------------
 
-#define dR diff_subtree (node->right, var, render)
-#define dL diff_subtree (node->left , var, render)
+#define dR d_right
+#define dL d_left
 #define dA dR
 
-#define cR tree::copy_subtree (node->right)
-#define cL tree::copy_subtree (node->left )
-#define cS tree::copy_subtree (node)
+#ifdef INTERN_SUBTREES
+    #define cR tree::share_node (node->right)
+    #define cL tree::share_node (node->left )
+    #define cS tree::share_node (node)
+#else
+    #define cR tree::copy_subtree (node->right)
+    #define cL tree::copy_subtree (node->left )
+    #define cS tree::copy_subtree (node)
+#endif
 #define cA cR
 
 #define NEW(x) tree::new_node(x)
 
-#define Lval node->left ->val
-#define Rval node->right->val
-#define Aval node->right->val
-
-#define NodeVal(node) node->val
-
-#define LL  node->left ->left
-#define LR  node->left ->right
-#define RL  node->right->left
-#define RR  node->right->right
-#define LLR node->left ->left ->right
-#define LRR node->left ->right->right
-#define RLR node->right->left ->right
-#define RRR node->right->right->right
-
-#define hasLeft  node->left  != nullptr
-#define hasRight node->right != nullptr
-
-#define notOP(node)  node->type != tree::node_type_t::OP
-#define notVAL(node) node->type != tree::node_type_t::VAL
-
-#define isOP(node)  node->type == tree::node_type_t::OP
-#define isVAL(node) node->type == tree::node_type_t::VAL
 #define isVAR(node) node->type == tree::node_type_t::VAR
 
-#define isOP_TYPE(node, op_type) (node->type == tree::node_type_t::OP && node->op == tree::op_t::op_type)
-#define isSINX(node) (isOP_TYPE (node, SIN) && (isVAR(node->right) && node->right->var == 'x'))
-#define isCOSX(node) (isOP_TYPE (node, COS) && (isVAR(node->right) && node->right->var == 'x'))
-
 #define diff_complex(func_diff) mul (func_diff, dA)
 
 #define PUSH_FRAME(type, lhs, ...)                                                      \
@@ -111,18 +96,62 @@ static bool iseq (double lhs, double rhs);
 // PUBLIC SECTION
 // -------------------------------------------------------------------------------------------------
 
-tree::tree_t tree::calc_diff (const tree::tree_t *src, char var, render::render_t *render, bool verbose)
+/// Sources are interned, so equal subtrees are one node and key is compared by pointer
+struct tree::diff_memo_entry_t
+{
+    uint64_t      hash;
+    char          var;
+    tree::node_t *key;      ///< Differentiated canonical subtree (holds reference, so address isn't reused)
+    tree::node_t *result;   ///< Its simplified derivative (holds reference)
+};
+
+void tree::diff_cache_ctor (diff_cache_t *cache)
+{
+    assert (cache != nullptr && "invalid pointer");
+
+    *cache = {};
+    intern_ctor (&cache->intern);
+}
+
+void tree::diff_cache_dtor (diff_cache_t *cache)
+{
+    assert (cache != nullptr && "invalid pointer");
+
+    size_t lookups = cache->hits + cache->misses;
+    LOG (log::DBG, "Diff memo: %zu hits, %zu misses (hit rate %.1f%%), %zu entries",
+                    cache->hits, cache->misses,
+                    (lookups) ? 100.0 * (double) cache->hits / (double) lookups : 0.0, cache->size);
+
+    for (size_t i = 0; i < cache->capacity; ++i)
+    {
+        if (cache->entries[i].key == nullptr) continue;
+
+        del_node (cache->entries[i].key);
+        del_node (cache->entries[i].result);
+    }
+
+    free (cache->entries);
+    intern_dtor (&cache->intern);
+
+    *cache = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_t tree::calc_diff (const tree::tree_t *src, char var, render::render_t *render, bool verbose,
+                                                            diff_cache_t *cache, bool simplify)
 {
     assert (src != nullptr);
     tree::tree_t res = {};
     tree::ctor (&res);
 
-    res.head_node = calc_diff (src->head_node, var, render, verbose);
+    res.head_node = calc_diff (src->head_node, var, render, verbose, cache, simplify);
 
     return res;
 }
 
-tree::node_t *tree::calc_diff (tree::node_t *src, char var, render::render_t *render, bool verbose)
+tree::node_t *tree::calc_diff (tree::node_t *src, char var, render::render_t *render, bool verbose,
+                                                     diff_cache_t *cache, bool simplify)
 {
     assert (src != nullptr);
     tree::node_t *res = nullptr;
@@ -130,15 +159,41 @@ tree::node_t *tree::calc_diff (tree::node_t *src, char var, render::render_t *re
     IF_RENDER (render::push_subsubsection (render, "Постановка задачи"));
     IF_RENDER (render::push_diff_task_frame (render, src, var));
 
+    diff_cache_t local_cache = {};
+    if (cache == nullptr)
+    {
+        diff_cache_ctor (&local_cache);
+        cache = &local_cache;
+    }
+
+    assert ((cache->size == 0 || cache->simplify == simplify) && "memo mixes simplified derivatives");
+    cache->simplify = simplify;
+
+#ifdef INTERN_SUBTREES
+    tree::node_t *src_dag = intern (&cache->intern, src);
+    assert (src_dag != nullptr && "OOM");
+#else
+    tree::node_t *src_dag = src;
+#endif
+
     if (verbose) {
         IF_RENDER (render::push_subsubsection (render, "Расчеты"));
-        res = diff_subtree (src, var, render);
+        res = diff_subtree (src_dag, var, render, cache);
     } else {
         IF_RENDER (render::push_subsubsection (render, ""));
-        res = diff_subtree (src, var, nullptr);
+        res = diff_subtree (src_dag, var, nullptr, cache);
     }
 
-    simplify (res);
+    if (simplify) tree::simplify (&res);
+
+#ifdef INTERN_SUBTREES
+    tree::del_node (src_dag);
+#endif
+
+    if (cache == &local_cache)
+    {
+        diff_cache_dtor (&local_cache);
+    }
 
     IF_RENDER (render::push_subsubsection (render, "Получение ответа"));
     IF_RENDER (render::push_diff_frame (render, src, res, var))
@@ -149,28 +204,15 @@ tree::node_t *tree::calc_diff (tree::node_t *src, char var, render::render_t *re
 
 void tree::simplify (tree::tree_t *tree, render::render_t *render)
 {
-    simplify (tree->head_node, render);
+    simplify (&tree->head_node, render);
 }
 
-void tree::simplify (tree::node_t *node, render::render_t *render)
+void tree::simplify (tree::node_t **slot, render::render_t *render)
 {
-    assert (node != nullptr && "invalid pointer");
-
-    bool not_simplified = true;
+    assert (slot != nullptr && "invalid pointer");
 
-    bool const_simplified     = true;
-    bool primitive_simplified = true;
-
-    while (not_simplified)
-    {
-        const_simplified     = simplify_const_subtree     (node);
-        primitive_simplified = simplify_primitive_subtree (node); 
-
-        not_simplified &= const_simplified || primitive_simplified;
-        
-        if (not_simplified) {
-            IF_RENDER (render::push_simplify_frame (render, node));
-        }
+    if (rewrite (slot)) {
+        IF_RENDER (render::push_simplify_frame (render, *slot));
     }
 }
 
@@ -183,17 +225,22 @@ tree::tree_t tree::taylor_series (const tree::tree_t *src, int order, render::re
     const int buf_size             = sizeof ("Вычисление %d производной") + 10;
     char subsection_name[buf_size] = "";
 
+    // Copy has no canonical marks yet, so renamed nodes need no invalidate
     tree::node_t *current_diff  = copy_subtree (src->head_node);
     rename_variable (current_diff, 'x', 'a');
 
     tree::node_t *taylor_series = current_diff;
 
+    // Each order differentiates the previous derivative, so derivatives of its parts are reused
+    tree::diff_cache_t cache = {};
+    tree::diff_cache_ctor (&cache);
+
     for (int i = 1; i <= order; ++i)
     {
         IF_RENDER (sprintf (subsection_name, "Вычисление %d производной", i));
         IF_RENDER (render::push_subsection (render, subsection_name));
 
-        current_diff = calc_diff (current_diff, 'a', render);
+        current_diff = calc_diff (current_diff, 'a', render, false, &cache);
 
         taylor_series = add (taylor_series,
                              mul (
@@ -207,7 +254,9 @@ tree::tree_t tree::taylor_series (const tree::tree_t *src, int order, render::re
     }
 
 
-    tree::simplify (taylor_series);
+    tree::diff_cache_dtor (&cache);
+
+    tree::simplify (&taylor_series);
 
     IF_RENDER (render::push_subsection (render, "Итоговый ответ"));
     IF_RENDER (render::push_taylor_frame (render, src->head_node, taylor_series, order));
@@ -237,49 +286,178 @@ double tree::calc_tree (const tree::tree_t *tree, double x, render::render_t *re
 // STATIC SECTION
 // -------------------------------------------------------------------------------------------------
 
-#define RETURN(node)        \
-{                           \
-    res_node = node;        \
-    goto dump_and_return;   \
+/// Operation which operands are being differentiated
+struct diff_frame_t
+{
+    tree::node_t *node;
+    tree::node_t *left;         ///< Derivative of the left operand (holds reference) if it is needed
+    bool          right;        ///< Right operand is being differentiated
+    bool          need_right;
+};
+
+/**
+ * @brief Post-order differentiation with explicit stack like calc_subtree, derivative of the operation
+ *        is built when derivatives of its operands are ready, memoized subtrees aren't walked
+ */
+static tree::node_t *diff_subtree (tree::node_t *node, char var, render::render_t *render,
+                                                                  tree::diff_cache_t *cache)
+{
+    assert (node  != nullptr && "invalid pointer");
+    assert (cache != nullptr && "invalid pointer");
+
+    diff_frame_t  inline_frames[DIFF_INLINE_FRAMES];
+    diff_frame_t *frames   = inline_frames;
+    size_t        capacity = DIFF_INLINE_FRAMES;
+    size_t        size     = 0;
+
+    tree::node_t *res = nullptr;
+
+    while (true)
+    {
+        bool need_left  = false;
+        bool need_right = false;
+        bool ok         = true;
+
+        while ((res = diff_memo_find (cache, node, var)) == nullptr &&
+               diff_operands (node, &need_left, &need_right))
+        {
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (diff_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, nullptr, !need_left, need_right};
+            node = (need_left) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        if (res != nullptr) IF_RENDER (render::push_diff_frame (render, node, res, var))
+        else                res = diff_node (node, nullptr, nullptr, var, render, cache);
+
+        while (res != nullptr && size > 0 && (frames[size - 1].right || !frames[size - 1].need_right))
+        {
+            diff_frame_t *frame = frames + --size;
+
+            tree::node_t *left  = (frame->right) ? frame->left : res;
+            tree::node_t *right = (frame->right) ? res         : nullptr;
+
+            res = diff_node (frame->node, left, right, var, render, cache);
+        }
+
+        if (res == nullptr || size == 0) break;
+
+        frames[size - 1].left  = res;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    // Derivatives of left operands whose right ones were being calculated
+    for (size_t i = 0; res == nullptr && i < size; ++i) tree::del_node (frames[i].left);
+
+    if (frames != inline_frames) free (frames);
+
+    return res;
 }
 
-static tree::node_t *diff_subtree (tree::node_t *node, char var, render::render_t *render)
+/**
+ * @brief Which operand derivatives the derivative of node consists of
+ *
+ * @return false for leaves
+ */
+static bool diff_operands (const tree::node_t *node, bool *left, bool *right)
 {
-    assert (node != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
+    assert (left  != nullptr && "invalid pointer");
+    assert (right != nullptr && "invalid pointer");
+
+    if (node->type != tree::node_type_t::OP) return false;
+
+    switch (node->op)
+    {
+        case tree::op_t::ADD:
+        case tree::op_t::SUB:
+        case tree::op_t::MUL:
+        case tree::op_t::DIV:
+            *left  = true;
+            *right = true;
+            break;
+
+        // Power with constant exponent or base differentiates only the other operand
+        case tree::op_t::POW:
+            *left  = !is_const_subtree (node->left) || is_const_subtree (node->right);
+            *right = !is_const_subtree (node->right);
+            break;
+
+        case tree::op_t::SIN:
+        case tree::op_t::COS:
+        case tree::op_t::EXP:
+        case tree::op_t::LOG:
+            *left  = false;
+            *right = true;
+            break;
+
+        default:
+            assert (0 && "Unexpected op type");
+            break;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Derivative of node from derivatives of its operands, it is simplified and memoized
+ *
+ * @param d_left, d_right  References to operand derivatives (see diff_operands), they are taken
+ */
+static tree::node_t *diff_node (tree::node_t *node, tree::node_t *d_left, tree::node_t *d_right, char var,
+                                                    render::render_t *render, tree::diff_cache_t *cache)
+{
+    assert (node  != nullptr && "invalid pointer");
+    assert (cache != nullptr && "invalid pointer");
 
     tree::node_t *res_node = nullptr;
 
     switch (node->type)
     {
         case tree::node_type_t::VAL:
-            RETURN (NEW (0.0));
+            res_node = NEW (0.0);
+            break;
 
         case tree::node_type_t::VAR:
-            if (node->var == var) RETURN (tree::new_node(1.0))
-            else                  RETURN (tree::new_node(0.0))
+            res_node = tree::new_node ((node->var == var) ? 1.0 : 0.0);
+            break;
 
         case tree::node_type_t::OP:
-            RETURN (diff_op (node, var, render));
+            res_node = diff_op (node, d_left, d_right);
+            break;
 
         case tree::node_type_t::NOT_SET:
             assert (0 && "Invalid node type for diff");
-        
+            break;
+
         default:
             assert (0 && "Unexpected node type");
+            break;
     }
 
+    if (cache->simplify) tree::simplify (&res_node, nullptr);
+    diff_memo_insert (cache, node, var, res_node);
+    IF_RENDER (render::push_diff_frame (render, node, res_node, var));
 
-    dump_and_return:
-        tree::simplify (res_node, nullptr);
-        IF_RENDER (render::push_diff_frame (render, node, res_node, var));
-        return res_node;
+    return res_node;
 }
 
-#undef RETURN
-
 // -------------------------------------------------------------------------------------------------
 
-static tree::node_t *diff_op (tree::node_t *node, char var, render::render_t *render)
+static tree::node_t *diff_op (tree::node_t *node, tree::node_t *d_left, tree::node_t *d_right)
 {
     assert (node != nullptr && "invalid pointer");
     assert (node->type == tree::node_type_t::OP && "invalid node");
@@ -306,16 +484,17 @@ static tree::node_t *diff_op (tree::node_t *node, char var, render::render_t *re
         case tree::op_t::EXP:
             return diff_complex (cS);
 
+        // diff_operands gives only the derivative of the non-constant operand
         case tree::op_t::POW:
-            if (is_const_subtree (node->right)) {
+            if (dR == nullptr) {
                 return mul (mul (cR, 
                                 pow (cL, sub (cR, NEW(1.0)))
                                 ),
                            dL
                            );
             }
-            else if (is_const_subtree (node->left)) {
-                return mul (log (node->left), 
+            else if (dL == nullptr) {
+                return mul (log (cL), 
                             mul (cS, dR));
             } else {
                 return mul (cS, 
@@ -327,7 +506,7 @@ static tree::node_t *diff_op (tree::node_t *node, char var, render::render_t *re
             }
 
         case tree::op_t::LOG:
-            return diff_complex (div (NEW(1.0), cS));
+            return diff_complex (div (NEW(1.0), cA));
 
         default:
             assert(0 && "Unexpected op type");
@@ -337,350 +516,165 @@ static tree::node_t *diff_op (tree::node_t *node, char var, render::render_t *re
 
 // -------------------------------------------------------------------------------------------------
 
-#define SIMPLIFY_BINARY_OP(type, op)             \
-    case tree::op_t::type:                       \
-        assert (hasLeft);                        \
-        tree::change_node (node, Lval op Rval);  \
-        break;
-
-#define SIMPLIFY_UNARY_OP(type, func)            \
-    case tree::op_t::type:                       \
-        tree::change_node (node, func (Rval));   \
-        break;
-
-static bool simplify_const_subtree (tree::node_t *node)
+static uint64_t diff_memo_hash (const tree::node_t *node, char var)
 {
-    assert (node != nullptr);
-    assert (node->type != tree::node_type_t::NOT_SET && "Incomplete node");
-
-    if (notOP (node)) return false;
-
-    bool simplified = false;
-
-    if (hasLeft) {
-        simplified |= simplify_const_subtree (node->left);
-    }
-    simplified |= simplify_const_subtree (node->right);
-
-    if ((hasLeft && notVAL (node->left)) || notVAL (node->right)) {
-        if (simplified) {
-            node->alpha_index = 0;
-        }
-        return simplified;
-    }
-
-    switch (node->op)
-    {
-        SIMPLIFY_BINARY_OP(ADD, +)
-        SIMPLIFY_BINARY_OP(SUB, -)
-        SIMPLIFY_BINARY_OP(DIV, /)
-        SIMPLIFY_BINARY_OP(MUL, *)
-
-        SIMPLIFY_UNARY_OP(SIN, sin)
-        SIMPLIFY_UNARY_OP(COS, cos)
-        SIMPLIFY_UNARY_OP(EXP, exp)
-        SIMPLIFY_UNARY_OP(LOG, log)
-        
-        case tree::op_t::POW:
-            tree::change_node (node, pow (Lval, Rval));
-            break;
+    uint64_t hash = ((uintptr_t) node ^ (uint64_t) (unsigned char) var) * 0x9E3779B97F4A7C15ull;
 
-        default:
-            assert(0 && "Unexpected op type");
-            break;
-    }
-
-    tree::del_childs (node);
-
-    node->alpha_index = 0;
-    return true;
+    return hash ^ (hash >> 29);
 }
 
-#undef SIMPLIFY_BINARY_OP
-#undef SIMPLIFY_UNARY_OP
-
-// -------------------------------------------------------------------------------------------------
-
-#define SIMPLIFY_OP(op_type, func)      \
-case tree::op_t::op_type:               \
-            is_smpled = func (node);    \
-            break;
-
-static bool simplify_primitive_subtree (tree::node_t *node)
+/**
+ * @return New reference to memoized derivative or nullptr if there is no one
+ */
+static tree::node_t *diff_memo_find (tree::diff_cache_t *cache, tree::node_t *node, char var)
 {
-    assert (node != nullptr);
-    assert (node->type != tree::node_type_t::NOT_SET && "Incomplete node");
-
-    if (notOP(node)) return false;
-
-    bool is_smpled = false;
-
-    switch (node->op)
-    {
-        case tree::op_t::ADD:
-            is_smpled = simplify_primitive_add_sub (node) || simplify_primitive_add (node);
-            break;
-
-        case tree::op_t::SUB:
-            is_smpled = simplify_primitive_add_sub (node) || simplify_primitive_sub (node);
-            break;
-
-        SIMPLIFY_OP (DIV, simplify_primitive_div)
-        SIMPLIFY_OP (MUL, simplify_primitive_mul)
-        SIMPLIFY_OP (SIN, simplify_primitive_sin)
-        SIMPLIFY_OP (COS, simplify_primitive_cos)
-        SIMPLIFY_OP (EXP, simplify_primitive_exp)
-        SIMPLIFY_OP (POW, simplify_primitive_pow)
-        SIMPLIFY_OP (LOG, simplify_primitive_log)
-
-        default:
-            break;
-    }
+    assert (cache != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
 
-    if (is_smpled)
+    if (cache->capacity == 0)
     {
-        node->alpha_index = 0;
-
-        return true;
-    }
-
-    if (node->left != nullptr) {
-        is_smpled |= simplify_primitive_subtree (node->left);
-    }
-    is_smpled |= simplify_primitive_subtree (node->right);
-
-    if (is_smpled) {
-        node->alpha_index = 0;
-    }
-
-    return is_smpled;
-}
-
-#undef SIMPLIFY_OP
-
-// -------------------------------------------------------------------------------------------------
-
-#define CLEAN_AND_RETURN()  \
-{                           \
-    del_childs (node);      \
-    return true;            \
-}
-
-static bool simplify_primitive_add_sub (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
-    assert (isOP(node) && "invalid node");
-
-    if (isVAL(node->left) && iseq (Lval, 0)) {
-        del_left  (node);
-        move_node (node, node->right);
-        return true;
-    } else if (isVAL(node->right) && iseq (Rval, 0)) {
-        del_right (node);
-        move_node (node, node->left);
-        return true;
+        cache->misses++;
+        return nullptr;
     }
 
-    return false;
-}
-
-static bool simplify_primitive_add (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
+    size_t mask = cache->capacity - 1;
 
-    //sin^2 + cos ^2
-    if (isOP_TYPE(node->left, MUL) && isOP_TYPE(node->right, MUL))
+    for (size_t indx = diff_memo_hash (node, var) & mask; cache->entries[indx].key != nullptr;
+                                                              indx = (indx + 1) & mask)
     {
-        if (isSINX (LL) && isSINX (LR) && isCOSX (RL) && isCOSX(RR))
-        {
-            change_node (node, 1.0);
-            CLEAN_AND_RETURN();
-        }
+        tree::diff_memo_entry_t *entry = cache->entries + indx;
 
-        if (isCOSX (LL) && isCOSX (LR) && isSINX (RL) && isSINX(RR))
+        if (entry->key == node && entry->var == var)
         {
-            change_node (node, 1.0);
-            CLEAN_AND_RETURN();
+            cache->hits++;
+            return tree::share_node (entry->result);
         }
     }
 
-    return false;
+    cache->misses++;
+    return nullptr;
 }
 
-static bool simplify_primitive_sub (tree::node_t *node)
+static void diff_memo_insert (tree::diff_cache_t *cache, tree::node_t *node, char var,
+                                                         tree::node_t *res)
 {
-    assert (node != nullptr && "invalid pointer");
+    assert (cache != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
+    assert (res   != nullptr && "invalid pointer");
 
-    // cos^x - sin^x
-    if (isOP_TYPE(node->left, MUL) && isOP_TYPE(node->right, MUL))
+    if (2 * (cache->size + 1) > cache->capacity)
     {
-        if (isCOSX (LL) && isCOSX (LR) &&
-            isSINX (RL) && isSINX (RR))
-        {
-            change_node (node, tree::op_t::COS);
-            change_node (node->right, tree::op_t::MUL);
-            change_node (RL, 2.0);
-            change_node (RR, 'x');
-            del_left (node);
-            return true;
-        }
-    }
-
-    return false;
-}
+        size_t new_capacity = (cache->capacity) ? 2 * cache->capacity : DIFF_MEMO_MIN_CAPACITY;
 
-static bool simplify_primitive_mul (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
+        tree::diff_memo_entry_t *new_entries = (tree::diff_memo_entry_t *)
+                                    calloc (new_capacity, sizeof (tree::diff_memo_entry_t));
+        if (new_entries == nullptr) return; // Memo is optional
 
-    if (isVAL(node->left) && iseq(Lval, 0)) {
-        change_node (node, 0.0);
-        CLEAN_AND_RETURN();
-    } else if (isVAL(node->right) && iseq(Rval, 0)) {
-        change_node (node, 0.0);
-        CLEAN_AND_RETURN();
-    }
+        for (size_t i = 0; i < cache->capacity; ++i)
+        {
+            if (cache->entries[i].key == nullptr) continue;
 
-    if (isVAL(node->left) && iseq(Lval, 1)) {
-        del_left  (node);
-        move_node (node, node->right);
-        return node;
-    } else if (isVAL(node->right) && iseq(Rval, 1)) {
-        del_right (node);
-        move_node (node, node->left);
-        return true;
-    }
+            size_t indx = cache->entries[i].hash & (new_capacity - 1);
+            while (new_entries[indx].key != nullptr)
+            {
+                indx = (indx + 1) & (new_capacity - 1);
+            }
 
-    if (isVAL(node->left) && isOP_TYPE(node->right, MUL))
-    {
-        if (isVAL (RL)) {
-            tree::change_node (node->left, NodeVal (node->left) * NodeVal(RL));
-            tree::del_left (node->right);
-            tree::move_node (node->right, RR);
-        } else if (isVAL (RR)) {
-            tree::change_node (node->left, NodeVal (node->left) * NodeVal(RR));
-            tree::del_right (node->right);
-            tree::move_node (node->right, RL);
+            new_entries[indx] = cache->entries[i];
         }
-    }
 
-    if (isVAL(node->right) && isOP_TYPE(node->left, MUL))
-    {
-        if (isVAL (LL)) {
-            tree::change_node (node->right, NodeVal (node->right) * NodeVal(LL));
-            tree::del_left (node->left);
-            tree::move_node (node->left, LR);
-        } else if (isVAL (LR)) {
-            tree::change_node (node->right, NodeVal (node->right) * NodeVal(LR));
-            tree::del_right (node->left);
-            tree::move_node (node->left, LL);
-        }
+        free (cache->entries);
+        cache->entries  = new_entries;
+        cache->capacity = new_capacity;
     }
 
-    return false;
-}
-
-static bool simplify_primitive_div (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
+    uint64_t hash = diff_memo_hash (node, var);
 
-    if (isVAL(node->left) && iseq (Lval, 0)) {
-        change_node (node, 0.0);
-        CLEAN_AND_RETURN();
-    }
+    size_t mask = cache->capacity - 1;
+    size_t indx = hash & mask;
 
-    if (isVAL(node->right) && iseq (Rval, 1)) {
-        del_right (node);
-        move_node (node, node->left);
-        return true;
+    while (cache->entries[indx].key != nullptr)
+    {
+        indx = (indx + 1) & mask;
     }
 
-    return false;
+    cache->entries[indx] = {hash, var, tree::share_node (node), tree::share_node (res)};
+    cache->size++;
 }
 
-static bool simplify_primitive_sin (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
-
-    if (isVAL(node->right) && iseq (Aval, 0)) {
-        change_node (node, 0.0);
-        CLEAN_AND_RETURN();
-    }
-
-    return false;
-}
+// -------------------------------------------------------------------------------------------------
 
-static bool simplify_primitive_cos (tree::node_t *node)
+/// Operation which operands are being calculated
+struct calc_frame_t
 {
-    assert (node != nullptr && "invalid pointer");
-
-    if (isVAL(node->right) && iseq (Aval, 0)) {
-        change_node (node, 1.0);
-        CLEAN_AND_RETURN();
-    }
-
-    return false;
-}
-
+    const tree::node_t *node;
+    double              left;   ///< Value of the left operand when it is calculated
+    bool                right;  ///< Right operand is being calculated
+};
 
-static bool simplify_primitive_exp (tree::node_t *node)
+/**
+ * @brief Post-order evaluation with explicit stack: goes down left links pushing operations,
+ *        then goes up calculating them, so depth of the tree is limited by memory only
+ */
+static double calc_subtree (const tree::node_t *node, double x)
 {
-    assert (node != nullptr && "invalid pointer");
-
-    if (isVAL(node->right) && iseq (Aval, 0)) {
-        change_node (node, 1.0);
-        CLEAN_AND_RETURN();
-    }
+    assert(node != nullptr && "invalid pointer");
 
-    return false;
-}
+    calc_frame_t  inline_frames[CALC_INLINE_FRAMES];
+    calc_frame_t *frames   = inline_frames;
+    size_t        capacity = CALC_INLINE_FRAMES;
+    size_t        size     = 0;
 
+    double val = NAN;
 
-static bool simplify_primitive_pow (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
+    while (true)
+    {
+        while (node->type == tree::node_type_t::OP)
+        {
+            if (size == capacity)
+            {
+                calc_frame_t *new_frames = (calc_frame_t *) malloc (2 * capacity * sizeof (calc_frame_t));
+                if (new_frames == nullptr)
+                {
+                    if (frames != inline_frames) free (frames);
+                    return NAN;
+                }
+
+                memcpy (new_frames, frames, size * sizeof (calc_frame_t));
+                if (frames != inline_frames) free (frames);
+
+                frames    = new_frames;
+                capacity *= 2;
+            }
 
-    if (isVAL(node->right) && iseq (Aval, 1)) { //isArg
-        tree::del_right (node);
-        move_node (node, node->left);
-        return true;
-    }
+            frames[size++] = {node, NAN, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
 
-    return false;
-}
+        val = calc_node (node, NAN, NAN, x);
 
+        while (size > 0 && frames[size - 1].right)
+        {
+            size--;
+            val = calc_node (frames[size].node, frames[size].left, val, x);
+        }
 
-static bool simplify_primitive_log (tree::node_t *node)
-{
-    assert (node != nullptr && "invalid pointer");
+        if (size == 0) break;
 
-    if (isVAL(node->right) && iseq (Aval, 1)) {
-        change_node (node, 0.0);
-        CLEAN_AND_RETURN();
+        frames[size - 1].left  = val;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
     }
 
-    return false;
-}
-
-#undef CLEAN_AND_RETURN
+    if (frames != inline_frames) free (frames);
 
-// -------------------------------------------------------------------------------------------------
+    return val;
+}
 
-static double calc_subtree (const tree::node_t *node, double x)
+static double calc_node (const tree::node_t *node, double left, double right, double x)
 {
     assert(node != nullptr && "invalid pointer");
 
-    double left  = NAN;
-    double right = NAN;
-
-    if (node->left != nullptr) {
-        left = calc_subtree (node->left, x);
-    }
-
-    if (node->right != nullptr) {
-        right = calc_subtree (node->right, x);
-    }
-
     switch (node->type)
     {
         case tree::node_type_t::VAL:
@@ -762,10 +756,3 @@ static bool is_const_subtree (tree::node_t *start_node)
                                         nullptr,        nullptr,
                                         nullptr,        nullptr);
 }
-
-// ----------------------------------------------------------------------------
-
-static bool iseq (double lhs, double rhs)
-{
-    return fabs (lhs - rhs) < DBL_ERROR;
-}
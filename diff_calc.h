@@ -5,12 +5,49 @@
 #include "tree.h"
 
 namespace tree {
-    tree_t  calc_diff (const tree_t *src, char var = 'x', render::render_t *render = nullptr, bool verbose = false);
-    node_t *calc_diff (      node_t *src, char var = 'x', render::render_t *render = nullptr, bool verbose = false);
+    struct diff_memo_entry_t;
+
+    /**
+     * @brief Derivatives memo (keyed by canonical node and variable) + interned sources
+     *
+     * May live for one calc_diff call or be shared by several calls (e.g. whole Taylor run).
+     */
+    struct diff_cache_t
+    {
+        intern_t intern = {};
+
+        diff_memo_entry_t *entries  = nullptr;
+        size_t             capacity = 0;
+        size_t             size     = 0;
+
+        size_t hits   = 0;
+        size_t misses = 0;
+
+        bool simplify = true;   ///< Memoized derivatives are simplified, set by calc_diff
+    };
+
+    void diff_cache_ctor (diff_cache_t *cache);
+    void diff_cache_dtor (diff_cache_t *cache);
+
+    /**
+     * @param simplify  Simplify derivative, calls sharing one cache must pass the same value
+     */
+    tree_t  calc_diff (const tree_t *src, char var = 'x', render::render_t *render = nullptr, bool verbose = false,
+                                                    diff_cache_t *cache = nullptr, bool simplify = true);
+    node_t *calc_diff (      node_t *src, char var = 'x', render::render_t *render = nullptr, bool verbose = false,
+                                                    diff_cache_t *cache = nullptr, bool simplify = true);
 
     void simplify (tree_t *tree, render::render_t *render = nullptr);
-    void simplify (node_t *node, render::render_t *render = nullptr);
 
+    /**
+     * @brief      Simplify subtree in the slot, shared nodes are replaced by simplified copies
+     */
+    void simplify (node_t **slot, render::render_t *render = nullptr);
+
+    /**
+     * @brief      Series at symbolic x = a by repeated differentiation, renders every derivative.
+     *             Numeric centers are much cheaper with taylor_series_at from series.h
+     */
     tree_t taylor_series (const tree_t *src, int order, render::render_t *render = nullptr);
 
     double calc_tree (const tree::tree_t *tree, double x, render::render_t *render = nullptr);
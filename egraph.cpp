@@ -0,0 +1,1120 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "egraph.h"
+#include "tree.h"
+#include "tree_parsing.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+struct eq_rule_t
+{
+    const char *pattern;
+    const char *replacement;
+};
+
+/**
+ * @brief Equalities for saturation, every match adds the replacement to the class of the match
+ *
+ * Syntax is the same as in rewrite rules (upper case letters are metavariables, K, L, M are
+ * constants). Order doesn't matter: nothing is removed from the e-graph. Constants are
+ * folded by the e-graph itself.
+ */
+static const eq_rule_t EQ_RULES[] =
+{
+    {"A + B",       "B + A"},
+    {"A * B",       "B * A"},
+    {"(A + B) + C", "A + (B + C)"},
+    {"A + (B + C)", "(A + B) + C"},
+    {"(A * B) * C", "A * (B * C)"},
+    {"A * (B * C)", "(A * B) * C"},
+
+    {"A * (B + C)",     "A * B + A * C"},
+    {"A * B + A * C",   "A * (B + C)"},
+    {"A - B",           "A + -1 * B"},
+    {"A + -1 * B",      "A - B"},
+    {"A / B * C",       "A * C / B"},
+    {"A * C / B",       "A / B * C"},
+
+    {"A + 0", "A"},
+    {"A - 0", "A"},
+    {"A * 1", "A"},
+    {"A * 0", "0"},
+    {"0 / A", "0"},
+    {"A / 1", "A"},
+    {"A - A", "0"},
+    {"A + A", "2 * A"},
+    {"A * A", "A ^ 2"},
+    {"A ^ 1", "A"},
+    {"A ^ 0", "1"},
+
+    {"exp A * exp B", "exp (A + B)"},
+    {"log (exp A)",   "A"},
+
+    {"sin A * sin A + cos A * cos A", "1"},
+    {"cos A * cos A - sin A * sin A", "cos (2 * A)"},
+    {"sin A ^ 2 + cos A ^ 2",         "1"},
+    {"cos A ^ 2 - sin A ^ 2",         "cos (2 * A)"},
+};
+
+const size_t N_EQ_RULES = sizeof (EQ_RULES) / sizeof (*EQ_RULES);
+
+const size_t N_METAVARS   = 'Z' - 'A' + 1;
+const size_t MAX_PAT_SIZE = 32;
+const size_t NONE         = (size_t) -1;
+
+const size_t EGRAPH_MIN_CAPACITY = 64;
+const size_t MATCHES_PER_NODE    = 4;   ///< Limit of matches per round is max_nodes * this
+
+/// Walks of trees not deeper than this don't allocate memory for the stack
+const size_t EGRAPH_INLINE_FRAMES = 64;
+
+///@brief Floating point calculations accuracy
+const double DBL_ERROR = 1e-11;
+
+/// Cost of operations for cost_model_t::EVAL_COST, indexed by op_t
+const double OP_EVAL_COST[] =
+{
+    2,  // ADD
+    2,  // SUB
+    8,  // DIV
+    2,  // MUL
+    40, // SIN
+    40, // COS
+    40, // EXP
+    60, // POW
+    40  // LOG
+};
+
+const double LEAF_EVAL_COST = 1;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+struct enode_t
+{
+    tree::node_type_t type;
+    tree::op_t        op;
+    double            val;
+    char              var;
+
+    size_t left;    ///< Classes of operands (NONE if there is no operand)
+    size_t right;
+
+    size_t eclass;
+    bool   alive;   ///< Duplicates found by rebuild are dead
+};
+
+struct eclass_t
+{
+    size_t parent;  ///< Union-find
+
+    bool   is_const;
+    double val;
+};
+
+/**
+ * @brief E-graph: classes of equal expressions, operands of e-nodes are classes
+ *
+ * Hash consing table keeps e-nodes unique up to class equality (restored by rebuild).
+ * Nodes of every class are indexed (class_start, class_nodes) before each matching round.
+ */
+struct egraph_t
+{
+    enode_t *nodes;
+    size_t   n_nodes;
+    size_t   nodes_capacity;
+
+    eclass_t *classes;
+    size_t    n_classes;
+    size_t    classes_capacity;
+
+    size_t *table;
+    size_t  table_capacity;
+
+    size_t *class_start;
+    size_t *class_nodes;
+};
+
+struct ematch_t
+{
+    size_t rule;
+    size_t eclass;
+    size_t subst[N_METAVARS];
+};
+
+struct saturate_ctx_t
+{
+    egraph_t *graph;
+
+    tree::node_t *patterns    [N_EQ_RULES];
+    tree::node_t *replacements[N_EQ_RULES];
+
+    ematch_t *matches;
+    size_t    n_matches;
+    size_t    max_matches;
+};
+
+/// Operation which operands are being added, left is class of the left one when it is added
+struct add_frame_t
+{
+    const tree::node_t *node;
+    size_t              left;
+    bool                right;  ///< Right operand is being added
+};
+
+/// Operation of extracted class which operands are being extracted
+struct extract_frame_t
+{
+    size_t        eclass;
+    tree::node_t *node;     ///< Extracted node, its left child is set when it is extracted
+    bool          right;    ///< Right operand is being extracted
+};
+
+/// Pattern node waiting for matching against a class
+struct pat_goal_t
+{
+    const tree::node_t *pat;
+    size_t              eclass;
+};
+
+static bool   egraph_ctor (egraph_t *graph);
+static void   egraph_dtor (egraph_t *graph);
+static size_t egraph_add  (egraph_t *graph, enode_t enode);
+static size_t egraph_add_subtree (egraph_t *graph, const tree::node_t *node);
+static size_t egraph_add_node    (egraph_t *graph, const tree::node_t *node, size_t left, size_t right);
+static size_t egraph_find  (egraph_t *graph, size_t eclass);
+static bool   egraph_union (egraph_t *graph, size_t lhs, size_t rhs);
+static bool   egraph_rebuild (egraph_t *graph);
+static bool   egraph_index   (egraph_t *graph);
+
+static size_t table_lookup (egraph_t *graph, const enode_t *enode);
+static bool   table_insert (egraph_t *graph, size_t node_indx);
+static bool   table_rehash (egraph_t *graph, size_t capacity);
+static size_t enode_hash   (const enode_t *enode);
+static bool   enode_equal  (const enode_t *lhs, const enode_t *rhs);
+static bool   enode_fold   (const egraph_t *graph, const enode_t *enode, double *val);
+
+static bool ematch_class (saturate_ctx_t *ctx, size_t rule, size_t eclass);
+static bool ematch_goals (saturate_ctx_t *ctx, size_t rule, size_t root,
+                          pat_goal_t *goals, size_t n_goals, size_t *subst);
+static size_t instantiate (egraph_t *graph, const tree::node_t *pat, const size_t *subst);
+
+static double extract_costs (egraph_t *graph, size_t root, tree::cost_model_t model, size_t *best_node);
+static tree::node_t *extract_subtree (egraph_t *graph, size_t eclass, const size_t *best_node,
+                                                                        tree::node_t **built);
+static tree::node_t *extract_node    (const enode_t *enode);
+
+static double node_cost    (tree::node_type_t type, tree::op_t op, tree::cost_model_t model);
+static double subtree_cost (const tree::node_t *node, tree::cost_model_t model);
+
+static bool   is_metavar (const tree::node_t *pat);
+static double seconds_now ();
+static bool   iseq (double lhs, double rhs);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Simplify by equality saturation: apply EQ_RULES to the e-graph of the tree until
+ *        nothing changes or the budget is exhausted, then extract the cheapest expression
+ *
+ * Unlike greedy rewriting result doesn't depend on rules order. Tree is replaced only if
+ * the extracted expression is cheaper.
+ */
+tree::tree_err_t tree::simplify_saturate (tree_t *tree, const saturate_opts_t *opts,
+                                                        render::render_t *render)
+{
+    assert (tree            != nullptr && "invalid pointer");
+    assert (tree->head_node != nullptr && "invalid pointer");
+
+    const saturate_opts_t default_opts = {};
+    if (opts == nullptr) opts = &default_opts;
+
+    double start_time = seconds_now ();
+
+    egraph_t graph = {};
+    saturate_ctx_t ctx = {};
+    ctx.graph       = &graph;
+    ctx.max_matches = opts->max_nodes * MATCHES_PER_NODE;
+
+    tree_err_t err  = OOM;
+    size_t     root = NONE;
+
+    size_t       *best_node = nullptr;
+    tree::node_t **built    = nullptr;
+
+    for (size_t i = 0; i < N_EQ_RULES; ++i)
+    {
+        ctx.patterns[i]     = parse_dump (EQ_RULES[i].pattern);
+        ctx.replacements[i] = parse_dump (EQ_RULES[i].replacement);
+
+        assert (ctx.patterns[i] && ctx.replacements[i] && "invalid rule");
+    }
+
+    ctx.matches = (ematch_t *) calloc (ctx.max_matches, sizeof (ematch_t));
+
+    if (ctx.matches == nullptr || !egraph_ctor (&graph)) goto finish;
+    if ((root = egraph_add_subtree (&graph, tree->head_node)) == NONE) goto finish;
+
+    for (unsigned iter = 0; iter < opts->max_iters; ++iter)
+    {
+        if (!egraph_rebuild (&graph) || !egraph_index (&graph)) goto finish;
+
+        // Read phase: all matches are collected on the same e-graph
+        ctx.n_matches = 0;
+        for (size_t rule = 0; rule < N_EQ_RULES; ++rule)
+        {
+            for (size_t eclass = 0; eclass < graph.n_classes; ++eclass)
+            {
+                if (egraph_find (&graph, eclass) == eclass && !ematch_class (&ctx, rule, eclass)) break;
+            }
+        }
+
+        // Write phase
+        bool changed = false;
+        for (size_t i = 0; i < ctx.n_matches && graph.n_nodes < opts->max_nodes; ++i)
+        {
+            ematch_t *match = ctx.matches + i;
+
+            size_t eclass = instantiate (&graph, ctx.replacements[match->rule], match->subst);
+            if (eclass == NONE) goto finish;
+
+            changed |= egraph_union (&graph, match->eclass, eclass);
+        }
+
+        if (!changed || graph.n_nodes >= opts->max_nodes ||
+                        seconds_now () - start_time > opts->max_seconds)
+        {
+            break;
+        }
+    }
+
+    if (!egraph_rebuild (&graph)) goto finish;
+
+    best_node = (size_t *)        calloc (graph.n_classes, sizeof (size_t));
+    built     = (tree::node_t **) calloc (graph.n_classes, sizeof (tree::node_t *));
+    if (best_node == nullptr || built == nullptr) goto finish;
+
+    root = egraph_find (&graph, root);
+
+    if (extract_costs (&graph, root, opts->cost, best_node) < subtree_cost (tree->head_node, opts->cost))
+    {
+        tree::node_t *res = extract_subtree (&graph, root, best_node, built);
+        if (res == nullptr) goto finish;
+
+        del_node (tree->head_node);
+        tree->head_node = res;
+
+        if (render != nullptr) render::push_simplify_frame (render, res);
+    }
+
+    err = OK;
+
+finish:
+    if (built != nullptr)
+    {
+        for (size_t i = 0; i < graph.n_classes; ++i) del_node (built[i]);
+    }
+
+    free (built);
+    free (best_node);
+    free (ctx.matches);
+
+    for (size_t i = 0; i < N_EQ_RULES; ++i)
+    {
+        del_node (ctx.patterns[i]);
+        del_node (ctx.replacements[i]);
+    }
+
+    egraph_dtor (&graph);
+    return err;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static bool egraph_ctor (egraph_t *graph)
+{
+    assert (graph != nullptr && "invalid pointer");
+
+    *graph = {};
+
+    graph->nodes   = (enode_t *)  calloc (EGRAPH_MIN_CAPACITY, sizeof (enode_t));
+    graph->classes = (eclass_t *) calloc (EGRAPH_MIN_CAPACITY, sizeof (eclass_t));
+
+    graph->nodes_capacity   = EGRAPH_MIN_CAPACITY;
+    graph->classes_capacity = EGRAPH_MIN_CAPACITY;
+
+    return graph->nodes != nullptr && graph->classes != nullptr &&
+                                      table_rehash (graph, 2 * EGRAPH_MIN_CAPACITY);
+}
+
+static void egraph_dtor (egraph_t *graph)
+{
+    assert (graph != nullptr && "invalid pointer");
+
+    free (graph->nodes);
+    free (graph->classes);
+    free (graph->table);
+    free (graph->class_start);
+    free (graph->class_nodes);
+
+    *graph = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @return Class of the e-node (existing one if the e-node is already known) or NONE on OOM
+ */
+static size_t egraph_add (egraph_t *graph, enode_t enode)
+{
+    assert (graph != nullptr && "invalid pointer");
+
+    if (enode.left  != NONE) enode.left  = egraph_find (graph, enode.left);
+    if (enode.right != NONE) enode.right = egraph_find (graph, enode.right);
+
+    size_t found = table_lookup (graph, &enode);
+    if (found != NONE) return egraph_find (graph, graph->nodes[found].eclass);
+
+    if (graph->n_nodes == graph->nodes_capacity)
+    {
+        enode_t *new_nodes = (enode_t *) realloc (graph->nodes, 2 * graph->nodes_capacity * sizeof (enode_t));
+        if (new_nodes == nullptr) return NONE;
+
+        graph->nodes           = new_nodes;
+        graph->nodes_capacity *= 2;
+    }
+
+    if (graph->n_classes == graph->classes_capacity)
+    {
+        eclass_t *new_classes = (eclass_t *) realloc (graph->classes,
+                                                      2 * graph->classes_capacity * sizeof (eclass_t));
+        if (new_classes == nullptr) return NONE;
+
+        graph->classes           = new_classes;
+        graph->classes_capacity *= 2;
+    }
+
+    size_t eclass = graph->n_classes++;
+    bool is_const = enode.type == tree::node_type_t::VAL;
+
+    graph->classes[eclass] = {eclass, is_const, is_const ? enode.val : NAN};
+
+    enode.eclass = eclass;
+    enode.alive  = true;
+    graph->nodes[graph->n_nodes++] = enode;
+
+    if (!table_insert (graph, graph->n_nodes - 1)) return NONE;
+
+    return eclass;
+}
+
+/**
+ * @brief Post-order walk with explicit stack like calc_subtree, operation is added when classes
+ *        of its operands are known
+ *
+ * @return Class of the subtree or NONE on OOM
+ */
+static size_t egraph_add_subtree (egraph_t *graph, const tree::node_t *node)
+{
+    assert (graph != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
+
+    add_frame_t  inline_frames[EGRAPH_INLINE_FRAMES];
+    add_frame_t *frames   = inline_frames;
+    size_t       capacity = EGRAPH_INLINE_FRAMES;
+    size_t       size     = 0;
+
+    size_t eclass = NONE;
+
+    while (true)
+    {
+        bool ok = true;
+
+        while (node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (add_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, NONE, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        eclass = egraph_add_node (graph, node, NONE, NONE);
+
+        while (eclass != NONE && size > 0 && frames[size - 1].right)
+        {
+            size--;
+            eclass = egraph_add_node (graph, frames[size].node, frames[size].left, eclass);
+        }
+
+        if (eclass == NONE || size == 0) break;
+
+        frames[size - 1].left  = eclass;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return (size == 0) ? eclass : NONE;
+}
+
+/**
+ * @param left, right Classes of the operands (NONE if there is no operand)
+ */
+static size_t egraph_add_node (egraph_t *graph, const tree::node_t *node, size_t left, size_t right)
+{
+    assert (graph != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
+
+    enode_t enode = {node->type, tree::op_t::ADD, NAN, '\0', left, right, NONE, true};
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL: enode.val = node->val; break;
+        case tree::node_type_t::VAR: enode.var = node->var; break;
+        case tree::node_type_t::OP:  enode.op  = node->op;  break;
+
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    return egraph_add (graph, enode);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static size_t egraph_find (egraph_t *graph, size_t eclass)
+{
+    while (graph->classes[eclass].parent != eclass)
+    {
+        // Path halving
+        graph->classes[eclass].parent = graph->classes[graph->classes[eclass].parent].parent;
+        eclass = graph->classes[eclass].parent;
+    }
+
+    return eclass;
+}
+
+/// @return false if classes are already equal
+static bool egraph_union (egraph_t *graph, size_t lhs, size_t rhs)
+{
+    lhs = egraph_find (graph, lhs);
+    rhs = egraph_find (graph, rhs);
+
+    if (lhs == rhs) return false;
+    if (rhs < lhs)
+    {
+        size_t tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
+    }
+
+    graph->classes[rhs].parent = lhs;
+
+    if (!graph->classes[lhs].is_const && graph->classes[rhs].is_const)
+    {
+        graph->classes[lhs].is_const = true;
+        graph->classes[lhs].val      = graph->classes[rhs].val;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Restore congruence: e-nodes equal up to classes are merged, constant e-nodes are folded
+ *
+ * @return false on OOM
+ */
+static bool egraph_rebuild (egraph_t *graph)
+{
+    assert (graph != nullptr && "invalid pointer");
+
+    bool merged = true;
+
+    while (merged)
+    {
+        merged = false;
+
+        for (size_t i = 0; i < graph->table_capacity; ++i) graph->table[i] = NONE;
+
+        for (size_t i = 0; i < graph->n_nodes; ++i)
+        {
+            enode_t *enode = graph->nodes + i;
+            if (!enode->alive) continue;
+
+            if (enode->left  != NONE) enode->left  = egraph_find (graph, enode->left);
+            if (enode->right != NONE) enode->right = egraph_find (graph, enode->right);
+
+            size_t found = table_lookup (graph, enode);
+
+            if (found != NONE)
+            {
+                merged |= egraph_union (graph, enode->eclass, graph->nodes[found].eclass);
+                enode->alive = false;
+            }
+            else if (!table_insert (graph, i))
+            {
+                return false;
+            }
+        }
+
+        size_t n_nodes = graph->n_nodes;
+        for (size_t i = 0; i < n_nodes; ++i)
+        {
+            double val = NAN;
+            if (!graph->nodes[i].alive || !enode_fold (graph, graph->nodes + i, &val)) continue;
+
+            size_t eclass = egraph_find (graph, graph->nodes[i].eclass);
+            if (graph->classes[eclass].is_const) continue;
+
+            size_t const_class = egraph_add (graph, {tree::node_type_t::VAL, tree::op_t::ADD, val, '\0',
+                                                                            NONE, NONE, NONE, true});
+            if (const_class == NONE) return false;
+
+            merged |= egraph_union (graph, eclass, const_class);
+        }
+    }
+
+    return true;
+}
+
+/// Nodes of every class: class_nodes[class_start[c] .. class_start[c + 1])
+static bool egraph_index (egraph_t *graph)
+{
+    assert (graph != nullptr && "invalid pointer");
+
+    free (graph->class_start);
+    free (graph->class_nodes);
+
+    graph->class_start = (size_t *) calloc (graph->n_classes + 1, sizeof (size_t));
+    graph->class_nodes = (size_t *) calloc (graph->n_nodes + 1,   sizeof (size_t));
+    if (graph->class_start == nullptr || graph->class_nodes == nullptr) return false;
+
+    for (size_t i = 0; i < graph->n_nodes; ++i)
+    {
+        if (graph->nodes[i].alive) graph->class_start[egraph_find (graph, graph->nodes[i].eclass) + 1]++;
+    }
+
+    for (size_t c = 0; c < graph->n_classes; ++c) graph->class_start[c + 1] += graph->class_start[c];
+
+    for (size_t i = 0; i < graph->n_nodes; ++i)
+    {
+        if (!graph->nodes[i].alive) continue;
+
+        size_t eclass = egraph_find (graph, graph->nodes[i].eclass);
+        graph->nodes[i].eclass = eclass;
+
+        // class_start[c] is used as a cursor and restored below
+        graph->class_nodes[graph->class_start[eclass]++] = i;
+    }
+
+    for (size_t c = graph->n_classes; c > 0; --c) graph->class_start[c] = graph->class_start[c - 1];
+    graph->class_start[0] = 0;
+
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static size_t table_lookup (egraph_t *graph, const enode_t *enode)
+{
+    size_t mask = graph->table_capacity - 1;
+
+    for (size_t indx = enode_hash (enode) & mask; graph->table[indx] != NONE; indx = (indx + 1) & mask)
+    {
+        if (enode_equal (graph->nodes + graph->table[indx], enode)) return graph->table[indx];
+    }
+
+    return NONE;
+}
+
+static bool table_insert (egraph_t *graph, size_t node_indx)
+{
+    if (2 * graph->n_nodes > graph->table_capacity && !table_rehash (graph, 2 * graph->table_capacity))
+    {
+        return false;
+    }
+
+    size_t mask = graph->table_capacity - 1;
+    size_t indx = enode_hash (graph->nodes + node_indx) & mask;
+
+    while (graph->table[indx] != NONE) indx = (indx + 1) & mask;
+
+    graph->table[indx] = node_indx;
+    return true;
+}
+
+static bool table_rehash (egraph_t *graph, size_t capacity)
+{
+    size_t *new_table = (size_t *) malloc (capacity * sizeof (size_t));
+    if (new_table == nullptr) return false;
+
+    for (size_t i = 0; i < capacity; ++i) new_table[i] = NONE;
+
+    free (graph->table);
+    graph->table          = new_table;
+    graph->table_capacity = capacity;
+
+    size_t mask = capacity - 1;
+
+    for (size_t i = 0; i < graph->n_nodes; ++i)
+    {
+        if (!graph->nodes[i].alive) continue;
+
+        size_t indx = enode_hash (graph->nodes + i) & mask;
+        while (graph->table[indx] != NONE) indx = (indx + 1) & mask;
+
+        graph->table[indx] = i;
+    }
+
+    return true;
+}
+
+static size_t enode_hash (const enode_t *enode)
+{
+    uint64_t payload = 0;
+
+    switch (enode->type)
+    {
+        case tree::node_type_t::OP:  payload = (uint64_t) enode->op;                   break;
+        case tree::node_type_t::VAL: memcpy (&payload, &enode->val, sizeof (double));   break;
+        case tree::node_type_t::VAR: payload = (uint64_t) (unsigned char) enode->var;   break;
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "Invalid node type");
+    }
+
+    uint64_t hash = (uint64_t) enode->type;
+    hash = (hash ^ payload)                * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (uint64_t) enode->left)  * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (uint64_t) enode->right) * 0x9E3779B97F4A7C15ull;
+
+    return hash ^ (hash >> 29);
+}
+
+static bool enode_equal (const enode_t *lhs, const enode_t *rhs)
+{
+    if (lhs->type != rhs->type || lhs->left != rhs->left || lhs->right != rhs->right) return false;
+
+    switch (lhs->type)
+    {
+        case tree::node_type_t::OP:  return lhs->op  == rhs->op;
+        case tree::node_type_t::VAR: return lhs->var == rhs->var;
+        case tree::node_type_t::VAL: return memcmp (&lhs->val, &rhs->val, sizeof (double)) == 0;
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "Invalid node type");
+    }
+
+    return false;
+}
+
+/// @return true if all operands are constant and the result is finite
+static bool enode_fold (const egraph_t *graph, const enode_t *enode, double *val)
+{
+    if (enode->type != tree::node_type_t::OP) return false;
+
+    const eclass_t *lhs_class = (enode->left != NONE) ? graph->classes + enode->left : nullptr;
+    const eclass_t *rhs_class = graph->classes + enode->right;
+
+    if ((lhs_class && !lhs_class->is_const) || !rhs_class->is_const) return false;
+
+    double lhs = lhs_class ? lhs_class->val : NAN;
+    double rhs = rhs_class->val;
+
+    switch (enode->op)
+    {
+        case tree::op_t::ADD: *val = lhs + rhs;       break;
+        case tree::op_t::SUB: *val = lhs - rhs;       break;
+        case tree::op_t::DIV: *val = lhs / rhs;       break;
+        case tree::op_t::MUL: *val = lhs * rhs;       break;
+        case tree::op_t::SIN: *val = sin (rhs);       break;
+        case tree::op_t::COS: *val = cos (rhs);       break;
+        case tree::op_t::EXP: *val = exp (rhs);       break;
+        case tree::op_t::LOG: *val = log (rhs);       break;
+        case tree::op_t::POW: *val = pow (lhs, rhs);  break;
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    return isfinite (*val);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// @return false if matches limit is reached
+static bool ematch_class (saturate_ctx_t *ctx, size_t rule, size_t eclass)
+{
+    size_t     subst[N_METAVARS];
+    pat_goal_t goals[MAX_PAT_SIZE] = {{ctx->patterns[rule], eclass}};
+
+    for (size_t i = 0; i < N_METAVARS; ++i) subst[i] = NONE;
+
+    return ematch_goals (ctx, rule, eclass, goals, 1, subst);
+}
+
+/**
+ * @brief Backtracking matching of pattern nodes (goals) against classes, every full
+ *        substitution is saved to ctx->matches
+ *
+ * @return false if matches limit is reached
+ */
+static bool ematch_goals (saturate_ctx_t *ctx, size_t rule, size_t root,
+                          pat_goal_t *goals, size_t n_goals, size_t *subst)
+{
+    egraph_t *graph = ctx->graph;
+
+    if (n_goals == 0)
+    {
+        if (ctx->n_matches == ctx->max_matches) return false;
+
+        ematch_t *match = ctx->matches + ctx->n_matches++;
+        match->rule   = rule;
+        match->eclass = root;
+        memcpy (match->subst, subst, sizeof (match->subst));
+
+        return true;
+    }
+
+    pat_goal_t      goal   = goals[n_goals - 1];
+    const eclass_t *eclass = graph->classes + goal.eclass;
+    bool            res    = true;
+
+    if (is_metavar (goal.pat))
+    {
+        size_t *bind     = subst + (goal.pat->var - 'A');
+        bool    is_const = goal.pat->var == 'K' || goal.pat->var == 'L' || goal.pat->var == 'M';
+
+        if (is_const && !eclass->is_const) return true;
+
+        if (*bind != NONE)
+        {
+            return (*bind != goal.eclass) || ematch_goals (ctx, rule, root, goals, n_goals - 1, subst);
+        }
+
+        *bind = goal.eclass;
+        res   = ematch_goals (ctx, rule, root, goals, n_goals - 1, subst);
+        *bind = NONE;
+
+        return res;
+    }
+
+    if (goal.pat->type == tree::node_type_t::VAL)
+    {
+        if (!eclass->is_const || !iseq (eclass->val, goal.pat->val)) return true;
+
+        return ematch_goals (ctx, rule, root, goals, n_goals - 1, subst);
+    }
+
+    for (size_t i = graph->class_start[goal.eclass]; i < graph->class_start[goal.eclass + 1] && res; ++i)
+    {
+        const enode_t *enode = graph->nodes + graph->class_nodes[i];
+
+        if (enode->type != goal.pat->type) continue;
+
+        if (enode->type == tree::node_type_t::VAR)
+        {
+            if (enode->var == goal.pat->var) res = ematch_goals (ctx, rule, root, goals, n_goals - 1, subst);
+            continue;
+        }
+
+        if (enode->op != goal.pat->op) continue;
+
+        assert (n_goals + 1 < MAX_PAT_SIZE && "too big pattern");
+
+        size_t n_next = n_goals - 1;
+        goals[n_next++] = {goal.pat->right, enode->right};
+        if (goal.pat->left) goals[n_next++] = {goal.pat->left, enode->left};
+
+        res = ematch_goals (ctx, rule, root, goals, n_next, subst);
+
+        goals[n_goals - 1] = goal;
+    }
+
+    return res;
+}
+
+/**
+ * @return Class of the pattern with substituted metavariables or NONE on OOM
+ */
+static size_t instantiate (egraph_t *graph, const tree::node_t *pat, const size_t *subst)
+{
+    if (is_metavar (pat)) return subst[pat->var - 'A'];
+
+    enode_t enode = {pat->type, tree::op_t::ADD, NAN, '\0', NONE, NONE, NONE, true};
+
+    switch (pat->type)
+    {
+        case tree::node_type_t::VAL: enode.val = pat->val; break;
+        case tree::node_type_t::VAR: enode.var = pat->var; break;
+
+        case tree::node_type_t::OP:
+            enode.op = pat->op;
+
+            if (pat->left && (enode.left = instantiate (graph, pat->left, subst)) == NONE) return NONE;
+            if ((enode.right = instantiate (graph, pat->right, subst)) == NONE)            return NONE;
+            break;
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "invalid pattern");
+    }
+
+    return egraph_add (graph, enode);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Cheapest e-node of every class (fixed point over all e-nodes)
+ *
+ * @return Cost of the root class
+ */
+static double extract_costs (egraph_t *graph, size_t root, tree::cost_model_t model, size_t *best_node)
+{
+    double *costs = (double *) calloc (graph->n_classes, sizeof (double));
+    if (costs == nullptr) return INFINITY;
+
+    for (size_t c = 0; c < graph->n_classes; ++c) costs[c] = INFINITY;
+
+    bool improved = true;
+
+    while (improved)
+    {
+        improved = false;
+
+        for (size_t i = 0; i < graph->n_nodes; ++i)
+        {
+            const enode_t *enode = graph->nodes + i;
+            if (!enode->alive) continue;
+
+            double cost = node_cost (enode->type, enode->op, model);
+            if (enode->left  != NONE) cost += costs[egraph_find (graph, enode->left)];
+            if (enode->right != NONE) cost += costs[egraph_find (graph, enode->right)];
+
+            size_t eclass = egraph_find (graph, enode->eclass);
+
+            if (cost < costs[eclass])
+            {
+                costs[eclass]     = cost;
+                best_node[eclass] = i;
+                improved          = true;
+            }
+        }
+    }
+
+    double root_cost = costs[root];
+
+    free (costs);
+    return root_cost;
+}
+
+/**
+ * @brief Post-order walk with explicit stack over the best e-nodes, node is finished when
+ *        its operands are extracted
+ *
+ * @param built already extracted classes (shared by every user)
+ */
+static tree::node_t *extract_subtree (egraph_t *graph, size_t eclass, const size_t *best_node,
+                                                                        tree::node_t **built)
+{
+    assert (graph     != nullptr && "invalid pointer");
+    assert (best_node != nullptr && "invalid pointer");
+    assert (built     != nullptr && "invalid pointer");
+
+    extract_frame_t  inline_frames[EGRAPH_INLINE_FRAMES];
+    extract_frame_t *frames   = inline_frames;
+    size_t           capacity = EGRAPH_INLINE_FRAMES;
+    size_t           size     = 0;
+
+    tree::node_t *node = nullptr;
+
+    while (true)
+    {
+        while (true)
+        {
+            eclass = egraph_find (graph, eclass);
+
+            if (built[eclass] != nullptr)
+            {
+                node = tree::share_node (built[eclass]);
+                break;
+            }
+
+            const enode_t *enode = graph->nodes + best_node[eclass];
+
+            if ((node = extract_node (enode)) == nullptr) break;
+
+            if (enode->type != tree::node_type_t::OP)
+            {
+                built[eclass] = tree::share_node (node);
+                break;
+            }
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    tree::del_node (node);
+                    node = nullptr;
+                    break;
+                }
+
+                frames = (extract_frame_t *) new_frames;
+            }
+
+            frames[size++] = {eclass, node, enode->left == NONE};
+            eclass = (enode->left != NONE) ? enode->left : enode->right;
+        }
+
+        bool ok = node != nullptr;
+
+        while (ok && size > 0 && frames[size - 1].right)
+        {
+            extract_frame_t *frame = frames + --size;
+
+            frame->node->right   = node;
+            built[frame->eclass] = tree::share_node (frame->node);
+
+            node = frame->node;
+        }
+
+        if (!ok || size == 0) break;
+
+        frames[size - 1].node->left = node;
+        frames[size - 1].right      = true;
+
+        eclass = graph->nodes[best_node[frames[size - 1].eclass]].right;
+    }
+
+    // Unfinished nodes own their extracted left operands
+    for (size_t i = 0; node == nullptr && i < size; ++i) tree::del_node (frames[i].node);
+
+    if (frames != inline_frames) free (frames);
+
+    return node;
+}
+
+static tree::node_t *extract_node (const enode_t *enode)
+{
+    assert (enode != nullptr && "invalid pointer");
+
+    switch (enode->type)
+    {
+        case tree::node_type_t::VAL: return tree::new_node (enode->val);
+        case tree::node_type_t::VAR: return tree::new_node (enode->var);
+        case tree::node_type_t::OP:  return tree::new_node (enode->op);
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "invalid node");
+    }
+
+    return nullptr;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static double node_cost (tree::node_type_t type, tree::op_t op, tree::cost_model_t model)
+{
+    if (model == tree::cost_model_t::NODE_COUNT) return 1;
+
+    return (type == tree::node_type_t::OP) ? OP_EVAL_COST[(int) op] : LEAF_EVAL_COST;
+}
+
+/**
+ * @brief Sum of node costs, order of the walk doesn't matter
+ *
+ * @return Cost or 0 on OOM, so the tree is kept
+ */
+static double subtree_cost (const tree::node_t *node, tree::cost_model_t model)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    const tree::node_t  *inline_frames[EGRAPH_INLINE_FRAMES];
+    const tree::node_t **frames   = inline_frames;
+    size_t               capacity = EGRAPH_INLINE_FRAMES;
+    size_t               size     = 0;
+
+    double cost = 0;
+
+    frames[size++] = node;
+
+    while (size > 0)
+    {
+        node = frames[--size];
+
+        tree::op_t op = (node->type == tree::node_type_t::OP) ? node->op : tree::op_t::ADD;
+        cost += node_cost (node->type, op, model);
+
+        if (size + 2 > capacity)
+        {
+            void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+            if (new_frames == nullptr)
+            {
+                cost = 0;
+                break;
+            }
+
+            frames = (const tree::node_t **) new_frames;
+        }
+
+        if (node->left  != nullptr) frames[size++] = node->left;
+        if (node->right != nullptr) frames[size++] = node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return cost;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool is_metavar (const tree::node_t *pat)
+{
+    return pat->type == tree::node_type_t::VAR && 'A' <= pat->var && pat->var <= 'Z';
+}
+
+static double seconds_now ()
+{
+    timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+static bool iseq (double lhs, double rhs)
+{
+    return fabs (lhs - rhs) < DBL_ERROR;
+}
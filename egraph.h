@@ -0,0 +1,27 @@
+#ifndef EGRAPH_H
+#define EGRAPH_H
+
+#include "tree.h"
+#include "tree_output.h"
+
+namespace tree
+{
+    enum class cost_model_t
+    {
+        NODE_COUNT,     ///< Every node costs 1
+        EVAL_COST       ///< Rough cost of evaluation (transcendental functions are expensive)
+    };
+
+    struct saturate_opts_t
+    {
+        size_t       max_nodes   = 5000;    ///< E-graph size limit
+        unsigned     max_iters   = 8;       ///< Rewrite rounds limit
+        double       max_seconds = 0.05;    ///< Time limit
+        cost_model_t cost        = cost_model_t::NODE_COUNT;
+    };
+
+    tree_err_t simplify_saturate (tree_t *tree, const saturate_opts_t *opts = nullptr,
+                                                render::render_t *render = nullptr);
+}
+
+#endif
@@ -107,13 +107,17 @@ unsigned int count_lines (const char *text)
     assert (text != NULL && "pointer can't be NULL");
 
     unsigned int n_lines = 0;
+    const char *next     = NULL;
 
-    while ((text = strchr (text, '\n')) != NULL)
+    while ((next = strchr (text, '\n')) != NULL)
     {
         n_lines++;
-        text++;
+        text = next + 1;
     }
 
+    // Last line without '\n'
+    if (*text != '\0') n_lines++;
+
     return n_lines;
 }
 
@@ -139,6 +143,13 @@ void create_index (struct text *text)
         n_line++;
         line_start = cur;
     }
+
+    // Last line without '\n' is already terminated by read_file
+    if (*line_start != '\0')
+    {
+        lines[n_line].content = line_start;
+        lines[n_line].len     = strlen (line_start) + 1;
+    }
 }
 
 void free_text (struct text *text)
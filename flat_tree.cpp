@@ -0,0 +1,848 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat_tree.h"
+#include "lib/log.h"
+#include "tree.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const size_t FLAT_MIN_CAPACITY = 64;
+
+/// Walks of trees not deeper than this don't allocate stack in heap
+const size_t FLAT_INLINE_FRAMES = 64;
+
+/// Trees with more nodes keep values of evaluation in heap
+const size_t FLAT_STACK_VALS = 512;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Operation which children are being flattened, left holds index of the left child
+struct flatten_frame_t
+{
+    const tree::node_t *node;
+    uint32_t            left;
+    bool                right;  ///< Right child is being flattened
+};
+
+struct flatten_shared_t
+{
+    const tree::node_t *node;
+    uint32_t            indx;
+};
+
+/**
+ * @brief Explicit walk stack + indices of shared nodes (ref_cnt > 1) which are already flattened
+ */
+struct flatten_ctx_t
+{
+    tree::flat_tree_t *flat;
+
+    flatten_frame_t *frames;
+    size_t           frames_capacity;
+    size_t           frames_size;
+    flatten_frame_t  inline_frames[FLAT_INLINE_FRAMES];
+
+    flatten_shared_t *shared;
+    size_t            shared_capacity;
+    size_t            shared_size;
+};
+
+/// Infix output state of one node: 0 - nothing is printed, 1 - left operand, 2 - both operands
+struct store_frame_t
+{
+    uint32_t indx;
+    int      stage;
+};
+
+static bool     push_frame    (flatten_ctx_t *ctx, const tree::node_t *node);
+static uint64_t ptr_hash      (const tree::node_t *node);
+static uint32_t shared_find   (const flatten_ctx_t *ctx, const tree::node_t *node);
+static bool     shared_insert (flatten_ctx_t *ctx, const tree::node_t *node, uint32_t indx);
+
+static bool     flat_reserve (tree::flat_tree_t *flat, size_t capacity);
+static uint32_t flat_push    (tree::flat_tree_t *flat, tree::node_type_t type, uint8_t op, double val,
+                                                        uint32_t left, uint32_t right);
+static uint32_t push_node    (tree::flat_tree_t *flat, const tree::node_t *node,
+                                                        uint32_t left, uint32_t right);
+
+static double apply_op (tree::op_t op, double left, double right);
+static bool   is_unary (tree::op_t op);
+
+static uint32_t diff_node (tree::flat_tree_t *flat, uint32_t indx, const uint32_t *ders,
+                                                                   const bool *has_var, char var);
+static uint32_t make_val  (tree::flat_tree_t *flat, double val);
+static uint32_t make_op   (tree::flat_tree_t *flat, tree::op_t op, uint32_t left, uint32_t right);
+static bool     compact   (tree::flat_tree_t *flat, uint32_t root);
+
+static void store_leaf (const tree::flat_tree_t *flat, uint32_t indx, FILE *stream);
+
+static bool is_zero (double val);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+void tree::flat_dtor (flat_tree_t *flat)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    free (flat->types);
+    free (flat->ops);
+    free (flat->vals);
+    free (flat->lefts);
+    free (flat->rights);
+
+    *flat = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::flatten (const tree_t *tree, flat_tree_t *flat)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    return flatten (tree->head_node, flat);
+}
+
+/**
+ * @brief Post-order flattening with explicit stack: goes down left links,
+ *        appends node when its children are appended
+ */
+tree::tree_err_t tree::flatten (const node_t *node, flat_tree_t *flat)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (flat != nullptr && "invalid pointer");
+
+    *flat = {};
+
+    flatten_ctx_t ctx = {};
+    ctx.flat            = flat;
+    ctx.frames          = ctx.inline_frames;
+    ctx.frames_capacity = FLAT_INLINE_FRAMES;
+
+    uint32_t indx = FLAT_NONE;
+    bool     ok   = flat_reserve (flat, FLAT_MIN_CAPACITY);
+
+    while (ok)
+    {
+        while (ok && (indx = shared_find (&ctx, node)) == FLAT_NONE)
+        {
+            if (node->left == nullptr && node->right == nullptr)
+            {
+                indx = push_node (flat, node, FLAT_NONE, FLAT_NONE);
+                ok   = indx != FLAT_NONE && shared_insert (&ctx, node, indx);
+                break;
+            }
+
+            ok   = push_frame (&ctx, node);
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        while (ok && ctx.frames_size > 0 && ctx.frames[ctx.frames_size - 1].right)
+        {
+            flatten_frame_t *frame = ctx.frames + --ctx.frames_size;
+
+            indx = push_node (flat, frame->node, frame->left, indx);
+            ok   = indx != FLAT_NONE && shared_insert (&ctx, frame->node, indx);
+        }
+
+        if (!ok || ctx.frames_size == 0) break;
+
+        flatten_frame_t *frame = ctx.frames + ctx.frames_size - 1;
+        frame->left  = indx;
+        frame->right = true;
+
+        assert (frame->node->right != nullptr && "node with left child only");
+        node = frame->node->right;
+    }
+
+    if (ctx.frames != ctx.inline_frames) free (ctx.frames);
+    free (ctx.shared);
+
+    if (!ok)
+    {
+        flat_dtor (flat);
+        return OOM;
+    }
+
+    return OK;
+}
+
+tree::tree_err_t tree::unflatten (const flat_tree_t *flat, tree_t *tree)
+{
+    assert (flat != nullptr && "invalid pointer");
+    assert (tree != nullptr && "invalid pointer");
+    assert (flat->size > 0  && "empty tree");
+
+    node_t **nodes = (node_t **) calloc (flat->size, sizeof (node_t *));
+    if (nodes == nullptr) return OOM;
+
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < flat->size; ++i)
+    {
+        switch ((node_type_t) flat->types[i])
+        {
+            case node_type_t::VAL: nodes[i] = new_node (flat->vals[i]);          break;
+            case node_type_t::VAR: nodes[i] = new_node ((char) flat->ops[i]);    break;
+            case node_type_t::OP:  nodes[i] = new_node ((op_t) flat->ops[i]);    break;
+
+            case node_type_t::NOT_SET:
+            default:
+                assert (0 && "invalid node type");
+        }
+
+        if (nodes[i] == nullptr)
+        {
+            ok = false;
+            break;
+        }
+
+        // Array holds own reference of every node, so shared child is shared by reference count
+        if (flat->lefts[i]  != FLAT_NONE) nodes[i]->left  = share_node (nodes[flat->lefts[i]]);
+        if (flat->rights[i] != FLAT_NONE) nodes[i]->right = share_node (nodes[flat->rights[i]]);
+    }
+
+    tree->head_node = ok ? nodes[flat->size - 1] : nullptr;
+
+    for (size_t i = 0; i < flat->size; ++i)
+    {
+        if (ok && i == flat->size - 1) break;
+        del_node (nodes[i]);
+    }
+
+    free (nodes);
+    return ok ? OK : OOM;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+double tree::calc_tree (const flat_tree_t *flat, double x)
+{
+    assert (flat != nullptr && "invalid pointer");
+    assert (flat->size > 0  && "empty tree");
+
+    double  stack_vals[FLAT_STACK_VALS];
+    double *vals = stack_vals;
+
+    if (flat->size > FLAT_STACK_VALS)
+    {
+        vals = (double *) calloc (flat->size, sizeof (double));
+        if (vals == nullptr) return NAN;
+    }
+
+    for (size_t i = 0; i < flat->size; ++i)
+    {
+        switch ((node_type_t) flat->types[i])
+        {
+            case node_type_t::VAL:
+                vals[i] = flat->vals[i];
+                break;
+
+            case node_type_t::VAR:
+                vals[i] = (flat->ops[i] == 'x') ? x : NAN;
+                break;
+
+            case node_type_t::OP:
+            {
+                double left  = (flat->lefts[i]  != FLAT_NONE) ? vals[flat->lefts[i]]  : NAN;
+                double right = (flat->rights[i] != FLAT_NONE) ? vals[flat->rights[i]] : NAN;
+
+                vals[i] = apply_op ((op_t) flat->ops[i], left, right);
+                break;
+            }
+
+            case node_type_t::NOT_SET:
+            default:
+                assert (0 && "invalid node type");
+        }
+    }
+
+    double ans = vals[flat->size - 1];
+
+    if (vals != stack_vals) free (vals);
+
+    return ans;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Derivative by the rules of diff_calc, computed for all nodes in one forward pass
+ *
+ * Dst starts as a copy of src (derivatives refer to source nodes by the same indices),
+ * derivative nodes are appended with constant folding, then nodes unreachable from
+ * the derivative root are dropped.
+ */
+tree::tree_err_t tree::calc_diff (const flat_tree_t *src, flat_tree_t *dst, char var)
+{
+    assert (src != nullptr && "invalid pointer");
+    assert (dst != nullptr && "invalid pointer");
+    assert (src != dst     && "differentiation can't be done in place");
+    assert (src->size > 0  && "empty tree");
+
+    *dst = {};
+
+    size_t n = src->size;
+
+    uint32_t *ders    = (uint32_t *) calloc (n, sizeof (uint32_t));
+    bool     *has_var = (bool *)     calloc (n, sizeof (bool));
+
+    bool ok = ders != nullptr && has_var != nullptr && flat_reserve (dst, 4 * n);
+
+    if (ok)
+    {
+        memcpy (dst->types,  src->types,  n * sizeof (uint8_t));
+        memcpy (dst->ops,    src->ops,    n * sizeof (uint8_t));
+        memcpy (dst->vals,   src->vals,   n * sizeof (double));
+        memcpy (dst->lefts,  src->lefts,  n * sizeof (uint32_t));
+        memcpy (dst->rights, src->rights, n * sizeof (uint32_t));
+        dst->size = n;
+    }
+
+    for (uint32_t i = 0; ok && i < n; ++i)
+    {
+        has_var[i] = src->types[i] == (uint8_t) node_type_t::VAR                    ||
+                     (src->lefts[i]  != FLAT_NONE && has_var[src->lefts[i]])       ||
+                     (src->rights[i] != FLAT_NONE && has_var[src->rights[i]]);
+
+        ders[i] = diff_node (dst, i, ders, has_var, var);
+        ok = ders[i] != FLAT_NONE;
+    }
+
+    ok = ok && compact (dst, ders[n - 1]);
+
+    free (ders);
+    free (has_var);
+
+    if (!ok)
+    {
+        flat_dtor (dst);
+        return OOM;
+    }
+
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Store as fully parenthesized expression which parse_dump (and load) reads back,
+ *        shared subtrees are written at every use
+ */
+void tree::store (const flat_tree_t *flat, FILE *stream)
+{
+    assert (flat   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+    assert (flat->size > 0    && "empty tree");
+
+    store_frame_t  inline_frames[FLAT_INLINE_FRAMES];
+    store_frame_t *frames   = inline_frames;
+    size_t         capacity = FLAT_INLINE_FRAMES;
+    size_t         size     = 0;
+
+    frames[size++] = {(uint32_t) (flat->size - 1), 0};
+
+    while (size > 0)
+    {
+        store_frame_t *frame = frames + size - 1;
+        uint32_t       indx  = frame->indx;
+        uint32_t       child = FLAT_NONE;
+
+        if (flat->types[indx] != (uint8_t) node_type_t::OP)
+        {
+            store_leaf (flat, indx, stream);
+            size--;
+            continue;
+        }
+
+        op_t op = (op_t) flat->ops[indx];
+
+        switch (frame->stage++)
+        {
+            case 0:
+                if (is_unary (op))
+                {
+                    fprintf (stream, "%s (", op == op_t::SIN ? "sin" : op == op_t::COS ? "cos" :
+                                             op == op_t::EXP ? "exp" : "log");
+                    frame->stage++;
+                    child = flat->rights[indx];
+                }
+                else
+                {
+                    fprintf (stream, "(");
+                    child = flat->lefts[indx];
+                }
+                break;
+
+            case 1:
+                fprintf (stream, " %c ", op == op_t::ADD ? '+' : op == op_t::SUB ? '-' :
+                                         op == op_t::MUL ? '*' : op == op_t::DIV ? '/' : '^');
+                child = flat->rights[indx];
+                break;
+
+            case 2:
+                fprintf (stream, ")");
+                size--;
+                break;
+
+            default:
+                assert (0 && "invalid store stage");
+        }
+
+        if (child == FLAT_NONE) continue;
+
+        if (size == capacity)
+        {
+            store_frame_t *new_frames = (store_frame_t *) malloc (2 * capacity * sizeof (store_frame_t));
+            if (new_frames == nullptr)
+            {
+                LOG (log::ERR, "no memory to store the tree");
+                break;
+            }
+
+            memcpy (new_frames, frames, size * sizeof (store_frame_t));
+            if (frames != inline_frames) free (frames);
+
+            frames    = new_frames;
+            capacity *= 2;
+        }
+
+        frames[size++] = {child, 0};
+    }
+
+    fprintf (stream, "\n");
+
+    if (frames != inline_frames) free (frames);
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static bool push_frame (flatten_ctx_t *ctx, const tree::node_t *node)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    if (ctx->frames_size == ctx->frames_capacity)
+    {
+        size_t new_capacity = 2 * ctx->frames_capacity;
+
+        flatten_frame_t *new_frames = (flatten_frame_t *) malloc (new_capacity * sizeof (flatten_frame_t));
+        if (new_frames == nullptr) return false;
+
+        memcpy (new_frames, ctx->frames, ctx->frames_size * sizeof (flatten_frame_t));
+        if (ctx->frames != ctx->inline_frames) free (ctx->frames);
+
+        ctx->frames          = new_frames;
+        ctx->frames_capacity = new_capacity;
+    }
+
+    ctx->frames[ctx->frames_size++] = {node, tree::FLAT_NONE, node->left == nullptr};
+    return true;
+}
+
+static uint64_t ptr_hash (const tree::node_t *node)
+{
+    uint64_t hash = (uintptr_t) node * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 32);
+}
+
+static uint32_t shared_find (const flatten_ctx_t *ctx, const tree::node_t *node)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    if (node->ref_cnt <= 1 || ctx->shared_capacity == 0) return tree::FLAT_NONE;
+
+    size_t mask = ctx->shared_capacity - 1;
+
+    for (size_t indx = ptr_hash (node) & mask; ctx->shared[indx].node != nullptr; indx = (indx + 1) & mask)
+    {
+        if (ctx->shared[indx].node == node) return ctx->shared[indx].indx;
+    }
+
+    return tree::FLAT_NONE;
+}
+
+/// Only shared nodes are remembered, other ones are met once
+static bool shared_insert (flatten_ctx_t *ctx, const tree::node_t *node, uint32_t indx)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    if (node->ref_cnt <= 1) return true;
+
+    if (2 * (ctx->shared_size + 1) > ctx->shared_capacity)
+    {
+        size_t new_capacity = ctx->shared_capacity ? 2 * ctx->shared_capacity : FLAT_MIN_CAPACITY;
+
+        flatten_shared_t *new_shared = (flatten_shared_t *) calloc (new_capacity, sizeof (flatten_shared_t));
+        if (new_shared == nullptr) return false;
+
+        for (size_t i = 0; i < ctx->shared_capacity; ++i)
+        {
+            if (ctx->shared[i].node == nullptr) continue;
+
+            size_t pos = ptr_hash (ctx->shared[i].node) & (new_capacity - 1);
+            while (new_shared[pos].node != nullptr) pos = (pos + 1) & (new_capacity - 1);
+
+            new_shared[pos] = ctx->shared[i];
+        }
+
+        free (ctx->shared);
+        ctx->shared          = new_shared;
+        ctx->shared_capacity = new_capacity;
+    }
+
+    size_t mask = ctx->shared_capacity - 1;
+    size_t pos  = ptr_hash (node) & mask;
+    while (ctx->shared[pos].node != nullptr) pos = (pos + 1) & mask;
+
+    ctx->shared[pos] = {node, indx};
+    ctx->shared_size++;
+
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+#define GROW(array, type)                                                           \
+{                                                                                   \
+    type *new_array = (type *) realloc (flat->array, capacity * sizeof (type));    \
+    if (new_array == nullptr) return false;                                         \
+    flat->array = new_array;                                                        \
+}
+
+static bool flat_reserve (tree::flat_tree_t *flat, size_t capacity)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    if (capacity <= flat->capacity) return true;
+
+    // Capacity is changed after all arrays are grown, so failure leaves the tree valid
+    GROW (types,  uint8_t);
+    GROW (ops,    uint8_t);
+    GROW (vals,   double);
+    GROW (lefts,  uint32_t);
+    GROW (rights, uint32_t);
+
+    flat->capacity = capacity;
+    return true;
+}
+
+#undef GROW
+
+/**
+ * @return Index of the new node or FLAT_NONE on OOM (or if indices are exhausted)
+ */
+static uint32_t flat_push (tree::flat_tree_t *flat, tree::node_type_t type, uint8_t op, double val,
+                                                     uint32_t left, uint32_t right)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    if (flat->size >= tree::FLAT_NONE) return tree::FLAT_NONE;
+
+    if (flat->size == flat->capacity &&
+        !flat_reserve (flat, flat->capacity ? 2 * flat->capacity : FLAT_MIN_CAPACITY))
+    {
+        return tree::FLAT_NONE;
+    }
+
+    size_t indx = flat->size++;
+
+    flat->types [indx] = (uint8_t) type;
+    flat->ops   [indx] = op;
+    flat->vals  [indx] = val;
+    flat->lefts [indx] = left;
+    flat->rights[indx] = right;
+
+    return (uint32_t) indx;
+}
+
+static uint32_t push_node (tree::flat_tree_t *flat, const tree::node_t *node, uint32_t left, uint32_t right)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            return flat_push (flat, node->type, 0, node->val, left, right);
+
+        case tree::node_type_t::VAR:
+            return flat_push (flat, node->type, (uint8_t) node->var, 0, left, right);
+
+        case tree::node_type_t::OP:
+            return flat_push (flat, node->type, (uint8_t) node->op, 0, left, right);
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "invalid node type");
+            return tree::FLAT_NONE;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Same operations as calc_subtree
+static double apply_op (tree::op_t op, double left, double right)
+{
+    switch (op)
+    {
+        case tree::op_t::ADD: return left + right;
+        case tree::op_t::SUB: return left - right;
+        case tree::op_t::DIV: return left / right;
+        case tree::op_t::MUL: return left * right;
+        case tree::op_t::SIN: return sin (right);
+        case tree::op_t::COS: return cos (right);
+        case tree::op_t::EXP: return exp (right);
+        case tree::op_t::POW: return pow (left, right);
+        case tree::op_t::LOG: return log (right);
+
+        default:
+            assert (0 && "Unexpected op type");
+            return NAN;
+    }
+}
+
+static bool is_unary (tree::op_t op)
+{
+    return op == tree::op_t::SIN || op == tree::op_t::COS ||
+           op == tree::op_t::EXP || op == tree::op_t::LOG;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+#define VAL(val)            make_val (flat, val)
+#define OP(op, lhs, rhs)    make_op  (flat, tree::op_t::op, lhs, rhs)
+#define FUNC(op, arg)       make_op  (flat, tree::op_t::op, tree::FLAT_NONE, arg)
+
+/**
+ * @brief Append derivative of the node, derivatives of its children are already appended
+ *
+ * @return Index of the derivative or FLAT_NONE on OOM
+ */
+static uint32_t diff_node (tree::flat_tree_t *flat, uint32_t indx, const uint32_t *ders,
+                                                                   const bool *has_var, char var)
+{
+    assert (flat    != nullptr && "invalid pointer");
+    assert (ders    != nullptr && "invalid pointer");
+    assert (has_var != nullptr && "invalid pointer");
+
+    switch ((tree::node_type_t) flat->types[indx])
+    {
+        case tree::node_type_t::VAL:
+            return VAL (0);
+
+        case tree::node_type_t::VAR:
+            return VAL (flat->ops[indx] == (uint8_t) var ? 1 : 0);
+
+        case tree::node_type_t::OP:
+            break;
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "invalid node type");
+            return tree::FLAT_NONE;
+    }
+
+    uint32_t l  = flat->lefts [indx];
+    uint32_t r  = flat->rights[indx];
+    uint32_t dl = (l != tree::FLAT_NONE) ? ders[l] : tree::FLAT_NONE;
+    uint32_t dr = ders[r];
+
+    switch ((tree::op_t) flat->ops[indx])
+    {
+        case tree::op_t::ADD: return OP (ADD, dl, dr);
+        case tree::op_t::SUB: return OP (SUB, dl, dr);
+
+        case tree::op_t::MUL: return OP (ADD, OP (MUL, dl, r), OP (MUL, l, dr));
+
+        case tree::op_t::DIV:
+            return OP (DIV, OP (SUB, OP (MUL, dl, r), OP (MUL, l, dr)),
+                            OP (MUL, r, r));
+
+        case tree::op_t::SIN: return OP (MUL, FUNC (COS, r), dr);
+        case tree::op_t::COS: return OP (MUL, OP (MUL, VAL (-1), FUNC (SIN, r)), dr);
+        case tree::op_t::EXP: return OP (MUL, indx, dr);
+        case tree::op_t::LOG: return OP (MUL, OP (DIV, VAL (1), r), dr);
+
+        case tree::op_t::POW:
+            if (!has_var[r])
+            {
+                return OP (MUL, OP (MUL, r, OP (POW, l, OP (SUB, r, VAL (1)))), dl);
+            }
+            else if (!has_var[l])
+            {
+                return OP (MUL, FUNC (LOG, l), OP (MUL, indx, dr));
+            }
+            else
+            {
+                return OP (MUL, indx, OP (ADD, OP (MUL, dr, FUNC (LOG, l)),
+                                               OP (MUL, OP (DIV, r, l), dl)));
+            }
+
+        default:
+            assert (0 && "Unexpected op type");
+            return tree::FLAT_NONE;
+    }
+}
+
+#undef VAL
+#undef OP
+#undef FUNC
+
+static uint32_t make_val (tree::flat_tree_t *flat, double val)
+{
+    return flat_push (flat, tree::node_type_t::VAL, 0, val, tree::FLAT_NONE, tree::FLAT_NONE);
+}
+
+#define IS_VAL(indx) (flat->types[indx] == (uint8_t) tree::node_type_t::VAL)
+
+/**
+ * @brief Append operation folding constants and neutral elements (like simplify does)
+ *
+ * @return Index of the result (may be one of the operands) or FLAT_NONE if some operand is
+ *         FLAT_NONE (allocation failed before) or on OOM
+ */
+static uint32_t make_op (tree::flat_tree_t *flat, tree::op_t op, uint32_t left, uint32_t right)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    bool unary = is_unary (op);
+
+    if (right == tree::FLAT_NONE || (!unary && left == tree::FLAT_NONE)) return tree::FLAT_NONE;
+
+    bool   l_val = !unary && IS_VAL (left);
+    bool   r_val = IS_VAL (right);
+    double l     = l_val ? flat->vals[left]  : NAN;
+    double r     = r_val ? flat->vals[right] : NAN;
+
+    if (r_val && (unary || l_val)) return make_val (flat, apply_op (op, l, r));
+
+    switch (op)
+    {
+        case tree::op_t::ADD:
+            if (l_val && is_zero (l)) return right;
+            if (r_val && is_zero (r)) return left;
+            break;
+
+        case tree::op_t::SUB:
+            if (r_val && is_zero (r)) return left;
+            break;
+
+        case tree::op_t::MUL:
+            if ((l_val && is_zero (l)) || (r_val && is_zero (r))) return make_val (flat, 0);
+            if (l_val && is_zero (l - 1)) return right;
+            if (r_val && is_zero (r - 1)) return left;
+            break;
+
+        case tree::op_t::DIV:
+            if (l_val && is_zero (l))     return make_val (flat, 0);
+            if (r_val && is_zero (r - 1)) return left;
+            break;
+
+        case tree::op_t::POW:
+            if (r_val && is_zero (r))     return make_val (flat, 1);
+            if (r_val && is_zero (r - 1)) return left;
+            break;
+
+        case tree::op_t::SIN:
+        case tree::op_t::COS:
+        case tree::op_t::EXP:
+        case tree::op_t::LOG:
+            break;
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    return flat_push (flat, tree::node_type_t::OP, (uint8_t) op, 0, left, right);
+}
+
+#undef IS_VAL
+
+/**
+ * @brief Drop nodes unreachable from the root, the root becomes the last node
+ *
+ * Order of the rest is kept, so it is still post-order.
+ */
+static bool compact (tree::flat_tree_t *flat, uint32_t root)
+{
+    assert (flat != nullptr && "invalid pointer");
+    assert (root < flat->size && "invalid root");
+
+    // Reachability marks first, then new indices (new index is never greater than the old one)
+    uint32_t *map = (uint32_t *) calloc (root + 1, sizeof (uint32_t));
+    if (map == nullptr) return false;
+
+    map[root] = 1;
+
+    for (uint32_t i = root + 1; i-- > 0; )
+    {
+        if (map[i] == 0) continue;
+
+        if (flat->lefts[i]  != tree::FLAT_NONE) map[flat->lefts[i]]  = 1;
+        if (flat->rights[i] != tree::FLAT_NONE) map[flat->rights[i]] = 1;
+    }
+
+    uint32_t size = 0;
+
+    for (uint32_t i = 0; i <= root; ++i)
+    {
+        if (map[i] == 0) continue;
+
+        flat->types [size] = flat->types[i];
+        flat->ops   [size] = flat->ops  [i];
+        flat->vals  [size] = flat->vals [i];
+        flat->lefts [size] = (flat->lefts[i]  != tree::FLAT_NONE) ? map[flat->lefts[i]]  : tree::FLAT_NONE;
+        flat->rights[size] = (flat->rights[i] != tree::FLAT_NONE) ? map[flat->rights[i]] : tree::FLAT_NONE;
+
+        map[i] = size++;
+    }
+
+    flat->size = size;
+
+    free (map);
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void store_leaf (const tree::flat_tree_t *flat, uint32_t indx, FILE *stream)
+{
+    assert (flat   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    if (flat->types[indx] == (uint8_t) tree::node_type_t::VAR)
+    {
+        fprintf (stream, "%c", flat->ops[indx]);
+        return;
+    }
+
+    double val = flat->vals[indx];
+
+    // Parser reads names of special values as variables
+    if (isnan (val)) {
+        fprintf (stream, "(0 / 0)");
+    } else if (isinf (val)) {
+        fprintf (stream, val > 0 ? "(1 / 0)" : "(-1 / 0)");
+    } else {
+        fprintf (stream, "%.17g", val);
+    }
+}
+
+static bool is_zero (double val)
+{
+    return fpclassify (val) == FP_ZERO;
+}
@@ -0,0 +1,45 @@
+#ifndef FLAT_TREE_H
+#define FLAT_TREE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tree.h"
+
+namespace tree
+{
+    const uint32_t FLAT_NONE = UINT32_MAX;   ///< No child
+
+    /**
+     * @brief Tree stored as parallel arrays indexed by node, in post-order
+     *
+     * Children always have smaller indices than their parent, the root is the last node.
+     * Shared subtrees of the source DAG stay shared: one index is a child of several nodes.
+     */
+    struct flat_tree_t
+    {
+        uint8_t  *types  = nullptr;   ///< node_type_t
+        uint8_t  *ops    = nullptr;   ///< op_t of OP node, name of VAR node
+        double   *vals   = nullptr;   ///< Value of VAL node
+        uint32_t *lefts  = nullptr;
+        uint32_t *rights = nullptr;
+
+        size_t size     = 0;
+        size_t capacity = 0;
+    };
+
+    void flat_dtor (flat_tree_t *flat);
+
+    tree_err_t flatten (const tree_t *tree, flat_tree_t *flat);
+    tree_err_t flatten (const node_t *node, flat_tree_t *flat);
+
+    tree_err_t unflatten (const flat_tree_t *flat, tree_t *tree);
+
+    double calc_tree (const flat_tree_t *flat, double x);
+
+    tree_err_t calc_diff (const flat_tree_t *src, flat_tree_t *dst, char var = 'x');
+
+    void store (const flat_tree_t *flat, FILE *stream);
+}
+
+#endif
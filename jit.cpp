@@ -0,0 +1,349 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cse.h"
+#include "jit.h"
+#include "lib/log.h"
+#include "tree.h"
+#include "tree_vm.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Plans with more temporaries keep them in heap
+const size_t JIT_STACK_TMPS = 512;
+
+/// Upper bounds of machine code size: prologue + epilogue and one instruction (POW is the longest)
+const size_t JIT_FRAME_BYTES = 32;
+const size_t JIT_INSTR_BYTES = 40;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+#ifdef __x86_64__
+
+struct jit_buf_t
+{
+    unsigned char *code;
+    size_t         size;
+};
+
+static void emit_plan  (jit_buf_t *buf, const tree::cse_plan_t *plan);
+static void emit_instr (jit_buf_t *buf, const tree::cse_instr_t *instr, unsigned tmp, unsigned x_tmp);
+
+static void emit_bytes (jit_buf_t *buf, const unsigned char *bytes, size_t n);
+static void emit_u32   (jit_buf_t *buf, uint32_t val);
+static void emit_u64   (jit_buf_t *buf, uint64_t val);
+
+static void emit_sse   (jit_buf_t *buf, unsigned char opcode, unsigned char modrm, unsigned tmp);
+static void emit_imm   (jit_buf_t *buf, uint64_t bits, unsigned tmp);
+static void emit_call  (jit_buf_t *buf, uint64_t func);
+
+#endif
+
+static double run_jit (const tree::jit_t *jit, double x, double *tmps);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::jit_compile (const tree_t *tree, jit_t *jit)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    return jit_compile (tree->head_node, jit);
+}
+
+/**
+ * @brief Translate the tree to machine code, every temporary of its CSE plan lives in memory
+ *
+ * Fails only if there is no memory for the plan: if machine code can't be made,
+ * calc_tree interprets the plan instead.
+ */
+tree::tree_err_t tree::jit_compile (const node_t *node, jit_t *jit)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (jit  != nullptr && "invalid pointer");
+
+    *jit = {};
+
+    tree_err_t err = cse_plan (node, &jit->plan);
+    if (err != OK) return err;
+
+#ifdef __x86_64__
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    size_t size = JIT_FRAME_BYTES + JIT_INSTR_BYTES * jit->plan.code_size;
+    size = (size + page - 1) / page * page;
+
+    // Temporaries are addressed by 32-bit displacement
+    if (8 * (jit->plan.code_size + 1) > INT32_MAX)
+    {
+        LOG (log::INF, "JIT: plan is too big, it will be interpreted");
+        return OK;
+    }
+
+    void *code = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        LOG (log::ERR, "JIT: mmap failed, plan will be interpreted");
+        return OK;
+    }
+
+    jit_buf_t buf = {(unsigned char *) code, 0};
+    emit_plan (&buf, &jit->plan);
+
+    assert (buf.size <= size && "machine code size bound is wrong");
+
+    if (mprotect (code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        LOG (log::ERR, "JIT: mprotect failed, plan will be interpreted");
+
+        munmap (code, size);
+        return OK;
+    }
+
+    jit->code      = code;
+    jit->code_size = size;
+
+    // Object to function pointer conversion is conditionally supported, so copy the bits
+    memcpy (&jit->func, &code, sizeof (jit->func));
+
+    LOG (log::DBG, "JIT: %zu temporaries -> %zu bytes of code", jit->plan.code_size, buf.size);
+#endif
+
+    return OK;
+}
+
+void tree::jit_dtor (jit_t *jit)
+{
+    assert (jit != nullptr && "invalid pointer");
+
+    if (jit->code != nullptr) munmap (jit->code, jit->code_size);
+
+    cse_plan_dtor (&jit->plan);
+    *jit = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+double tree::calc_tree (const jit_t *jit, double x)
+{
+    assert (jit            != nullptr && "invalid pointer");
+    assert (jit->plan.code != nullptr && "tree is not compiled");
+
+    if (jit->func == nullptr) return calc_tree (&jit->plan, x);
+
+    if (jit->plan.code_size + 1 <= JIT_STACK_TMPS)
+    {
+        double tmps[JIT_STACK_TMPS];
+        return run_jit (jit, x, tmps);
+    }
+
+    double *tmps = (double *) calloc (jit->plan.code_size + 1, sizeof (double));
+    if (tmps == nullptr) return NAN;
+
+    double res = run_jit (jit, x, tmps);
+
+    free (tmps);
+    return res;
+}
+
+tree::tree_err_t tree::calc_tree_batch (const jit_t *jit, const double *xs, double *out, size_t n)
+{
+    assert (jit            != nullptr && "invalid pointer");
+    assert (jit->plan.code != nullptr && "tree is not compiled");
+    assert ((xs  != nullptr || n == 0) && "invalid pointer");
+    assert ((out != nullptr || n == 0) && "invalid pointer");
+
+    if (jit->func == nullptr || jit->plan.code_size + 1 > JIT_STACK_TMPS)
+    {
+        for (size_t i = 0; i < n; ++i) out[i] = calc_tree (jit, xs[i]);
+        return OK;
+    }
+
+    double tmps[JIT_STACK_TMPS];
+
+    for (size_t i = 0; i < n; ++i) out[i] = run_jit (jit, xs[i], tmps);
+
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static double run_jit (const tree::jit_t *jit, double x, double *tmps)
+{
+    assert (jit       != nullptr && "invalid pointer");
+    assert (jit->func != nullptr && "invalid pointer");
+    assert (tmps      != nullptr && "invalid pointer");
+
+    return jit->func (x, tmps);
+}
+
+#ifdef __x86_64__
+
+// SSE2 opcodes (F2 0F xx) and ModRM bytes of [rbx + disp32] operand
+const unsigned char SSE_LOAD  = 0x10;
+const unsigned char SSE_STORE = 0x11;
+const unsigned char SSE_ADD   = 0x58;
+const unsigned char SSE_MUL   = 0x59;
+const unsigned char SSE_SUB   = 0x5C;
+const unsigned char SSE_DIV   = 0x5E;
+
+const unsigned char MODRM_XMM0_RBX = 0x83;
+const unsigned char MODRM_XMM1_RBX = 0x8B;
+
+const unsigned char X86_PROLOGUE[]  = {0x53,                // push rbx
+                                       0x48, 0x89, 0xFB};   // mov  rbx, rdi
+const unsigned char X86_EPILOGUE[]  = {0x5B,                // pop  rbx
+                                       0xC3};               // ret
+const unsigned char X86_MOV_RAX[]   = {0x48, 0xB8};         // mov  rax, imm64
+const unsigned char X86_STORE_RAX[] = {0x48, 0x89, 0x83};   // mov  [rbx + disp32], rax
+const unsigned char X86_CALL_RAX[]  = {0xFF, 0xD0};         // call rax
+const unsigned char X86_SSE_SD[]    = {0xF2, 0x0F};         // scalar double prefix
+
+/**
+ * @brief double f (double x, double *tmps): rbx holds tmps, x is kept in tmps[code_size]
+ *
+ * Every instruction is computed in xmm0 and stored to its temporary,
+ * libm is called with the stack aligned by the rbx push.
+ */
+static void emit_plan (jit_buf_t *buf, const tree::cse_plan_t *plan)
+{
+    assert (buf  != nullptr && "invalid pointer");
+    assert (plan != nullptr && "invalid pointer");
+
+    unsigned x_tmp = (unsigned) plan->code_size;
+
+    emit_bytes (buf, X86_PROLOGUE, sizeof (X86_PROLOGUE));
+    emit_sse   (buf, SSE_STORE, MODRM_XMM0_RBX, x_tmp);
+
+    for (unsigned tmp = 0; tmp < plan->code_size; ++tmp)
+    {
+        emit_instr (buf, plan->code + tmp, tmp, x_tmp);
+    }
+
+    emit_sse (buf, SSE_LOAD, MODRM_XMM0_RBX, x_tmp - 1);
+
+    emit_bytes (buf, X86_EPILOGUE, sizeof (X86_EPILOGUE));
+}
+
+#define BINARY_OP(op, opcode)                                       \
+    case tree::vm_op_t::op:                                         \
+        emit_sse (buf, SSE_LOAD, MODRM_XMM0_RBX, instr->lhs);       \
+        emit_sse (buf, opcode,   MODRM_XMM0_RBX, instr->rhs);       \
+        break;
+
+#define LIBM_OP(op, func)                                           \
+    case tree::vm_op_t::op:                                         \
+        emit_sse  (buf, SSE_LOAD, MODRM_XMM0_RBX, instr->rhs);      \
+        emit_call (buf, (uint64_t) (double (*)(double)) func);      \
+        break;
+
+static void emit_instr (jit_buf_t *buf, const tree::cse_instr_t *instr, unsigned tmp, unsigned x_tmp)
+{
+    assert (buf   != nullptr && "invalid pointer");
+    assert (instr != nullptr && "invalid pointer");
+
+    uint64_t bits = 0;
+
+    switch (instr->op)
+    {
+        case tree::vm_op_t::CONST:
+            memcpy (&bits, &instr->val, sizeof (bits));
+            emit_imm (buf, bits, tmp);
+            return;
+
+        case tree::vm_op_t::VAR_NAN:
+        {
+            double nan = NAN;
+            memcpy (&bits, &nan, sizeof (bits));
+            emit_imm (buf, bits, tmp);
+            return;
+        }
+
+        case tree::vm_op_t::VAR_X:
+            emit_sse (buf, SSE_LOAD, MODRM_XMM0_RBX, x_tmp);
+            break;
+
+        BINARY_OP (ADD, SSE_ADD)
+        BINARY_OP (SUB, SSE_SUB)
+        BINARY_OP (DIV, SSE_DIV)
+        BINARY_OP (MUL, SSE_MUL)
+
+        LIBM_OP (SIN, sin)
+        LIBM_OP (COS, cos)
+        LIBM_OP (EXP, exp)
+        LIBM_OP (LOG, log)
+
+        case tree::vm_op_t::POW:
+            emit_sse  (buf, SSE_LOAD, MODRM_XMM0_RBX, instr->lhs);
+            emit_sse  (buf, SSE_LOAD, MODRM_XMM1_RBX, instr->rhs);
+            emit_call (buf, (uint64_t) (double (*)(double, double)) pow);
+            break;
+
+        default:
+            assert (0 && "Unexpected instruction");
+    }
+
+    emit_sse (buf, SSE_STORE, MODRM_XMM0_RBX, tmp);
+}
+
+#undef BINARY_OP
+#undef LIBM_OP
+
+// -------------------------------------------------------------------------------------------------
+
+static void emit_bytes (jit_buf_t *buf, const unsigned char *bytes, size_t n)
+{
+    assert (buf   != nullptr && "invalid pointer");
+    assert (bytes != nullptr && "invalid pointer");
+
+    memcpy (buf->code + buf->size, bytes, n);
+    buf->size += n;
+}
+
+static void emit_u32 (jit_buf_t *buf, uint32_t val)
+{
+    emit_bytes (buf, (const unsigned char *) &val, sizeof (val));
+}
+
+static void emit_u64 (jit_buf_t *buf, uint64_t val)
+{
+    emit_bytes (buf, (const unsigned char *) &val, sizeof (val));
+}
+
+/// opsd xmm, [rbx + 8 * tmp]
+static void emit_sse (jit_buf_t *buf, unsigned char opcode, unsigned char modrm, unsigned tmp)
+{
+    emit_bytes (buf, X86_SSE_SD, sizeof (X86_SSE_SD));
+    emit_bytes (buf, &opcode, 1);
+    emit_bytes (buf, &modrm,  1);
+    emit_u32   (buf, 8 * tmp);
+}
+
+/// tmps[tmp] = bits
+static void emit_imm (jit_buf_t *buf, uint64_t bits, unsigned tmp)
+{
+    emit_bytes (buf, X86_MOV_RAX, sizeof (X86_MOV_RAX));
+    emit_u64   (buf, bits);
+    emit_bytes (buf, X86_STORE_RAX, sizeof (X86_STORE_RAX));
+    emit_u32   (buf, 8 * tmp);
+}
+
+static void emit_call (jit_buf_t *buf, uint64_t func)
+{
+    emit_bytes (buf, X86_MOV_RAX, sizeof (X86_MOV_RAX));
+    emit_u64   (buf, func);
+    emit_bytes (buf, X86_CALL_RAX, sizeof (X86_CALL_RAX));
+}
+
+#endif
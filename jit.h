@@ -0,0 +1,37 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cse.h"
+#include "tree.h"
+
+namespace tree
+{
+    typedef double (*jit_f)(double x, double *tmps);
+
+    /**
+     * @brief CSE plan translated to x86-64 machine code in executable mapping
+     *
+     * Without machine code (other architecture or mapping failure) the plan is interpreted,
+     * so calc_tree works for every compiled tree.
+     */
+    struct jit_t
+    {
+        cse_plan_t plan = {};
+
+        void  *code      = nullptr;
+        size_t code_size = 0;       ///< Size of the mapping
+
+        jit_f func = nullptr;       ///< Needs plan.code_size + 1 temporaries, nullptr means fallback
+    };
+
+    tree_err_t jit_compile (const tree_t *tree, jit_t *jit);
+    tree_err_t jit_compile (const node_t *node, jit_t *jit);
+
+    void jit_dtor (jit_t *jit);
+
+    double calc_tree (const jit_t *jit, double x);
+
+    tree_err_t calc_tree_batch (const jit_t *jit, const double *xs, double *out, size_t n);
+}
+
+#endif
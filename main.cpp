@@ -1,9 +1,12 @@
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <time.h>
 #include <stdio.h>
+#include "batch.h"
 #include "common.h"
+#include "server.h"
 #include "tree.h"
 #include "diff_calc.h"
 #include "tree_output.h"
@@ -27,6 +30,9 @@ int demonstrate_diff   (render::render_t *render);
 int demonstrate_taylor (render::render_t *render);
 int demonstrate_calc   (render::render_t *render);
 
+int run_batch  (int argc, char *argv[]);
+int run_server (int argc, char *argv[]);
+
 const char DIFF_FILENAME[]   = "diff.txt";
 const char TAYLOR_FILENAME[] = "diff.txt";
 const char CALC_FILENAME[]   = "diff.txt";
@@ -43,8 +49,16 @@ const int TAYLOR_ORDER = 3;
 
 #include "tree_dsl.h"
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp (argv[1], "--batch") == 0) {
+        return run_batch (argc, argv);
+    }
+
+    if (argc > 1 && (strcmp (argv[1], "--serve") == 0 || strcmp (argv[1], "--client") == 0)) {
+        return run_server (argc, argv);
+    }
+
     srand ((unsigned int) time(NULL));
 
     render::render_t render = {};
@@ -159,4 +173,95 @@ int demonstrate_calc (render::render_t *render)
 
     tree::dtor(&tree);
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief --batch <input> [-o <output>] [-j <threads>] [--at <x>] [--no-simplify]
+ *
+ * @return 0 if every line is differentiated, 1 if some lines are malformed, ERROR on usage/IO error
+ */
+int run_batch (int argc, char *argv[])
+{
+    assert (argv != nullptr && "invalid pointer");
+
+    if (argc < 3) {
+        fprintf (stderr, "Usage: %s --batch <input> [-o <output>] [-j <threads>] [--at <x>] [--no-simplify]\n",
+                                                                                                    argv[0]);
+        return ERROR;
+    }
+
+    batch::batch_opts_t opts = {};
+    const char *output_path  = nullptr;
+
+    for (int i = 3; i < argc; ++i)
+    {
+        if (strcmp (argv[i], "--no-simplify") == 0) {
+            opts.simplify = false;
+        } else if (i + 1 < argc && strcmp (argv[i], "-o") == 0) {
+            output_path = argv[++i];
+        } else if (i + 1 < argc && strcmp (argv[i], "-j") == 0) {
+            opts.n_threads = (unsigned) atoi (argv[++i]);
+        } else if (i + 1 < argc && strcmp (argv[i], "--at") == 0) {
+            opts.eval   = true;
+            opts.eval_x = atof (argv[++i]);
+        } else {
+            fprintf (stderr, "Unknown option %s\n", argv[i]);
+            return ERROR;
+        }
+    }
+
+    FILE *input = fopen (argv[2], "r");
+    if (input == nullptr) {
+        fprintf (stderr, "Failed to open %s\n", argv[2]);
+        return ERROR;
+    }
+
+    FILE *output = (output_path != nullptr) ? fopen (output_path, "w") : stdout;
+    if (output == nullptr) {
+        fprintf (stderr, "Failed to open %s\n", output_path);
+        fclose (input);
+        return ERROR;
+    }
+
+    int n_failed = batch::run (input, output, &opts);
+
+    fclose (input);
+    if (output != stdout) fclose (output);
+
+    if (n_failed > 0) {
+        fprintf (stderr, "%d lines failed\n", n_failed);
+    }
+
+    return (n_failed == ERROR) ? ERROR : (n_failed > 0);
+}
+
+/**
+ * @brief --serve [<socket>] [-j <threads>] or --client [<socket>] (requests from stdin)
+ */
+int run_server (int argc, char *argv[])
+{
+    assert (argv != nullptr && "invalid pointer");
+
+    server::server_opts_t opts = {};
+
+    int i = 2;
+    if (i < argc && argv[i][0] != '-') {
+        opts.socket_path = argv[i++];
+    }
+
+    if (strcmp (argv[1], "--client") == 0) {
+        return server::client (opts.socket_path, stdin, stdout);
+    }
+
+    for (; i < argc; ++i)
+    {
+        if (i + 1 < argc && strcmp (argv[i], "-j") == 0) {
+            opts.n_threads = (unsigned) atoi (argv[++i]);
+        } else {
+            fprintf (stderr, "Usage: %s --serve [<socket>] [-j <threads>]\n", argv[0]);
+            return ERROR;
+        }
+    }
+
+    return server::serve (&opts);
+}
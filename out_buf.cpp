@@ -0,0 +1,255 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "out_buf.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Significant digits of "%lg"
+const int DOUBLE_PRECISION = 6;
+
+/// "%lg" uses fixed notation for decimal exponents in [FIXED_MIN_EXP, DOUBLE_PRECISION)
+const int FIXED_MIN_EXP = -4;
+
+/// POW10[i] == 10^i exactly
+const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10};
+
+/// Scaled values closer than that to a rounding tie go through snprintf for exact rounding
+const double TIE_EPSILON = 1e-7;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+static bool   reserve      (out_buf_t *buf, size_t len);
+static size_t format_fixed (char *str, double val);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+int out_buf_ctor (out_buf_t *buf, size_t capacity)
+{
+    assert (buf != nullptr && "invalid pointer");
+
+    *buf = {};
+
+    buf->data = (char *) malloc (capacity);
+    if (buf->data == nullptr) return ERROR;
+
+    buf->capacity = capacity;
+    return 0;
+}
+
+void out_buf_dtor (out_buf_t *buf)
+{
+    assert (buf != nullptr && "invalid pointer");
+
+    free (buf->data);
+    *buf = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+void out_append (out_buf_t *buf, const char *data, size_t len)
+{
+    assert (buf  != nullptr && "invalid pointer");
+    assert (data != nullptr && "invalid pointer");
+
+    if (!reserve (buf, len)) return;
+
+    memcpy (buf->data + buf->size, data, len);
+    buf->size += len;
+}
+
+void out_str (out_buf_t *buf, const char *str)
+{
+    assert (str != nullptr && "invalid pointer");
+
+    out_append (buf, str, strlen (str));
+}
+
+void out_char (out_buf_t *buf, char c)
+{
+    assert (buf != nullptr && "invalid pointer");
+
+    if (!reserve (buf, 1)) return;
+
+    buf->data[buf->size++] = c;
+}
+
+void out_int (out_buf_t *buf, int val)
+{
+    char  digits[OUT_DOUBLE_MAX] = "";
+    char *end = digits + sizeof (digits);
+    char *cur = end;
+
+    // Unsigned negation, so INT_MIN doesn't overflow
+    unsigned abs_val = (val < 0) ? 0u - (unsigned) val : (unsigned) val;
+
+    do
+    {
+        *--cur   = (char) ('0' + abs_val % 10);
+        abs_val /= 10;
+    } while (abs_val != 0);
+
+    if (val < 0) *--cur = '-';
+
+    out_append (buf, cur, (size_t) (end - cur));
+}
+
+void out_double (out_buf_t *buf, double val)
+{
+    char str[OUT_DOUBLE_MAX] = "";
+
+    out_append (buf, str, format_double (str, val));
+}
+
+// -------------------------------------------------------------------------------------------------
+
+size_t format_double (char *str, double val)
+{
+    assert (str != nullptr && "invalid pointer");
+
+    size_t len = format_fixed (str, val);
+    if (len != 0) return len;
+
+    int res = snprintf (str, OUT_DOUBLE_MAX, "%lg", val);
+    assert (res > 0 && (size_t) res < OUT_DOUBLE_MAX && "unexpected double format");
+
+    return (size_t) res;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+int out_flush (out_buf_t *buf, FILE *stream)
+{
+    assert (buf    != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    bool ok = !buf->oom && fwrite (buf->data, 1, buf->size, stream) == buf->size;
+
+    buf->size = 0;
+    buf->oom  = false;
+
+    return ok ? 0 : ERROR;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static bool reserve (out_buf_t *buf, size_t len)
+{
+    assert (buf != nullptr && "invalid pointer");
+
+    if (buf->size + len <= buf->capacity) return true;
+
+    size_t new_capacity = buf->capacity ? buf->capacity : BUFSIZ;
+    while (new_capacity < buf->size + len) new_capacity *= 2;
+
+    char *new_data = (char *) realloc (buf->data, new_capacity);
+    if (new_data == nullptr)
+    {
+        buf->oom = true;
+        return false;
+    }
+
+    buf->data     = new_data;
+    buf->capacity = new_capacity;
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Values which "%lg" prints in fixed notation are scaled to a 6-digit integer,
+ *        rounded and printed digit by digit
+ *
+ * @return Length of the result or 0 if the value must be formatted by snprintf
+ */
+static size_t format_fixed (char *str, double val)
+{
+    assert (str != nullptr && "invalid pointer");
+
+    char *cur = str;
+
+    if (signbit (val)) *cur++ = '-';
+
+    double abs_val = fabs (val);
+
+    if (fpclassify (abs_val) == FP_ZERO)
+    {
+        *cur++ = '0';
+        *cur   = '\0';
+        return (size_t) (cur - str);
+    }
+
+    if (!isfinite (abs_val) || abs_val < 1e-4 || abs_val >= POW10[DOUBLE_PRECISION])
+        return 0;
+
+    // Integer values are the most common ones in formulas
+    if (fpclassify (abs_val - floor (abs_val)) == FP_ZERO)
+    {
+        char  digits[OUT_DOUBLE_MAX] = "";
+        char *end  = digits + sizeof (digits);
+        char *iter = end;
+
+        for (uint32_t int_val = (uint32_t) abs_val; int_val != 0; int_val /= 10)
+            *--iter = (char) ('0' + int_val % 10);
+
+        while (iter != end) *cur++ = *iter++;
+
+        *cur = '\0';
+        return (size_t) (cur - str);
+    }
+
+    // Estimate may be off near powers of 10, then mantissa check below sends value to snprintf
+    int exp = (int) floor (log10 (abs_val));
+    if (exp < FIXED_MIN_EXP || exp >= DOUBLE_PRECISION) return 0;
+
+    double scaled = abs_val * POW10[DOUBLE_PRECISION - 1 - exp];
+    double floor_scaled = floor (scaled);
+
+    if (fabs (scaled - floor_scaled - 0.5) < TIE_EPSILON) return 0;
+
+    // Rounding to even is never needed, ties are excluded above
+    uint32_t mantissa = (uint32_t) floor_scaled + (scaled - floor_scaled > 0.5);
+
+    // Rounded up to the next power of 10 or exponent was estimated wrong, leave it to snprintf
+    if (mantissa < POW10[DOUBLE_PRECISION - 1] || mantissa >= POW10[DOUBLE_PRECISION]) return 0;
+
+    char digits[OUT_DOUBLE_MAX] = "";
+    for (int i = DOUBLE_PRECISION - 1; i >= 0; --i)
+    {
+        digits[i]  = (char) ('0' + mantissa % 10);
+        mantissa  /= 10;
+    }
+
+    int n_digits = DOUBLE_PRECISION;
+    while (digits[n_digits - 1] == '0') n_digits--;
+
+    if (exp < 0)
+    {
+        *cur++ = '0';
+        *cur++ = '.';
+        for (int i = exp + 1; i < 0; ++i) *cur++ = '0';
+        for (int i = 0; i < n_digits; ++i) *cur++ = digits[i];
+    }
+    else
+    {
+        for (int i = 0;       i <= exp;      ++i) *cur++ = digits[i];
+        if  (n_digits > exp + 1)                 *cur++ = '.';
+        for (int i = exp + 1; i <  n_digits; ++i) *cur++ = digits[i];
+    }
+
+    *cur = '\0';
+    return (size_t) (cur - str);
+}
@@ -0,0 +1,63 @@
+#ifndef OUT_BUF_H
+#define OUT_BUF_H
+
+#include <stdio.h>
+#include "common.h"
+
+/// Enough for any "%lg" output
+const size_t OUT_DOUBLE_MAX = 32;
+
+/**
+ * @brief Growable byte buffer, text is collected in memory and written to a stream at once
+ */
+struct out_buf_t
+{
+    char  *data     = nullptr;
+    size_t size     = 0;
+    size_t capacity = 0;
+    bool   oom      = false;    ///< Some appends were dropped because realloc failed
+};
+
+/**
+ * @brief      Allocate initial storage
+ *
+ * @return     Non-zero value on OOM
+ */
+int out_buf_ctor (out_buf_t *buf, size_t capacity = BUFSIZ);
+
+void out_buf_dtor (out_buf_t *buf);
+
+/**
+ * @brief      Append len bytes of data
+ */
+void out_append (out_buf_t *buf, const char *data, size_t len);
+
+/// Append string literal or char array without strlen
+#define out_literal(buf, literal) out_append (buf, literal, sizeof (literal) - 1)
+
+void out_str    (out_buf_t *buf, const char *str);
+void out_char   (out_buf_t *buf, char c);
+void out_int    (out_buf_t *buf, int val);
+
+/**
+ * @brief      Append val formatted exactly as printf ("%lg") does
+ */
+void out_double (out_buf_t *buf, double val);
+
+/**
+ * @brief      Format val as printf ("%lg") without going through stdio for ordinary values
+ *
+ * @param[out] str   At least OUT_DOUBLE_MAX bytes, result is '\0'-terminated
+ *
+ * @return     Length of the result
+ */
+size_t format_double (char *str, double val);
+
+/**
+ * @brief      Write buffer content with one fwrite and empty the buffer
+ *
+ * @return     Non-zero value if write failed or some output was lost on OOM
+ */
+int out_flush (out_buf_t *buf, FILE *stream);
+
+#endif
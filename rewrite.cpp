@@ -0,0 +1,925 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewrite.h"
+#include "tree.h"
+#include "tree_parsing.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+struct rule_t
+{
+    const char *pattern;
+    const char *replacement;
+};
+
+/**
+ * @brief Rewrite rules, earlier rule wins if several match one node
+ *
+ * Rules are written in parse_dump syntax. Upper case letters are metavariables:
+ * K, L, M match only constants, other letters match any subtree. Repeated metavariable
+ * matches equal subtrees. Lower case letters are ordinary variables.
+ * Constant subtrees are folded before rules are applied.
+ */
+static const rule_t RULES[] =
+{
+    {"0 + A", "A"},
+    {"A + 0", "A"},
+    {"0 - A", "-1 * A"},
+    {"A - 0", "A"},
+
+    {"0 * A", "0"},
+    {"A * 0", "0"},
+    {"1 * A", "A"},
+    {"A * 1", "A"},
+
+    {"K * (L * A)", "(K * L) * A"},
+    {"K * (A * L)", "(K * L) * A"},
+    {"(K * A) * L", "A * (K * L)"},
+    {"(A * K) * L", "A * (K * L)"},
+
+    {"0 / A", "0"},
+    {"A / 1", "A"},
+
+    {"A ^ 1", "A"},
+
+    {"sin A * sin A + cos A * cos A", "1"},
+    {"cos A * cos A + sin A * sin A", "1"},
+    {"cos A * cos A - sin A * sin A", "cos (2 * A)"},
+};
+
+const size_t N_RULES = sizeof (RULES) / sizeof (*RULES);
+
+const size_t N_METAVARS   = 'Z' - 'A' + 1;
+const size_t MAX_PENDING  = 32;     ///< Max number of unmatched subtrees while walking dtree
+const size_t NONE         = (size_t) -1;
+
+const size_t N_OPS        = (size_t) tree::op_t::LOG + 1;
+
+const size_t DTREE_MIN_CAPACITY = 16;
+
+/// Trees not deeper than this are rewritten without memory for the walk
+const size_t REWRITE_INLINE_FRAMES = 64;
+
+/// Patterns not deeper than this are compiled without memory for the walk
+const size_t PATTERN_INLINE_FRAMES = 16;
+
+///@brief Floating point calculations accuracy
+const double DBL_ERROR = 1e-11;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+enum class sym_kind_t
+{
+    OP,
+    VAL,
+    VAR,
+    ANY,    ///< Metavariable, any subtree
+    CONST   ///< Metavariable, only constant
+};
+
+/// Pattern node or discrimination tree edge label
+struct symbol_t
+{
+    sym_kind_t kind;
+    tree::op_t op;
+    double     val;
+    char       var;
+};
+
+/// Compiled pattern: nodes in one array, children are indices
+struct pat_node_t
+{
+    symbol_t sym;
+
+    size_t left;
+    size_t right;
+};
+
+struct pattern_t
+{
+    pat_node_t *nodes;
+    size_t      size;
+    size_t      root;
+};
+
+struct compiled_rule_t
+{
+    pattern_t pattern;
+    pattern_t replacement;
+
+    size_t next_rule;   ///< Next rule ending in the same dtree state
+};
+
+struct dtree_edge_t
+{
+    symbol_t sym;
+
+    size_t target;
+    size_t next_edge;
+};
+
+struct dtree_state_t
+{
+    size_t first_edge;
+    size_t first_rule;
+};
+
+/**
+ * @brief Discrimination tree: trie over pre-order symbols of all patterns
+ *
+ * Node is matched by one walk of the trie, metavariable edges skip whole subtree.
+ */
+struct rule_set_t
+{
+    compiled_rule_t rules[N_RULES];
+
+    dtree_state_t *states;
+    size_t         n_states;
+    size_t         states_capacity;
+
+    dtree_edge_t *edges;
+    size_t        n_edges;
+    size_t        edges_capacity;
+
+    size_t op_states[N_OPS];    ///< State after the root symbol of the node, by op
+};
+
+struct match_t
+{
+    const rule_set_t *set;
+    tree::node_t     *subject;
+
+    size_t        best_rule;
+    tree::node_t *binds[N_METAVARS];
+};
+
+/// Operation of the pattern which operands are being compiled
+struct pattern_frame_t
+{
+    const tree::node_t *node;
+    size_t              left;   ///< Compiled left operand
+    bool                right;  ///< Right operand is being compiled
+};
+
+/// Operation which operands are being rewritten
+struct rewrite_frame_t
+{
+    tree::node_t *node;
+    tree::node_t *left;     ///< Rewritten left operand
+    bool          shared;   ///< Node or some ancestor has other owners, so it can't be edited
+    bool          changed;  ///< Some operand has been changed
+    bool          right;    ///< Right operand is being rewritten
+};
+
+static const rule_set_t *get_rule_set ();
+static rule_set_t        compile_rules ();
+
+static pattern_t compile_pattern (const char *str);
+static size_t    compile_pattern_subtree (pattern_t *pattern, const tree::node_t *node);
+static size_t    compile_pattern_node    (pattern_t *pattern, const tree::node_t *node,
+                                                              size_t left, size_t right);
+static size_t    count_nodes (const tree::node_t *node);
+
+static void   dtree_insert    (rule_set_t *set, const pattern_t *pattern, size_t rule_indx);
+static size_t dtree_insert_rec(rule_set_t *set, const pattern_t *pattern, size_t pat_indx, size_t state);
+static size_t dtree_step      (rule_set_t *set, size_t state, const symbol_t *sym);
+static size_t dtree_new_state (rule_set_t *set);
+
+static void dtree_match (match_t *match, size_t state, tree::node_t **pending, size_t n_pending);
+
+static bool bind_pattern (const pattern_t *pattern, size_t pat_indx, tree::node_t *node,
+                                                    tree::node_t **binds);
+static tree::node_t *build_replacement (const rule_set_t *set, const pattern_t *pattern, size_t pat_indx,
+                                        tree::node_t **binds, bool is_root);
+
+static tree::node_t *rewrite_node (const rule_set_t *set, tree::node_t *node, tree::node_t *left,
+                                   tree::node_t *right, bool shared, bool *changed);
+
+static bool normalize_node  (tree::node_t *node, const rule_set_t *set);
+static bool fold_const_node (tree::node_t *node);
+static bool apply_rule      (tree::node_t *node, const rule_set_t *set, size_t rule_indx,
+                                                 tree::node_t **binds);
+
+static bool symbol_equal  (const symbol_t *lhs, const symbol_t *rhs);
+static bool symbol_accept (const symbol_t *sym,  const tree::node_t *node);
+
+static bool iseq (double lhs, double rhs);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Rewrite subtree by the rule table (see RULES) until no rule matches
+ *
+ * Nodes are normalized bottom-up, so every node is matched once unless a rewrite creates
+ * new nodes above normalized ones. Normalized nodes are marked canonical and skipped later,
+ * so after a local edit followed by tree::invalidate of the edited node only the paths to it
+ * are visited again. Nodes owned only by the subtree are edited in place. Shared nodes (and everything
+ * below them) may be interned or memoized, so a shared node which has to change is replaced
+ * by its rewritten copy, then the slot gets the copy.
+ *
+ * @return true if something has been changed
+ */
+bool tree::rewrite (node_t **slot)
+{
+    assert (slot  != nullptr && "invalid pointer");
+    assert (*slot != nullptr && "invalid pointer");
+
+    const rule_set_t *set = get_rule_set ();
+
+    rewrite_frame_t  inline_frames[REWRITE_INLINE_FRAMES];
+    rewrite_frame_t *frames   = inline_frames;
+    size_t           capacity = REWRITE_INLINE_FRAMES;
+    size_t           size     = 0;
+
+    node_t *node    = *slot;
+    node_t *res     = nullptr;
+    bool    shared  = node->ref_cnt > 1;
+    bool    changed = false;
+    bool    ok      = true;
+
+    while (true)
+    {
+        // Simplified subtrees (including shared ones seen earlier) are not entered
+        while (!node->canonical && node->type == node_type_t::OP)
+        {
+            if (size == capacity)
+            {
+                void *new_frames = grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (rewrite_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, node->left, shared, false, node->left == nullptr};
+
+            node   = (node->left != nullptr) ? node->left : node->right;
+            shared = shared || node->ref_cnt > 1;
+        }
+
+        if (!ok) break;
+
+        // Leaves are normal, the mark doesn't change the content, so shared ones get it too
+        node->canonical = true;
+
+        res     = node;
+        changed = false;
+
+        while (size > 0 && frames[size - 1].right)
+        {
+            rewrite_frame_t *frame = frames + --size;
+
+            changed = frame->changed || changed;
+            res     = rewrite_node (set, frame->node, frame->left, res, frame->shared, &changed);
+        }
+
+        if (size == 0) break;
+
+        frames[size - 1].left    = res;
+        frames[size - 1].changed = changed;
+        frames[size - 1].right   = true;
+
+        node   = frames[size - 1].node->right;
+        shared = frames[size - 1].shared || node->ref_cnt > 1;
+    }
+
+    if (!ok)
+    {
+        // Pending copies are dropped, nodes edited in place are already consistent
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (frames[i].right && frames[i].left != frames[i].node->left) del_node (frames[i].left);
+        }
+
+        changed = false;
+    }
+    else if (res != *slot)
+    {
+        del_node (*slot);
+        *slot = res;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return changed;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static const rule_set_t *get_rule_set ()
+{
+    static const rule_set_t set = compile_rules ();
+
+    return &set;
+}
+
+static rule_set_t compile_rules ()
+{
+    rule_set_t set = {};
+
+    dtree_new_state (&set);     // root
+
+    for (size_t i = 0; i < N_RULES; ++i)
+    {
+        set.rules[i].pattern     = compile_pattern (RULES[i].pattern);
+        set.rules[i].replacement = compile_pattern (RULES[i].replacement);
+        set.rules[i].next_rule   = NONE;
+
+        dtree_insert (&set, &set.rules[i].pattern, i);
+    }
+
+    for (size_t op = 0; op < N_OPS; ++op) set.op_states[op] = NONE;
+
+    for (size_t edge = set.states[0].first_edge; edge != NONE; edge = set.edges[edge].next_edge)
+    {
+        assert (set.edges[edge].sym.kind == sym_kind_t::OP && "rule must match an operation");
+
+        set.op_states[(int) set.edges[edge].sym.op] = set.edges[edge].target;
+    }
+
+    return set;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static pattern_t compile_pattern (const char *str)
+{
+    assert (str != nullptr && "invalid pointer");
+
+    tree::node_t *node = tree::parse_dump (str);
+    assert (node != nullptr && "invalid rule");
+
+    pattern_t pattern = {};
+    pattern.nodes = (pat_node_t *) calloc (count_nodes (node), sizeof (pat_node_t));
+    assert (pattern.nodes != nullptr && "OOM while compiling rules");
+
+    pattern.root = compile_pattern_subtree (&pattern, node);
+
+    tree::del_node (node);
+    return pattern;
+}
+
+/**
+ * @brief Post-order walk with explicit stack like calc_subtree, node is compiled after its operands
+ *
+ * @return Index of the compiled root
+ */
+static size_t compile_pattern_subtree (pattern_t *pattern, const tree::node_t *node)
+{
+    assert (pattern != nullptr && "invalid pointer");
+    assert (node    != nullptr && "invalid pointer");
+
+    pattern_frame_t  inline_frames[PATTERN_INLINE_FRAMES];
+    pattern_frame_t *frames   = inline_frames;
+    size_t           capacity = PATTERN_INLINE_FRAMES;
+    size_t           size     = 0;
+
+    size_t indx = NONE;
+
+    while (true)
+    {
+        while (node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                frames = (pattern_frame_t *) tree::grow_walk_stack (frames, inline_frames, &capacity,
+                                                                    sizeof (*frames));
+                assert (frames != nullptr && "OOM while compiling rules");
+            }
+
+            frames[size++] = {node, NONE, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        indx = compile_pattern_node (pattern, node, NONE, NONE);
+
+        while (size > 0 && frames[size - 1].right)
+        {
+            size--;
+            indx = compile_pattern_node (pattern, frames[size].node, frames[size].left, indx);
+        }
+
+        if (size == 0) break;
+
+        frames[size - 1].left  = indx;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return indx;
+}
+
+/**
+ * @param left, right Compiled operands (NONE if there is no operand)
+ */
+static size_t compile_pattern_node (pattern_t *pattern, const tree::node_t *node, size_t left, size_t right)
+{
+    assert (pattern != nullptr && "invalid pointer");
+    assert (node    != nullptr && "invalid pointer");
+
+    pat_node_t pat = {{sym_kind_t::VAL, tree::op_t::ADD, 0, '\0'}, left, right};
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            pat.sym.val = node->val;
+            break;
+
+        case tree::node_type_t::VAR:
+            pat.sym.var = node->var;
+
+            if ('A' <= node->var && node->var <= 'Z')
+            {
+                bool is_const = node->var == 'K' || node->var == 'L' || node->var == 'M';
+                pat.sym.kind  = is_const ? sym_kind_t::CONST : sym_kind_t::ANY;
+            }
+            else
+            {
+                pat.sym.kind = sym_kind_t::VAR;
+            }
+            break;
+
+        case tree::node_type_t::OP:
+            pat.sym.kind = sym_kind_t::OP;
+            pat.sym.op   = node->op;
+            break;
+
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    pattern->nodes[pattern->size] = pat;
+    return pattern->size++;
+}
+
+/// Order of the walk doesn't matter for the count
+static size_t count_nodes (const tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    const tree::node_t  *inline_frames[PATTERN_INLINE_FRAMES];
+    const tree::node_t **frames   = inline_frames;
+    size_t               capacity = PATTERN_INLINE_FRAMES;
+    size_t               size     = 0;
+
+    size_t count = 0;
+
+    frames[size++] = node;
+
+    while (size > 0)
+    {
+        node = frames[--size];
+        count++;
+
+        if (size + 2 > capacity)
+        {
+            frames = (const tree::node_t **) tree::grow_walk_stack (frames, inline_frames, &capacity,
+                                                                    sizeof (*frames));
+            assert (frames != nullptr && "OOM while compiling rules");
+        }
+
+        if (node->left  != nullptr) frames[size++] = node->left;
+        if (node->right != nullptr) frames[size++] = node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return count;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void dtree_insert (rule_set_t *set, const pattern_t *pattern, size_t rule_indx)
+{
+    assert (set     != nullptr && "invalid pointer");
+    assert (pattern != nullptr && "invalid pointer");
+
+    size_t state = dtree_insert_rec (set, pattern, pattern->root, 0);
+
+    // Rules of one state are kept in table order
+    size_t *slot = &set->states[state].first_rule;
+    while (*slot != NONE) slot = &set->rules[*slot].next_rule;
+
+    *slot = rule_indx;
+}
+
+/// @return State after pre-order symbols of the pattern subtree
+static size_t dtree_insert_rec (rule_set_t *set, const pattern_t *pattern, size_t pat_indx, size_t state)
+{
+    const pat_node_t *pat = pattern->nodes + pat_indx;
+
+    state = dtree_step (set, state, &pat->sym);
+
+    if (pat->left  != NONE) state = dtree_insert_rec (set, pattern, pat->left,  state);
+    if (pat->right != NONE) state = dtree_insert_rec (set, pattern, pat->right, state);
+
+    return state;
+}
+
+/// @return Target of the edge labeled sym, edge is created if there isn't one
+static size_t dtree_step (rule_set_t *set, size_t state, const symbol_t *sym)
+{
+    for (size_t edge = set->states[state].first_edge; edge != NONE; edge = set->edges[edge].next_edge)
+    {
+        if (symbol_equal (&set->edges[edge].sym, sym)) return set->edges[edge].target;
+    }
+
+    if (set->n_edges == set->edges_capacity)
+    {
+        set->edges_capacity = set->edges_capacity ? 2 * set->edges_capacity : DTREE_MIN_CAPACITY;
+        set->edges = (dtree_edge_t *) realloc (set->edges, set->edges_capacity * sizeof (dtree_edge_t));
+        assert (set->edges != nullptr && "OOM while compiling rules");
+    }
+
+    size_t target = dtree_new_state (set);
+    size_t edge   = set->n_edges++;
+
+    set->edges[edge] = {*sym, target, set->states[state].first_edge};
+    set->states[state].first_edge = edge;
+
+    return target;
+}
+
+static size_t dtree_new_state (rule_set_t *set)
+{
+    if (set->n_states == set->states_capacity)
+    {
+        set->states_capacity = set->states_capacity ? 2 * set->states_capacity : DTREE_MIN_CAPACITY;
+        set->states = (dtree_state_t *) realloc (set->states, set->states_capacity * sizeof (dtree_state_t));
+        assert (set->states != nullptr && "OOM while compiling rules");
+    }
+
+    set->states[set->n_states] = {NONE, NONE};
+    return set->n_states++;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Walk dtree by pre-order symbols of the subject, keep the first rule which binds
+ *
+ * @param pending subtrees of the subject which are not matched yet, next one is on top
+ */
+static void dtree_match (match_t *match, size_t state, tree::node_t **pending, size_t n_pending)
+{
+    const rule_set_t *set = match->set;
+
+    if (n_pending == 0)
+    {
+        for (size_t rule = set->states[state].first_rule;
+                    rule != NONE && rule < match->best_rule; rule = set->rules[rule].next_rule)
+        {
+            tree::node_t *binds[N_METAVARS] = {};
+            const pattern_t    *pattern = &set->rules[rule].pattern;
+
+            if (bind_pattern (pattern, pattern->root, match->subject, binds))
+            {
+                match->best_rule = rule;
+                memcpy (match->binds, binds, sizeof (binds));
+                break;
+            }
+        }
+
+        return;
+    }
+
+    tree::node_t *node = pending[n_pending - 1];
+
+    for (size_t edge = set->states[state].first_edge; edge != NONE; edge = set->edges[edge].next_edge)
+    {
+        const symbol_t *sym = &set->edges[edge].sym;
+        if (!symbol_accept (sym, node)) continue;
+
+        size_t target = set->edges[edge].target;
+
+        if (sym->kind != sym_kind_t::OP)
+        {
+            dtree_match (match, target, pending, n_pending - 1);
+            continue;
+        }
+
+        assert (n_pending + 1 < MAX_PENDING && "too big pattern");
+
+        size_t n_next = n_pending - 1;
+        pending[n_next++] = node->right;
+        if (node->left) pending[n_next++] = node->left;
+
+        dtree_match (match, target, pending, n_next);
+
+        pending[n_pending - 1] = node;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool bind_pattern (const pattern_t *pattern, size_t pat_indx, tree::node_t *node,
+                                                    tree::node_t **binds)
+{
+    const pat_node_t *pat = pattern->nodes + pat_indx;
+
+    if (!symbol_accept (&pat->sym, node)) return false;
+
+    switch (pat->sym.kind)
+    {
+        case sym_kind_t::ANY:
+        case sym_kind_t::CONST:
+        {
+            tree::node_t **bind = binds + (pat->sym.var - 'A');
+
+            if (*bind != nullptr) return tree::subtree_equal (*bind, node);
+
+            *bind = node;
+            return true;
+        }
+
+        case sym_kind_t::OP:
+            return (pat->left == NONE || bind_pattern (pattern, pat->left, node->left, binds)) &&
+                                         bind_pattern (pattern, pat->right, node->right, binds);
+
+        case sym_kind_t::VAL:
+        case sym_kind_t::VAR:
+            return true;
+
+        default:
+            assert (0 && "unexpected symbol");
+    }
+
+    return false;
+}
+
+/**
+ * @brief Replacement with metavariables substituted by shared bound subtrees
+ *
+ * Bound subtrees are already normalized, so only new nodes are normalized (except the root,
+ * which goes to the place of the rewritten node).
+ *
+ * @return Replacement or nullptr on OOM
+ */
+static tree::node_t *build_replacement (const rule_set_t *set, const pattern_t *pattern, size_t pat_indx,
+                                        tree::node_t **binds, bool is_root)
+{
+    const pat_node_t *pat = pattern->nodes + pat_indx;
+    tree::node_t     *res = nullptr;
+
+    switch (pat->sym.kind)
+    {
+        case sym_kind_t::ANY:
+        case sym_kind_t::CONST:
+            assert (binds[pat->sym.var - 'A'] != nullptr && "unbound metavariable");
+            return tree::share_node (binds[pat->sym.var - 'A']);
+
+        case sym_kind_t::VAL: return tree::new_node (pat->sym.val);
+        case sym_kind_t::VAR: return tree::new_node (pat->sym.var);
+
+        case sym_kind_t::OP:
+            break;
+
+        default:
+            assert (0 && "unexpected symbol");
+    }
+
+    if ((res = tree::new_node (pat->sym.op)) == nullptr) return nullptr;
+
+    if (pat->left != NONE && (res->left = build_replacement (set, pattern, pat->left, binds, false)) == nullptr)
+    {
+        tree::del_node (res);
+        return nullptr;
+    }
+
+    if ((res->right = build_replacement (set, pattern, pat->right, binds, false)) == nullptr)
+    {
+        tree::del_node (res);
+        return nullptr;
+    }
+
+    if (!is_root)
+    {
+        normalize_node (res, set);
+        res->canonical = true;
+    }
+
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Normalize operation which operands have been rewritten to left and right
+ *
+ * @param shared           Node must not be edited, it is copied first
+ * @param[in,out] changed  Some operand has been changed / node has been changed
+ *
+ * @return Node itself or its rewritten copy which holds a new reference
+ */
+static tree::node_t *rewrite_node (const rule_set_t *set, tree::node_t *node, tree::node_t *left,
+                                   tree::node_t *right, bool shared, bool *changed)
+{
+    assert (set     != nullptr && "invalid pointer");
+    assert (node    != nullptr && "invalid pointer");
+    assert (changed != nullptr && "invalid pointer");
+
+    tree::node_t *res = node;
+
+    if (shared)
+    {
+        // Reference of the copy, node keeps all its owners
+        tree::share_node (node);
+
+        if (tree::unshare_node (&res) == nullptr)
+        {
+            tree::del_node (node);
+
+            if (left  != node->left)  tree::del_node (left);
+            if (right != node->right) tree::del_node (right);
+
+            *changed = false;
+            return node;
+        }
+    }
+
+    if (left != res->left)
+    {
+        tree::del_node (res->left);
+        res->left = left;
+    }
+
+    if (right != res->right)
+    {
+        tree::del_node (res->right);
+        res->right = right;
+    }
+
+    *changed = normalize_node (res, set) || *changed;
+
+    if (res != node && !*changed)
+    {
+        // Copy is equal to node, so node itself is normal
+        tree::del_node (res);
+        res = node;
+    }
+    else if (*changed)
+    {
+        res->alpha_index = 0;
+        res->weight      = 0;
+    }
+
+    res->canonical = true;
+    return res;
+}
+
+/**
+ * @brief Apply rules to the node until none matches, children must be normalized
+ */
+static bool normalize_node (tree::node_t *node, const rule_set_t *set)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    bool changed = false;
+
+    while (node->type == tree::node_type_t::OP)
+    {
+        if (fold_const_node (node)) return true;
+
+        size_t state = set->op_states[(int) node->op];
+        if (state == NONE) break;
+
+        tree::node_t *pending[MAX_PENDING];
+        size_t n_pending = 0;
+
+        pending[n_pending++] = node->right;
+        if (node->left) pending[n_pending++] = node->left;
+
+        match_t match = {set, node, NONE, {}};
+
+        dtree_match (&match, state, pending, n_pending);
+
+        if (match.best_rule == NONE || !apply_rule (node, set, match.best_rule, match.binds)) break;
+
+        changed = true;
+    }
+
+    return changed;
+}
+
+static bool fold_const_node (tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    if (node->type != tree::node_type_t::OP) return false;
+
+    if ((node->left && node->left->type != tree::node_type_t::VAL) ||
+                       node->right->type != tree::node_type_t::VAL)
+    {
+        return false;
+    }
+
+    double lhs = node->left ? node->left->val : NAN;
+    double rhs = node->right->val;
+    double res = NAN;
+
+    switch (node->op)
+    {
+        case tree::op_t::ADD: res = lhs + rhs;       break;
+        case tree::op_t::SUB: res = lhs - rhs;       break;
+        case tree::op_t::DIV: res = lhs / rhs;       break;
+        case tree::op_t::MUL: res = lhs * rhs;       break;
+        case tree::op_t::SIN: res = sin (rhs);       break;
+        case tree::op_t::COS: res = cos (rhs);       break;
+        case tree::op_t::EXP: res = exp (rhs);       break;
+        case tree::op_t::LOG: res = log (rhs);       break;
+        case tree::op_t::POW: res = pow (lhs, rhs);  break;
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    tree::del_childs  (node);
+    tree::change_node (node, res);
+
+    return true;
+}
+
+static bool apply_rule (tree::node_t *node, const rule_set_t *set, size_t rule_indx,
+                                            tree::node_t **binds)
+{
+    const pattern_t *replacement = &set->rules[rule_indx].replacement;
+
+    tree::node_t *res = build_replacement (set, replacement, replacement->root, binds, true);
+    if (res == nullptr) return false;
+
+    // res holds its own references to the bound subtrees
+    tree::del_childs (node);
+    tree::move_node  (node, res);
+
+    node->alpha_index = 0;
+    node->weight      = 0;
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool symbol_equal (const symbol_t *lhs, const symbol_t *rhs)
+{
+    if (lhs->kind != rhs->kind) return false;
+
+    switch (lhs->kind)
+    {
+        case sym_kind_t::OP:  return lhs->op  == rhs->op;
+        case sym_kind_t::VAR: return lhs->var == rhs->var;
+        case sym_kind_t::VAL: return iseq (lhs->val, rhs->val);
+
+        case sym_kind_t::ANY:
+        case sym_kind_t::CONST:
+            return true;
+
+        default:
+            assert (0 && "unexpected symbol");
+    }
+
+    return false;
+}
+
+static bool symbol_accept (const symbol_t *sym, const tree::node_t *node)
+{
+    switch (sym->kind)
+    {
+        case sym_kind_t::ANY:   return true;
+        case sym_kind_t::CONST: return node->type == tree::node_type_t::VAL;
+
+        case sym_kind_t::OP:    return node->type == tree::node_type_t::OP  && node->op  == sym->op;
+        case sym_kind_t::VAR:   return node->type == tree::node_type_t::VAR && node->var == sym->var;
+        case sym_kind_t::VAL:   return node->type == tree::node_type_t::VAL && iseq (node->val, sym->val);
+
+        default:
+            assert (0 && "unexpected symbol");
+    }
+
+    return false;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool iseq (double lhs, double rhs)
+{
+    return fabs (lhs - rhs) < DBL_ERROR;
+}
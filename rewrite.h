@@ -0,0 +1,18 @@
+#ifndef REWRITE_H
+#define REWRITE_H
+
+#include "tree.h"
+
+namespace tree
+{
+    /**
+     * @brief Simplify subtree in the slot by the rule table
+     *
+     * Shared nodes are never edited, the slot may get a rewritten copy instead.
+     *
+     * @return true if something has been changed
+     */
+    bool rewrite (node_t **slot);
+}
+
+#endif
@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <thread>
+
+#include "scheduler.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const unsigned MAX_THREADS = 256;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Task range [begin, end) of one worker, packed into one word to be changed by one CAS
+ *
+ * Owner takes tasks from the front, thieves take the back half. Nothing is locked.
+ */
+struct worker_t
+{
+    alignas (64) std::atomic<uint64_t> range = 0;
+};
+
+struct pool_t
+{
+    worker_t *workers;
+    unsigned  n_workers;
+
+    sched::task_f task;
+    void         *param;
+};
+
+static void work (pool_t *pool, unsigned worker_indx);
+
+static bool pop_task  (worker_t *worker, size_t *task_indx);
+static bool steal     (pool_t *pool, unsigned thief_indx);
+
+static inline uint64_t pack_range   (uint64_t begin, uint64_t end) { return (end << 32) | begin; }
+static inline uint64_t range_begin  (uint64_t range)               { return range & 0xFFFFFFFF;  }
+static inline uint64_t range_end    (uint64_t range)               { return range >> 32;         }
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+unsigned sched::hardware_threads ()
+{
+    unsigned n_threads = std::thread::hardware_concurrency ();
+
+    return (n_threads) ? n_threads : 1;
+}
+
+/**
+ * @brief Run task (i, param) for every i in [0, n_tasks) on n_threads threads
+ *
+ * Calling thread works too. Tasks are split evenly and idle workers steal from busy ones.
+ *
+ * @param n_threads Number of threads, 0 means all hardware threads
+ */
+void sched::parallel_for (size_t n_tasks, task_f task, void *param, unsigned n_threads)
+{
+    assert (task != nullptr && "invalid pointer");
+    assert (n_tasks <= UINT32_MAX && "too many tasks");
+
+    if (n_threads == 0)          n_threads = hardware_threads ();
+    if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+    if (n_threads > n_tasks)     n_threads = (unsigned) n_tasks;
+
+    if (n_threads <= 1)
+    {
+        for (size_t i = 0; i < n_tasks; ++i) task (i, param);
+        return;
+    }
+
+    worker_t *workers = new worker_t[n_threads];
+
+    for (unsigned i = 0; i < n_threads; ++i)
+    {
+        workers[i].range.store (pack_range (n_tasks *  i      / n_threads,
+                                            n_tasks * (i + 1) / n_threads));
+    }
+
+    pool_t pool = {workers, n_threads, task, param};
+
+    std::thread *threads = new std::thread[n_threads - 1];
+
+    for (unsigned i = 1; i < n_threads; ++i)
+    {
+        threads[i - 1] = std::thread (work, &pool, i);
+    }
+
+    work (&pool, 0);
+
+    for (unsigned i = 1; i < n_threads; ++i)
+    {
+        threads[i - 1].join ();
+    }
+
+    delete[] threads;
+    delete[] workers;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static void work (pool_t *pool, unsigned worker_indx)
+{
+    assert (pool != nullptr && "invalid pointer");
+
+    worker_t *self = pool->workers + worker_indx;
+    size_t task_indx = 0;
+
+    while (true)
+    {
+        while (pop_task (self, &task_indx))
+        {
+            pool->task (task_indx, pool->param);
+        }
+
+        if (!steal (pool, worker_indx)) return;
+    }
+}
+
+static bool pop_task (worker_t *worker, size_t *task_indx)
+{
+    assert (worker    != nullptr && "invalid pointer");
+    assert (task_indx != nullptr && "invalid pointer");
+
+    uint64_t range = worker->range.load ();
+
+    while (range_begin (range) < range_end (range))
+    {
+        uint64_t new_range = pack_range (range_begin (range) + 1, range_end (range));
+
+        if (worker->range.compare_exchange_weak (range, new_range))
+        {
+            *task_indx = range_begin (range);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Move back half of some other worker's range to the thief
+ *
+ * @return false if there is nothing to steal (all work is taken)
+ */
+static bool steal (pool_t *pool, unsigned thief_indx)
+{
+    assert (pool != nullptr && "invalid pointer");
+
+    for (unsigned shift = 1; shift < pool->n_workers; ++shift)
+    {
+        worker_t *victim = pool->workers + (thief_indx + shift) % pool->n_workers;
+        uint64_t  range  = victim->range.load ();
+
+        while (range_begin (range) < range_end (range))
+        {
+            uint64_t begin = range_begin (range);
+            uint64_t end   = range_end   (range);
+            uint64_t mid   = end - (end - begin + 1) / 2;
+
+            if (victim->range.compare_exchange_weak (range, pack_range (begin, mid)))
+            {
+                // Own range is empty, so nobody else changes it
+                pool->workers[thief_indx].range.store (pack_range (mid, end));
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,15 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+
+namespace sched
+{
+    typedef void (*task_f)(size_t task_indx, void *param);
+
+    unsigned hardware_threads ();
+
+    void parallel_for (size_t n_tasks, task_f task, void *param, unsigned n_threads = 0);
+}
+
+#endif
@@ -0,0 +1,451 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff_calc.h"
+#include "series.h"
+#include "tree.h"
+#include "tree_dsl.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Series of trees not deeper than this don't allocate memory for the walk
+const size_t SERIES_INLINE_FRAMES = 64;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Truncated power series: coefficients c[0..order] of sum c[k] * (var - a)^k
+struct series_ctx_t
+{
+    char   var;
+    double a;
+    size_t len;     ///< order + 1
+};
+
+/// Operation which operand series are being calculated
+struct series_frame_t
+{
+    const tree::node_t *node;
+    double             *left;   ///< Series of the left operand when it is calculated
+    bool                right;  ///< Right operand is being calculated
+};
+
+static double *series_subtree (const tree::node_t *node, const series_ctx_t *ctx);
+static double *series_leaf    (const tree::node_t *node, const series_ctx_t *ctx);
+static double *series_op      (const tree::node_t *node, const series_ctx_t *ctx,
+                                                         double *lhs, double *rhs);
+
+static void series_mul (const double *lhs, const double *rhs, double *res, size_t len);
+static void series_div (const double *lhs, const double *rhs, double *res, size_t len);
+static void series_exp (const double *arg, double *res, size_t len);
+static void series_log (const double *arg, double *res, size_t len);
+static void series_sin_cos (const double *arg, double *sin_res, double *cos_res, size_t len);
+static bool series_pow (const double *base, const double *power, double *res, size_t len);
+
+static bool is_const_series (const double *series, size_t len);
+
+static bool is_zero (double val);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Taylor coefficients of the subtree at var = a without symbolic differentiation
+ *
+ * Coefficient arrays are propagated through the tree, every node costs O(order^2).
+ *
+ * @param[out] coeffs coeffs[k] = f^(k)(a) / k!, k = 0..order
+ */
+tree::tree_err_t tree::taylor_coeffs (const node_t *node, char var, double a, int order,
+                                                                              double *coeffs)
+{
+    assert (node   != nullptr && "invalid pointer");
+    assert (coeffs != nullptr && "invalid pointer");
+    assert (order >= 0 && "invalid order");
+
+    series_ctx_t ctx = {var, a, (size_t) order + 1};
+
+    double *res = series_subtree (node, &ctx);
+    if (res == nullptr) return OOM;
+
+    memcpy (coeffs, res, ctx.len * sizeof (double));
+    free (res);
+
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Taylor series of src at x = a with numeric coefficients
+ */
+tree::tree_t tree::taylor_series_at (const tree_t *src, int order, double a, render::render_t *render)
+{
+    assert (src != nullptr && "invalid pointer");
+
+    tree::tree_t res = {};
+    tree::ctor (&res);
+
+    double *coeffs = (double *) calloc ((size_t) order + 1, sizeof (double));
+    if (coeffs == nullptr) return res;
+
+    if (taylor_coeffs (src->head_node, 'x', a, order, coeffs) != OK)
+    {
+        free (coeffs);
+        return res;
+    }
+
+    tree::node_t *series = new_node (coeffs[0]);
+
+    for (int i = 1; i <= order; ++i)
+    {
+        if (is_zero (coeffs[i])) continue;
+
+        series = add (series,
+                      mul (
+                          new_node (coeffs[i]),
+                          pow (sub (new_node ('x'), new_node (a)), new_node ((double) i))   // (x-a)^i
+                      )
+                 );
+    }
+
+    free (coeffs);
+
+    simplify (&series);
+
+    if (render != nullptr)
+    {
+        render::push_subsection  (render, "Итоговый ответ");
+        render::push_taylor_frame (render, src->head_node, series, order);
+    }
+
+    res.head_node = series;
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order walk with explicit stack like calc_subtree, series of an operation is
+ *        calculated when series of its operands are ready
+ *
+ * @return Allocated coefficients of the subtree series or nullptr on OOM
+ */
+static double *series_subtree (const tree::node_t *node, const series_ctx_t *ctx)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (ctx  != nullptr && "invalid pointer");
+
+    series_frame_t  inline_frames[SERIES_INLINE_FRAMES];
+    series_frame_t *frames   = inline_frames;
+    size_t          capacity = SERIES_INLINE_FRAMES;
+    size_t          size     = 0;
+
+    double *res = nullptr;
+
+    while (true)
+    {
+        bool ok = true;
+
+        while (node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (series_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, nullptr, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        res = series_leaf (node, ctx);
+
+        while (res != nullptr && size > 0 && frames[size - 1].right)
+        {
+            series_frame_t *frame = frames + --size;
+
+            double *rhs = res;
+            res = series_op (frame->node, ctx, frame->left, rhs);
+
+            free (frame->left);
+            free (rhs);
+        }
+
+        if (res == nullptr || size == 0) break;
+
+        frames[size - 1].left  = res;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    // Series of left operands whose right ones were being calculated
+    for (size_t i = 0; res == nullptr && i < size; ++i) free (frames[i].left);
+
+    if (frames != inline_frames) free (frames);
+
+    return res;
+}
+
+static double *series_leaf (const tree::node_t *node, const series_ctx_t *ctx)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (ctx  != nullptr && "invalid pointer");
+
+    double *res = (double *) calloc (ctx->len, sizeof (double));
+    if (res == nullptr) return nullptr;
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            res[0] = node->val;
+            break;
+
+        case tree::node_type_t::VAR:
+            if (node->var == ctx->var)
+            {
+                res[0] = ctx->a;
+                if (ctx->len > 1) res[1] = 1;
+            }
+            else
+            {
+                for (size_t i = 0; i < ctx->len; ++i) res[i] = NAN;
+            }
+            break;
+
+        case tree::node_type_t::OP:
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static double *series_op (const tree::node_t *node, const series_ctx_t *ctx, double *lhs, double *rhs)
+{
+    assert (node != nullptr && "invalid pointer");
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (rhs  != nullptr && "invalid pointer");
+
+    size_t len  = ctx->len;
+    double *res = (double *) calloc (len, sizeof (double));
+    if (res == nullptr) return nullptr;
+
+    double *tmp = nullptr;
+
+    switch (node->op)
+    {
+        case tree::op_t::ADD: for (size_t k = 0; k < len; ++k) res[k] = lhs[k] + rhs[k]; break;
+        case tree::op_t::SUB: for (size_t k = 0; k < len; ++k) res[k] = lhs[k] - rhs[k]; break;
+
+        case tree::op_t::MUL: series_mul (lhs, rhs, res, len); break;
+        case tree::op_t::DIV: series_div (lhs, rhs, res, len); break;
+        case tree::op_t::EXP: series_exp (rhs, res, len);      break;
+        case tree::op_t::LOG: series_log (rhs, res, len);      break;
+
+        case tree::op_t::SIN:
+        case tree::op_t::COS:
+            tmp = (double *) calloc (len, sizeof (double));
+            if (tmp == nullptr)
+            {
+                free (res);
+                return nullptr;
+            }
+
+            if (node->op == tree::op_t::SIN) series_sin_cos (rhs, res, tmp, len);
+            else                             series_sin_cos (rhs, tmp, res, len);
+
+            free (tmp);
+            break;
+
+        case tree::op_t::POW:
+            if (!series_pow (lhs, rhs, res, len))
+            {
+                free (res);
+                return nullptr;
+            }
+            break;
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void series_mul (const double *lhs, const double *rhs, double *res, size_t len)
+{
+    for (size_t k = 0; k < len; ++k)
+    {
+        double sum = 0;
+        for (size_t j = 0; j <= k; ++j) sum += lhs[j] * rhs[k - j];
+
+        res[k] = sum;
+    }
+}
+
+/// res = lhs / rhs <=> res * rhs = lhs
+static void series_div (const double *lhs, const double *rhs, double *res, size_t len)
+{
+    for (size_t k = 0; k < len; ++k)
+    {
+        double sum = lhs[k];
+        for (size_t j = 1; j <= k; ++j) sum -= rhs[j] * res[k - j];
+
+        res[k] = sum / rhs[0];
+    }
+}
+
+/// res = exp (arg) <=> res' = arg' * res
+static void series_exp (const double *arg, double *res, size_t len)
+{
+    res[0] = exp (arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sum = 0;
+        for (size_t j = 1; j <= k; ++j) sum += (double) j * arg[j] * res[k - j];
+
+        res[k] = sum / (double) k;
+    }
+}
+
+/// res = log (arg) <=> arg * res' = arg'
+static void series_log (const double *arg, double *res, size_t len)
+{
+    res[0] = log (arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sum = 0;
+        for (size_t j = 1; j < k; ++j) sum += (double) j * res[j] * arg[k - j];
+
+        res[k] = (arg[k] - sum / (double) k) / arg[0];
+    }
+}
+
+/// sin' = arg' * cos, cos' = -arg' * sin
+static void series_sin_cos (const double *arg, double *sin_res, double *cos_res, size_t len)
+{
+    sin_res[0] = sin (arg[0]);
+    cos_res[0] = cos (arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sin_sum = 0;
+        double cos_sum = 0;
+
+        for (size_t j = 1; j <= k; ++j)
+        {
+            sin_sum += (double) j * arg[j] * cos_res[k - j];
+            cos_sum += (double) j * arg[j] * sin_res[k - j];
+        }
+
+        sin_res[k] =  sin_sum / (double) k;
+        cos_res[k] = -cos_sum / (double) k;
+    }
+}
+
+/**
+ * @brief res = base ^ power
+ *
+ * Constant power uses base * res' = power * base' * res, that works for negative bases too.
+ * Zero base with natural power is multiplied directly, everything else is exp (power * log base).
+ *
+ * @return false on OOM
+ */
+static bool series_pow (const double *base, const double *power, double *res, size_t len)
+{
+    if (is_const_series (power, len))
+    {
+        double c = power[0];
+
+        if (!is_zero (base[0]))
+        {
+            res[0] = pow (base[0], c);
+
+            for (size_t k = 1; k < len; ++k)
+            {
+                double sum = 0;
+                for (size_t j = 1; j <= k; ++j)
+                {
+                    sum += (c * (double) j - (double) (k - j)) * base[j] * res[k - j];
+                }
+
+                res[k] = sum / ((double) k * base[0]);
+            }
+
+            return true;
+        }
+
+        if (c >= 0 && is_zero (c - floor (c)))
+        {
+            // Lowest term of base^c is (x-a)^c, so powers above the order give zero series
+            memset (res, 0, len * sizeof (double));
+            if (c >= (double) len) return true;
+
+            double *tmp = (double *) calloc (len, sizeof (double));
+            if (tmp == nullptr) return false;
+
+            res[0] = 1;
+
+            for (unsigned i = 0; i < (unsigned) c; ++i)
+            {
+                series_mul (res, base, tmp, len);
+                memcpy (res, tmp, len * sizeof (double));
+            }
+
+            free (tmp);
+            return true;
+        }
+    }
+
+    double *tmp = (double *) calloc (len, sizeof (double));
+    if (tmp == nullptr) return false;
+
+    series_log (base, res, len);
+    series_mul (power, res, tmp, len);
+    series_exp (tmp, res, len);
+
+    free (tmp);
+    return true;
+}
+
+static bool is_const_series (const double *series, size_t len)
+{
+    for (size_t k = 1; k < len; ++k)
+    {
+        if (!is_zero (series[k])) return false;
+    }
+
+    return true;
+}
+
+static bool is_zero (double val)
+{
+    return fpclassify (val) == FP_ZERO;
+}
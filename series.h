@@ -0,0 +1,14 @@
+#ifndef SERIES_H
+#define SERIES_H
+
+#include "tree.h"
+#include "tree_output.h"
+
+namespace tree
+{
+    tree_err_t taylor_coeffs (const node_t *node, char var, double a, int order, double *coeffs);
+
+    tree_t taylor_series_at (const tree_t *src, int order, double a, render::render_t *render = nullptr);
+}
+
+#endif
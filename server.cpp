@@ -0,0 +1,1244 @@
+#include <assert.h>
+#include <condition_variable>
+#include <errno.h>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "common.h"
+#include "diff_calc.h"
+#include "flat_tree.h"
+#include "jit.h"
+#include "lib/log.h"
+#include "scheduler.h"
+#include "series.h"
+#include "server.h"
+#include "tree.h"
+#include "tree_parsing.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const int SERVER_MAX_EVENTS = 64;
+
+/// Requests of one connection which are being processed or wait for earlier responses
+const size_t CONN_MAX_INFLIGHT = 64;
+
+/// Longer requests close the connection, complete lines waiting for the pipeline don't count
+const size_t CONN_MAX_LINE = 1 << 20;
+
+/// Connection isn't read while client doesn't take this much of responses
+const size_t CONN_MAX_OUT = 1 << 20;
+
+/// Requests are read by chunks of at most this size, so full pipeline stops reading soon
+const size_t CONN_READ_CHUNK = 1 << 16;
+
+const size_t CONN_MIN_BUF = 4096;
+
+/// Series engine costs O(order^2) per node, the cap only bounds the response
+const int TAYLOR_MAX_ORDER = 64;
+
+/// Results are computed as DAGs but printed unfolded, bigger ones are rejected instead of printed
+const size_t RESULT_MAX_NODES = 1 << 20;
+
+/// Sent instead of a response which couldn't be written to memory
+const char OOM_RESPONSE[] = "error out of memory\n";
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// First field of everything registered in epoll
+enum source_kind_t
+{
+    SOURCE_LISTEN,
+    SOURCE_WAKEUP,
+    SOURCE_SIGNAL,
+    SOURCE_CONN
+};
+
+struct conn_t;
+
+struct job_t
+{
+    conn_t *conn;
+    size_t  seq;
+
+    char  *request;
+    char  *response;        ///< nullptr if it couldn't be written, OOM_RESPONSE is sent instead
+    size_t response_size;
+
+    job_t *next;
+};
+
+struct buf_t
+{
+    char  *data;
+    size_t size;
+    size_t capacity;
+};
+
+/**
+ * @brief Client connection, it is freed after the current batch of events when it is closed
+ *        and none of its jobs is in workers
+ */
+struct conn_t
+{
+    source_kind_t kind;
+    int           fd;
+
+    buf_t  in;
+    buf_t  out;
+    size_t out_sent;
+
+    size_t next_seq;                        ///< Sequence number of the next request
+    size_t send_seq;                        ///< Sequence number of the next response to send
+    job_t *done[CONN_MAX_INFLIGHT];         ///< Finished jobs by seq % CONN_MAX_INFLIGHT
+    size_t n_pending;                       ///< Jobs given to workers
+
+    bool eof;                               ///< Client won't send more
+    bool closed;
+    bool want_in;                           ///< EPOLLIN is registered
+    bool want_out;                          ///< EPOLLOUT is registered
+
+    conn_t *prev;
+    conn_t *next;
+};
+
+struct eval_entry_t
+{
+    char       *expr;
+    tree::jit_t jit;
+};
+
+/// Warm state of one worker, it lives as long as the server
+struct worker_cache_t
+{
+    tree::diff_cache_t diff;
+
+    eval_entry_t *evals;
+    size_t        evals_capacity;
+
+    size_t eval_hits;
+    size_t eval_misses;
+};
+
+struct server_ctx_t
+{
+    const server::server_opts_t *opts;
+
+    int epoll_fd;
+    int listen_fd;
+    int wakeup_fd;
+    int signal_fd;
+
+    conn_t *conns;
+    conn_t *dead_conns;                     ///< Closed connections to be freed after events batch
+
+    std::mutex              mutex;          ///< Guards queue, completed and stopping
+    std::condition_variable has_jobs;
+
+    job_t *queue_head;
+    job_t *queue_tail;
+    job_t *completed;
+    bool   stopping;
+};
+
+static const source_kind_t LISTEN_SOURCE = SOURCE_LISTEN;
+static const source_kind_t WAKEUP_SOURCE = SOURCE_WAKEUP;
+static const source_kind_t SIGNAL_SOURCE = SOURCE_SIGNAL;
+
+static bool server_ctor (server_ctx_t *ctx, const server::server_opts_t *opts);
+static void server_dtor (server_ctx_t *ctx);
+static bool watch       (server_ctx_t *ctx, int fd, const void *source, uint32_t events, int op = EPOLL_CTL_ADD);
+
+static void accept_conns     (server_ctx_t *ctx);
+static void read_conn        (server_ctx_t *ctx, conn_t *conn);
+static void dispatch_lines   (server_ctx_t *ctx, conn_t *conn);
+static bool pipeline_full    (const conn_t *conn);
+static void update_events    (server_ctx_t *ctx, conn_t *conn);
+static void collect_done     (server_ctx_t *ctx);
+static void send_responses   (server_ctx_t *ctx, conn_t *conn);
+static void close_conn       (server_ctx_t *ctx, conn_t *conn);
+static void release_conn     (server_ctx_t *ctx, conn_t *conn);
+static void free_dead_conns  (server_ctx_t *ctx);
+
+static void   work   (server_ctx_t *ctx);
+static void   submit (server_ctx_t *ctx, job_t *job);
+static job_t *take   (server_ctx_t *ctx);
+
+static void worker_cache_ctor (worker_cache_t *cache, size_t cache_size);
+static void worker_cache_dtor (worker_cache_t *cache);
+
+static void handle_request (worker_cache_t *cache, const server::server_opts_t *opts, job_t *job);
+static bool handle_diff    (worker_cache_t *cache, const server::server_opts_t *opts,
+                                                                   const char *args, FILE *stream);
+static bool handle_taylor  (const char *args, FILE *stream);
+static bool handle_eval    (worker_cache_t *cache, const char *args, FILE *stream);
+
+static tree::node_t *parse_arg   (const char *expr, FILE *stream);
+static bool          store_node  (const tree::node_t *node, FILE *stream);
+static uint64_t      str_hash    (const char *str);
+static size_t        unfolded_size (const tree::flat_tree_t *flat);
+
+static bool buf_reserve (buf_t *buf, size_t capacity);
+static bool buf_append  (buf_t *buf, const char *data, size_t size);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+int server::serve (const server_opts_t *opts)
+{
+    server_opts_t default_opts = {};
+    if (opts == nullptr) opts = &default_opts;
+
+    server_ctx_t ctx = {};
+    if (!server_ctor (&ctx, opts)) return ERROR;
+
+    unsigned n_threads = opts->n_threads ? opts->n_threads : sched::hardware_threads ();
+
+    std::thread *workers = new std::thread[n_threads];
+    for (unsigned i = 0; i < n_threads; ++i) workers[i] = std::thread (work, &ctx);
+
+    LOG (log::INF, "Serving on %s with %u workers", opts->socket_path, n_threads);
+
+    epoll_event events[SERVER_MAX_EVENTS] = {};
+    bool        running                   = true;
+
+    while (running)
+    {
+        int n_events = epoll_wait (ctx.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (n_events < 0)
+        {
+            if (errno == EINTR) continue;
+
+            LOG (log::ERR, "epoll_wait failed: %s", strerror (errno));
+            break;
+        }
+
+        for (int i = 0; i < n_events; ++i)
+        {
+            switch (*(const source_kind_t *) events[i].data.ptr)
+            {
+                case SOURCE_LISTEN:
+                    accept_conns (&ctx);
+                    break;
+
+                case SOURCE_WAKEUP:
+                    collect_done (&ctx);
+                    break;
+
+                case SOURCE_SIGNAL:
+                    running = false;
+                    break;
+
+                case SOURCE_CONN:
+                {
+                    conn_t *conn = (conn_t *) events[i].data.ptr;
+                    if (conn->closed) break;
+
+                    if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    {
+                        close_conn (&ctx, conn);
+                        break;
+                    }
+
+                    if (events[i].events & EPOLLIN)                   read_conn      (&ctx, conn);
+                    if (events[i].events & EPOLLOUT && !conn->closed) send_responses (&ctx, conn);
+                    break;
+                }
+
+                default:
+                    assert (0 && "unexpected event source");
+            }
+        }
+
+        // Later events of the batch may still refer to them
+        free_dead_conns (&ctx);
+    }
+
+    LOG (log::INF, "Stopping server");
+
+    {
+        std::lock_guard<std::mutex> lock (ctx.mutex);
+        ctx.stopping = true;
+    }
+
+    ctx.has_jobs.notify_all ();
+
+    for (unsigned i = 0; i < n_threads; ++i) workers[i].join ();
+    delete[] workers;
+
+    server_dtor (&ctx);
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Requests are sent while responses are read, so long inputs don't stall on full socket buffers
+ */
+int server::client (const char *socket_path, FILE *input, FILE *output)
+{
+    assert (socket_path != nullptr && "invalid pointer");
+    assert (input       != nullptr && "invalid pointer");
+    assert (output      != nullptr && "invalid pointer");
+
+    buf_t requests = {};
+
+    while (!feof (input) && !ferror (input))
+    {
+        if (!buf_reserve (&requests, requests.size + CONN_MIN_BUF))
+        {
+            free (requests.data);
+            return ERROR;
+        }
+
+        requests.size += fread (requests.data + requests.size, 1, requests.capacity - requests.size, input);
+    }
+
+    // Last request without '\n' is still a request
+    if (requests.size > 0 && requests.data[requests.size - 1] != '\n' && !buf_append (&requests, "\n", 1))
+    {
+        free (requests.data);
+        return ERROR;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family  = AF_UNIX;
+    strncpy (addr.sun_path, socket_path, sizeof (addr.sun_path) - 1);
+
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect (fd, (const sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+        LOG (log::ERR, "Failed to connect to %s: %s", socket_path, strerror (errno));
+
+        if (fd >= 0) close (fd);
+        free (requests.data);
+        return ERROR;
+    }
+
+    if (requests.size == 0) shutdown (fd, SHUT_WR);
+
+    size_t sent = 0;
+    int    res  = 0;
+
+    while (true)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (sent < requests.size) pfd.events |= POLLOUT;
+
+        if (poll (&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+
+            res = ERROR;
+            break;
+        }
+
+        if (pfd.revents & POLLOUT)
+        {
+            ssize_t n_sent = send (fd, requests.data + sent, requests.size - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n_sent < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                res = ERROR;
+                break;
+            }
+
+            if (n_sent > 0) sent += (size_t) n_sent;
+            if (sent == requests.size) shutdown (fd, SHUT_WR);
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            char    response[CONN_MIN_BUF];
+            ssize_t n_read = recv (fd, response, sizeof (response), MSG_DONTWAIT);
+
+            if (n_read == 0) break;
+            if (n_read < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR) continue;
+
+                res = ERROR;
+                break;
+            }
+
+            fwrite (response, 1, (size_t) n_read, output);
+        }
+    }
+
+    if (res == ERROR) LOG (log::ERR, "Connection to %s failed: %s", socket_path, strerror (errno));
+
+    close (fd);
+    free (requests.data);
+    fflush (output);
+
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static bool server_ctor (server_ctx_t *ctx, const server::server_opts_t *opts)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (opts != nullptr && "invalid pointer");
+
+    ctx->opts      = opts;
+    ctx->epoll_fd  = -1;
+    ctx->listen_fd = -1;
+    ctx->wakeup_fd = -1;
+    ctx->signal_fd = -1;
+
+    // Signals are blocked before workers start, so only signalfd receives them
+    sigset_t signals = {};
+    sigemptyset (&signals);
+    sigaddset   (&signals, SIGINT);
+    sigaddset   (&signals, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &signals, nullptr);
+
+    sockaddr_un addr = {};
+    addr.sun_family  = AF_UNIX;
+
+    if (strlen (opts->socket_path) >= sizeof (addr.sun_path))
+    {
+        LOG (log::ERR, "Socket path %s is too long", opts->socket_path);
+        return false;
+    }
+
+    strcpy (addr.sun_path, opts->socket_path);
+    unlink (opts->socket_path);
+
+    ctx->epoll_fd  = epoll_create1 (EPOLL_CLOEXEC);
+    ctx->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ctx->wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ctx->signal_fd = signalfd (-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    bool ok = ctx->epoll_fd >= 0 && ctx->listen_fd >= 0 && ctx->wakeup_fd >= 0 && ctx->signal_fd >= 0 &&
+              bind   (ctx->listen_fd, (const sockaddr *) &addr, sizeof (addr)) == 0 &&
+              listen (ctx->listen_fd, SOMAXCONN) == 0 &&
+              watch  (ctx, ctx->listen_fd, &LISTEN_SOURCE, EPOLLIN) &&
+              watch  (ctx, ctx->wakeup_fd, &WAKEUP_SOURCE, EPOLLIN) &&
+              watch  (ctx, ctx->signal_fd, &SIGNAL_SOURCE, EPOLLIN);
+
+    if (!ok)
+    {
+        LOG (log::ERR, "Failed to start server on %s: %s", opts->socket_path, strerror (errno));
+
+        server_dtor (ctx);
+        return false;
+    }
+
+    return true;
+}
+
+static void server_dtor (server_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    // Workers are stopped, so jobs left in lists are never finished
+    job_t *lists[] = {ctx->queue_head, ctx->completed};
+
+    for (job_t *job : lists)
+    {
+        while (job != nullptr)
+        {
+            job_t *next = job->next;
+
+            job->conn->n_pending--;
+            if (job->conn->closed && job->conn->n_pending == 0) release_conn (ctx, job->conn);
+
+            free (job->request);
+            free (job->response);
+            free (job);
+
+            job = next;
+        }
+    }
+
+    while (ctx->conns != nullptr) close_conn (ctx, ctx->conns);
+    free_dead_conns (ctx);
+
+    if (ctx->listen_fd >= 0) unlink (ctx->opts->socket_path);
+
+    int fds[] = {ctx->epoll_fd, ctx->listen_fd, ctx->wakeup_fd, ctx->signal_fd};
+
+    for (int fd : fds)
+    {
+        if (fd >= 0) close (fd);
+    }
+
+    ctx->queue_head = nullptr;
+    ctx->completed  = nullptr;
+}
+
+static bool watch (server_ctx_t *ctx, int fd, const void *source, uint32_t events, int op)
+{
+    assert (ctx    != nullptr && "invalid pointer");
+    assert (source != nullptr && "invalid pointer");
+
+    epoll_event event = {};
+    event.events   = events;
+    event.data.ptr = const_cast<void *> (source);  // epoll doesn't modify the source
+
+    return epoll_ctl (ctx->epoll_fd, op, fd, &event) == 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void accept_conns (server_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    while (true)
+    {
+        int fd = accept4 (ctx->listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR) LOG (log::ERR, "accept failed: %s", strerror (errno));
+            return;
+        }
+
+        conn_t *conn = (conn_t *) calloc (1, sizeof (conn_t));
+        if (conn == nullptr || !watch (ctx, fd, conn, EPOLLIN | EPOLLRDHUP))
+        {
+            LOG (log::ERR, "Failed to register connection");
+
+            free (conn);
+            close (fd);
+            continue;
+        }
+
+        conn->kind    = SOURCE_CONN;
+        conn->fd      = fd;
+        conn->want_in = true;
+        conn->next    = ctx->conns;
+
+        if (ctx->conns != nullptr) ctx->conns->prev = conn;
+        ctx->conns = conn;
+    }
+}
+
+/// Read by chunks and dispatch after each one, reading stops while pipeline is full
+static void read_conn (server_ctx_t *ctx, conn_t *conn)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (conn != nullptr && "invalid pointer");
+
+    while (!conn->eof && !conn->closed && !pipeline_full (conn))
+    {
+        if (!buf_reserve (&conn->in, conn->in.size + CONN_READ_CHUNK))
+        {
+            close_conn (ctx, conn);
+            return;
+        }
+
+        ssize_t n_read = recv (conn->fd, conn->in.data + conn->in.size, CONN_READ_CHUNK, 0);
+
+        if (n_read > 0)
+        {
+            conn->in.size += (size_t) n_read;
+            dispatch_lines (ctx, conn);
+            continue;
+        }
+
+        if (n_read < 0 && errno == EINTR) continue;
+        if (n_read < 0 && errno == EAGAIN) break;
+
+        if (n_read < 0)
+        {
+            close_conn (ctx, conn);
+            return;
+        }
+
+        // Client has sent everything: requests are finished, then connection is closed
+        conn->eof = true;
+
+        if (conn->in.size > 0 && conn->in.data[conn->in.size - 1] != '\n')
+        {
+            if (!buf_append (&conn->in, "\n", 1))
+            {
+                close_conn (ctx, conn);
+                return;
+            }
+        }
+
+        dispatch_lines (ctx, conn);
+    }
+
+    if (!conn->closed) update_events (ctx, conn);
+}
+
+/// Give complete lines to workers while pipeline of the connection isn't full
+static void dispatch_lines (server_ctx_t *ctx, conn_t *conn)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (conn != nullptr && "invalid pointer");
+
+    size_t line_start = 0;
+
+    while (!pipeline_full (conn))
+    {
+        char *line_end = (char *) memchr (conn->in.data + line_start, '\n', conn->in.size - line_start);
+        if (line_end == nullptr) break;
+
+        size_t line_len = (size_t) (line_end - conn->in.data) - line_start;
+
+        job_t *job = (job_t *) calloc (1, sizeof (job_t));
+        char  *req = (char *)  malloc (line_len + 1);
+
+        if (job == nullptr || req == nullptr)
+        {
+            free (job);
+            free (req);
+
+            close_conn (ctx, conn);
+            return;
+        }
+
+        memcpy (req, conn->in.data + line_start, line_len);
+        req[line_len] = '\0';
+
+        job->conn    = conn;
+        job->seq     = conn->next_seq++;
+        job->request = req;
+
+        conn->n_pending++;
+        submit (ctx, job);
+
+        line_start += line_len + 1;
+    }
+
+    memmove (conn->in.data, conn->in.data + line_start, conn->in.size - line_start);
+    conn->in.size -= line_start;
+
+    // Complete lines left here wait for the pipeline, only the incomplete one may be too long
+    const char *last_end = (const char *) memrchr (conn->in.data, '\n', conn->in.size);
+    size_t      tail_len = (last_end == nullptr) ? conn->in.size
+                                                 : conn->in.size - (size_t) (last_end + 1 - conn->in.data);
+    if (tail_len > CONN_MAX_LINE)
+    {
+        LOG (log::ERR, "Request is too long, closing connection");
+        close_conn (ctx, conn);
+        return;
+    }
+
+    if (conn->eof && conn->in.size == 0 && conn->send_seq == conn->next_seq &&
+        conn->out_sent == conn->out.size)
+    {
+        close_conn (ctx, conn);
+    }
+}
+
+/// Connection takes no more requests until some responses are sent
+static bool pipeline_full (const conn_t *conn)
+{
+    assert (conn != nullptr && "invalid pointer");
+
+    return conn->next_seq - conn->send_seq >= CONN_MAX_INFLIGHT ||
+           conn->out.size - conn->out_sent >= CONN_MAX_OUT;
+}
+
+/// EPOLLIN only while connection takes requests, EPOLLOUT only while there is output to send
+static void update_events (server_ctx_t *ctx, conn_t *conn)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (conn != nullptr && "invalid pointer");
+
+    bool want_in  = !conn->eof && !pipeline_full (conn);
+    bool want_out = conn->out_sent < conn->out.size;
+
+    if (want_in == conn->want_in && want_out == conn->want_out) return;
+
+    conn->want_in  = want_in;
+    conn->want_out = want_out;
+
+    uint32_t events = 0;
+    if (want_in)  events |= EPOLLIN | EPOLLRDHUP;
+    if (want_out) events |= EPOLLOUT;
+
+    watch (ctx, conn->fd, conn, events, EPOLL_CTL_MOD);
+}
+
+/// Route responses of workers to their connections
+static void collect_done (server_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    uint64_t counter = 0;
+    if (read (ctx->wakeup_fd, &counter, sizeof (counter)) < 0 && errno != EAGAIN)
+    {
+        LOG (log::ERR, "Failed to read wakeup counter: %s", strerror (errno));
+    }
+
+    job_t *jobs = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock (ctx->mutex);
+
+        jobs           = ctx->completed;
+        ctx->completed = nullptr;
+    }
+
+    while (jobs != nullptr)
+    {
+        job_t  *job  = jobs;
+        conn_t *conn = job->conn;
+        jobs = job->next;
+
+        conn->n_pending--;
+
+        if (conn->closed)
+        {
+            free (job->request);
+            free (job->response);
+            free (job);
+
+            if (conn->n_pending == 0) release_conn (ctx, conn);
+            continue;
+        }
+
+        conn->done[job->seq % CONN_MAX_INFLIGHT] = job;
+        send_responses (ctx, conn);
+    }
+}
+
+/// Move finished responses to output buffer in request order and send as much as socket takes
+static void send_responses (server_ctx_t *ctx, conn_t *conn)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (conn != nullptr && "invalid pointer");
+
+    job_t **slot = nullptr;
+
+    while (*(slot = conn->done + conn->send_seq % CONN_MAX_INFLIGHT) != nullptr)
+    {
+        job_t *job = *slot;
+
+        bool ok = (job->response != nullptr) ? buf_append (&conn->out, job->response, job->response_size) :
+                                               buf_append (&conn->out, OOM_RESPONSE, sizeof (OOM_RESPONSE) - 1);
+
+        free (job->request);
+        free (job->response);
+        free (job);
+
+        *slot = nullptr;
+        conn->send_seq++;
+
+        if (!ok)
+        {
+            close_conn (ctx, conn);
+            return;
+        }
+    }
+
+    while (conn->out_sent < conn->out.size)
+    {
+        ssize_t n_sent = send (conn->fd, conn->out.data + conn->out_sent, conn->out.size - conn->out_sent,
+                                                                                    MSG_NOSIGNAL);
+        if (n_sent < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+
+            close_conn (ctx, conn);
+            return;
+        }
+
+        conn->out_sent += (size_t) n_sent;
+    }
+
+    if (conn->out_sent == conn->out.size)
+    {
+        conn->out.size = 0;
+        conn->out_sent = 0;
+    }
+
+    // Pipeline has room again
+    dispatch_lines (ctx, conn);
+
+    if (!conn->closed) update_events (ctx, conn);
+}
+
+static void close_conn (server_ctx_t *ctx, conn_t *conn)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (conn != nullptr && "invalid pointer");
+
+    if (conn->closed) return;
+
+    epoll_ctl (ctx->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close (conn->fd);
+
+    conn->closed = true;
+
+    if (conn->prev != nullptr) conn->prev->next = conn->next;
+    else                       ctx->conns       = conn->next;
+
+    if (conn->next != nullptr) conn->next->prev = conn->prev;
+
+    conn->prev = nullptr;
+    conn->next = nullptr;
+
+    for (size_t i = 0; i < CONN_MAX_INFLIGHT; ++i)
+    {
+        if (conn->done[i] == nullptr) continue;
+
+        free (conn->done[i]->request);
+        free (conn->done[i]->response);
+        free (conn->done[i]);
+
+        conn->done[i] = nullptr;
+    }
+
+    // Jobs in workers still point to the connection
+    if (conn->n_pending == 0) release_conn (ctx, conn);
+}
+
+static void release_conn (server_ctx_t *ctx, conn_t *conn)
+{
+    assert (ctx  != nullptr && "invalid pointer");
+    assert (conn != nullptr && "invalid pointer");
+    assert (conn->closed    && "connection is in use");
+
+    conn->next      = ctx->dead_conns;
+    ctx->dead_conns = conn;
+}
+
+static void free_dead_conns (server_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    while (ctx->dead_conns != nullptr)
+    {
+        conn_t *conn    = ctx->dead_conns;
+        ctx->dead_conns = conn->next;
+
+        free (conn->in.data);
+        free (conn->out.data);
+        free (conn);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void work (server_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    worker_cache_t cache = {};
+    worker_cache_ctor (&cache, ctx->opts->cache_size);
+
+    job_t *job = nullptr;
+
+    while ((job = take (ctx)) != nullptr)
+    {
+        handle_request (&cache, ctx->opts, job);
+
+        {
+            std::lock_guard<std::mutex> lock (ctx->mutex);
+
+            job->next      = ctx->completed;
+            ctx->completed = job;
+        }
+
+        uint64_t one = 1;
+        if (write (ctx->wakeup_fd, &one, sizeof (one)) < 0)
+        {
+            LOG (log::ERR, "Failed to wake event loop: %s", strerror (errno));
+        }
+    }
+
+    worker_cache_dtor (&cache);
+}
+
+static void submit (server_ctx_t *ctx, job_t *job)
+{
+    assert (ctx != nullptr && "invalid pointer");
+    assert (job != nullptr && "invalid pointer");
+
+    {
+        std::lock_guard<std::mutex> lock (ctx->mutex);
+
+        job->next = nullptr;
+
+        if (ctx->queue_tail != nullptr) ctx->queue_tail->next = job;
+        else                            ctx->queue_head       = job;
+
+        ctx->queue_tail = job;
+    }
+
+    ctx->has_jobs.notify_one ();
+}
+
+/// @return Next job or nullptr when server stops
+static job_t *take (server_ctx_t *ctx)
+{
+    assert (ctx != nullptr && "invalid pointer");
+
+    std::unique_lock<std::mutex> lock (ctx->mutex);
+    ctx->has_jobs.wait (lock, [ctx] { return ctx->stopping || ctx->queue_head != nullptr; });
+
+    if (ctx->stopping) return nullptr;
+
+    job_t *job = ctx->queue_head;
+
+    ctx->queue_head = job->next;
+    if (ctx->queue_head == nullptr) ctx->queue_tail = nullptr;
+
+    return job;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void worker_cache_ctor (worker_cache_t *cache, size_t cache_size)
+{
+    assert (cache != nullptr && "invalid pointer");
+
+    *cache = {};
+    tree::diff_cache_ctor (&cache->diff);
+
+    cache->evals = (eval_entry_t *) calloc (cache_size, sizeof (eval_entry_t));
+    if (cache->evals != nullptr) cache->evals_capacity = cache_size;
+}
+
+static void worker_cache_dtor (worker_cache_t *cache)
+{
+    assert (cache != nullptr && "invalid pointer");
+
+    LOG (log::DBG, "Evaluators: %zu hits, %zu misses", cache->eval_hits, cache->eval_misses);
+
+    for (size_t i = 0; i < cache->evals_capacity; ++i)
+    {
+        if (cache->evals[i].expr == nullptr) continue;
+
+        free (cache->evals[i].expr);
+        tree::jit_dtor (&cache->evals[i].jit);
+    }
+
+    free (cache->evals);
+    tree::diff_cache_dtor (&cache->diff);
+
+    *cache = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+#define IS_COMMAND(name) (strncmp (request, name, sizeof (name) - 1) == 0 &&                          \
+                          (request[sizeof (name) - 1] == ' ' || request[sizeof (name) - 1] == '\0'))
+
+static void handle_request (worker_cache_t *cache, const server::server_opts_t *opts, job_t *job)
+{
+    assert (cache != nullptr && "invalid pointer");
+    assert (opts  != nullptr && "invalid pointer");
+    assert (job   != nullptr && "invalid pointer");
+
+    FILE *stream = open_memstream (&job->response, &job->response_size);
+    if (stream == nullptr)
+    {
+        LOG (log::ERR, "Failed to allocate response");
+        return;
+    }
+
+    const char *request = job->request;
+    const char *args    = strchr (request, ' ');
+
+    args = (args != nullptr) ? args + 1 : "";
+
+    if      (IS_COMMAND ("diff"))   handle_diff   (cache, opts, args, stream);
+    else if (IS_COMMAND ("taylor")) handle_taylor (args, stream);
+    else if (IS_COMMAND ("eval"))   handle_eval   (cache, args, stream);
+    else if (IS_COMMAND ("ping"))   fprintf (stream, "ok pong\n");
+    else                            fprintf (stream, "error unknown command\n");
+
+    bool failed = ferror (stream) != 0;
+    if (fclose (stream) != 0) failed = true;
+
+    // Partial response would break the one line per request protocol
+    if (failed)
+    {
+        LOG (log::ERR, "Failed to write response");
+
+        free (job->response);
+        job->response      = nullptr;
+        job->response_size = 0;
+    }
+}
+
+#undef IS_COMMAND
+
+/// args: "<var> <expr>", memo of derivatives is reused by next requests
+static bool handle_diff (worker_cache_t *cache, const server::server_opts_t *opts,
+                                                                   const char *args, FILE *stream)
+{
+    assert (cache != nullptr && "invalid pointer");
+    assert (args  != nullptr && "invalid pointer");
+
+    if (args[0] == '\0' || args[1] != ' ')
+    {
+        fprintf (stream, "error expected variable\n");
+        return false;
+    }
+
+    tree::node_t *expr = parse_arg (args + 2, stream);
+    if (expr == nullptr) return false;
+
+    // Memo keeps its keys alive, so it is dropped as a whole when it grows too big
+    if (cache->diff.size > opts->cache_size)
+    {
+        tree::diff_cache_dtor (&cache->diff);
+        tree::diff_cache_ctor (&cache->diff);
+    }
+
+    tree::node_t *diff = tree::calc_diff (expr, args[0], nullptr, false, &cache->diff);
+    tree::del_node (expr);
+
+    bool ok = diff != nullptr && store_node (diff, stream);
+    if (diff == nullptr) fprintf (stream, "error out of memory\n");
+
+    tree::del_node (diff);
+    return ok;
+}
+
+/// args: "<order> <a> <expr>", coefficients are calculated numerically by the series engine
+static bool handle_taylor (const char *args, FILE *stream)
+{
+    assert (args != nullptr && "invalid pointer");
+
+    char *center_str = nullptr;
+    long  order      = strtol (args, &center_str, 10);
+
+    if (center_str == args || order <= 0 || order > TAYLOR_MAX_ORDER || *center_str != ' ')
+    {
+        fprintf (stream, "error expected order from 1 to %d\n", TAYLOR_MAX_ORDER);
+        return false;
+    }
+
+    char  *expr_str = nullptr;
+    double center   = strtod (center_str, &expr_str);
+
+    if (expr_str == center_str || *expr_str != ' ')
+    {
+        fprintf (stream, "error expected center of the series\n");
+        return false;
+    }
+
+    tree::node_t *expr = parse_arg (expr_str + 1, stream);
+    if (expr == nullptr) return false;
+
+    tree::tree_t src    = {expr};
+    tree::tree_t series = tree::taylor_series_at (&src, (int) order, center);
+
+    bool ok = series.head_node != nullptr && store_node (series.head_node, stream);
+    if (series.head_node == nullptr) fprintf (stream, "error out of memory\n");
+
+    tree::dtor (&series);
+    tree::del_node (expr);
+    return ok;
+}
+
+/// args: "<x> <expr>", compiled evaluators are found by expression text
+static bool handle_eval (worker_cache_t *cache, const char *args, FILE *stream)
+{
+    assert (cache != nullptr && "invalid pointer");
+    assert (args  != nullptr && "invalid pointer");
+
+    char  *expr_str = nullptr;
+    double x        = strtod (args, &expr_str);
+
+    if (expr_str == args || *expr_str != ' ')
+    {
+        fprintf (stream, "error expected value of x\n");
+        return false;
+    }
+
+    expr_str++;
+
+    eval_entry_t *entry = nullptr;
+
+    if (cache->evals_capacity > 0)
+    {
+        entry = cache->evals + str_hash (expr_str) % cache->evals_capacity;
+
+        if (entry->expr != nullptr && strcmp (entry->expr, expr_str) == 0)
+        {
+            cache->eval_hits++;
+            fprintf (stream, "ok %.17g\n", tree::calc_tree (&entry->jit, x));
+            return true;
+        }
+    }
+
+    cache->eval_misses++;
+
+    tree::node_t *expr = parse_arg (expr_str, stream);
+    if (expr == nullptr) return false;
+
+    tree::jit_t jit = {};
+    if (tree::jit_compile (expr, &jit) != tree::OK)
+    {
+        fprintf (stream, "error out of memory\n");
+
+        tree::del_node (expr);
+        return false;
+    }
+
+    tree::del_node (expr);
+
+    fprintf (stream, "ok %.17g\n", tree::calc_tree (&jit, x));
+
+    char *key = (entry != nullptr) ? strdup (expr_str) : nullptr;
+    if (key == nullptr)
+    {
+        tree::jit_dtor (&jit);
+        return true;
+    }
+
+    // Entry is replaced by the latest expression with the same hash
+    if (entry->expr != nullptr)
+    {
+        free (entry->expr);
+        tree::jit_dtor (&entry->jit);
+    }
+
+    entry->expr = key;
+    entry->jit  = jit;
+
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// @return Parsed expression or nullptr, error response is written then
+static tree::node_t *parse_arg (const char *expr, FILE *stream)
+{
+    assert (expr   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    tree::parse_error_t error = {};
+    tree::node_t *node = tree::parse_dump (expr, &error);
+
+    if (node == nullptr)
+    {
+        if (error.err == tree::INVALID_DUMP)
+            fprintf (stream, "error %zu: expected %s\n", error.offset, error.expected);
+        else
+            fprintf (stream, "error out of memory\n");
+    }
+
+    return node;
+}
+
+static bool store_node (const tree::node_t *node, FILE *stream)
+{
+    assert (node   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    tree::flat_tree_t flat = {};
+
+    if (tree::flatten (node, &flat) != tree::OK)
+    {
+        fprintf (stream, "error out of memory\n");
+        return false;
+    }
+
+    bool ok = unfolded_size (&flat) <= RESULT_MAX_NODES;
+
+    if (ok)
+    {
+        fprintf (stream, "ok ");
+        tree::store (&flat, stream);
+    }
+    else
+    {
+        fprintf (stream, "error result has more than %zu nodes\n", RESULT_MAX_NODES);
+    }
+
+    tree::flat_dtor (&flat);
+    return ok;
+}
+
+/// Number of nodes in the printed tree, counting stops above RESULT_MAX_NODES
+static size_t unfolded_size (const tree::flat_tree_t *flat)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    size_t *sizes = (size_t *) calloc (flat->size, sizeof (size_t));
+    if (sizes == nullptr) return SIZE_MAX;
+
+    // Children precede their parent
+    for (size_t i = 0; i < flat->size; ++i)
+    {
+        size_t size = 1;
+        if (flat->lefts [i] != tree::FLAT_NONE) size += sizes[flat->lefts [i]];
+        if (flat->rights[i] != tree::FLAT_NONE) size += sizes[flat->rights[i]];
+
+        sizes[i] = (size < RESULT_MAX_NODES) ? size : RESULT_MAX_NODES + 1;
+    }
+
+    size_t res = sizes[flat->size - 1];
+
+    free (sizes);
+    return res;
+}
+
+/// FNV-1a
+static uint64_t str_hash (const char *str)
+{
+    assert (str != nullptr && "invalid pointer");
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    for (; *str != '\0'; ++str)
+    {
+        hash ^= (unsigned char) *str;
+        hash *= 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool buf_reserve (buf_t *buf, size_t capacity)
+{
+    assert (buf != nullptr && "invalid pointer");
+
+    if (capacity <= buf->capacity) return true;
+
+    size_t new_capacity = buf->capacity ? buf->capacity : CONN_MIN_BUF;
+    while (new_capacity < capacity) new_capacity *= 2;
+
+    char *new_data = (char *) realloc (buf->data, new_capacity);
+    if (new_data == nullptr) return false;
+
+    buf->data     = new_data;
+    buf->capacity = new_capacity;
+    return true;
+}
+
+static bool buf_append (buf_t *buf, const char *data, size_t size)
+{
+    assert (buf  != nullptr && "invalid pointer");
+    assert (data != nullptr && "invalid pointer");
+
+    if (!buf_reserve (buf, buf->size + size)) return false;
+
+    memcpy (buf->data + buf->size, data, size);
+    buf->size += size;
+
+    return true;
+}
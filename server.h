@@ -0,0 +1,43 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+namespace server
+{
+    /**
+     * Protocol: one request per line, one response line per request in the same order,
+     * requests of one connection may be pipelined.
+     *
+     *     diff <var> <expr>           ->  ok <derivative>
+     *     taylor <order> <a> <expr>   ->  ok <series at x = a>
+     *     eval <x> <expr>             ->  ok <value>
+     *     ping                        ->  ok pong
+     *
+     * Expressions are in parse_dump syntax. Failure is "error <offset>: expected <token>"
+     * (offset in the expression) or "error <message>".
+     */
+    struct server_opts_t
+    {
+        const char *socket_path = "matangpt.sock";
+        unsigned    n_threads   = 0;        ///< Workers, 0 means all hardware threads
+        size_t      cache_size  = 4096;     ///< Derivatives memo entries and evaluators kept by one worker
+    };
+
+    /**
+     * @brief Serve requests until SIGINT or SIGTERM
+     *
+     * @param opts nullptr means default options
+     *
+     * @return 0 or ERROR if server can't be started
+     */
+    int serve (const server_opts_t *opts = nullptr);
+
+    /**
+     * @brief Send every line of input as a request and write responses to output
+     */
+    int client (const char *socket_path, FILE *input, FILE *output);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <mutex>
+#include <thread>
+
+#include "tree.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Several arena blocks per chain
+const int CHAIN_SIZE = 10000;
+
+const int N_CHAINS = 64;
+
+// -------------------------------------------------------------------------------------------------
+
+static tree::node_t *new_chain (int size)
+{
+    tree::node_t *root = tree::new_node ('x');
+
+    for (int i = 1; i < size; ++i)
+    {
+        tree::node_t *op = tree::new_node (tree::op_t::ADD);
+        assert (op != nullptr && "OOM");
+
+        op->left  = root;
+        op->right = tree::new_node (1.0);
+        root      = op;
+    }
+
+    return root;
+}
+
+/**
+ * @brief Nodes are released by another thread while their owner keeps allocating, then after
+ *        the owner has exited. Sanitizers catch races on free lists, writes to dead thread
+ *        storage and blocks leaked by the exited owner.
+ */
+int main ()
+{
+    std::mutex    handoff_mutex;
+    tree::node_t *handoff[N_CHAINS] = {};
+    int           n_handed          = 0;
+
+    std::thread producer ([&] ()
+    {
+        for (int i = 0; i < N_CHAINS; ++i)
+        {
+            tree::node_t *chain = new_chain (CHAIN_SIZE);
+
+            std::lock_guard<std::mutex> lock (handoff_mutex);
+            handoff[n_handed++] = chain;
+        }
+    });
+
+    int n_released = 0;
+    while (n_released < N_CHAINS / 2)
+    {
+        tree::node_t *chain = nullptr;
+        {
+            std::lock_guard<std::mutex> lock (handoff_mutex);
+            if (n_released < n_handed) chain = handoff[n_released];
+        }
+
+        if (chain == nullptr) { std::this_thread::yield (); continue; }
+
+        tree::del_node (chain);
+        n_released++;
+    }
+
+    producer.join ();
+
+    for (; n_released < N_CHAINS; ++n_released) tree::del_node (handoff[n_released]);
+
+    printf ("arena_remote_free: %d chains of %d nodes: ok\n", N_CHAINS, CHAIN_SIZE);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Recursive walks overflowed the stack at ~200k terms
+const int N_TERMS = 1000000;
+
+const char EXPECTED[] = "1000000\n";
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Left-leaning chain "x + x + ... + x" is as deep as it is long, every walk of parse,
+ *        intern, diff and simplify must keep its stack on the heap
+ */
+int main ()
+{
+    // Batch input is read by size of the file, so it can't be a memory stream
+    FILE *input = tmpfile ();
+    assert (input != nullptr && "can't create temporary file");
+
+    fputc ('x', input);
+    for (int i = 1; i < N_TERMS; ++i) fputs (" + x", input);
+    fputc ('\n', input);
+
+    rewind (input);
+
+    char  *result      = nullptr;
+    size_t result_size = 0;
+    FILE  *output      = open_memstream (&result, &result_size);
+    assert (output != nullptr && "OOM");
+
+    batch::batch_opts_t opts = {};
+    opts.n_threads = 2;
+
+    int n_failed = batch::run (input, output, &opts);
+
+    fclose (input);
+    fclose (output);
+
+    bool ok = n_failed == 0 && result_size == sizeof (EXPECTED) - 1 && strcmp (result, EXPECTED) == 0;
+    printf ("batch_deep_chain: %d terms: %s\n", N_TERMS, ok ? "ok" : "FAILED");
+
+    free (result);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+#include "tree_parsing.h"
+#include "tree_vm.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const char *const EXPRESSIONS[] = {"sin (x)", "cos (x)", "exp (x)", "log (x)", "x^3", "x^(0 - 4)", "x^2.5"};
+
+/// Arguments of every expression, both normal and the ones kernels give to libm
+const double X_MIN  = -800;
+const double X_MAX  =  800;
+const size_t N_GRID = 100003;
+
+const double SPECIAL_XS[] = {0.0, -0.0, INFINITY, -INFINITY, NAN, 1e-310, -1e-310, DBL_MIN, DBL_MAX,
+                             708.5, 709.5, -708.5, -745.5, 65536.5, M_PI, M_PI / 2};
+
+const int64_t MAX_ULP = 4;
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Doubles of one sign are ordered as their bits, negative ones are mirrored below zero
+ */
+static int64_t ulp_order (double val)
+{
+    int64_t bits = 0;
+    memcpy (&bits, &val, sizeof (bits));
+
+    return bits < 0 ? INT64_MIN - bits : bits;
+}
+
+static bool close_to_libm (double expected, double res)
+{
+    if (isnan (expected)) return isnan (res);
+
+    return llabs (ulp_order (expected) - ulp_order (res)) <= MAX_ULP;
+}
+
+/**
+ * @brief Vector kernels of batch mode must stay within a few ulp of libm used by calc_tree,
+ *        including lanes out of their fast ranges
+ */
+int main ()
+{
+    size_t n_special = sizeof (SPECIAL_XS) / sizeof (*SPECIAL_XS);
+    size_t n         = N_GRID + n_special;
+
+    double *xs  = (double *) calloc (n, sizeof (double));
+    double *out = (double *) calloc (n, sizeof (double));
+    assert (xs != nullptr && out != nullptr && "OOM");
+
+    for (size_t i = 0; i < N_GRID; ++i)
+        xs[i] = X_MIN + (X_MAX - X_MIN) * (double) i / (double) (N_GRID - 1);
+    memcpy (xs + N_GRID, SPECIAL_XS, sizeof (SPECIAL_XS));
+
+    size_t n_failed = 0;
+
+    for (const char *expr : EXPRESSIONS)
+    {
+        tree::tree_t    tree    = {tree::parse_dump (expr)};
+        tree::program_t program = {};
+        assert (tree.head_node != nullptr && tree::compile (&tree, &program) == tree::OK && "OOM");
+
+        bool ok = tree::calc_tree_batch (&program, xs, out, n) == tree::OK;
+        for (size_t i = 0; ok && i < n; ++i)
+            ok = close_to_libm (tree::calc_tree (&program, xs[i]), out[i]);
+
+        if (!ok)
+        {
+            printf ("batch_kernels: %s differs from libm\n", expr);
+            n_failed++;
+        }
+
+        tree::program_dtor (&program);
+        tree::dtor (&tree);
+    }
+
+    printf ("batch_kernels: %zu expressions at %zu points: %s\n", sizeof (EXPRESSIONS) / sizeof (*EXPRESSIONS),
+                                                                  n, n_failed == 0 ? "ok" : "FAILED");
+
+    free (xs);
+    free (out);
+
+    return n_failed == 0 ? 0 : 1;
+}
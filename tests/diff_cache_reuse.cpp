@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff_calc.h"
+#include "tree.h"
+#include "tree_parsing.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Enough distinct sources for the intern table to grow and rehash several times
+const int N_EXPRS = 300;
+
+const int N_PASSES = 2;
+
+const size_t EXPR_MAX = 128;
+
+// -------------------------------------------------------------------------------------------------
+
+static char *diff_dump (const char *expr, tree::diff_cache_t *cache)
+{
+    tree::node_t *src = tree::parse_dump (expr);
+    assert (src != nullptr && "invalid expression");
+
+    tree::tree_t diff = {tree::calc_diff (src, 'x', nullptr, false, cache)};
+
+    char  *dump      = nullptr;
+    size_t dump_size = 0;
+    FILE  *stream    = open_memstream (&dump, &dump_size);
+    assert (stream != nullptr && "OOM");
+
+    tree::store (&diff, stream);
+    fclose (stream);
+
+    tree::dtor     (&diff);
+    tree::del_node (src);
+
+    return dump;
+}
+
+/**
+ * @brief Simplification of derivatives must not edit interned sources they share, otherwise
+ *        a cache kept between requests (like in the daemon) gives different answers later
+ */
+int main ()
+{
+    tree::diff_cache_t cache = {};
+    tree::diff_cache_ctor (&cache);
+
+    int n_bad = 0;
+
+    for (int pass = 0; pass < N_PASSES; ++pass)
+    {
+        for (int i = 0; i < N_EXPRS; ++i)
+        {
+            char expr[EXPR_MAX] = "";
+            snprintf (expr, sizeof (expr), "sin (x ^ %d) * (x ^ 1) + x * %d + (x + %d) ^ 1", i % 7 + 1, i, i);
+
+            char *cached = diff_dump (expr, &cache);
+            char *fresh  = diff_dump (expr, nullptr);
+
+            if (strcmp (cached, fresh) != 0) n_bad++;
+
+            free (cached);
+            free (fresh);
+        }
+    }
+
+    tree::diff_cache_dtor (&cache);
+
+    bool ok = n_bad == 0;
+    printf ("diff_cache_reuse: %d of %d derivatives differ from uncached ones: %s\n",
+                               n_bad, N_PASSES * N_EXPRS, ok ? "ok" : "FAILED");
+
+    return ok ? 0 : 1;
+}
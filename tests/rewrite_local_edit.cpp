@@ -0,0 +1,59 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "diff_calc.h"
+#include "tree.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Far deeper than the inline stacks of the walks
+const int DEPTH = 10000;
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief After simplify every node of the chain is canonical, so an edit at the bottom is seen
+ *        by the next simplify only if invalidate clears the marks of all its ancestors
+ */
+int main ()
+{
+    tree::node_t *leaf = tree::new_node ('x');
+    tree::node_t *root = leaf;
+
+    for (int i = 0; i < DEPTH; ++i)
+    {
+        tree::node_t *op = tree::new_node ((i % 2) ? tree::op_t::SIN : tree::op_t::COS);
+        op->right = root;
+        root      = op;
+    }
+
+    tree::simplify (&root);
+    bool ok = root->canonical;
+
+    // x -> x * 1, which simplify turns back into x
+    tree::change_node (leaf, tree::op_t::MUL);
+    leaf->left  = tree::new_node ('x');
+    leaf->right = tree::new_node (1.0);
+
+    ok = ok && tree::invalidate (root, leaf) && !root->canonical;
+
+    tree::simplify (&root);
+
+    tree::node_t *bottom = root;
+    while (bottom->type == tree::node_type_t::OP) bottom = bottom->right;
+
+    ok = ok && bottom == leaf && leaf->type == tree::node_type_t::VAR && leaf->var == 'x';
+
+    // Node which is not in the subtree
+    tree::node_t *other = tree::new_node ('y');
+    ok = ok && !tree::invalidate (root, other);
+
+    printf ("rewrite_local_edit: edit at depth %d: %s\n", DEPTH, ok ? "ok" : "FAILED");
+
+    tree::del_node (other);
+    tree::del_node (root);
+
+    return ok ? 0 : 1;
+}
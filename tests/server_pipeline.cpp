@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "server.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const char SOCKET_PATH[] = "/tmp/matangpt_test_pipeline.sock";
+
+/// ~2 MB of requests, far more than one pipeline and one read of the connection
+const int N_REQUESTS = 80000;
+
+const int CONNECT_ATTEMPTS = 100;
+
+// -------------------------------------------------------------------------------------------------
+
+static bool wait_server ()
+{
+    sockaddr_un addr = {};
+    addr.sun_family  = AF_UNIX;
+    strncpy (addr.sun_path, SOCKET_PATH, sizeof (addr.sun_path) - 1);
+
+    for (int i = 0; i < CONNECT_ATTEMPTS; ++i)
+    {
+        int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return false;
+
+        bool ok = connect (fd, (const sockaddr *) &addr, sizeof (addr)) == 0;
+        close (fd);
+
+        if (ok) return true;
+        usleep (50000);
+    }
+
+    return false;
+}
+
+/**
+ * @brief Client sends all requests before reading, server must stop reading while its pipeline
+ *        is full instead of buffering them and must answer every one in order
+ */
+int main ()
+{
+    // Thread of the server inherits the mask, so SIGTERM goes to its signalfd only
+    sigset_t signals = {};
+    sigemptyset (&signals);
+    sigaddset   (&signals, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &signals, nullptr);
+
+    server::server_opts_t opts = {};
+    opts.socket_path = SOCKET_PATH;
+    opts.n_threads   = 2;
+
+    std::thread server_thread (server::serve, &opts);
+
+    char  *requests      = nullptr;
+    size_t requests_size = 0;
+    FILE  *input         = open_memstream (&requests, &requests_size);
+    assert (input != nullptr && "OOM");
+
+    for (int i = 0; i < N_REQUESTS; ++i)
+        fprintf (input, (i % 2) ? "eval %d (x * x) + sin (x)\n" : "diff x (x ^ %d) * cos (x)\n", i % 100);
+
+    fclose (input);
+
+    char  *responses      = nullptr;
+    size_t responses_size = 0;
+    FILE  *output         = open_memstream (&responses, &responses_size);
+    assert (output != nullptr && "OOM");
+
+    bool ok = false;
+
+    if (wait_server ())
+    {
+        input = fmemopen (requests, requests_size, "r");
+        assert (input != nullptr && "OOM");
+
+        ok = server::client (SOCKET_PATH, input, output) == 0;
+        fclose (input);
+    }
+
+    fclose (output);
+
+    kill (getpid (), SIGTERM);
+    server_thread.join ();
+
+    int         n_ok = 0;
+    const char *line = responses;
+
+    while (ok && line < responses + responses_size)
+    {
+        const char *line_end = strchr (line, '\n');
+
+        ok   = line_end != nullptr && strncmp (line, "ok ", 3) == 0;
+        line = line_end + 1;
+
+        if (ok) n_ok++;
+    }
+
+    ok = ok && n_ok == N_REQUESTS;
+    printf ("server_pipeline: %d of %d responses to %zu bytes of requests: %s\n",
+                              n_ok, N_REQUESTS, requests_size, ok ? "ok" : "FAILED");
+
+    free (requests);
+    free (responses);
+    unlink (SOCKET_PATH);
+
+    return ok ? 0 : 1;
+}
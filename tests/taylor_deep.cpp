@@ -0,0 +1,54 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "diff_calc.h"
+#include "tree.h"
+#include "tree_parsing.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Derivatives are DAGs which unfold to ~10^8 nodes at this order, so walks of the unfolded tree don't fit
+const int TAYLOR_ORDER = 12;
+
+/// Sanitized debug build takes well under a second
+const double TIME_LIMIT = 20;
+
+const char EXPR[] = "sin (x) * exp (x) / (x + 1)";
+
+// -------------------------------------------------------------------------------------------------
+
+static double seconds_now ()
+{
+    timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+/**
+ * @brief Taylor expansion feeds every derivative back into calc_diff, work must be bounded by
+ *        the number of distinct subexpressions
+ */
+int main ()
+{
+    tree::tree_t src = {tree::parse_dump (EXPR)};
+    assert (src.head_node != nullptr && "invalid expression");
+
+    double start = seconds_now ();
+
+    tree::tree_t series = tree::taylor_series (&src, TAYLOR_ORDER);
+
+    double elapsed = seconds_now () - start;
+
+    bool ok = series.head_node != nullptr && elapsed < TIME_LIMIT;
+    printf ("taylor_deep: order %d in %.2lf s: %s\n", TAYLOR_ORDER, elapsed, ok ? "ok" : "FAILED");
+
+    tree::dtor (&series);
+    tree::dtor (&src);
+
+    return ok ? 0 : 1;
+}
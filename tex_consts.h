@@ -94,8 +94,7 @@ const char APDX_FRAME_END[] = "\n";
 const char FORMULA_BEG[]    = "$";
 const char FORMULA_END[]    = "$\n\n";
 
-const int LETTERS_CNT = 33;
-const char *const LETTERS[LETTERS_CNT] = 
+const char *const LETTERS[] = 
 {
     "\\alpha",
     "\\beta",
@@ -131,6 +130,8 @@ const char *const LETTERS[LETTERS_CNT] =
 	"\\omega",
 };
 
+const int LETTERS_CNT = sizeof (LETTERS) / sizeof (LETTERS[0]);
+
 const char SPEECH_BEGIN[]   =
 "Дамы и господа, рад приветствовать на своем канале, где я пытаюсь просто и понятно объяснить основы матан+ализа "
 "на простейших примерах. "
@@ -5,6 +5,9 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <stdint.h>
+
+#include <new>
 
 #include "common.h"
 #include "file.h"
@@ -25,14 +28,100 @@ const char PREFIX[] = "digraph {\nnode [shape=record,style=\"filled\"]\nsplines=
 static const size_t DUMP_FILE_PATH_LEN = 20;
 static const char DUMP_FILE_PATH_FORMAT[] = "dump/%d.grv";
 
+const size_t INTERN_MIN_CAPACITY = 64;
+
+const size_t VISIT_MIN_CAPACITY = 64;
+
+/// Arena blocks are aligned by their size, so node's block (and owner arena) is found by mask
+static const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+/// Walks of trees not deeper than this don't allocate stack in heap
+const size_t DFS_INLINE_FRAMES = 64;
+
 // -------------------------------------------------------------------------------------------------
 // STATIC PROTOTYPES SECTION
 // -------------------------------------------------------------------------------------------------
 
-static bool dfs_recursion (tree::node_t *node, tree::walk_f pre_exec,  void *pre_param,
+/// Walk state of one node: which callbacks are already called and result of the subtree so far
+struct dfs_frame_t
+{
+    tree::node_t *node;
+    int           stage;
+    bool          cont;
+};
+
+static bool dfs_iterative (tree::node_t *node, tree::walk_f pre_exec,  void *pre_param,
                                                tree::walk_f in_exec,   void *in_param,
                                                tree::walk_f post_exec, void *post_param);
 
+/// Operation which children are being walked by post-order loop, left holds result of the left child
+struct post_frame_t
+{
+    const tree::node_t *node;
+    uintptr_t           left;
+    bool                right;  ///< Right child is being walked
+};
+
+/// Operation which children are being searched by invalidate, left is set if left child has the node
+struct invalidate_frame_t
+{
+    tree::node_t *node;
+    bool          left;
+    bool          right;    ///< Right child is being walked
+};
+
+struct post_stack_t
+{
+    post_frame_t *frames;
+    size_t        capacity;
+    size_t        size;
+
+    post_frame_t  inline_frames[DFS_INLINE_FRAMES];
+};
+
+static void post_stack_ctor (post_stack_t *stack);
+static void post_stack_dtor (post_stack_t *stack);
+static bool post_stack_push (post_stack_t *stack, const tree::node_t *node);
+static bool push_pair       (post_stack_t *stack, const tree::node_t *lhs, const tree::node_t *rhs);
+
+/// Result of the walk of a shared node (or of the pair of nodes for comparisons)
+struct visit_entry_t
+{
+    const tree::node_t *node;
+    const tree::node_t *pair;
+    uintptr_t           val;
+};
+
+/**
+ * @brief Walks remember shared nodes (ref_cnt > 1) there, so each node of a DAG is walked once.
+ *        Node with one parent is reached only through it, so it doesn't need an entry.
+ */
+struct visit_map_t
+{
+    visit_entry_t *entries;
+    size_t         capacity;
+    size_t         size;
+};
+
+static size_t visit_hash (const tree::node_t *node, const tree::node_t *pair);
+
+static void visit_map_ctor   (visit_map_t *map);
+static void visit_map_dtor   (visit_map_t *map);
+static bool visit_map_find   (const visit_map_t *map, const tree::node_t *node, const tree::node_t *pair,
+                                                                                uintptr_t *val);
+static void visit_map_insert (visit_map_t *map, const tree::node_t *node, const tree::node_t *pair,
+                                                                          uintptr_t val);
+
+static tree::node_t *intern_subtree (tree::intern_t *table, tree::node_t *node, visit_map_t *visited);
+static tree::node_t *intern_known   (const tree::intern_t *table, tree::node_t *node, const visit_map_t *visited);
+static tree::node_t *intern_node    (tree::intern_t *table, const tree::node_t *node,
+                                     tree::node_t *left, tree::node_t *right, visit_map_t *visited);
+static bool          is_interned    (const tree::intern_t *table, const tree::node_t *node);
+
+static tree::node_t *copy_node (const tree::node_t *node, tree::node_t *left, tree::node_t *right);
+
+static void clear_marks (tree::node_t *node);
+
 static bool node_codegen (tree::node_t *node, void *stream_void, bool cont);
 
 #ifndef RECURSIVE_LOAD
@@ -44,6 +133,53 @@ static bool eat_closing_bracket (tree::node_t *node, void *stream_void, bool con
 static const char *get_op_name (tree::op_t op);
 static void format_node (char *buf, const tree::node_t *node);
 
+static tree::node_t *alloc_node   ();
+static void          release_node (tree::node_t *node);
+
+static void orphan_arena      (tree::arena_t *arena);
+static void free_orphan_arena (tree::arena_t *arena);
+
+static uint64_t intern_hash  (const tree::node_t *node);
+static bool     intern_equal (const tree::node_t *lhs, const tree::node_t *rhs);
+static bool     intern_grow  (tree::intern_t *table);
+
+// -------------------------------------------------------------------------------------------------
+// ARENA SECTION
+// -------------------------------------------------------------------------------------------------
+
+struct tree::arena_block_t
+{
+    arena_block_t *next;
+    arena_t       *owner;
+};
+
+static const size_t ARENA_BLOCK_CAPACITY = (ARENA_BLOCK_SIZE - sizeof (tree::arena_block_t)) /
+                                                                    sizeof (tree::node_t);
+
+#define BLOCK_NODES(block) ((tree::node_t *) ((block) + 1))
+
+/**
+ * @brief Default arena of the thread, it is used when no arena is set by set_arena.
+ *        Nodes may outlive the thread, so the arena is on the heap until the last of them is released
+ */
+struct thread_arena_t
+{
+    tree::arena_t *arena = nullptr;
+
+    thread_arena_t () = default;
+    thread_arena_t (const thread_arena_t &) = delete;
+    thread_arena_t &operator= (const thread_arena_t &) = delete;
+
+    ~thread_arena_t ()
+    {
+        if (arena != nullptr) orphan_arena (arena);
+        arena = nullptr;
+    }
+};
+
+static thread_local thread_arena_t  THREAD_ARENA;
+static thread_local tree::arena_t  *CUR_ARENA    = nullptr;
+
 
 // -------------------------------------------------------------------------------------------------
 // PUBLIC SECTION
@@ -65,6 +201,84 @@ void tree::dtor (tree_t *tree)
 
 // -------------------------------------------------------------------------------------------------
 
+void tree::arena_ctor (arena_t *arena)
+{
+    assert (arena != nullptr && "invalid pointer");
+
+    arena->first_block = nullptr;
+    arena_reset (arena);
+
+    arena->owner.store (std::this_thread::get_id (), std::memory_order_relaxed);
+}
+
+void tree::arena_dtor (arena_t *arena)
+{
+    assert (arena != nullptr && "invalid pointer");
+
+    arena_block_t *block = arena->first_block;
+
+    while (block != nullptr)
+    {
+        arena_block_t *next = block->next;
+        free (block);
+        block = next;
+    }
+
+    arena->first_block = nullptr;
+    arena_reset (arena);
+}
+
+/**
+ * @brief Release all nodes of the arena at once, blocks are kept for future allocations
+ */
+void tree::arena_reset (arena_t *arena)
+{
+    assert (arena != nullptr && "invalid pointer");
+
+    arena->cur_block = arena->first_block;
+    arena->bump_indx = 0;
+    arena->free_list = nullptr;
+    arena->n_live    = 0;
+
+    arena->remote_free_list.store (nullptr, std::memory_order_relaxed);
+    arena->remote_live.store (0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Set arena for new nodes of the calling thread, the thread becomes its owner
+ *
+ * @param arena New arena or nullptr for thread default one
+ *
+ * @return Previous arena
+ */
+tree::arena_t *tree::set_arena (arena_t *arena)
+{
+    arena_t *prev = (CUR_ARENA != nullptr) ? CUR_ARENA : THREAD_ARENA.arena;
+    CUR_ARENA = arena;
+
+    if (arena != nullptr) arena->owner.store (std::this_thread::get_id (), std::memory_order_relaxed);
+
+    return prev;
+}
+
+/**
+ * @return Current arena of the calling thread or nullptr if there is no memory for the default one
+ */
+tree::arena_t *tree::get_arena ()
+{
+    if (CUR_ARENA != nullptr) return CUR_ARENA;
+
+    if (THREAD_ARENA.arena == nullptr)
+    {
+        THREAD_ARENA.arena = new (std::nothrow) arena_t;
+        if (THREAD_ARENA.arena != nullptr) arena_ctor (THREAD_ARENA.arena);
+    }
+
+    return THREAD_ARENA.arena;
+}
+
+// -------------------------------------------------------------------------------------------------
+
 bool tree::dfs_exec (tree_t *tree, walk_f pre_exec,  void *pre_param,
                                    walk_f in_exec,   void *in_param,
                                    walk_f post_exec, void *post_param)
@@ -72,7 +286,7 @@ bool tree::dfs_exec (tree_t *tree, walk_f pre_exec,  void *pre_param,
     assert (tree != nullptr && "invalid pointer");
     assert (tree->head_node != nullptr && "invalid tree");
 
-    return dfs_recursion (tree->head_node, pre_exec,  pre_param,
+    return dfs_iterative (tree->head_node, pre_exec,  pre_param,
                                            in_exec,   in_param,
                                            post_exec, post_param);
 }
@@ -83,19 +297,38 @@ bool tree::dfs_exec (node_t *node, walk_f pre_exec,  void *pre_param,
 {
     assert (node != nullptr && "invalid pointer");
 
-    return dfs_recursion (node, pre_exec,  pre_param,
+    return dfs_iterative (node, pre_exec,  pre_param,
                                 in_exec,   in_param,
                                 post_exec, post_param);
 }
 
 // -------------------------------------------------------------------------------------------------
 
+void *tree::grow_walk_stack (void *frames, const void *inline_frames, size_t *capacity, size_t frame_size)
+{
+    assert (frames   != nullptr && "invalid pointer");
+    assert (capacity != nullptr && "invalid pointer");
+
+    void *new_frames = malloc (2 * *capacity * frame_size);
+    if (new_frames == nullptr) return nullptr;
+
+    memcpy (new_frames, frames, *capacity * frame_size);
+    if (frames != inline_frames) free (frames);
+
+    *capacity *= 2;
+    return new_frames;
+}
+
+// -------------------------------------------------------------------------------------------------
+
 void tree::change_node (node_t *node, double val)
 {
     assert (node != nullptr && "invalid pointer");
 
     node->val  = val;
     node->type = node_type_t::VAL;
+
+    clear_marks (node);
 }
 
 void tree::change_node (node_t *node, op_t op)
@@ -104,6 +337,8 @@ void tree::change_node (node_t *node, op_t op)
 
     node->op   = op;
     node->type = node_type_t::OP;
+
+    clear_marks (node);
 }
 
 void tree::change_node (node_t *node, char var)
@@ -112,6 +347,8 @@ void tree::change_node (node_t *node, char var)
 
     node->var  = var;
     node->type = node_type_t::VAR;
+
+    clear_marks (node);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -121,53 +358,405 @@ void tree::move_node (node_t *dest, node_t *src)
     assert (dest != nullptr && "invalid pointer");
     assert (src  != nullptr && "invalid pointer");
 
-    memcpy (dest, src, sizeof (node_t));
+    int dest_ref_cnt = dest->ref_cnt;
+
+    if (src->ref_cnt > 1)
+    {
+        // Src is still used somewhere else, so dest only borrows its content
+        memcpy (dest, src, sizeof (node_t));
+        if (dest->left)  share_node (dest->left);
+        if (dest->right) share_node (dest->right);
+
+        src->ref_cnt--;
+    }
+    else
+    {
+        memcpy (dest, src, sizeof (node_t));
+        release_node (src);
+    }
 
-    free (src);
+    dest->ref_cnt = dest_ref_cnt;
 }
 
 // -------------------------------------------------------------------------------------------------
 
-#define NEW_NODE_IN_CASE(type, field)               \
-    case tree::node_type_t::type:                   \
-        node_copy = tree::new_node (node->field);   \
-        if (node_copy == nullptr) return nullptr;   \
-        break;
+/**
+ * @brief Post-order walk like subtree_hash: node is invalidated if the edited node is below it
+ *        through any of its children, shared nodes are walked once
+ */
+bool tree::invalidate (node_t *root, const node_t *node)
+{
+    assert (root != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    invalidate_frame_t  inline_frames[DFS_INLINE_FRAMES];
+    invalidate_frame_t *frames   = inline_frames;
+    size_t              capacity = DFS_INLINE_FRAMES;
+    size_t              size     = 0;
+
+    visit_map_t visited = {};
+    visit_map_ctor (&visited);
+
+    node_t *cur   = root;
+    bool    found = false;
+    bool    ok    = true;
+
+    while (true)
+    {
+        uintptr_t seen  = 0;
+        bool      known = false;
+
+        // Edited node is not entered, nothing below it can be the edited node again
+        while (cur != node && !(known = cur->ref_cnt > 1 && visit_map_find (&visited, cur, nullptr, &seen)) &&
+               (cur->left != nullptr || cur->right != nullptr))
+        {
+            if (size == capacity)
+            {
+                void *new_frames = grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (invalidate_frame_t *) new_frames;
+            }
+
+            frames[size++] = {cur, false, cur->left == nullptr};
+            cur = (cur->left != nullptr) ? cur->left : cur->right;
+        }
+
+        if (!ok) break;
+
+        if (known) {
+            found = seen != 0;
+        } else {
+            found = cur == node;
+            if (found) clear_marks (cur);
+            if (cur->ref_cnt > 1) visit_map_insert (&visited, cur, nullptr, found);
+        }
+
+        while (size > 0 && frames[size - 1].right)
+        {
+            invalidate_frame_t *frame = frames + --size;
+
+            found = frame->left || found;
+            if (found) clear_marks (frame->node);
+            if (frame->node->ref_cnt > 1) visit_map_insert (&visited, frame->node, nullptr, found);
+        }
+
+        if (size == 0) break;
+
+        frames[size - 1].left  = found;
+        frames[size - 1].right = true;
+
+        assert (frames[size - 1].node->right != nullptr && "node with left child only");
+        cur = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+    visit_map_dtor (&visited);
 
+    return ok && found;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order copy with explicit stack: goes down left links, copies node when copies
+ *        of its children are ready
+ */
 tree::node_t *tree::copy_subtree (tree::node_t *node)
 {
     assert (node != nullptr && "invalid pointer");
 
+    post_stack_t stack = {};
+    post_stack_ctor (&stack);
+
     tree::node_t *node_copy = nullptr;
+    const tree::node_t *cur = node;
 
-    switch (node->type)
+    while (true)
     {
-        NEW_NODE_IN_CASE(OP,  op);
-        NEW_NODE_IN_CASE(VAL, val);
-        NEW_NODE_IN_CASE(VAR, var);
-        
-        case tree::node_type_t::NOT_SET:
-            assert (0 && "Incomplete node");
-        default:
-            assert (0 && "Invalid node type");
+        bool ok = true;
+
+        while (ok && cur->left != nullptr)
+        {
+            ok  = post_stack_push (&stack, cur);
+            cur = cur->left;
+        }
+
+        if (!ok) break;
+
+        // Node without left child (unary operation) waits for its right one
+        if (cur->right != nullptr)
+        {
+            if (!post_stack_push (&stack, cur)) break;
+
+            stack.frames[stack.size - 1].right = true;
+
+            cur = cur->right;
+            continue;
+        }
+
+        node_copy = copy_node (cur, nullptr, nullptr);
+
+        while (node_copy != nullptr && stack.size > 0 && stack.frames[stack.size - 1].right)
+        {
+            post_frame_t *frame = stack.frames + --stack.size;
+
+            tree::node_t *left = (frame->node->left != nullptr) ? (tree::node_t *) frame->left : nullptr;
+            tree::node_t *res  = copy_node (frame->node, left, node_copy);
+
+            if (res == nullptr)
+            {
+                // Children copies aren't owned by anyone
+                del_node (left);
+                del_node (node_copy);
+            }
+
+            node_copy = res;
+        }
+
+        if (node_copy == nullptr || stack.size == 0) break;
+
+        post_frame_t *frame = stack.frames + stack.size - 1;
+        frame->left  = (uintptr_t) node_copy;
+        frame->right = true;
+
+        assert (frame->node->right != nullptr && "node with left child only");
+        cur = frame->node->right;
     }
 
-    if (node->right != nullptr) {
-        node_copy->right = copy_subtree (node->right);
-    } else {
-        node_copy->right = nullptr;
+    if (node_copy == nullptr)
+    {
+        // Left copies of operations whose right child was being copied
+        for (size_t i = 0; i < stack.size; ++i)
+        {
+            if (stack.frames[i].right && stack.frames[i].node->left != nullptr)
+            {
+                del_node ((tree::node_t *) stack.frames[i].left);
+            }
+        }
     }
 
-    if (node->left != nullptr) {
-        node_copy->left = copy_subtree (node->left);
-    } else {
-        node_copy->left = nullptr;
+    post_stack_dtor (&stack);
+    return node_copy;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Hash of subtree structure, equal subtrees (see subtree_equal) have equal hashes
+ *
+ * Hashes of shared nodes are remembered, so hash of a DAG costs its number of distinct nodes
+ */
+uint64_t tree::subtree_hash (const tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    post_stack_t stack = {};
+    post_stack_ctor (&stack);
+
+    visit_map_t visited = {};
+    visit_map_ctor (&visited);
+
+    uint64_t hash = 0;
+    bool     ok   = true;
+
+    while (ok)
+    {
+        bool known = false;
+
+        while (ok && !(known = node->ref_cnt > 1 && visit_map_find (&visited, node, nullptr, &hash)) &&
+               (node->left != nullptr || node->right != nullptr))
+        {
+            ok = post_stack_push (&stack, node);
+
+            if (node->left == nullptr) {
+                stack.frames[stack.size - 1].right = true;
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+
+        if (!ok) break;
+
+        if (!known)
+        {
+            tree::node_t key = *node;
+            key.left  = nullptr;
+            key.right = nullptr;
+
+            hash = intern_hash (&key);
+            if (node->ref_cnt > 1) visit_map_insert (&visited, node, nullptr, hash);
+        }
+
+        while (stack.size > 0 && stack.frames[stack.size - 1].right)
+        {
+            post_frame_t *frame = stack.frames + --stack.size;
+
+            tree::node_t key = *frame->node;
+            key.left  = (tree::node_t *) (frame->node->left  ? frame->left : 0);
+            key.right = (tree::node_t *) (frame->node->right ? hash        : 0);
+
+            hash = intern_hash (&key);
+            if (frame->node->ref_cnt > 1) visit_map_insert (&visited, frame->node, nullptr, hash);
+        }
+
+        if (stack.size == 0) break;
+
+        post_frame_t *frame = stack.frames + stack.size - 1;
+        frame->left  = hash;
+        frame->right = true;
+
+        assert (frame->node->right != nullptr && "node with left child only");
+        node = frame->node->right;
+    }
+
+    visit_map_dtor  (&visited);
+    post_stack_dtor (&stack);
+    return ok ? hash : 0;
+}
+
+/**
+ * @note Comparison of subtrees deeper than DFS_INLINE_FRAMES needs memory for the pairs
+ *       of subtrees to be compared, without it subtrees are reported as different
+ *
+ * Pairs with a shared node are compared once: if any pair differs, the whole result is false anyway
+ */
+bool tree::subtree_equal (const tree::node_t *lhs, const tree::node_t *rhs)
+{
+    post_stack_t pairs = {};
+    post_stack_ctor (&pairs);
+
+    visit_map_t visited = {};
+    visit_map_ctor (&visited);
+
+    // Pair of subtrees to compare is one frame: lhs in node, rhs in left
+    bool equal = push_pair (&pairs, lhs, rhs);
+
+    while (equal && pairs.size > 0)
+    {
+        post_frame_t *frame = pairs.frames + --pairs.size;
+
+        lhs = frame->node;
+        rhs = (const tree::node_t *) frame->left;
+
+        if (lhs == rhs) continue;
+
+        if (lhs == nullptr || rhs == nullptr)
+        {
+            equal = false;
+            break;
+        }
+
+        if (lhs->ref_cnt > 1 || rhs->ref_cnt > 1)
+        {
+            uintptr_t seen = 0;
+            if (visit_map_find (&visited, lhs, rhs, &seen)) continue;
+
+            visit_map_insert (&visited, lhs, rhs, true);
+        }
+
+        tree::node_t lhs_key = *lhs;
+        lhs_key.left  = rhs->left;
+        lhs_key.right = rhs->right;
+
+        equal = intern_equal (&lhs_key, rhs)                &&
+                push_pair (&pairs, lhs->right, rhs->right)  &&
+                push_pair (&pairs, lhs->left,  rhs->left);
     }
 
+    visit_map_dtor  (&visited);
+    post_stack_dtor (&pairs);
+    return equal;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+tree::node_t *tree::share_node (tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    node->ref_cnt++;
+    return node;
+}
+
+/**
+ * @brief Make node in the slot owned only by its parent (copy on write)
+ *
+ * Shared nodes are immutable, so before in-place edit of a shared node it is replaced by
+ * its shallow copy. Children stay shared.
+ *
+ * @return Node in the slot after unsharing or nullptr on OOM
+ */
+tree::node_t *tree::unshare_node (tree::node_t **slot)
+{
+    assert (slot  != nullptr && "invalid pointer");
+    assert (*slot != nullptr && "invalid pointer");
+
+    tree::node_t *node = *slot;
+    if (node->ref_cnt == 1) return node;
+
+    tree::node_t *node_copy = new_node ();
+    if (node_copy == nullptr) return nullptr;
+
+    memcpy (node_copy, node, sizeof (node_t));
+    node_copy->ref_cnt = 1;
+    if (node_copy->left)  share_node (node_copy->left);
+    if (node_copy->right) share_node (node_copy->right);
+
+    node->ref_cnt--;
+    *slot = node_copy;
+
     return node_copy;
 }
 
-#undef NEW_NODE_IN_CASE
+// -------------------------------------------------------------------------------------------------
+
+void tree::intern_ctor (intern_t *table)
+{
+    assert (table != nullptr && "invalid pointer");
+
+    *table = {};
+}
+
+void tree::intern_dtor (intern_t *table)
+{
+    assert (table != nullptr && "invalid pointer");
+
+    for (size_t i = 0; i < table->capacity; ++i)
+    {
+        del_node (table->nodes[i]);
+    }
+
+    free (table->nodes);
+    *table = {};
+}
+
+/**
+ * @brief Build interned (hash consed) copy of the subtree
+ *
+ * Shared nodes are interned once per call and nodes of the table are taken as is,
+ * so interning of a DAG (e.g. a derivative built from interned nodes) costs its new nodes only
+ *
+ * @return New reference to the canonical node or nullptr on OOM
+ */
+tree::node_t *tree::intern (intern_t *table, tree::node_t *node)
+{
+    assert (table != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
+
+    visit_map_t visited = {};
+    visit_map_ctor (&visited);
+
+    tree::node_t *canonical = intern_subtree (table, node, &visited);
+
+    visit_map_dtor (&visited);
+    return canonical;
+}
 
 // -------------------------------------------------------------------------------------------------
 
@@ -228,10 +817,14 @@ tree::tree_err_t tree::load (tree_t *tree, FILE *dump)
         return MMAP_FAILURE;
     }
 
-    tree->head_node = parse_dump (file);
+    parse_error_t error = {};
+    tree->head_node = parse_dump (file, &error);
 
     if (tree->head_node == nullptr) {
-        return INVALID_DUMP;
+        if (error.err == INVALID_DUMP)
+            LOG (log::ERR, "Invalid dump at offset %zu: expected %s", error.offset, error.expected);
+
+        return error.err;
     } else {
         return OK;
     }
@@ -352,12 +945,9 @@ int tree::graph_dump (node_t *node, const char *reason_fmt, va_list args)
 
 tree::node_t *tree::new_node ()
 {
-    tree::node_t *node = (tree::node_t *) calloc (sizeof (tree::node_t), 1);
+    tree::node_t *node = alloc_node ();
     if (node == nullptr) { return nullptr; }
 
-    const tree::node_t default_node = {};
-    memcpy (node, &default_node, sizeof (tree::node_t));
-
     node->type    = node_type_t::NOT_SET;   
     node->alpha_index  = 0; 
 
@@ -366,7 +956,7 @@ tree::node_t *tree::new_node ()
 
 tree::node_t *tree::new_node (double val)
 {
-    tree::node_t *node = (tree::node_t *) calloc (sizeof (tree::node_t), 1);
+    tree::node_t *node = alloc_node ();
     if (node == nullptr) { return nullptr; }
 
     node->type = node_type_t::VAL;
@@ -377,7 +967,7 @@ tree::node_t *tree::new_node (double val)
 
 tree::node_t *tree::new_node (op_t op)
 {
-    tree::node_t *node = (tree::node_t *) calloc (sizeof (tree::node_t), 1);
+    tree::node_t *node = alloc_node ();
     if (node == nullptr) { return nullptr; }
 
     node->type = node_type_t::OP;
@@ -388,7 +978,7 @@ tree::node_t *tree::new_node (op_t op)
 
 tree::node_t *tree::new_node (char var)
 {
-    tree::node_t *node = (tree::node_t *) calloc (sizeof (tree::node_t), 1);
+    tree::node_t *node = alloc_node ();
     if (node == nullptr) { return nullptr; }
 
     node->type = node_type_t::VAR;
@@ -399,6 +989,12 @@ tree::node_t *tree::new_node (char var)
 
 // -------------------------------------------------------------------------------------------------
 
+/**
+ * @brief Decrement reference counter, the last owner releases the subtree
+ *
+ * Released part is walked without stack: left child which is released too is rotated up,
+ * so the walk always goes down by right links only.
+ */
 void tree::del_node (node_t *start_node)
 {
     if (start_node == nullptr)
@@ -406,17 +1002,46 @@ void tree::del_node (node_t *start_node)
         return;
     }
 
-    tree::walk_f free_node_func = [](node_t* node, void *, bool){ free(node); return true; };
+    // Shared subtree is deleted by its last owner
+    if (--start_node->ref_cnt > 0)
+    {
+        return;
+    }
 
-    dfs_recursion (start_node, nullptr,        nullptr,
-                               nullptr,        nullptr,
-                               free_node_func, nullptr);
-}
+    tree::node_t *node = start_node;
+
+    while (node != nullptr)
+    {
+        tree::node_t *left = node->left;
+
+        if (left != nullptr)
+        {
+            node->left = nullptr;
+
+            // Left is shared, its other owners keep it
+            if (--left->ref_cnt > 0) continue;
+
+            // Node becomes right child of its released left child, link owns one reference
+            node->left    = left->right;
+            node->ref_cnt = 1;
+            left->right   = node;
+
+            node = left;
+            continue;
+        }
+
+        tree::node_t *right = node->right;
+        release_node (node);
+
+        node = (right != nullptr && --right->ref_cnt == 0) ? right : nullptr;
+    }
+}
 
 void tree::del_left  (node_t *node)
 {
     assert (node != nullptr && "invalid pointer");
 
+    clear_marks (node);
     del_node (node->left);
     node->left = nullptr;
 }
@@ -425,6 +1050,7 @@ void tree::del_right (node_t *node)
 {
     assert (node != nullptr && "invalid pointer");
 
+    clear_marks (node);
     del_node (node->right);
     node->right = nullptr;
 }
@@ -433,6 +1059,7 @@ void tree::del_childs (node_t *node)
 {
     assert (node != nullptr && "invalid pointer");
 
+    clear_marks (node);
     del_node (node->right);
     del_node (node->left);
     node->right = nullptr;
@@ -443,45 +1070,644 @@ void tree::del_childs (node_t *node)
 // PRIVATE SECTION
 // -------------------------------------------------------------------------------------------------
 
-static bool dfs_recursion (tree::node_t *node, tree::walk_f pre_exec,  void *pre_param,
+/**
+ * @brief dfs_exec with explicit stack: callbacks are called in the same order and
+ *        with the same cont arguments as by recursive walk
+ *
+ * @return false if some callback stopped the walk or there is no memory for the stack
+ */
+static bool dfs_iterative (tree::node_t *node, tree::walk_f pre_exec,  void *pre_param,
                                                tree::walk_f in_exec,   void *in_param,
                                                tree::walk_f post_exec, void *post_param)
 {
     assert (node != nullptr && "invalid pointer");
 
-    bool cont = true; 
+    enum { PRE = 0, IN, POST };
+
+    dfs_frame_t  inline_frames[DFS_INLINE_FRAMES];
+    dfs_frame_t *frames   = inline_frames;
+    size_t       capacity = DFS_INLINE_FRAMES;
+    size_t       size     = 0;
+
+    bool res = true;
+
+    frames[size++] = {node, PRE, true};
+
+    while (size > 0)
+    {
+        dfs_frame_t  *frame = frames + size - 1;
+        tree::node_t *child = nullptr;
+
+        switch (frame->stage)
+        {
+            case PRE:
+                if (pre_exec != nullptr)
+                {
+                    frame->cont = pre_exec (frame->node, pre_param, frame->cont) && frame->cont;
+                }
+
+                frame->stage = IN;
+                child        = frame->cont ? frame->node->left : nullptr;
+                break;
+
+            case IN:
+                if (in_exec != nullptr)
+                {
+                    frame->cont = in_exec (frame->node, in_param, frame->cont) && frame->cont;
+                }
+
+                frame->stage = POST;
+                child        = frame->cont ? frame->node->right : nullptr;
+                break;
+
+            case POST:
+            {
+                if (post_exec != nullptr)
+                {
+                    frame->cont = post_exec (frame->node, post_param, frame->cont) && frame->cont;
+                }
+
+                bool cont = frame->cont;
+
+                if (--size > 0) {
+                    frames[size - 1].cont = frames[size - 1].cont && cont;
+                } else {
+                    res = cont;
+                }
+                break;
+            }
+
+            default:
+                assert (0 && "invalid walk stage");
+        }
+
+        if (child == nullptr) continue;
+
+        if (size == capacity)
+        {
+            size_t new_capacity = 2 * capacity;
+
+            dfs_frame_t *new_frames = (dfs_frame_t *) malloc (new_capacity * sizeof (dfs_frame_t));
+            if (new_frames == nullptr)
+            {
+                LOG (log::ERR, "no memory for the walk stack, tree is %zu levels deep", size);
+
+                res = false;
+                break;
+            }
+
+            memcpy (new_frames, frames, size * sizeof (dfs_frame_t));
+            if (frames != inline_frames) free (frames);
+
+            frames   = new_frames;
+            capacity = new_capacity;
+        }
+
+        frames[size++] = {child, PRE, true};
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void post_stack_ctor (post_stack_t *stack)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    stack->frames   = stack->inline_frames;
+    stack->capacity = DFS_INLINE_FRAMES;
+    stack->size     = 0;
+}
+
+static void post_stack_dtor (post_stack_t *stack)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    if (stack->frames != stack->inline_frames) free (stack->frames);
+    stack->frames = nullptr;
+}
+
+static bool post_stack_push (post_stack_t *stack, const tree::node_t *node)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    if (stack->size == stack->capacity)
+    {
+        size_t new_capacity = 2 * stack->capacity;
+
+        post_frame_t *new_frames = (post_frame_t *) malloc (new_capacity * sizeof (post_frame_t));
+        if (new_frames == nullptr) return false;
+
+        memcpy (new_frames, stack->frames, stack->size * sizeof (post_frame_t));
+        if (stack->frames != stack->inline_frames) free (stack->frames);
+
+        stack->frames   = new_frames;
+        stack->capacity = new_capacity;
+    }
+
+    stack->frames[stack->size++] = {node, 0, false};
+    return true;
+}
+
+static bool push_pair (post_stack_t *stack, const tree::node_t *lhs, const tree::node_t *rhs)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    if (lhs == rhs) return true;
+
+    if (!post_stack_push (stack, lhs)) return false;
+
+    stack->frames[stack->size - 1].left = (uintptr_t) rhs;
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void visit_map_ctor (visit_map_t *map)
+{
+    assert (map != nullptr && "invalid pointer");
+
+    *map = {};
+}
+
+static void visit_map_dtor (visit_map_t *map)
+{
+    assert (map != nullptr && "invalid pointer");
+
+    free (map->entries);
+    *map = {};
+}
+
+static size_t visit_hash (const tree::node_t *node, const tree::node_t *pair)
+{
+    uint64_t hash = ((uintptr_t) node ^ ((uintptr_t) pair << 1)) * 0x9E3779B97F4A7C15ull;
+
+    return hash ^ (hash >> 32);
+}
+
+static bool visit_map_find (const visit_map_t *map, const tree::node_t *node, const tree::node_t *pair,
+                                                                                uintptr_t *val)
+{
+    assert (map != nullptr && "invalid pointer");
+    assert (val != nullptr && "invalid pointer");
+
+    if (map->capacity == 0) return false;
+
+    size_t mask = map->capacity - 1;
+
+    for (size_t indx = visit_hash (node, pair) & mask; map->entries[indx].node != nullptr; indx = (indx + 1) & mask)
+    {
+        if (map->entries[indx].node == node && map->entries[indx].pair == pair)
+        {
+            *val = map->entries[indx].val;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Map is only a shortcut, so on OOM node is just not remembered
+static void visit_map_insert (visit_map_t *map, const tree::node_t *node, const tree::node_t *pair,
+                                                                          uintptr_t val)
+{
+    assert (map  != nullptr && "invalid pointer");
+    assert (node != nullptr && "invalid pointer");
+
+    if (2 * (map->size + 1) > map->capacity)
+    {
+        size_t new_capacity = (map->capacity) ? 2 * map->capacity : VISIT_MIN_CAPACITY;
+
+        visit_entry_t *new_entries = (visit_entry_t *) calloc (new_capacity, sizeof (visit_entry_t));
+        if (new_entries == nullptr) return;
+
+        for (size_t i = 0; i < map->capacity; ++i)
+        {
+            visit_entry_t *entry = map->entries + i;
+            if (entry->node == nullptr) continue;
+
+            size_t indx = visit_hash (entry->node, entry->pair) & (new_capacity - 1);
+            while (new_entries[indx].node != nullptr) indx = (indx + 1) & (new_capacity - 1);
+
+            new_entries[indx] = *entry;
+        }
+
+        free (map->entries);
+        map->entries  = new_entries;
+        map->capacity = new_capacity;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t indx = visit_hash (node, pair) & mask;
+
+    while (map->entries[indx].node != nullptr) indx = (indx + 1) & mask;
+
+    map->entries[indx] = {node, pair, val};
+    map->size++;
+}
+
+/// Marks are valid only for the subtree they have been computed for
+static void clear_marks (tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    node->canonical = false;
+    node->weight    = 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+#define NEW_NODE_IN_CASE(type, field)               \
+    case tree::node_type_t::type:                   \
+        node_copy = tree::new_node (node->field);   \
+        if (node_copy == nullptr) return nullptr;   \
+        break;
+
+/// Copy of one node linked with copies of its children
+static tree::node_t *copy_node (const tree::node_t *node, tree::node_t *left, tree::node_t *right)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    tree::node_t *node_copy = nullptr;
+
+    switch (node->type)
+    {
+        NEW_NODE_IN_CASE(OP,  op);
+        NEW_NODE_IN_CASE(VAL, val);
+        NEW_NODE_IN_CASE(VAR, var);
+
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "Incomplete node");
+        default:
+            assert (0 && "Invalid node type");
+    }
+
+    node_copy->left  = left;
+    node_copy->right = right;
+
+    return node_copy;
+}
+
+#undef NEW_NODE_IN_CASE
+
+// -------------------------------------------------------------------------------------------------
+
+static tree::node_t *alloc_node ()
+{
+    tree::arena_t *arena = tree::get_arena ();
+    if (arena == nullptr) return nullptr;
+
+    if (arena->free_list == nullptr && arena->remote_free_list.load (std::memory_order_relaxed) != nullptr)
+        arena->free_list = arena->remote_free_list.exchange (nullptr, std::memory_order_acquire);
+
+    tree::node_t *node = arena->free_list;
+
+    if (node != nullptr)
+    {
+        arena->free_list = node->left;
+    }
+    else
+    {
+        if (arena->cur_block == nullptr || arena->bump_indx == ARENA_BLOCK_CAPACITY)
+        {
+            tree::arena_block_t *next_block = (arena->cur_block) ? arena->cur_block->next : nullptr;
+
+            if (next_block == nullptr)
+            {
+                next_block = (tree::arena_block_t *) aligned_alloc (ARENA_BLOCK_SIZE, ARENA_BLOCK_SIZE);
+                if (next_block == nullptr) { return nullptr; }
+
+                next_block->next  = nullptr;
+                next_block->owner = arena;
+
+                if (arena->cur_block != nullptr) arena->cur_block->next = next_block;
+                else                             arena->first_block     = next_block;
+            }
+
+            arena->cur_block = next_block;
+            arena->bump_indx = 0;
+        }
+
+        node = BLOCK_NODES (arena->cur_block) + arena->bump_indx++;
+    }
+
+    const tree::node_t default_node = {};
+    memcpy (node, &default_node, sizeof (tree::node_t));
+
+    arena->n_live++;
+    return node;
+}
+
+static void release_node (tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    tree::arena_block_t *block = (tree::arena_block_t *) ((uintptr_t) node & ~(ARENA_BLOCK_SIZE - 1));
+    tree::arena_t       *arena = block->owner;
+
+    if (arena->owner.load (std::memory_order_relaxed) == std::this_thread::get_id ())
+    {
+        node->left       = arena->free_list;
+        arena->free_list = node;
+        arena->n_live--;
+        return;
+    }
+
+    node->left = arena->remote_free_list.load (std::memory_order_relaxed);
+    while (!arena->remote_free_list.compare_exchange_weak (node->left, node, std::memory_order_release,
+                                                                             std::memory_order_relaxed))
+        ;
+
+    // Count gets positive only when the owner has exited, then the last node frees the arena
+    if (arena->remote_live.fetch_sub (1, std::memory_order_acq_rel) == 1) free_orphan_arena (arena);
+}
+
+/**
+ * @brief Owner thread exits: nodes still alive keep the arena, the last one released frees it
+ */
+static void orphan_arena (tree::arena_t *arena)
+{
+    assert (arena != nullptr && "invalid pointer");
+
+    arena->owner.store (std::thread::id {}, std::memory_order_relaxed);
+
+    int64_t n_live = (int64_t) arena->n_live;
+    if (arena->remote_live.fetch_add (n_live, std::memory_order_acq_rel) + n_live == 0)
+        free_orphan_arena (arena);
+}
+
+static void free_orphan_arena (tree::arena_t *arena)
+{
+    assert (arena != nullptr && "invalid pointer");
+
+    tree::arena_dtor (arena);
+    delete arena;
+}
+
+#undef BLOCK_NODES
+
+// -------------------------------------------------------------------------------------------------
+
+static uint64_t intern_hash (const tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    uint64_t payload = 0;
+
+    switch (node->type)
+    {
+        case tree::node_type_t::OP:  payload = (uint64_t) node->op;                 break;
+        case tree::node_type_t::VAL: memcpy (&payload, &node->val, sizeof (double)); break;
+        case tree::node_type_t::VAR: payload = (uint64_t) (unsigned char) node->var; break;
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "Invalid node type");
+    }
+
+    uint64_t hash = 0xcbf29ce484222325;
+    const uint64_t prime = 0x100000001b3;
+
+    hash = (hash ^ (uint64_t) node->type)  * prime;
+    hash = (hash ^ payload)                * prime;
+    hash = (hash ^ (uintptr_t) node->left)  * prime;
+    hash = (hash ^ (uintptr_t) node->right) * prime;
+
+    return hash ^ (hash >> 29);
+}
+
+static bool intern_equal (const tree::node_t *lhs, const tree::node_t *rhs)
+{
+    assert (lhs != nullptr && "invalid pointer");
+    assert (rhs != nullptr && "invalid pointer");
+
+    if (lhs->type != rhs->type || lhs->left != rhs->left || lhs->right != rhs->right)
+    {
+        return false;
+    }
+
+    switch (lhs->type)
+    {
+        case tree::node_type_t::OP:  return lhs->op  == rhs->op;
+        case tree::node_type_t::VAL: return memcmp (&lhs->val, &rhs->val, sizeof (double)) == 0;
+        case tree::node_type_t::VAR: return lhs->var == rhs->var;
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            assert (0 && "Invalid node type");
+            return false;
+    }
+}
+
+/**
+ * @brief Post-order walk like copy_subtree: canonical node is made when its children are canonical
+ *
+ * @return New reference to the canonical node or nullptr on OOM
+ */
+static tree::node_t *intern_subtree (tree::intern_t *table, tree::node_t *node, visit_map_t *visited)
+{
+    assert (table   != nullptr && "invalid pointer");
+    assert (node    != nullptr && "invalid pointer");
+    assert (visited != nullptr && "invalid pointer");
+
+    post_stack_t stack = {};
+    post_stack_ctor (&stack);
+
+    tree::node_t *canonical = nullptr;
+
+    while (true)
+    {
+        bool ok = true;
+
+        while (ok && (canonical = intern_known (table, node, visited)) == nullptr &&
+               (node->left != nullptr || node->right != nullptr))
+        {
+            ok = post_stack_push (&stack, node);
+
+            if (node->left == nullptr) {
+                stack.frames[stack.size - 1].right = true;
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+
+        if (!ok) break;
+
+        if (canonical == nullptr) canonical = intern_node (table, node, nullptr, nullptr, visited);
+
+        while (canonical != nullptr && stack.size > 0 && stack.frames[stack.size - 1].right)
+        {
+            post_frame_t *frame = stack.frames + --stack.size;
+
+            tree::node_t *left = (frame->node->left != nullptr) ? (tree::node_t *) frame->left : nullptr;
+            canonical = intern_node (table, frame->node, left, canonical, visited);
+        }
+
+        if (canonical == nullptr || stack.size == 0) break;
+
+        post_frame_t *frame = stack.frames + stack.size - 1;
+        frame->left  = (uintptr_t) canonical;
+        frame->right = true;
+
+        assert (frame->node->right != nullptr && "node with left child only");
+        node = frame->node->right;
+    }
+
+    if (canonical == nullptr)
+    {
+        // Canonical left children of operations whose right child was being interned
+        for (size_t i = 0; i < stack.size; ++i)
+        {
+            if (stack.frames[i].right && stack.frames[i].node->left != nullptr)
+            {
+                tree::del_node ((tree::node_t *) stack.frames[i].left);
+            }
+        }
+    }
+
+    post_stack_dtor (&stack);
+    return canonical;
+}
+
+/**
+ * @return New reference to the canonical node of already canonical or walked node, nullptr otherwise
+ */
+static tree::node_t *intern_known (const tree::intern_t *table, tree::node_t *node, const visit_map_t *visited)
+{
+    assert (table   != nullptr && "invalid pointer");
+    assert (node    != nullptr && "invalid pointer");
+    assert (visited != nullptr && "invalid pointer");
+
+    if (is_interned (table, node)) return tree::share_node (node);
 
-    if (pre_exec != nullptr)
+    uintptr_t known = 0;
+    if (node->ref_cnt > 1 && visit_map_find (visited, node, nullptr, &known))
     {
-        cont = pre_exec (node, pre_param, cont) && cont;
+        return tree::share_node ((tree::node_t *) known);
     }
 
-    if (cont && node->left != nullptr)
+    return nullptr;
+}
+
+/**
+ * @brief Find or add canonical node with payload of node and given canonical children
+ *
+ * @param left, right  References to canonical children, they are taken by the function
+ *
+ * @return New reference to the canonical node or nullptr on OOM
+ */
+static tree::node_t *intern_node (tree::intern_t *table, const tree::node_t *node,
+                                  tree::node_t *left, tree::node_t *right, visit_map_t *visited)
+{
+    assert (table   != nullptr && "invalid pointer");
+    assert (node    != nullptr && "invalid pointer");
+    assert (visited != nullptr && "invalid pointer");
+
+    tree::node_t key = *node;
+    key.left  = left;
+    key.right = right;
+
+    if (2 * (table->size + 1) > table->capacity && !intern_grow (table))
     {
-        cont = cont && dfs_recursion (node->left, pre_exec,  pre_param,
-                                                  in_exec,   in_param,
-                                                  post_exec, post_param);
+        tree::del_node (key.left);
+        tree::del_node (key.right);
+        return nullptr;
     }
 
-    if (in_exec != nullptr)
+    size_t mask = table->capacity - 1;
+    size_t indx = intern_hash (&key) & mask;
+
+    tree::node_t *canonical = nullptr;
+
+    while (table->nodes[indx] != nullptr)
     {
-        cont = in_exec (node, in_param, cont) && cont;
+        if (intern_equal (table->nodes[indx], &key))
+        {
+            // Children already hold references, that are not needed anymore
+            tree::del_node (key.left);
+            tree::del_node (key.right);
+
+            canonical = tree::share_node (table->nodes[indx]);
+            break;
+        }
+
+        indx = (indx + 1) & mask;
+    }
+
+    if (canonical == nullptr)
+    {
+        canonical = tree::new_node ();
+        if (canonical == nullptr)
+        {
+            tree::del_node (key.left);
+            tree::del_node (key.right);
+            return nullptr;
+        }
+
+        *canonical = key;
+        canonical->ref_cnt     = 1;
+        canonical->alpha_index = 0;
 
+        table->nodes[indx] = tree::share_node (canonical);
+        table->size++;
     }
 
-    if (cont && node->right != nullptr)
+    // Table holds the canonical node, so the pointer stays valid till the end of the walk
+    if (node->ref_cnt > 1) visit_map_insert (visited, node, nullptr, (uintptr_t) canonical);
+
+    return canonical;
+}
+
+/// Canonical node has canonical children, so it is found in the table by its own key
+static bool is_interned (const tree::intern_t *table, const tree::node_t *node)
+{
+    assert (table != nullptr && "invalid pointer");
+    assert (node  != nullptr && "invalid pointer");
+
+    if (table->capacity == 0) return false;
+
+    size_t mask = table->capacity - 1;
+
+    for (size_t indx = intern_hash (node) & mask; table->nodes[indx] != nullptr; indx = (indx + 1) & mask)
     {
-        cont = cont && dfs_recursion (node->right, pre_exec,  pre_param,
-                                    in_exec,   in_param,
-                                    post_exec, post_param);
+        if (table->nodes[indx] == node) return true;
     }
 
-    if (post_exec != nullptr)
+    return false;
+}
+
+static bool intern_grow (tree::intern_t *table)
+{
+    assert (table != nullptr && "invalid pointer");
+
+    size_t new_capacity = (table->capacity) ? 2 * table->capacity : INTERN_MIN_CAPACITY;
+
+    tree::node_t **new_nodes = (tree::node_t **) calloc (new_capacity, sizeof (tree::node_t *));
+    if (new_nodes == nullptr) return false;
+
+    for (size_t i = 0; i < table->capacity; ++i)
     {
-        cont = post_exec (node, post_param, cont) && cont;
+        tree::node_t *node = table->nodes[i];
+        if (node == nullptr) continue;
+
+        size_t indx = intern_hash (node) & (new_capacity - 1);
+        while (new_nodes[indx] != nullptr)
+        {
+            indx = (indx + 1) & (new_capacity - 1);
+        }
+
+        new_nodes[indx] = node;
     }
 
-    return cont;
+    free (table->nodes);
+    table->nodes    = new_nodes;
+    table->capacity = new_capacity;
+
+    return true;
 }
 
 // -------------------------------------------------------------------------------------------------
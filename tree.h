@@ -2,9 +2,13 @@
 #define TREE_H
 
 #include <cstdarg>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <atomic>
+#include <thread>
+
 namespace tree
 {
     enum class node_type_t
@@ -31,6 +35,8 @@ namespace tree
     struct node_t
     {
         node_type_t type = node_type_t::NOT_SET;
+        int ref_cnt      = 1;  ///< Number of parents (and tables) which hold the node
+
         union
         {
             double val;
@@ -38,7 +44,11 @@ namespace tree
             char var;
         };
 
-        int alpha_index = 0;
+        int  alpha_index = 0;
+        bool canonical   = false;   ///< Subtree is simplified (see rewrite), in-place edit clears it,
+                                    ///< invalidate clears it on the ancestors
+        uint16_t weight  = 0;       ///< Rendered width of unsplit subtree (see tree_output), 0 if unknown,
+                                    ///< cleared like canonical
 
         node_t *left    = nullptr;
         node_t *right   = nullptr;
@@ -49,12 +59,51 @@ namespace tree
         node_t *head_node;
     };
 
+    /**
+     * @brief Hash consing table: structurally equal subtrees are represented by one shared node
+     *
+     * Key of a node is (type, op/val/var, child pointers), so interned subtree is a DAG
+     * in which copy is just a reference. Table holds its own reference to every node.
+     */
+    struct intern_t
+    {
+        node_t **nodes    = nullptr;
+        size_t   capacity = 0;
+        size_t   size     = 0;
+    };
+
+    struct arena_block_t;
+
+    /**
+     * @brief Node pool: bump allocation from big blocks + free list of released nodes.
+     *
+     * Every new_node call takes memory from the current arena of the calling thread
+     * (see set_arena), del_node/move_node return nodes to the arena which owns them.
+     * Only the owner thread allocates from an arena. Nodes may be released by any thread:
+     * others push them to the lock-free remote list, owner takes it when its free list is empty.
+     */
+    struct arena_t
+    {
+        arena_block_t *first_block = nullptr;
+        arena_block_t *cur_block   = nullptr;
+        size_t         bump_indx   = 0;
+
+        node_t *free_list = nullptr;
+        size_t  n_live    = 0;      ///< Allocated minus released by the owner thread
+
+        std::atomic<std::thread::id> owner            = {};
+        std::atomic<node_t *>        remote_free_list = nullptr;
+        std::atomic<int64_t>         remote_live      = 0;  ///< Minus nodes released by other threads
+    };
+
     enum tree_err_t
     {
         OK = 0,
         OOM,
         INVALID_DUMP,
-        MMAP_FAILURE
+        MMAP_FAILURE,
+        COMPILE_FAILURE,
+        IO_FAILURE
     };
 
     typedef bool (*walk_f)(node_t *node, void *param, bool cont);
@@ -62,6 +111,13 @@ namespace tree
     void ctor (tree_t *tree);
     void dtor (tree_t *tree);
 
+    void arena_ctor  (arena_t *arena);
+    void arena_dtor  (arena_t *arena);
+    void arena_reset (arena_t *arena);
+
+    arena_t *set_arena (arena_t *arena);
+    arena_t *get_arena ();
+
     bool dfs_exec (tree_t *tree, walk_f pre_exec,  void *pre_param,
                                  walk_f in_exec,   void *in_param,
                                  walk_f post_exec, void *post_param);
@@ -69,14 +125,43 @@ namespace tree
                                  walk_f in_exec,   void *in_param,
                                  walk_f post_exec, void *post_param);
 
+    /**
+     * @brief      Double capacity of explicit walk stack which starts in a local inline array
+     *
+     * @return     New frames or nullptr on OOM, then old frames are left as they are
+     */
+    void *grow_walk_stack (void *frames, const void *inline_frames, size_t *capacity, size_t frame_size);
+
     void change_node (node_t *node, double val);
     void change_node (node_t *node, op_t   op);
     void change_node (node_t *node, char var);
 
     void move_node (node_t *dest, node_t *src);
 
+    /**
+     * @brief      Clear marks (canonical, weight) of node and of all its ancestors in the subtree
+     *
+     * Edits (change_node, move_node, del_left...) clear marks of the edited node only, nodes don't
+     * know their parents, so after a local edit of a subtree with marks this must be called
+     * for the edited node. Every path to node is invalidated, so other parents of a shared node
+     * lose their marks too.
+     *
+     * @return     false if node is not in the subtree or there is no memory for the walk
+     */
+    bool invalidate (node_t *root, const node_t *node);
+
     tree::node_t *copy_subtree (tree::node_t *node);
 
+    uint64_t subtree_hash  (const tree::node_t *node);
+    bool     subtree_equal (const tree::node_t *lhs, const tree::node_t *rhs);
+
+    tree::node_t *share_node   (tree::node_t *node);
+    tree::node_t *unshare_node (tree::node_t **slot);
+
+    void intern_ctor (intern_t *table);
+    void intern_dtor (intern_t *table);
+    tree::node_t *intern (intern_t *table, tree::node_t *node);
+
     void store (tree_t *tree, FILE *stream);
     tree::tree_err_t load (tree_t *tree, FILE *dump);
 
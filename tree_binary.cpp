@@ -0,0 +1,436 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "flat_tree.h"
+#include "lib/log.h"
+#include "tree.h"
+#include "tree_binary.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const char BINARY_MAGIC[4] = {'M', 'G', 'T', 'B'};
+
+const size_t BINARY_HEADER_SIZE = 32;
+
+/// Tag byte, 8 bytes of value or two 5-byte LEB128 distances
+const size_t BINARY_MAX_RECORD = 11;
+
+const uint8_t TAG_TYPE_MASK = 0x03;
+const uint8_t TAG_HAS_LEFT  = 0x04;
+const uint8_t TAG_HAS_RIGHT = 0x08;
+const int     TAG_OP_SHIFT  = 4;
+
+const uint64_t FNV_OFFSET = 0xCBF29CE484222325ull;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Bounded reader of the payload, any read past the end sets failed
+struct reader_t
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool           failed;
+};
+
+static uint8_t *put_u32  (uint8_t *pos, uint32_t val);
+static uint8_t *put_u64  (uint8_t *pos, uint64_t val);
+static uint8_t *put_leb  (uint8_t *pos, uint32_t val);
+static uint32_t get_u32  (const uint8_t *pos);
+static uint64_t get_u64  (const uint8_t *pos);
+
+static uint8_t  read_u8  (reader_t *reader);
+static uint64_t read_u64 (reader_t *reader);
+static uint32_t read_ref (reader_t *reader, uint32_t indx);
+
+static uint64_t fnv1a (const uint8_t *data, size_t size);
+
+static bool flat_alloc (tree::flat_tree_t *flat, size_t size);
+static bool decode     (tree::flat_tree_t *flat, reader_t *reader, size_t n_nodes);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::store_binary (const tree_t *tree, FILE *stream)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    flat_tree_t flat = {};
+
+    tree_err_t res = flatten (tree, &flat);
+    if (res == OK) res = store_binary (&flat, stream);
+
+    flat_dtor (&flat);
+    return res;
+}
+
+/**
+ * @brief Encode whole dump into one buffer and write it at once
+ */
+tree::tree_err_t tree::store_binary (const flat_tree_t *flat, FILE *stream)
+{
+    assert (flat   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    uint8_t *buf = (uint8_t *) malloc (BINARY_HEADER_SIZE + flat->size * BINARY_MAX_RECORD);
+    if (buf == nullptr) return OOM;
+
+    uint8_t *pos = buf + BINARY_HEADER_SIZE;
+
+    for (size_t i = 0; i < flat->size; ++i)
+    {
+        uint8_t tag = flat->types[i];
+        if (flat->lefts[i]  != FLAT_NONE) tag |= TAG_HAS_LEFT;
+        if (flat->rights[i] != FLAT_NONE) tag |= TAG_HAS_RIGHT;
+
+        switch ((node_type_t) flat->types[i])
+        {
+            case node_type_t::VAL:
+            {
+                uint64_t bits = 0;
+                memcpy (&bits, flat->vals + i, sizeof (bits));
+
+                *pos++ = tag;
+                pos    = put_u64 (pos, bits);
+                break;
+            }
+
+            case node_type_t::VAR:
+                *pos++ = tag;
+                *pos++ = flat->ops[i];
+                break;
+
+            case node_type_t::OP:
+                *pos++ = (uint8_t) (tag | flat->ops[i] << TAG_OP_SHIFT);
+                break;
+
+            case node_type_t::NOT_SET:
+            default:
+                assert (0 && "invalid node type");
+        }
+
+        // Post-order: children precede the node, distance back to them is small
+        if (flat->lefts[i]  != FLAT_NONE) pos = put_leb (pos, (uint32_t) i - flat->lefts[i]);
+        if (flat->rights[i] != FLAT_NONE) pos = put_leb (pos, (uint32_t) i - flat->rights[i]);
+    }
+
+    size_t payload_size = (size_t) (pos - buf) - BINARY_HEADER_SIZE;
+
+    uint8_t *header = buf;
+    memcpy (header, BINARY_MAGIC, sizeof (BINARY_MAGIC));
+    header = put_u32 (header + sizeof (BINARY_MAGIC), BINARY_VERSION);
+    header = put_u64 (header, flat->size);
+    header = put_u64 (header, payload_size);
+    header = put_u64 (header, fnv1a (buf + BINARY_HEADER_SIZE, payload_size));
+
+    size_t dump_size = BINARY_HEADER_SIZE + payload_size;
+    bool   written   = fwrite (buf, 1, dump_size, stream) == dump_size;
+
+    free (buf);
+
+    if (!written)
+    {
+        LOG (log::ERR, "Failed to write binary dump");
+        return IO_FAILURE;
+    }
+
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::load_binary (tree_t *tree, FILE *stream)
+{
+    assert (tree != nullptr && "invalid pointer");
+    assert (tree->head_node == nullptr && "non empty tree");
+
+    flat_tree_t flat = {};
+
+    tree_err_t res = load_binary (&flat, stream);
+    if (res == OK) res = unflatten (&flat, tree);
+
+    flat_dtor (&flat);
+    return res;
+}
+
+tree::tree_err_t tree::load_binary (flat_tree_t *flat, FILE *stream)
+{
+    assert (flat   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    *flat = {};
+
+    ssize_t dump_size_tmp = file_size (stream);
+    if (dump_size_tmp < (ssize_t) BINARY_HEADER_SIZE)
+    {
+        LOG (log::ERR, "Binary dump is too short");
+        return INVALID_DUMP;
+    }
+
+    size_t dump_size = (size_t) dump_size_tmp;
+
+    uint8_t *buf = (uint8_t *) malloc (dump_size);
+    if (buf == nullptr) return OOM;
+
+    if (fread (buf, 1, dump_size, stream) != dump_size)
+    {
+        LOG (log::ERR, "Failed to read binary dump");
+
+        free (buf);
+        return IO_FAILURE;
+    }
+
+    uint32_t version      = get_u32 (buf + 4);
+    uint64_t n_nodes      = get_u64 (buf + 8);
+    uint64_t payload_size = get_u64 (buf + 16);
+    uint64_t checksum     = get_u64 (buf + 24);
+
+    const uint8_t *payload = buf + BINARY_HEADER_SIZE;
+
+    tree_err_t res = OK;
+
+    if (memcmp (buf, BINARY_MAGIC, sizeof (BINARY_MAGIC)) != 0 || version != BINARY_VERSION)
+    {
+        LOG (log::ERR, "Not a binary dump or unsupported version %u", version);
+        res = INVALID_DUMP;
+    }
+    // Every record is at least one byte, so broken count can't make huge allocation
+    else if (payload_size != dump_size - BINARY_HEADER_SIZE || n_nodes == 0 ||
+             n_nodes > payload_size || n_nodes >= FLAT_NONE)
+    {
+        LOG (log::ERR, "Invalid binary dump sizes");
+        res = INVALID_DUMP;
+    }
+    else if (fnv1a (payload, payload_size) != checksum)
+    {
+        LOG (log::ERR, "Binary dump checksum mismatch");
+        res = INVALID_DUMP;
+    }
+    else if (!flat_alloc (flat, n_nodes))
+    {
+        res = OOM;
+    }
+    else
+    {
+        reader_t reader = {payload, payload + payload_size, false};
+
+        if (!decode (flat, &reader, n_nodes))
+        {
+            LOG (log::ERR, "Invalid binary dump record");
+
+            flat_dtor (flat);
+            res = INVALID_DUMP;
+        }
+    }
+
+    free (buf);
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static uint8_t *put_u32 (uint8_t *pos, uint32_t val)
+{
+    for (int i = 0; i < 4; ++i) *pos++ = (uint8_t) (val >> (8 * i));
+    return pos;
+}
+
+static uint8_t *put_u64 (uint8_t *pos, uint64_t val)
+{
+    for (int i = 0; i < 8; ++i) *pos++ = (uint8_t) (val >> (8 * i));
+    return pos;
+}
+
+static uint8_t *put_leb (uint8_t *pos, uint32_t val)
+{
+    while (val >= 0x80)
+    {
+        *pos++ = (uint8_t) (val | 0x80);
+        val >>= 7;
+    }
+
+    *pos++ = (uint8_t) val;
+    return pos;
+}
+
+static uint32_t get_u32 (const uint8_t *pos)
+{
+    uint32_t val = 0;
+    for (int i = 0; i < 4; ++i) val |= (uint32_t) pos[i] << (8 * i);
+    return val;
+}
+
+static uint64_t get_u64 (const uint8_t *pos)
+{
+    uint64_t val = 0;
+    for (int i = 0; i < 8; ++i) val |= (uint64_t) pos[i] << (8 * i);
+    return val;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static uint8_t read_u8 (reader_t *reader)
+{
+    assert (reader != nullptr && "invalid pointer");
+
+    if (reader->pos == reader->end)
+    {
+        reader->failed = true;
+        return 0;
+    }
+
+    return *reader->pos++;
+}
+
+static uint64_t read_u64 (reader_t *reader)
+{
+    assert (reader != nullptr && "invalid pointer");
+
+    if (reader->end - reader->pos < 8)
+    {
+        reader->failed = true;
+        return 0;
+    }
+
+    uint64_t val = get_u64 (reader->pos);
+    reader->pos += 8;
+
+    return val;
+}
+
+/**
+ * @brief Read LEB128 distance and turn it into index of the child
+ *
+ * @return Child index, FLAT_NONE with reader->failed if the distance doesn't point back into the tree
+ */
+static uint32_t read_ref (reader_t *reader, uint32_t indx)
+{
+    assert (reader != nullptr && "invalid pointer");
+
+    uint64_t dist = 0;
+
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        uint8_t byte = read_u8 (reader);
+        dist |= (uint64_t) (byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+        {
+            if (dist == 0 || dist > indx) break;
+            return indx - (uint32_t) dist;
+        }
+    }
+
+    reader->failed = true;
+    return tree::FLAT_NONE;
+}
+
+static uint64_t fnv1a (const uint8_t *data, size_t size)
+{
+    assert (data != nullptr && "invalid pointer");
+
+    uint64_t hash = FNV_OFFSET;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool flat_alloc (tree::flat_tree_t *flat, size_t size)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    flat->types  = (uint8_t  *) malloc (size * sizeof (uint8_t));
+    flat->ops    = (uint8_t  *) malloc (size * sizeof (uint8_t));
+    flat->vals   = (double   *) malloc (size * sizeof (double));
+    flat->lefts  = (uint32_t *) malloc (size * sizeof (uint32_t));
+    flat->rights = (uint32_t *) malloc (size * sizeof (uint32_t));
+
+    if (flat->types == nullptr || flat->ops    == nullptr || flat->vals == nullptr ||
+        flat->lefts == nullptr || flat->rights == nullptr)
+    {
+        tree::flat_dtor (flat);
+        return false;
+    }
+
+    flat->capacity = size;
+    return true;
+}
+
+/**
+ * @brief Fill preallocated flat tree from the payload, every record is checked to be
+ *        a node which unflatten and calc_tree accept
+ */
+static bool decode (tree::flat_tree_t *flat, reader_t *reader, size_t n_nodes)
+{
+    assert (flat   != nullptr && "invalid pointer");
+    assert (reader != nullptr && "invalid pointer");
+
+    for (uint32_t i = 0; i < n_nodes && !reader->failed; ++i)
+    {
+        uint8_t tag       = read_u8 (reader);
+        bool    has_left  = tag & TAG_HAS_LEFT;
+        bool    has_right = tag & TAG_HAS_RIGHT;
+
+        flat->types[i] = tag & TAG_TYPE_MASK;
+        flat->ops  [i] = 0;
+        flat->vals [i] = 0;
+
+        switch ((tree::node_type_t) flat->types[i])
+        {
+            case tree::node_type_t::VAL:
+            {
+                uint64_t bits = read_u64 (reader);
+                memcpy (flat->vals + i, &bits, sizeof (bits));
+
+                if (tag >> TAG_OP_SHIFT || has_left || has_right) return false;
+                break;
+            }
+
+            case tree::node_type_t::VAR:
+                flat->ops[i] = read_u8 (reader);
+
+                if (tag >> TAG_OP_SHIFT || has_left || has_right) return false;
+                break;
+
+            case tree::node_type_t::OP:
+            {
+                tree::op_t op = (tree::op_t) (tag >> TAG_OP_SHIFT);
+                bool unary    = op == tree::op_t::SIN || op == tree::op_t::COS ||
+                                op == tree::op_t::EXP || op == tree::op_t::LOG;
+
+                if (op > tree::op_t::LOG || !has_right || has_left == unary) return false;
+
+                flat->ops[i] = (uint8_t) op;
+                break;
+            }
+
+            case tree::node_type_t::NOT_SET:
+            default:
+                return false;
+        }
+
+        flat->lefts [i] = has_left  ? read_ref (reader, i) : tree::FLAT_NONE;
+        flat->rights[i] = has_right ? read_ref (reader, i) : tree::FLAT_NONE;
+    }
+
+    flat->size = n_nodes;
+
+    return !reader->failed && reader->pos == reader->end;
+}
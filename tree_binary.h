@@ -0,0 +1,35 @@
+#ifndef TREE_BINARY_H
+#define TREE_BINARY_H
+
+#include <stdio.h>
+
+#include "flat_tree.h"
+#include "tree.h"
+
+namespace tree
+{
+    /**
+     * Binary dump layout, all integers are little-endian:
+     *
+     *     header:  magic "MGTB" | u32 version | u64 n_nodes | u64 payload size | u64 FNV-1a of payload
+     *     payload: n_nodes records in post-order, the root is the last one
+     *
+     * Record is a tag byte (bits 0-1 - node_type_t, bit 2 - has left, bit 3 - has right,
+     * bits 4-7 - op_t) followed by 8 raw bytes of VAL, name byte of VAR or LEB128 distances
+     * from the node back to its left and right children. Shared subtrees are stored once.
+     */
+    const uint32_t BINARY_VERSION = 1;
+
+    tree_err_t store_binary (const tree_t      *tree, FILE *stream);
+    tree_err_t store_binary (const flat_tree_t *flat, FILE *stream);
+
+    /**
+     * @brief Read whole dump with one read and decode it without parsing text
+     *
+     * @return INVALID_DUMP if header, checksum or any record is broken
+     */
+    tree_err_t load_binary (tree_t      *tree, FILE *stream);
+    tree_err_t load_binary (flat_tree_t *flat, FILE *stream);
+}
+
+#endif
@@ -0,0 +1,252 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "file.h"
+#include "flat_tree.h"
+#include "lib/log.h"
+#include "tree.h"
+#include "tree_image.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+const char IMAGE_MAGIC[4] = {'M', 'G', 'T', 'I'};
+
+/// Arrays start at multiples of it, so values and indices are aligned in the mapping
+const size_t IMAGE_ALIGN = 8;
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Offsets are counted from the beginning of the file
+struct image_header_t
+{
+    uint32_t magic;     ///< IMAGE_MAGIC bytes
+    uint32_t version;
+    uint64_t n_nodes;
+    uint64_t file_size;
+
+    uint64_t types;
+    uint64_t ops;
+    uint64_t vals;
+    uint64_t lefts;
+    uint64_t rights;
+};
+
+static size_t align_up    (size_t size);
+static bool   write_array (const void *array, size_t size, FILE *stream);
+
+static bool array_fits (const image_header_t *header, uint64_t offset, size_t elem_size);
+static bool valid_node (const tree::flat_tree_t *flat, uint32_t indx);
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::store_image (const tree_t *tree, FILE *stream)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    flat_tree_t flat = {};
+
+    tree_err_t res = flatten (tree, &flat);
+    if (res == OK) res = store_image (&flat, stream);
+
+    flat_dtor (&flat);
+    return res;
+}
+
+tree::tree_err_t tree::store_image (const flat_tree_t *flat, FILE *stream)
+{
+    assert (flat   != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+    assert (flat->size > 0    && "empty tree");
+
+    image_header_t header = {};
+    memcpy (&header.magic, IMAGE_MAGIC, sizeof (IMAGE_MAGIC));
+
+    header.version = IMAGE_VERSION;
+    header.n_nodes = flat->size;
+
+    header.types     = align_up (sizeof (header));
+    header.ops       = align_up (header.types  + flat->size * sizeof (uint8_t));
+    header.vals      = align_up (header.ops    + flat->size * sizeof (uint8_t));
+    header.lefts     = align_up (header.vals   + flat->size * sizeof (double));
+    header.rights    = align_up (header.lefts  + flat->size * sizeof (uint32_t));
+    header.file_size = align_up (header.rights + flat->size * sizeof (uint32_t));
+
+    bool ok = write_array (&header,      sizeof (header),                 stream) &&
+              write_array (flat->types,  flat->size * sizeof (uint8_t),   stream) &&
+              write_array (flat->ops,    flat->size * sizeof (uint8_t),   stream) &&
+              write_array (flat->vals,   flat->size * sizeof (double),    stream) &&
+              write_array (flat->lefts,  flat->size * sizeof (uint32_t),  stream) &&
+              write_array (flat->rights, flat->size * sizeof (uint32_t),  stream);
+
+    if (!ok)
+    {
+        LOG (log::ERR, "Failed to write tree image");
+        return IO_FAILURE;
+    }
+
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::map_image (image_t *image, FILE *stream)
+{
+    assert (image  != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    *image = {};
+
+    ssize_t map_size = file_size (stream);
+    if (map_size < (ssize_t) sizeof (image_header_t))
+    {
+        LOG (log::ERR, "Tree image is too short");
+        return INVALID_DUMP;
+    }
+
+    void *map = mmap (NULL, (size_t) map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fileno (stream), 0);
+    if (map == MAP_FAILED)
+    {
+        LOG (log::ERR, "Failed to map tree image");
+        return MMAP_FAILURE;
+    }
+
+    image->map      = map;
+    image->map_size = (size_t) map_size;
+
+    const image_header_t *header = (const image_header_t *) map;
+    uint8_t              *base   = (uint8_t *) map;
+
+    if (memcmp (&header->magic, IMAGE_MAGIC, sizeof (IMAGE_MAGIC)) != 0 || header->version != IMAGE_VERSION)
+    {
+        LOG (log::ERR, "Not a tree image or unsupported version");
+
+        image_dtor (image);
+        return INVALID_DUMP;
+    }
+
+    if (header->file_size != image->map_size || header->n_nodes == 0 || header->n_nodes >= FLAT_NONE ||
+        !array_fits (header, header->types,  sizeof (uint8_t))  ||
+        !array_fits (header, header->ops,    sizeof (uint8_t))  ||
+        !array_fits (header, header->vals,   sizeof (double))   ||
+        !array_fits (header, header->lefts,  sizeof (uint32_t)) ||
+        !array_fits (header, header->rights, sizeof (uint32_t)))
+    {
+        LOG (log::ERR, "Invalid tree image layout");
+
+        image_dtor (image);
+        return INVALID_DUMP;
+    }
+
+    flat_tree_t *flat = &image->flat;
+
+    flat->types    = base + header->types;
+    flat->ops      = base + header->ops;
+    flat->vals     = (double   *) (void *) (base + header->vals);
+    flat->lefts    = (uint32_t *) (void *) (base + header->lefts);
+    flat->rights   = (uint32_t *) (void *) (base + header->rights);
+    flat->size     = header->n_nodes;
+    flat->capacity = header->n_nodes;
+
+    // Children must precede the node, so walks over the view can't leave the mapping or loop
+    for (uint32_t i = 0; i < flat->size; ++i)
+    {
+        if (!valid_node (flat, i))
+        {
+            LOG (log::ERR, "Invalid node %u in tree image", i);
+
+            image_dtor (image);
+            return INVALID_DUMP;
+        }
+    }
+
+    return OK;
+}
+
+void tree::image_dtor (image_t *image)
+{
+    assert (image != nullptr && "invalid pointer");
+
+    if (image->map != nullptr) munmap (image->map, image->map_size);
+
+    *image = {};
+}
+
+double tree::calc_tree (const image_t *image, double x)
+{
+    assert (image != nullptr && "invalid pointer");
+
+    return calc_tree (&image->flat, x);
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static size_t align_up (size_t size)
+{
+    return (size + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+/// Array is followed by zero padding up to IMAGE_ALIGN
+static bool write_array (const void *array, size_t size, FILE *stream)
+{
+    assert (array  != nullptr && "invalid pointer");
+    assert (stream != nullptr && "invalid pointer");
+
+    static const uint8_t PADDING[IMAGE_ALIGN] = {};
+
+    size_t padding = align_up (size) - size;
+
+    return fwrite (array,   1, size,    stream) == size &&
+           fwrite (PADDING, 1, padding, stream) == padding;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool array_fits (const image_header_t *header, uint64_t offset, size_t elem_size)
+{
+    assert (header != nullptr && "invalid pointer");
+
+    return offset % elem_size == 0 && offset >= sizeof (image_header_t) && offset <= header->file_size &&
+           (header->file_size - offset) / elem_size >= header->n_nodes;
+}
+
+static bool valid_node (const tree::flat_tree_t *flat, uint32_t indx)
+{
+    assert (flat != nullptr && "invalid pointer");
+
+    uint32_t left  = flat->lefts [indx];
+    uint32_t right = flat->rights[indx];
+
+    switch ((tree::node_type_t) flat->types[indx])
+    {
+        case tree::node_type_t::VAL:
+        case tree::node_type_t::VAR:
+            return left == tree::FLAT_NONE && right == tree::FLAT_NONE;
+
+        case tree::node_type_t::OP:
+        {
+            tree::op_t op = (tree::op_t) flat->ops[indx];
+            bool unary    = op == tree::op_t::SIN || op == tree::op_t::COS ||
+                            op == tree::op_t::EXP || op == tree::op_t::LOG;
+
+            if (op > tree::op_t::LOG || right >= indx) return false;
+
+            return unary ? left == tree::FLAT_NONE : left < indx;
+        }
+
+        case tree::node_type_t::NOT_SET:
+        default:
+            return false;
+    }
+}
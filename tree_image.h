@@ -0,0 +1,47 @@
+#ifndef TREE_IMAGE_H
+#define TREE_IMAGE_H
+
+#include <stdio.h>
+
+#include "flat_tree.h"
+#include "tree.h"
+
+namespace tree
+{
+    /**
+     * Image is flat_tree_t arrays written as is after a header which holds their offsets
+     * from the beginning of the file. Children are indices, so the image doesn't depend
+     * on the address it is mapped to. Byte order is the one of the machine which stored it.
+     */
+    const uint32_t IMAGE_VERSION = 1;
+
+    /**
+     * @brief Mapped image, flat is a read-only view of the mapping
+     *
+     * flat can be passed to every function which takes const flat_tree_t *
+     * (calc_tree, calc_diff source, store, unflatten), but never to flat_dtor.
+     */
+    struct image_t
+    {
+        void  *map      = nullptr;
+        size_t map_size = 0;
+
+        flat_tree_t flat = {};
+    };
+
+    tree_err_t store_image (const tree_t      *tree, FILE *stream);
+    tree_err_t store_image (const flat_tree_t *flat, FILE *stream);
+
+    /**
+     * @brief Map image without copying it, header and every node are checked once
+     *
+     * @return INVALID_DUMP if image is broken, MMAP_FAILURE if it can't be mapped
+     */
+    tree_err_t map_image (image_t *image, FILE *stream);
+
+    void image_dtor (image_t *image);
+
+    double calc_tree (const image_t *image, double x);
+}
+
+#endif
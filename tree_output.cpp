@@ -1,7 +1,16 @@
 #include <assert.h>
 #include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "lib/log.h"
 #include "tree.h"
 #include "tree_output.h"
 
@@ -12,13 +21,31 @@ const int FRAMES_OFFSET = 2;
 const int LOWWATER_CHILD_CNT  = 60;
 const int HIGHWATER_CHILD_CNT = 100;
 
-const int MAX_CMD_LEN   = 150;
+/// Max weight of operator itself (see get_weight)
+const int MAX_OP_WEIGHT = 3;
+
+/**
+ * Subtree is split only if it's heavier than LOWWATER_CHILD_CNT or it is the heavier child
+ * of a node over HIGHWATER_CHILD_CNT, so lighter subtrees are never split and their weight can be
+ * stored in node_t::weight once and reused by every frame which shows them.
+ * Heavier subtrees which are not split yet are walked again by every frame.
+ */
+const int MAX_CACHED_WEIGHT = (HIGHWATER_CHILD_CNT - MAX_OP_WEIGHT) / 2;
+
+const size_t LATEX_PATH_LEN = 1024;
+
+const char LATEX_OUTPUT_DIR[] = "render/";
+
+/// Formulas not deeper than this are split and dumped without memory for the walk
+const size_t DUMP_INLINE_FRAMES = 64;
+
+const uint64_t FNV_OFFSET = 0xCBF29CE484222325ull;
 
 // -------------------------------------------------------------------------------------------------
 
-#define EMIT_MAIN(str, ...)   fprintf (render->main_file,     str, ##__VA_ARGS__);
-#define EMIT_APDX(str, ...)   fprintf (render->appendix_file, str, ##__VA_ARGS__);
-#define EMIT_SPCH(str, ...)   fprintf (render->speech_file, str, ##__VA_ARGS__);
+#define EMIT_MAIN(literal)   out_literal (&render->main_buf,     literal);
+#define EMIT_APDX(literal)   out_literal (&render->appendix_buf, literal);
+#define EMIT_SPCH(literal)   out_literal (&render->speech_buf,   literal);
 
 #define Lval node->left ->val
 #define Rval node->right->val
@@ -37,30 +64,103 @@ const int MAX_CMD_LEN   = 150;
 
 #define NOT_SPLITTED_DIV(node) !isALPHA(node) && isTYPE(node, OP) && isOPTYPE(node, DIV)
 
-typedef void (*dump_f)(tree::node_t *node, FILE *stream);
+typedef void (*dump_f)(tree::node_t *node, out_buf_t *out);
 
 // -------------------------------------------------------------------------------------------------
 
+/// Operation which operands are being split, left holds weight of the left operand
+struct split_frame_t
+{
+    tree::node_t *node;
+    int           left;
+    bool          right;    ///< Right operand is being split
+};
+
+/// Walk state of one node of dfs_dump: which callbacks are already called
+struct dfs_dump_frame_t
+{
+    tree::node_t *node;
+    int           stage;
+};
+
+enum class dump_task_kind_t
+{
+    SUBTREE,
+    CONTENT,
+    LITERAL,
+};
+
+/// Pending piece of subtree_dump output, pieces of a node are pushed in reverse order
+struct dump_task_t
+{
+    dump_task_kind_t kind;
+    tree::node_t    *node;      ///< Subtree or node which content is dumped
+    const char      *literal;
+    size_t           len;
+};
+
+struct dump_stack_t
+{
+    dump_task_t *tasks;
+    size_t       capacity;
+    size_t       size;
+
+    dump_task_t inline_tasks[DUMP_INLINE_FRAMES];
+};
+
+// -------------------------------------------------------------------------------------------------
+
+/// One pdflatex run, hash is written to stamp_path after successful build
+struct latex_job_t
+{
+    const char *tex_path;
+    uint64_t    hash;
+
+    char stamp_path[LATEX_PATH_LEN];
+    char pdf_path  [LATEX_PATH_LEN];
+
+    pid_t  pid;
+    double start;
+};
+
+static void compile_documents (latex_job_t *jobs, size_t n_jobs);
+static bool up_to_date        (latex_job_t *job);
+static bool start_pdflatex    (latex_job_t *job);
+static void finish_pdflatex   (latex_job_t *job, int status);
+
+static double   seconds_now ();
+static uint64_t fnv1a       (uint64_t hash, const char *data, size_t size);
+
+static void flush_frame  (render::render_t *render);
+static void emit_heading (render::render_t *render, const char *command, const char *name);
+
 static int split_subtree (render::render_t *render, tree::node_t *node);
+static int split_leaf    (tree::node_t *node);
+static int split_node    (render::render_t *render, tree::node_t *node, int left_cnt, int right_cnt);
 
-static void dump_splitted (render::render_t *render, tree::node_t *node, FILE *stream);
+static void dump_splitted (render::render_t *render, tree::node_t *node, out_buf_t *out);
 
-static void dfs_dump (tree::node_t *node, FILE *stream, dump_f pre_exec,
+static void dfs_dump (tree::node_t *node, out_buf_t *out, dump_f pre_exec,
                                                         dump_f in_exec,   
                                                         dump_f post_exec);
 
-static void subtree_dump   (tree::node_t *node, FILE *stream);
+static void subtree_dump   (tree::node_t *node, out_buf_t *out);
+static bool dump_expand    (dump_stack_t *stack, tree::node_t *node, out_buf_t *out);
+static bool dump_wrapped   (dump_stack_t *stack, tree::node_t *parent, tree::node_t *child);
+static bool dump_push      (dump_stack_t *stack, dump_task_kind_t kind, tree::node_t *node,
+                                                 const char *literal, size_t len);
 
-static void dump_node_pre  (tree::node_t *node, FILE *stream);
-static void dump_node_in   (tree::node_t *node, FILE *stream);
-static void dump_node_post (tree::node_t *node, FILE *stream);
+static void dump_node_pre  (tree::node_t *node, out_buf_t *out);
+static void dump_node_in   (tree::node_t *node, out_buf_t *out);
+static void dump_node_post (tree::node_t *node, out_buf_t *out);
 
-static void dump_node_content  (FILE *stream, tree::node_t *node);
-static void dump_node_operator (FILE *stream, tree::node_t *node);
+static void dump_node_content  (out_buf_t *out, tree::node_t *node);
+static void dump_node_operator (out_buf_t *out, tree::node_t *node);
 
-static void dump_alpha (FILE *stream, int index);
+static void dump_alpha (out_buf_t *out, int index);
 
-static int get_weight (tree::node_t *node);
+static int  get_weight   (tree::node_t *node);
+static bool known_weight (tree::node_t *node);
 
 static bool need_parentheses (tree::node_t *operator_node, tree::node_t *operand_node);
 
@@ -79,11 +179,18 @@ int render::render_ctor (render_t *render, const char *main_filename, const char
     render->main_file         = fopen (main_filename,     "w"); if (!render->main_file)     return ERROR;
     render->appendix_file     = fopen (appendix_filename, "w"); if (!render->appendix_file) return ERROR;
     render->speech_file       = fopen (speech_filename,   "w"); if (!render->speech_file)   return ERROR;
+
+    _UNWRAP_ERR (out_buf_ctor (&render->main_buf));
+    _UNWRAP_ERR (out_buf_ctor (&render->appendix_buf));
+    _UNWRAP_ERR (out_buf_ctor (&render->speech_buf));
+
     render->main_filename     = main_filename;
     render->appendix_filename = appendix_filename;
     render->speech_filename   = speech_filename;
     render->frame_cnt         = FRAMES_OFFSET;
     render->last_alpha_indx   = 0;
+    render->main_hash         = FNV_OFFSET;
+    render->appendix_hash     = FNV_OFFSET;
 
     EMIT_MAIN (MAIN_BEGIN);
     EMIT_APDX (APPENDIX_BEGIN);
@@ -100,17 +207,23 @@ void render::render_dtor (render_t *render)
 
     EMIT_MAIN (MAIN_END);
     EMIT_APDX (APPENDIX_END);
-    
+
+    flush_frame (render);
+
     fclose (render->main_file);
     fclose (render->appendix_file);
     fclose (render->speech_file);
 
-    const char cmd_fmt[] = "pdflatex -output-directory='render/' %s && "
-                           "pdflatex -output-directory='render/' %s";
-    char cmd[MAX_CMD_LEN] = "";
+    out_buf_dtor (&render->main_buf);
+    out_buf_dtor (&render->appendix_buf);
+    out_buf_dtor (&render->speech_buf);
+
+    latex_job_t jobs[] = {
+        {.tex_path = render->main_filename,     .hash = render->main_hash},
+        {.tex_path = render->appendix_filename, .hash = render->appendix_hash},
+    };
 
-    sprintf (cmd, cmd_fmt, render->main_filename, render->appendix_filename);
-    system  (cmd);
+    compile_documents (jobs, sizeof (jobs) / sizeof (jobs[0]));
 
     // sprintf (cmd, "./generate_video '%s'", render->speech_filename);
 }
@@ -125,17 +238,22 @@ void render::push_diff_frame (render_t *render, tree::node_t* lhs, tree::node_t
     EMIT_MAIN (FRAME_BEG);
     EMIT_APDX (APDX_FRAME_BEG);
 
-    EMIT_MAIN ("\\frac {\\partial}{\\partial %c} \\left[", var);
-    dump_splitted (render, lhs, render->main_file);
+    EMIT_MAIN ("\\frac {\\partial}{\\partial ");
+    out_char  (&render->main_buf, var);
+    EMIT_MAIN ("} \\left[");
+    dump_splitted (render, lhs, &render->main_buf);
     EMIT_MAIN ("\\right] \\allowbreak  = \\allowbreak  ");
-    dump_splitted (render, rhs, render->main_file);
+    dump_splitted (render, rhs, &render->main_buf);
 
     EMIT_MAIN (FRAME_END);
     EMIT_APDX (APDX_FRAME_END);
 
-    EMIT_SPCH ("%s\n", PHRASES[rand() % NUM_PHRASES]);
+    out_str   (&render->speech_buf, PHRASES[rand() % NUM_PHRASES]);
+    EMIT_SPCH ("\n");
 
     render->frame_cnt++;
+
+    flush_frame (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -145,16 +263,21 @@ void render::push_diff_task_frame (render_t *render, tree::node_t* lhs, char var
     EMIT_MAIN (FRAME_BEG);
     EMIT_APDX (APDX_FRAME_BEG);
 
-    EMIT_MAIN ("\\frac {\\partial}{\\partial %c} \\left[", var);
-    dump_splitted (render, lhs, render->main_file);
+    EMIT_MAIN ("\\frac {\\partial}{\\partial ");
+    out_char  (&render->main_buf, var);
+    EMIT_MAIN ("} \\left[");
+    dump_splitted (render, lhs, &render->main_buf);
     EMIT_MAIN ("\\right] \\allowbreak  = ?");
 
     EMIT_MAIN (FRAME_END);
     EMIT_APDX (APDX_FRAME_END);
 
-    EMIT_SPCH ("%s\n", PHRASES[rand() % NUM_PHRASES]);
+    out_str   (&render->speech_buf, PHRASES[rand() % NUM_PHRASES]);
+    EMIT_SPCH ("\n");
 
     render->frame_cnt++;
+
+    flush_frame (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -168,14 +291,17 @@ void render::push_simplify_frame (render_t *render, tree::node_t* tree)
     EMIT_APDX (APDX_FRAME_BEG);
 
     EMIT_MAIN ("\\allowbreak  = \\allowbreak ");
-    dump_splitted (render, tree, render->main_file);
+    dump_splitted (render, tree, &render->main_buf);
 
     EMIT_MAIN (FRAME_END);
     EMIT_APDX (APDX_FRAME_END);
 
-    EMIT_SPCH ("%s\n", PHRASES[rand() % NUM_PHRASES]);
+    out_str   (&render->speech_buf, PHRASES[rand() % NUM_PHRASES]);
+    EMIT_SPCH ("\n");
 
     render->frame_cnt++;
+
+    flush_frame (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -185,8 +311,8 @@ void render::push_section (render_t *render, const char *name)
     assert (render != nullptr && "invalid pointer");
     assert (name   != nullptr && "invlaid pointer");
 
-    EMIT_MAIN ("\\section {%s}\n", name);
-    EMIT_APDX ("\\section {%s}\n", name);
+    emit_heading (render, "\\section {", name);
+    flush_frame  (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -196,10 +322,9 @@ void render::push_subsection (render_t *render, const char *name)
     assert (render != nullptr && "invalid pointer");
     assert (name   != nullptr && "invlaid pointer");
 
-    EMIT_MAIN ("\\subsection {%s}\n", name);
-    EMIT_APDX ("\\subsection {%s}\n", name);
-    EMIT_MAIN ("\\subsubsection {%s}\n", name);
-    EMIT_APDX ("\\subsubsection {%s}\n", name);
+    emit_heading (render, "\\subsection {",    name);
+    emit_heading (render, "\\subsubsection {", name);
+    flush_frame  (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -209,8 +334,8 @@ void render::push_subsubsection (render_t *render, const char *name)
     assert (render != nullptr && "invalid pointer");
     assert (name   != nullptr && "invlaid pointer");
 
-    EMIT_MAIN ("\\subsubsection {%s}\n", name);
-    EMIT_APDX ("\\subsubsection {%s}\n", name);
+    emit_heading (render, "\\subsubsection {", name);
+    flush_frame  (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -223,11 +348,14 @@ void render::push_raw_frame (render_t *render, const char *content, const char *
 
     EMIT_MAIN (FRAME_BLOCK_BEG);
 
-    EMIT_MAIN ("%s", content);
+    out_str   (&render->main_buf, content);
 
     EMIT_MAIN (FRAME_BLOCK_END);
-    EMIT_SPCH ("%s\n", speaker_text);
+    out_str   (&render->speech_buf, speaker_text);
+    EMIT_SPCH ("\n");
     render->frame_cnt++;
+
+    flush_frame (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -240,17 +368,22 @@ void render::push_taylor_frame (render_t *render, tree::node_t *orig, tree::node
 
     EMIT_MAIN (FRAME_BEG);
 
-    dump_splitted (render, orig, render->main_file);
+    dump_splitted (render, orig, &render->main_buf);
     EMIT_MAIN (" = ");
-    dump_splitted (render, series, render->main_file);
-    EMIT_MAIN(" + \\tilde{o} ((x-a)^{%d})", order);
+    dump_splitted (render, series, &render->main_buf);
+    EMIT_MAIN (" + \\tilde{o} ((x-a)^{");
+    out_int   (&render->main_buf, order);
+    EMIT_MAIN ("})");
     // EMIT_MAIN("$\n\n\n$");
     // dfs_dump (series, render->main_file, dump_node_pre, dump_node_in, dump_node_post);
 
     EMIT_MAIN (FRAME_END);
     EMIT_APDX (APDX_FRAME_END);
-    EMIT_SPCH ("%s\n", PHRASES[rand() % NUM_PHRASES]);
+    out_str   (&render->speech_buf, PHRASES[rand() % NUM_PHRASES]);
+    EMIT_SPCH ("\n");
     render->frame_cnt++;
+
+    flush_frame (render);
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -261,32 +394,307 @@ void render::push_calculation_frame (render_t *render, tree::node_t *orig, doubl
 
     EMIT_MAIN (FRAME_BEG);
 
-    dump_splitted (render, orig, render->main_file);
-    EMIT_MAIN ("\\bigg|_{x = %lg} \\allowbreak  = \\allowbreak ", x);
-    EMIT_MAIN("%lg", answer);
+    dump_splitted (render, orig, &render->main_buf);
+    EMIT_MAIN  ("\\bigg|_{x = ");
+    out_double (&render->main_buf, x);
+    EMIT_MAIN  ("} \\allowbreak  = \\allowbreak ");
+    out_double (&render->main_buf, answer);
 
     EMIT_MAIN (FRAME_END);
     EMIT_APDX (APDX_FRAME_END);
-    EMIT_SPCH ("%s\n", PHRASES[rand() % NUM_PHRASES]);
+    out_str   (&render->speech_buf, PHRASES[rand() % NUM_PHRASES]);
+    EMIT_SPCH ("\n");
     render->frame_cnt++;
+
+    flush_frame (render);
 }
 
 // -------------------------------------------------------------------------------------------------
 // STATIC SECTION
 // -------------------------------------------------------------------------------------------------
 
+/// One write per stream, so stdio is entered per frame and not per token
+static void flush_frame (render::render_t *render)
+{
+    assert (render != nullptr && "invalid pointer");
+
+    render->main_hash     = fnv1a (render->main_hash,     render->main_buf.data,     render->main_buf.size);
+    render->appendix_hash = fnv1a (render->appendix_hash, render->appendix_buf.data, render->appendix_buf.size);
+
+    if (out_flush (&render->main_buf,     render->main_file)     != 0 ||
+        out_flush (&render->appendix_buf, render->appendix_file) != 0 ||
+        out_flush (&render->speech_buf,   render->speech_file)   != 0)
+    {
+        LOG (log::ERR, "Failed to write render output");
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Documents are independent, so all of them are compiled at once
+static void compile_documents (latex_job_t *jobs, size_t n_jobs)
+{
+    assert (jobs != nullptr && "invalid pointer");
+
+    for (size_t i = 0; i < n_jobs; ++i)
+    {
+        jobs[i].pid = -1;
+
+        if (up_to_date (&jobs[i]))
+        {
+            LOG (log::INF, "%s is unchanged, pdflatex skipped", jobs[i].tex_path);
+            continue;
+        }
+
+        start_pdflatex (&jobs[i]);
+    }
+
+    // Each job is reaped by its own pid, children started elsewhere in the process are left alone
+    for (size_t i = 0; i < n_jobs; ++i)
+    {
+        if (jobs[i].pid <= 0) continue;
+
+        int   status = 0;
+        pid_t pid    = -1;
+
+        do pid = waitpid (jobs[i].pid, &status, 0);
+        while (pid < 0 && errno == EINTR);
+
+        if (pid < 0)
+        {
+            LOG (log::ERR, "waitpid on %s failed: %s", jobs[i].tex_path, strerror (errno));
+            continue;
+        }
+
+        finish_pdflatex (&jobs[i], status);
+    }
+}
+
+/// Fills job paths, document is up to date if its pdf exists and stamp holds the same hash
+static bool up_to_date (latex_job_t *job)
+{
+    assert (job           != nullptr && "invalid pointer");
+    assert (job->tex_path != nullptr && "invalid pointer");
+
+    const char *name = strrchr (job->tex_path, '/');
+    name = (name != nullptr) ? name + 1 : job->tex_path;
+
+    const char *ext      = strrchr (name, '.');
+    int         name_len = (int) ((ext != nullptr) ? (size_t) (ext - name) : strlen (name));
+
+    bool paths_ok =
+        snprintf (job->stamp_path, LATEX_PATH_LEN, "%s.hash",     job->tex_path)                   < (int) LATEX_PATH_LEN &&
+        snprintf (job->pdf_path,   LATEX_PATH_LEN, "%s%.*s.pdf", LATEX_OUTPUT_DIR, name_len, name) < (int) LATEX_PATH_LEN;
+
+    if (!paths_ok || access (job->pdf_path, R_OK) != 0) return false;
+
+    FILE *stamp = fopen (job->stamp_path, "r");
+    if (stamp == nullptr) return false;
+
+    uint64_t old_hash = 0;
+    bool     same     = fscanf (stamp, "%" SCNx64, &old_hash) == 1 && old_hash == job->hash;
+
+    fclose (stamp);
+    return same;
+}
+
+static bool start_pdflatex (latex_job_t *job)
+{
+    assert (job != nullptr && "invalid pointer");
+
+    // Stamp of the previous build must not outlive a failed or interrupted one
+    unlink (job->stamp_path);
+
+    job->start = seconds_now ();
+    job->pid   = fork ();
+
+    if (job->pid < 0)
+    {
+        LOG (log::ERR, "fork failed: %s", strerror (errno));
+        return false;
+    }
+
+    if (job->pid == 0)
+    {
+        // Concurrent runs can't share the terminal, progress and errors stay in the .log of the document
+        int null_fd = open ("/dev/null", O_RDWR);
+        if (null_fd >= 0)
+        {
+            dup2 (null_fd, STDIN_FILENO);
+            dup2 (null_fd, STDOUT_FILENO);
+        }
+
+        execlp ("pdflatex", "pdflatex", "-interaction=nonstopmode", "-output-directory", LATEX_OUTPUT_DIR,
+                                                                    job->tex_path, (char *) nullptr);
+        _exit (127);
+    }
+
+    return true;
+}
+
+static void finish_pdflatex (latex_job_t *job, int status)
+{
+    assert (job != nullptr && "invalid pointer");
+
+    double elapsed = seconds_now () - job->start;
+
+    // Stamp is written only for a clean exit, otherwise the next render compiles the document again
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+        LOG (log::ERR, "pdflatex failed on %s after %.2lf s (status %d)", job->tex_path, elapsed,
+                        WIFEXITED (status) ? WEXITSTATUS (status) : -1);
+        return;
+    }
+
+    LOG (log::INF, "%s compiled in %.2lf s", job->pdf_path, elapsed);
+
+    FILE *stamp = fopen (job->stamp_path, "w");
+    if (stamp == nullptr) return;
+
+    fprintf (stamp, "%016" PRIx64 "\n", job->hash);
+    fclose  (stamp);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static double seconds_now ()
+{
+    timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+static uint64_t fnv1a (uint64_t hash, const char *data, size_t size)
+{
+    assert (data != nullptr && "invalid pointer");
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Heading goes to both main and appendix
+static void emit_heading (render::render_t *render, const char *command, const char *name)
+{
+    assert (render  != nullptr && "invalid pointer");
+    assert (command != nullptr && "invalid pointer");
+    assert (name    != nullptr && "invalid pointer");
+
+    out_buf_t *bufs[] = {&render->main_buf, &render->appendix_buf};
+
+    for (out_buf_t *buf : bufs)
+    {
+        out_str     (buf, command);
+        out_str     (buf, name);
+        out_literal (buf, "}\n");
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order walk with explicit stack like calc_subtree, split decision of a node is made
+ *        after weights of its operands are known
+ *
+ * @return Weight of the subtree left in the formula (or 0 on OOM, then nothing more is split)
+ */
 static int split_subtree (render::render_t *render, tree::node_t *node)
 {
     assert (node   != nullptr && "invalid pointer");
     assert (render != nullptr && "invalid pointer");
 
-    if (isALPHA(node) || !isTYPE(node, OP))
+    split_frame_t  inline_frames[DUMP_INLINE_FRAMES];
+    split_frame_t *frames   = inline_frames;
+    size_t         capacity = DUMP_INLINE_FRAMES;
+    size_t         size     = 0;
+
+    int  cnt = 0;
+    bool ok  = true;
+
+    while (true)
+    {
+        // Split nodes and subtrees with known weight are not entered
+        while (isTYPE(node, OP) && !isALPHA(node) && !known_weight (node))
+        {
+            if (size == capacity)
+            {
+                void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+                if (new_frames == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+
+                frames = (split_frame_t *) new_frames;
+            }
+
+            frames[size++] = {node, 0, node->left == nullptr};
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        cnt = split_leaf (node);
+
+        while (size > 0 && frames[size - 1].right)
+        {
+            size--;
+            cnt = split_node (render, frames[size].node, frames[size].left, cnt);
+        }
+
+        if (size == 0) break;
+
+        frames[size - 1].left  = cnt;
+        frames[size - 1].right = true;
+        node = frames[size - 1].node->right;
+    }
+
+    if (frames != inline_frames) free (frames);
+
+    if (!ok)
+    {
+        LOG (log::ERR, "no memory for the walk stack, formula is not split");
+        return 0;
+    }
+
+    return cnt;
+}
+
+/// Weight of the subtree which is not walked: split node, subtree with known weight or leaf
+static int split_leaf (tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    if (isALPHA(node))
     {
         return get_weight(node);
     }
 
-    int left_cnt  = (node->left ) ? split_subtree (render, node->left ) : 0;
-    int right_cnt = (node->right) ? split_subtree (render, node->right) : 0;
+    if (known_weight (node))
+    {
+        return node->weight;
+    }
+
+    node->weight = (uint16_t) get_weight (node);
+    return node->weight;
+}
+
+/**
+ * @brief Move the node (or its heavier operand) to the appendix if it is too heavy
+ *
+ * @return Weight of the node left in the formula
+ */
+static int split_node (render::render_t *render, tree::node_t *node, int left_cnt, int right_cnt)
+{
+    assert (render != nullptr && "invalid pointer");
+    assert (node   != nullptr && "invalid pointer");
 
     assert (left_cnt  < HIGHWATER_CHILD_CNT);
     assert (right_cnt < HIGHWATER_CHILD_CNT);
@@ -295,12 +703,12 @@ static int split_subtree (render::render_t *render, tree::node_t *node)
 
     if (cur_cnt > LOWWATER_CHILD_CNT) {
         EMIT_APDX (FORMULA_BEG);
-        dump_alpha (render->appendix_file, render->last_alpha_indx);
+        dump_alpha (&render->appendix_buf, render->last_alpha_indx);
         EMIT_APDX (" = ");
         
         if (cur_cnt < HIGHWATER_CHILD_CNT) 
         {
-            subtree_dump (node, render->appendix_file);
+            subtree_dump (node, &render->appendix_buf);
 
             node->alpha_index = render->last_alpha_indx;
             cur_cnt = 1;
@@ -309,7 +717,7 @@ static int split_subtree (render::render_t *render, tree::node_t *node)
         {
             tree::node_t *max_node = (left_cnt > right_cnt) ? node->left : node->right;
 
-            subtree_dump (max_node, render->appendix_file);
+            subtree_dump (max_node, &render->appendix_buf);
 
             max_node->alpha_index = render->last_alpha_indx;
             
@@ -324,46 +732,96 @@ static int split_subtree (render::render_t *render, tree::node_t *node)
         return cur_cnt;
     }
 
+    if (cur_cnt <= MAX_CACHED_WEIGHT && (!node->left  || known_weight (node->left)) &&
+                                        (!node->right || known_weight (node->right)))
+    {
+        node->weight = (uint16_t) cur_cnt;
+    }
+
     return cur_cnt;
 }
 
 // -------------------------------------------------------------------------------------------------
 
-static void dump_splitted (render::render_t *render, tree::node_t *node, FILE *stream)
+static void dump_splitted (render::render_t *render, tree::node_t *node, out_buf_t *out)
 {
     assert (render != nullptr && "invalid pointer");
     assert (node   != nullptr && "invalid pointer");
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
 
     split_subtree (render, node);
 
-    subtree_dump (node, stream);
+    subtree_dump (node, out);
 }
 
 // -------------------------------------------------------------------------------------------------
 
-#define WRAP_PARENTHESS(_parent, _child)        \
-{                                               \
-    fprintf (stream, "{");                      \
-    if (need_parentheses (_parent, _child)) {   \
-        fprintf (stream, " \\left( ");          \
-    }                                           \
-    subtree_dump (_child, stream);              \
-    if (need_parentheses (_parent, _child)) {   \
-        fprintf (stream, " \\right)");          \
-    }                                           \
-    fprintf (stream, "}");                      \
+/**
+ * @brief In-order dump with explicit stack of pending output pieces, so depth of the formula
+ *        is limited only by memory (output is marked as lost on OOM)
+ */
+static void subtree_dump (tree::node_t *node, out_buf_t *out)
+{
+    assert (out    != nullptr && "invalid pointer");
+
+    if (node == nullptr) { return; }
+
+    dump_stack_t stack = {};
+    stack.tasks    = stack.inline_tasks;
+    stack.capacity = DUMP_INLINE_FRAMES;
+
+    bool ok = dump_push (&stack, dump_task_kind_t::SUBTREE, node, nullptr, 0);
+
+    while (ok && stack.size > 0)
+    {
+        dump_task_t task = stack.tasks[--stack.size];
+
+        switch (task.kind)
+        {
+            case dump_task_kind_t::SUBTREE:
+                ok = dump_expand (&stack, task.node, out);
+                break;
+
+            case dump_task_kind_t::CONTENT:
+                dump_node_content (out, task.node);
+                break;
+
+            case dump_task_kind_t::LITERAL:
+                out_append (out, task.literal, task.len);
+                break;
+
+            default:
+                assert (0 && "unexpected dump task");
+        }
+    }
+
+    if (!ok)
+    {
+        LOG (log::ERR, "no memory for the dump stack, formula is lost");
+        out->oom = true;
+    }
+
+    if (stack.tasks != stack.inline_tasks) free (stack.tasks);
 }
 
-static void subtree_dump (tree::node_t *node, FILE *stream)
+#define PUSH_SUBTREE(_node)     dump_push (stack, dump_task_kind_t::SUBTREE, _node,   nullptr, 0)
+#define PUSH_CONTENT(_node)     dump_push (stack, dump_task_kind_t::CONTENT, _node,   nullptr, 0)
+#define PUSH_LITERAL(literal)   dump_push (stack, dump_task_kind_t::LITERAL, nullptr, literal, \
+                                                                             sizeof (literal) - 1)
+
+/**
+ * @brief Push output pieces of the node in reverse order, leaves are dumped at once
+ */
+static bool dump_expand (dump_stack_t *stack, tree::node_t *node, out_buf_t *out)
 {
-    assert (stream != nullptr && "invalid pointer");
+    assert (stack  != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
 
-    if (node == nullptr) { return; }
+    if (node == nullptr) { return true; }
 
     if (!isTYPE(node, OP) || isALPHA(node)) {
-        dump_node_content (stream, node);
-        return;
+        dump_node_content (out, node);
+        return true;
     }
 
     if (isOPTYPE (node, MUL))
@@ -372,174 +830,239 @@ static void subtree_dump (tree::node_t *node, FILE *stream)
             //(isSIMPLE(node->right) && !isTYPE(node->left,  VAL)) ||
             (isFUNC(node->left) && isFUNC(node->right)))
         {
-            subtree_dump (node->left,  stream);
-            subtree_dump (node->right, stream);
-            return;
+            return PUSH_SUBTREE (node->right) &&
+                   PUSH_SUBTREE (node->left);
         }
     }
 
     if (isOPTYPE (node, DIV))
     {
-        fprintf(stream, " \\frac { ");
-        subtree_dump (node->left,  stream);
-        fprintf (stream, " }{ ");
-        subtree_dump (node->right, stream);
-        fprintf (stream, " } ");
-        return;
+        return PUSH_LITERAL (" } ")         &&
+               PUSH_SUBTREE (node->right)   &&
+               PUSH_LITERAL (" }{ ")        &&
+               PUSH_SUBTREE (node->left)    &&
+               PUSH_LITERAL (" \\frac { ");
     }
 
     if (isOPTYPE (node, POW) && isFUNC (node->left)){
-        dump_node_content (stream, node->left);
-        dump_node_content (stream, node);
-        fprintf (stream, "{");
-        subtree_dump (node->right,   stream);
-        fprintf (stream, "}");
-        WRAP_PARENTHESS (node->left, node->left->right);
-        return;
+        return dump_wrapped (stack, node->left, node->left->right) &&
+               PUSH_LITERAL ("}")           &&
+               PUSH_SUBTREE (node->right)   &&
+               PUSH_LITERAL ("{")           &&
+               PUSH_CONTENT (node)          &&
+               PUSH_CONTENT (node->left);
     }
 
-    WRAP_PARENTHESS (node, node->left);
-    dump_node_content (stream, node);
-    WRAP_PARENTHESS (node, node->right);
+    return dump_wrapped (stack, node, node->right) &&
+           PUSH_CONTENT (node)                     &&
+           dump_wrapped (stack, node, node->left);
 }
 
-#undef WRAP_PARENTHESS
+/// Operand in braces and parentheses if it needs them, pieces are pushed in reverse order
+static bool dump_wrapped (dump_stack_t *stack, tree::node_t *parent, tree::node_t *child)
+{
+    assert (stack  != nullptr && "invalid pointer");
+    assert (parent != nullptr && "invalid pointer");
+
+    bool parentheses = need_parentheses (parent, child);
+
+    return                 PUSH_LITERAL ("}")             &&
+           (!parentheses || PUSH_LITERAL (" \\right)"))   &&
+           (child == nullptr || PUSH_SUBTREE (child))     &&
+           (!parentheses || PUSH_LITERAL (" \\left( "))   &&
+                           PUSH_LITERAL ("{");
+}
+
+#undef PUSH_SUBTREE
+#undef PUSH_CONTENT
+#undef PUSH_LITERAL
+
+static bool dump_push (dump_stack_t *stack, dump_task_kind_t kind, tree::node_t *node,
+                                            const char *literal, size_t len)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    if (stack->size == stack->capacity)
+    {
+        void *new_tasks = tree::grow_walk_stack (stack->tasks, stack->inline_tasks, &stack->capacity,
+                                                 sizeof (*stack->tasks));
+        if (new_tasks == nullptr) return false;
+
+        stack->tasks = (dump_task_t *) new_tasks;
+    }
+
+    stack->tasks[stack->size++] = {kind, node, literal, len};
+    return true;
+}
 
 // -------------------------------------------------------------------------------------------------
 
-static void dfs_dump (tree::node_t *node, FILE *stream, dump_f pre_exec,
+/**
+ * @brief Walk like tree::dfs_exec, split nodes are not entered
+ */
+static void dfs_dump (tree::node_t *node, out_buf_t *out, dump_f pre_exec,
                                                         dump_f in_exec,   
                                                         dump_f post_exec)
 {
     assert (node        != nullptr && "invalid pointer");
-    assert (stream      != nullptr && "invalid pointer");
+    assert (out         != nullptr && "invalid pointer");
 
-    if (pre_exec != nullptr)
-    {
-        pre_exec (node, stream);
-    }
+    enum { PRE = 0, IN, POST };
 
-    if (!isALPHA(node) && node->left != nullptr)
-    {
-        dfs_dump (node->left, stream,   pre_exec,
-                                        in_exec,
-                                        post_exec);
-    }
+    dfs_dump_frame_t  inline_frames[DUMP_INLINE_FRAMES];
+    dfs_dump_frame_t *frames   = inline_frames;
+    size_t            capacity = DUMP_INLINE_FRAMES;
+    size_t            size     = 0;
 
-    if (in_exec != nullptr)
+    frames[size++] = {node, PRE};
+
+    while (size > 0)
     {
-        in_exec (node, stream);
+        dfs_dump_frame_t *frame = frames + size - 1;
+        tree::node_t     *child = nullptr;
 
-    }
+        switch (frame->stage)
+        {
+            case PRE:
+                if (pre_exec != nullptr) pre_exec (frame->node, out);
 
-    if (!isALPHA(node) && node->right != nullptr)
-    {
-        dfs_dump (node->right, stream,  pre_exec,
-                                        in_exec,
-                                        post_exec);
-    }
+                frame->stage = IN;
+                child        = isALPHA(frame->node) ? nullptr : frame->node->left;
+                break;
 
-    if (post_exec != nullptr)
-    {
-        post_exec (node, stream);
+            case IN:
+                if (in_exec != nullptr) in_exec (frame->node, out);
+
+                frame->stage = POST;
+                child        = isALPHA(frame->node) ? nullptr : frame->node->right;
+                break;
+
+            case POST:
+                if (post_exec != nullptr) post_exec (frame->node, out);
+
+                size--;
+                break;
+
+            default:
+                assert (0 && "invalid walk stage");
+        }
+
+        if (child == nullptr) continue;
+
+        if (size == capacity)
+        {
+            void *new_frames = tree::grow_walk_stack (frames, inline_frames, &capacity, sizeof (*frames));
+            if (new_frames == nullptr)
+            {
+                LOG (log::ERR, "no memory for the walk stack, formula is lost");
+                out->oom = true;
+                break;
+            }
+
+            frames = (dfs_dump_frame_t *) new_frames;
+        }
+
+        frames[size++] = {child, PRE};
     }
+
+    if (frames != inline_frames) free (frames);
 }
 
 // -------------------------------------------------------------------------------------------------
 
-static void dump_node_pre (tree::node_t *node, FILE *stream)
+static void dump_node_pre (tree::node_t *node, out_buf_t *out)
 {
     assert (node   != nullptr && "invalid pointer");
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
 
     if (NOT_SPLITTED_DIV (node))
     {
-        fprintf (stream, "\\frac{");
+        out_literal (out, "\\frac{");
         return;
     }
 
-    fprintf (stream, "{");
+    out_literal (out, "{");
 
     if (need_parentheses (node, node->left))
     {
-        fprintf (stream, "\\left(");
+        out_literal (out, "\\left(");
     }
 
     return;
 }
 
-static void dump_node_in (tree::node_t *node, FILE *stream)
+static void dump_node_in (tree::node_t *node, out_buf_t *out)
 {
     assert (node   != nullptr && "invalid pointer");
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
 
     if (NOT_SPLITTED_DIV (node))
     {
-        fprintf (stream, "}{");
+        out_literal (out, "}{");
         return;
     }
 
     if (need_parentheses (node, node->left)) {
-        fprintf (stream, " \\right) ");
+        out_literal (out, " \\right) ");
     }
 
-    fprintf (stream, "}");
-    dump_node_content (stream, node);
-    fprintf (stream, "{");
+    out_literal (out, "}");
+    dump_node_content (out, node);
+    out_literal (out, "{");
 
     if (need_parentheses (node, node->right)) {
-        fprintf (stream, " \\left( ");
+        out_literal (out, " \\left( ");
     }
 
     return;
 }
 
 
-static void dump_node_post (tree::node_t *node, FILE *stream)
+static void dump_node_post (tree::node_t *node, out_buf_t *out)
 {
     assert (node   != nullptr && "invalid pointer");
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
 
     if (NOT_SPLITTED_DIV (node))
     {
-        fprintf (stream, "}");
+        out_literal (out, "}");
         return;
     }
     
     if (need_parentheses (node, node->right))
     {
-        fprintf (stream, " \\right)");
+        out_literal (out, " \\right)");
     }
 
-    fprintf (stream, "}");
+    out_literal (out, "}");
     return;
 }
 
 // -------------------------------------------------------------------------------------------------
 
-static void dump_node_content (FILE *stream, tree::node_t *node)
+static void dump_node_content (out_buf_t *out, tree::node_t *node)
 {
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
     assert (node   != nullptr && "invalid pointer");
 
     if (isALPHA(node))
     {
-        dump_alpha (stream, node->alpha_index);
+        dump_alpha (out, node->alpha_index);
         return;
     }
 
     switch (node->type)
     {
         case tree::node_type_t::OP:
-            dump_node_operator (stream, node);
+            dump_node_operator (out, node);
             break;
 
         case tree::node_type_t::VAL:
-            fprintf (stream, "%lg", node->val);
+            out_double (out, node->val);
             break;
 
         case tree::node_type_t::VAR:
-            fprintf (stream, "%c", node->var);
+            out_char (out, node->var);
             break;
 
         case tree::node_type_t::NOT_SET:
@@ -554,12 +1077,12 @@ static void dump_node_content (FILE *stream, tree::node_t *node)
 
 #define OP_FORMAT(type, format)     \
     case tree::op_t::type:          \
-        fprintf (stream, format);   \
+        out_literal (out, format);  \
         break;
 
-static void dump_node_operator (FILE *stream, tree::node_t *node)
+static void dump_node_operator (out_buf_t *out, tree::node_t *node)
 {
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
     assert (node   != nullptr && "invalid pointer");
     assert (node->type == tree::node_type_t::OP && "Invalid call");
 
@@ -584,11 +1107,14 @@ static void dump_node_operator (FILE *stream, tree::node_t *node)
 
 // -------------------------------------------------------------------------------------------------
 
-void dump_alpha (FILE *stream, int index)
+void dump_alpha (out_buf_t *out, int index)
 {
-    assert (stream != nullptr && "invalid pointer");
+    assert (out    != nullptr && "invalid pointer");
 
-    fprintf (stream, "%s_{%d}", LETTERS[index % LETTERS_CNT], index / LETTERS_CNT + 1);
+    out_str     (out, LETTERS[index % LETTERS_CNT]);
+    out_literal (out, "_{");
+    out_int     (out, index / LETTERS_CNT + 1);
+    out_char    (out, '}');
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -602,13 +1128,10 @@ static int get_weight (tree::node_t *node)
         return 1;
     }
 
-    char tmp_buf[20] = "";
-    int n = 0;
-
     if (isTYPE (node, VAL))
     {
-        sprintf (tmp_buf, "%lg%n", node->val, &n);
-        return n;
+        char tmp_buf[OUT_DOUBLE_MAX] = "";
+        return (int) format_double (tmp_buf, node->val);
     }
 
     assert (isTYPE(node, OP) && "unexpected node");
@@ -637,6 +1160,17 @@ static int get_weight (tree::node_t *node)
     }
 }
 
+/**
+ * @brief Weight is stored only for subtrees without split nodes. Rewrite clears it on changed nodes
+ *        and their ancestors, other in-place edits must be followed by tree::invalidate
+ */
+static bool known_weight (tree::node_t *node)
+{
+    assert (node != nullptr && "invalid pointer");
+
+    return !isALPHA (node) && node->weight != 0;
+}
+
 // -------------------------------------------------------------------------------------------------
 
 static bool need_parentheses (tree::node_t *operator_node, tree::node_t *operand_node)
@@ -1,6 +1,7 @@
 #ifndef TREE_OUTPUT_H
 #define TREE_OUTPUT_H
 
+#include "out_buf.h"
 #include "tree.h"
 
 namespace render
@@ -10,6 +11,11 @@ namespace render
         FILE *main_file;
         FILE *appendix_file;
         FILE *speech_file;
+        out_buf_t main_buf;         ///< Frame text, written to files at the end of each push_*
+        out_buf_t appendix_buf;
+        out_buf_t speech_buf;
+        uint64_t main_hash;         ///< FNV-1a of the whole document, pdflatex is skipped if it's unchanged
+        uint64_t appendix_hash;
         const char *main_filename;
         const char *appendix_filename;
         const char *speech_filename;
@@ -1,7 +1,7 @@
 #include <assert.h>
-#include <cctype>
-#include <cstring>
-#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lib/log.h"
 #include "tree.h"
@@ -9,71 +9,154 @@
 #include "tree_parsing.h"
 
 // -------------------------------------------------------------------------------------------------
-// STATIC SECTION
+// CONST SECTION
 // -------------------------------------------------------------------------------------------------
 
-static tree::node_t *GetExpression     (const char **input_str);
-static tree::node_t *GetAddOperand     (const char **input_str);
-static tree::node_t *GetMulOperand     (const char **input_str);
-static tree::node_t *GetFuncOperand    (const char **input_str);
-static tree::node_t *GetFunction       (const char **input_str);
-static tree::node_t *GetGeneralOperand (const char **input_str);
-static tree::node_t *GetQuant          (const char **input_str);
+/// Expressions not deeper than this are parsed without heap allocations except nodes
+const size_t PARSE_INLINE_STACK = 64;
+
+/// More significant digits don't fit into uint64_t mantissa
+const int NUM_MAX_DIGITS = 19;
+
+/// Integers up to 2^53 and powers of ten up to 1e22 are exact doubles
+const uint64_t NUM_MAX_EXACT_MANTISSA = 1ull << 53;
+const int      NUM_MAX_EXACT_POW10    = 22;
+
+/// Bigger exponents give 0 or inf anyway, it keeps exponent from overflow
+const int NUM_MAX_EXP = 100000;
+
+const double POW10[NUM_MAX_EXACT_POW10 + 1] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
+const char EXPECTED_OPERAND[]  = "number, variable, function or '('";
+const char EXPECTED_ARGUMENT[] = "number, variable or '('";
+const char EXPECTED_OPERATOR[] = "operator, ')' or end of input";
+const char EXPECTED_END[]      = "operator or end of input";
+const char EXPECTED_RPAREN[]   = "')'";
 
 // -------------------------------------------------------------------------------------------------
-// DEFINE SECTION
+// STATIC PROTOTYPES SECTION
 // -------------------------------------------------------------------------------------------------
 
-#define TRY(expr)               \
-{                               \
-    if ((expr) == nullptr)      \
-    {                           \
-        del_node (node);        \
-        return nullptr;         \
-    }                           \
-}
+enum token_kind_t
+{
+    TOKEN_END,
+    TOKEN_NUM,
+    TOKEN_VAR,
+    TOKEN_FUNC,
+    TOKEN_OP,       ///< Binary operator
+    TOKEN_LPAREN,
+    TOKEN_RPAREN,
+    TOKEN_INVALID
+};
+
+struct token_t
+{
+    token_kind_t kind;
+    size_t       offset;
 
-#define EXPECT(expr)            \
-{                               \
-    if (!(expr))                \
-    {                           \
-        del_node (node);        \
-        return nullptr;         \
-    }                           \
-}
+    char       sym;     ///< Operator symbol or variable name
+    tree::op_t func;
+    double     val;
+};
 
-#define SUCCESS()               \
-{                               \
-    *input_str = str;           \
-    return node;                \
-}
+/// Pending operator: binary operator symbol, '(' or 'f' (function applied to the next operand)
+struct parse_op_t
+{
+    char       sym;
+    tree::op_t func;
+};
 
-#define SKIP_SPACES()           \
-{                               \
-    while (isspace (*str))      \
-    {                           \
-        str++;                  \
-    }                           \
-}
+/**
+ * @brief Operator precedence parser state: nodes of complete operands and operators
+ *        waiting for their right operand, stacks move to heap when inline ones are full
+ */
+struct parser_t
+{
+    const char *begin;
+    const char *pos;
+
+    tree::node_t **operands;
+    size_t         operands_capacity;
+    size_t         n_operands;
+
+    parse_op_t *ops;
+    size_t      ops_capacity;
+    size_t      n_ops;
+
+    tree::node_t *inline_operands[PARSE_INLINE_STACK];
+    parse_op_t    inline_ops     [PARSE_INLINE_STACK];
+};
+
+static bool parse_expression (parser_t *parser, tree::parse_error_t *error);
 
+static token_t next_token  (parser_t *parser, bool expect_operand);
+static bool    scan_ident  (const char **input_str, token_t *token);
+static bool    scan_number (const char **input_str, double *val);
+static bool    is_digit    (char c);
+static bool    is_alpha    (char c);
+static bool    is_space    (char c);
+
+static bool reduce         (parser_t *parser);
+static bool reduce_func    (parser_t *parser);
+static int  precedence     (char sym);
+
+static bool push_operand   (parser_t *parser, tree::node_t *node);
+static bool push_op        (parser_t *parser, parse_op_t op);
+
+static bool fail (tree::parse_error_t *error, tree::tree_err_t err, size_t offset, const char *expected);
+
+// -------------------------------------------------------------------------------------------------
+// DEFINE SECTION
 // -------------------------------------------------------------------------------------------------
 
-tree::node_t *tree::parse_dump (const char *str)
+#define TOP_OP(parser) (parser)->ops[(parser)->n_ops - 1]
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::node_t *tree::parse_dump (const char *str, parse_error_t *error)
 {
     assert (str != nullptr && "invalid pointer");
-    
+
+    parse_error_t local_error = {};
+    if (error == nullptr) error = &local_error;
+
+    *error = {};
+
+    parser_t parser = {};
+    parser.begin             = str;
+    parser.pos               = str;
+    parser.operands          = parser.inline_operands;
+    parser.operands_capacity = PARSE_INLINE_STACK;
+    parser.ops               = parser.inline_ops;
+    parser.ops_capacity      = PARSE_INLINE_STACK;
+
     tree::node_t *node = nullptr;
 
-    TRY (node = GetExpression (&str));
+    if (parse_expression (&parser, error))
+    {
+        assert (parser.n_operands == 1 && "expression must be reduced to one operand");
+
+        node = parser.operands[0];
+    }
+    else
+    {
+        for (size_t i = 0; i < parser.n_operands; ++i) del_node (parser.operands[i]);
+    }
 
-    SKIP_SPACES();
-    EXPECT (*str == '\0');
+    if (parser.operands != parser.inline_operands) free (parser.operands);
+    if (parser.ops      != parser.inline_ops)      free (parser.ops);
 
-    assert (node != nullptr);
     return node;
 }
 
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
 // -------------------------------------------------------------------------------------------------
 
 /**
@@ -82,161 +165,419 @@ tree::node_t *tree::parse_dump (const char *str)
  * AddOperand  ::= MulOperand  ([/ *] MulOperand )*
  * MulOperand  ::= FuncOperand ([^]  FuncOperand)*
  * FuncOperand ::= Function | GeneralOperand
- * 
- * Function ::= ('sin ' | 'cos ' | 'exp ' | 'ln ') GeneralOperand
- * 
+ *
+ * Function ::= ('sin' | 'cos' | 'exp' | 'log' | 'ln') GeneralOperand
+ *
  * GeneralOperand ::= Quant | '(' Expression ')'
- * Quant ::= (<ctype alpha> | <scanf double>)
+ * Quant ::= (<one letter> | <decimal number with optional sign>)
+ *
+ * Grammar is parsed by operator precedence without recursion: all binary operators are
+ * left associative, function is applied as soon as its GeneralOperand is complete.
  */
-
-static tree::node_t *GetExpression (const char **input_str)
+static bool parse_expression (parser_t *parser, tree::parse_error_t *error)
 {
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
-
-    const char *str        = *input_str;
-    tree::node_t *node     = nullptr;
-    tree::node_t *node_rhs = nullptr;
+    assert (parser != nullptr && "invalid pointer");
+    assert (error  != nullptr && "invalid pointer");
 
-    TRY (node = GetAddOperand (&str));
+    bool expect_operand = true;
+    bool after_func     = false;   ///< Function takes GeneralOperand only, not another function
 
-    SKIP_SPACES();
-    while (*str == '+' || *str == '-')
+    while (true)
     {
-        char sign = *str;
-        str++;
+        token_t token = next_token (parser, expect_operand);
+
+        if (expect_operand)
+        {
+            tree::node_t *node = nullptr;
+
+            switch (token.kind)
+            {
+                case TOKEN_FUNC:
+                    if (after_func) break;
+
+                    if (!push_op (parser, {'f', token.func}))
+                        return fail (error, tree::OOM, token.offset, nullptr);
+
+                    after_func = true;
+                    continue;
+
+                case TOKEN_LPAREN:
+                    if (!push_op (parser, {'(', tree::op_t::ADD}))
+                        return fail (error, tree::OOM, token.offset, nullptr);
+
+                    after_func = false;
+                    continue;
+
+                case TOKEN_NUM:
+                case TOKEN_VAR:
+                    node = (token.kind == TOKEN_NUM) ? tree::new_node (token.val) : tree::new_node (token.sym);
 
-        TRY (node_rhs = GetAddOperand (&str));
+                    if (node == nullptr || !push_operand (parser, node))
+                    {
+                        tree::del_node (node);
+                        return fail (error, tree::OOM, token.offset, nullptr);
+                    }
 
-        if (sign == '+') {
-            node = add (node, node_rhs);
-        } else {
-            node = sub (node, node_rhs);
+                    if (!reduce_func (parser)) return fail (error, tree::OOM, token.offset, nullptr);
+
+                    expect_operand = false;
+                    after_func     = false;
+                    continue;
+
+                case TOKEN_END:
+                case TOKEN_OP:
+                case TOKEN_RPAREN:
+                case TOKEN_INVALID:
+                default:
+                    break;
+            }
+
+            return fail (error, tree::INVALID_DUMP, token.offset, after_func ? EXPECTED_ARGUMENT
+                                                                             : EXPECTED_OPERAND);
         }
 
-        SKIP_SPACES();
-    }
+        switch (token.kind)
+        {
+            case TOKEN_OP:
+                while (parser->n_ops > 0 && precedence (TOP_OP (parser).sym) >= precedence (token.sym))
+                {
+                    if (!reduce (parser)) return fail (error, tree::OOM, token.offset, nullptr);
+                }
+
+                if (!push_op (parser, {token.sym, tree::op_t::ADD}))
+                    return fail (error, tree::OOM, token.offset, nullptr);
+
+                expect_operand = true;
+                continue;
+
+            case TOKEN_RPAREN:
+                while (parser->n_ops > 0 && TOP_OP (parser).sym != '(')
+                {
+                    if (!reduce (parser)) return fail (error, tree::OOM, token.offset, nullptr);
+                }
+
+                // Unbalanced parenthesis
+                if (parser->n_ops == 0) return fail (error, tree::INVALID_DUMP, token.offset, EXPECTED_END);
+
+                parser->n_ops--;
+                if (!reduce_func (parser)) return fail (error, tree::OOM, token.offset, nullptr);
+
+                continue;
 
-    SUCCESS();
+            case TOKEN_END:
+                while (parser->n_ops > 0)
+                {
+                    if (TOP_OP (parser).sym == '(')
+                        return fail (error, tree::INVALID_DUMP, token.offset, EXPECTED_RPAREN);
+
+                    if (!reduce (parser)) return fail (error, tree::OOM, token.offset, nullptr);
+                }
+
+                return true;
+
+            case TOKEN_NUM:
+            case TOKEN_VAR:
+            case TOKEN_FUNC:
+            case TOKEN_LPAREN:
+            case TOKEN_INVALID:
+            default:
+                return fail (error, tree::INVALID_DUMP, token.offset, EXPECTED_OPERATOR);
+        }
+    }
 }
 
 // -------------------------------------------------------------------------------------------------
 
-static tree::node_t *GetAddOperand (const char **input_str)
+/**
+ * @brief Read one token, sign before a digit is a part of number only where operand is expected
+ */
+static token_t next_token (parser_t *parser, bool expect_operand)
 {
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
+    assert (parser != nullptr && "invalid pointer");
 
-    const char *str        = *input_str;
-    tree::node_t *node     = nullptr;
-    tree::node_t *node_rhs = nullptr;
+    const char *str = parser->pos;
+    while (is_space (*str)) str++;
 
-    TRY (node = GetMulOperand (&str));
+    token_t token = {};
+    token.kind    = TOKEN_INVALID;
+    token.offset  = (size_t) (str - parser->begin);
 
-    SKIP_SPACES();
-    while (*str == '*' || *str == '/')
+    switch (*str)
     {
-        char sign = *str;
-        str++;
+        case '\0':
+            token.kind = TOKEN_END;
+            break;
+
+        case '(':
+            token.kind = TOKEN_LPAREN;
+            str++;
+            break;
+
+        case ')':
+            token.kind = TOKEN_RPAREN;
+            str++;
+            break;
+
+        case '+': case '-':
+            if (expect_operand && (is_digit (str[1]) || (str[1] == '.' && is_digit (str[2]))))
+            {
+                if (scan_number (&str, &token.val)) token.kind = TOKEN_NUM;
+                break;
+            }
+            [[fallthrough]];
+
+        case '*': case '/': case '^':
+            token.kind = TOKEN_OP;
+            token.sym  = *str++;
+            break;
+
+        default:
+            if (is_alpha (*str))
+            {
+                if (!scan_ident (&str, &token)) token.kind = TOKEN_INVALID;
+            }
+            else if (is_digit (*str) || *str == '.')
+            {
+                if (scan_number (&str, &token.val)) token.kind = TOKEN_NUM;
+            }
+
+            break;
+    }
 
-        TRY (node_rhs = GetMulOperand (&str));
+    parser->pos = str;
+    return token;
+}
 
-        if (sign == '*') {
-            node = mul (node, node_rhs);
-        } else {
-            node = div (node, node_rhs);
-        }
+#define TRY_FUNC(name, type)                                                \
+if (len == sizeof (name) - 1 && memcmp (begin, name, sizeof (name) - 1) == 0)  \
+{                                                                           \
+    token->kind = TOKEN_FUNC;                                               \
+    token->func = tree::op_t::type;                                         \
+} else
+
+/**
+ * @brief Letters run is a function name or one letter variable
+ */
+static bool scan_ident (const char **input_str, token_t *token)
+{
+    assert (input_str  != nullptr && "invalid pointer");
+    assert (*input_str != nullptr && "invalid pointer");
+    assert (token      != nullptr && "invalid pointer");
+
+    const char *begin = *input_str;
+    const char *str   = begin;
+
+    while (is_alpha (*str)) str++;
+
+    size_t len = (size_t) (str - begin);
 
-        SKIP_SPACES();
+    TRY_FUNC ("sin", SIN)
+    TRY_FUNC ("cos", COS)
+    TRY_FUNC ("exp", EXP)
+    TRY_FUNC ("log", LOG)
+    TRY_FUNC ("ln",  LOG)
+    if (len == 1)
+    {
+        token->kind = TOKEN_VAR;
+        token->sym  = *begin;
+    }
+    else
+    {
+        return false;
     }
 
-    SUCCESS();
+    *input_str = str;
+    return true;
 }
 
-// -------------------------------------------------------------------------------------------------
+#undef TRY_FUNC
 
-static tree::node_t *GetMulOperand (const char **input_str)
+/**
+ * @brief Decimal number: [+-] digits [. digits] [e [+-] digits], at least one mantissa digit
+ *
+ * Up to 19 significant digits are collected in integer mantissa, when it and the power of ten
+ * are exact doubles the result is one exactly rounded multiplication or division.
+ * Other numbers (and hexadecimal ones) are left to strtod, so result is always correctly rounded.
+ */
+static bool scan_number (const char **input_str, double *val)
 {
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
+    assert (input_str  != nullptr && "invalid pointer");
+    assert (*input_str != nullptr && "invalid pointer");
+    assert (val        != nullptr && "invalid pointer");
 
-    const char *str        = *input_str;
-    tree::node_t *node     = nullptr;
-    tree::node_t *node_rhs = nullptr;
+    const char *begin = *input_str;
+    const char *str   = begin;
 
-    TRY (node = GetFuncOperand (&str));
+    bool negative = (*str == '-');
+    if (*str == '+' || *str == '-') str++;
 
-    SKIP_SPACES();
-    while (*str == '^')
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
     {
-        str++;
+        char *end = nullptr;
+        *val = strtod (begin, &end);
 
-        TRY (node_rhs = GetFuncOperand (&str));
+        *input_str = end;
+        return end != begin;
+    }
 
-        node = pow (node, node_rhs);
+    uint64_t mantissa  = 0;
+    int      n_digits  = 0;     ///< Significant digits in mantissa
+    int      exp10     = 0;
+    bool     truncated = false;
+    bool     has_digit = false;
+
+    for (; is_digit (*str); ++str)
+    {
+        has_digit = true;
 
-        SKIP_SPACES();
+        if (mantissa == 0 && *str == '0') continue;
+
+        if (n_digits < NUM_MAX_DIGITS)
+        {
+            mantissa = mantissa * 10 + (uint64_t) (*str - '0');
+            n_digits++;
+        }
+        else
+        {
+            exp10++;
+            truncated |= (*str != '0');
+        }
     }
 
-    SUCCESS();
-}
+    if (*str == '.')
+    {
+        for (str++; is_digit (*str); ++str)
+        {
+            has_digit = true;
+
+            if (mantissa == 0 && *str == '0')
+            {
+                exp10--;
+                continue;
+            }
+
+            if (n_digits < NUM_MAX_DIGITS)
+            {
+                mantissa = mantissa * 10 + (uint64_t) (*str - '0');
+                n_digits++;
+                exp10--;
+            }
+            else
+            {
+                truncated |= (*str != '0');
+            }
+        }
+    }
 
-// -------------------------------------------------------------------------------------------------
+    if (!has_digit) return false;
 
-static tree::node_t *GetFuncOperand (const char **input_str)
-{
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
+    if ((*str == 'e' || *str == 'E') &&
+        (is_digit (str[1]) || ((str[1] == '+' || str[1] == '-') && is_digit (str[2]))))
+    {
+        str++;
+
+        bool negative_exp = (*str == '-');
+        if (*str == '+' || *str == '-') str++;
 
-    const char *str    = *input_str;
-    tree::node_t *node = GetFunction (&str);
+        int exp = 0;
+        for (; is_digit (*str); ++str)
+        {
+            if (exp < NUM_MAX_EXP) exp = exp * 10 + (*str - '0');
+        }
+
+        exp10 += negative_exp ? -exp : exp;
+    }
 
-    if (node != nullptr)
+    if (mantissa == 0)
     {
-        SUCCESS();
+        *val = negative ? -0.0 : 0.0;
     }
+    else if (!truncated && mantissa <= NUM_MAX_EXACT_MANTISSA &&
+             -NUM_MAX_EXACT_POW10 <= exp10 && exp10 <= NUM_MAX_EXACT_POW10)
+    {
+        double res = (double) mantissa;
+        res = (exp10 < 0) ? res / POW10[-exp10] : res * POW10[exp10];
 
-    TRY (node = GetGeneralOperand (&str));
+        *val = negative ? -res : res;
+    }
+    else
+    {
+        *val = strtod (begin, nullptr);
+    }
 
-    SUCCESS();
+    *input_str = str;
+    return true;
 }
 
-// -------------------------------------------------------------------------------------------------
+static bool is_digit (char c)
+{
+    return '0' <= c && c <= '9';
+}
 
-#define TRY_PARSE_FUNC(name, type)              \
-if (strncmp (name, str, sizeof(name) - 1) == 0) \
-{                                               \
-    op_type = tree::op_t::type;                 \
-    str += sizeof(name)-1;                      \
-} else 
+static bool is_alpha (char c)
+{
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
 
-static tree::node_t *GetFunction (const char **input_str)
+static bool is_space (char c)
 {
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
 
-    const char *str    = *input_str;
-    tree::node_t *node = nullptr;
-    tree::op_t op_type = tree::op_t::ADD; // It is invalid op in this situation => poison
+// -------------------------------------------------------------------------------------------------
+
+/// Apply the top binary operator to two top operands
+static bool reduce (parser_t *parser)
+{
+    assert (parser != nullptr && "invalid pointer");
+    assert (parser->n_ops      >  0 && "no operator");
+    assert (parser->n_operands >= 2 && "no operands");
 
-    SKIP_SPACES();
+    char sym = parser->ops[--parser->n_ops].sym;
 
-    TRY_PARSE_FUNC ("sin ", SIN)
-    TRY_PARSE_FUNC ("cos ", COS)
-    TRY_PARSE_FUNC ("exp ", EXP)
-    TRY_PARSE_FUNC ("log ", LOG)
+    tree::node_t *rhs  = parser->operands[parser->n_operands - 1];
+    tree::node_t *lhs  = parser->operands[parser->n_operands - 2];
+    tree::node_t *node = nullptr;
+
+    switch (sym)
     {
-        return nullptr;
+        case '+': node = add (lhs, rhs); break;
+        case '-': node = sub (lhs, rhs); break;
+        case '*': node = mul (lhs, rhs); break;
+        case '/': node = div (lhs, rhs); break;
+        case '^': node = pow (lhs, rhs); break;
+
+        default:
+            assert (0 && "Unexpected operator");
+            return false;
     }
 
-    TRY (node = GetGeneralOperand (&str));
+    if (node == nullptr) return false;
+
+    parser->n_operands--;
+    parser->operands[parser->n_operands - 1] = node;
 
-    switch (op_type)
+    return true;
+}
+
+/// Apply function waiting for the just completed operand (if there is one)
+static bool reduce_func (parser_t *parser)
+{
+    assert (parser != nullptr && "invalid pointer");
+    assert (parser->n_operands > 0 && "no operand");
+
+    if (parser->n_ops == 0 || TOP_OP (parser).sym != 'f') return true;
+
+    tree::op_t    func = parser->ops[--parser->n_ops].func;
+    tree::node_t *arg  = parser->operands[parser->n_operands - 1];
+    tree::node_t *node = nullptr;
+
+    switch (func)
     {
-        case tree::op_t::SIN: node = sin (node); break;
-        case tree::op_t::COS: node = cos (node); break;
-        case tree::op_t::EXP: node = exp (node); break;
-        case tree::op_t::LOG: node = log (node); break;
+        case tree::op_t::SIN: node = sin (arg); break;
+        case tree::op_t::COS: node = cos (arg); break;
+        case tree::op_t::EXP: node = exp (arg); break;
+        case tree::op_t::LOG: node = log (arg); break;
 
         case tree::op_t::ADD:
         case tree::op_t::SUB:
@@ -244,71 +585,84 @@ static tree::node_t *GetFunction (const char **input_str)
         case tree::op_t::MUL:
         case tree::op_t::POW:
             assert (0 && "Invalid situation");
+            return false;
 
         default:
             assert (0 && "Unexpected op");
-        }
+            return false;
+    }
 
-    SUCCESS();
+    if (node == nullptr) return false;
+
+    parser->operands[parser->n_operands - 1] = node;
+    return true;
 }
 
-#undef TRY_PARSE_FUNC
+/// '(' and functions are never reduced by binary operators
+static int precedence (char sym)
+{
+    switch (sym)
+    {
+        case '+': case '-': return 1;
+        case '*': case '/': return 2;
+        case '^':           return 3;
+
+        default:
+            return 0;
+    }
+}
 
 // -------------------------------------------------------------------------------------------------
 
-static tree::node_t *GetGeneralOperand (const char **input_str)
-{
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
+#define GROW_STACK(array, inline_array, capacity, size, type)                           \
+{                                                                                       \
+    type *new_array = (type *) malloc (2 * parser->capacity * sizeof (type));           \
+    if (new_array == nullptr) return false;                                             \
+                                                                                        \
+    memcpy (new_array, parser->array, parser->size * sizeof (type));                    \
+    if (parser->array != parser->inline_array) free (parser->array);                    \
+                                                                                        \
+    parser->array     = new_array;                                                      \
+    parser->capacity *= 2;                                                              \
+}
 
-    const char *str    = *input_str;
-    tree::node_t *node = nullptr;
+static bool push_operand (parser_t *parser, tree::node_t *node)
+{
+    assert (parser != nullptr && "invalid pointer");
 
-    SKIP_SPACES();
-    if (*str == '(')
+    if (parser->n_operands == parser->operands_capacity)
     {
-        str++;
+        GROW_STACK (operands, inline_operands, operands_capacity, n_operands, tree::node_t *);
+    }
 
-        TRY (node = GetExpression (&str));
+    parser->operands[parser->n_operands++] = node;
+    return true;
+}
 
-        SKIP_SPACES();
-        EXPECT (*str == ')');
-        str++;
-    }
-    else
+static bool push_op (parser_t *parser, parse_op_t op)
+{
+    assert (parser != nullptr && "invalid pointer");
+
+    if (parser->n_ops == parser->ops_capacity)
     {
-        TRY (node = GetQuant (&str));
+        GROW_STACK (ops, inline_ops, ops_capacity, n_ops, parse_op_t);
     }
 
-    SUCCESS();
+    parser->ops[parser->n_ops++] = op;
+    return true;
 }
 
-// -------------------------------------------------------------------------------------------------
+#undef GROW_STACK
 
-static tree::node_t *GetQuant (const char **input_str)
+static bool fail (tree::parse_error_t *error, tree::tree_err_t err, size_t offset, const char *expected)
 {
-    assert (input_str  != nullptr);
-    assert (*input_str != nullptr);
-
-    const char *str    = *input_str;
-    tree::node_t *node = nullptr;
+    assert (error != nullptr && "invalid pointer");
 
-    SKIP_SPACES();
-    if (isalpha (*str))
-    {
-        node = tree::new_node (*str);
-        str++;
+    error->err      = err;
+    error->offset   = offset;
+    error->expected = expected;
 
-        SUCCESS ();
-    }
-
-    double val = 0;
-    int n_symb = 0;
-    
-    EXPECT (sscanf (str, "%lg%n", &val, &n_symb) == 1);
-    
-    str += n_symb;
-    node = tree::new_node (val);
+    return false;
+}
 
-    SUCCESS();
-}
\ No newline at end of file
+#undef TOP_OP
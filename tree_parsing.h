@@ -1,11 +1,26 @@
 #ifndef TREE_PARSING_H
 #define TREE_PARSING_H
 
+#include <stddef.h>
+
 #include "tree.h"
 
 namespace tree
 {
-    tree::node_t *parse_dump (const char *dump);
+    /**
+     * @brief Why parse_dump failed
+     */
+    struct parse_error_t
+    {
+        tree_err_t  err      = OK;        ///< INVALID_DUMP for malformed input, OOM
+        size_t      offset   = 0;         ///< Offset of the token which can't be parsed
+        const char *expected = nullptr;   ///< What could stand at offset (nullptr on OOM)
+    };
+
+    /**
+     * @return Tree of expression or nullptr on error, which is described in error (if it isn't nullptr)
+     */
+    tree::node_t *parse_dump (const char *dump, parse_error_t *error = nullptr);
 }
 
-#endif
\ No newline at end of file
+#endif
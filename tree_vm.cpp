@@ -0,0 +1,916 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "scheduler.h"
+#include "tree.h"
+#include "tree_vm.h"
+
+// -------------------------------------------------------------------------------------------------
+// CONST SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Programs with deeper stack use heap allocated one
+const size_t VM_STACK_SIZE = 256;
+
+/// Points processed by one instruction in batch mode, multiple of VM_VECTOR_WIDTH
+const size_t VM_BATCH_BLOCK = 256;
+
+/// Doubles in one vector of batch kernels, AVX2 register
+const size_t VM_VECTOR_WIDTH = 4;
+
+/// Chunk of points of deterministic multithreaded batch
+const size_t VM_DETERMINISTIC_CHUNK = 16 * VM_BATCH_BLOCK;
+
+/// Automatic chunking gives every thread about this number of chunks to balance load by stealing
+const size_t VM_CHUNKS_PER_THREAD = 8;
+
+/// Compilation of trees not deeper than this doesn't allocate memory for the walk
+const size_t VM_INLINE_FRAMES = 64;
+
+/// x + ROUND_MAGIC - ROUND_MAGIC rounds x to integer, low bits of x + ROUND_MAGIC hold this integer
+const double  ROUND_MAGIC      = 0x1.8p52;
+const int64_t ROUND_MAGIC_BITS = 0x4338000000000000;
+
+const int64_t DBL_SIGN_BIT      = INT64_MIN;
+const int64_t DBL_MANTISSA_MASK = 0x000FFFFFFFFFFFFF;
+const int64_t DBL_ONE_BITS      = 0x3FF0000000000000;
+const int     DBL_MANTISSA_BITS = 52;
+const int64_t DBL_EXP_BIAS      = 1023;
+
+/// Split of ln (2) and pi / 2 from fdlibm, high parts are short enough to be multiplied exactly
+const double LN2_HI = 6.93147180369123816490e-01;
+const double LN2_LO = 1.90821492927058770002e-10;
+const double PIO2_1 = 1.57079632673412561417e+00;
+const double PIO2_2 = 6.07710050630396597660e-11;
+const double PIO2_3 = 2.02226624879595063154e-21;
+
+const double LOG2E       = 1.4426950408889634;
+const double SQRT2       = 1.4142135623730951;
+const double TWO_OVER_PI = 0.63661977236758134308;
+
+/// Arguments out of fast ranges (and NaN) are computed by libm
+const double EXP_FAST_MIN  = -708;
+const double EXP_FAST_MAX  =  709;
+const double TRIG_FAST_MAX =  65536;
+
+const double POW_FAST_MAX_EXP = 4;
+const size_t POW_FAST_BITS    = 3;      ///< Bits of POW_FAST_MAX_EXP
+
+/// Taylor coefficients of exp (r), |r| <= ln (2) / 2
+const double EXP_POLY[] = {1.0, 1.0, 0.5, 0.16666666666666666, 0.041666666666666664,
+                           0.008333333333333333, 0.001388888888888889, 0.0001984126984126984,
+                           2.48015873015873e-05, 2.7557319223985893e-06, 2.755731922398589e-07,
+                           2.505210838544172e-08, 2.08767569878681e-09, 1.6059043836821613e-10};
+
+/// log (1 + f) = f - f^2 / 2 + s * (f^2 / 2 + z * LOG_POLY (z)), s = f / (2 + f), z = s^2
+const double LOG_POLY[] = {0.6666666666666666, 0.4, 0.2857142857142857, 0.2222222222222222,
+                           0.18181818181818182, 0.15384615384615385, 0.13333333333333333,
+                           0.11764705882352941, 0.10526315789473684, 0.09523809523809523,
+                           0.08695652173913043, 0.08};
+
+/// sin (r) = r + r * z * SIN_POLY (z), cos (r) = 1 + z * COS_POLY (z), z = r^2, |r| <= pi / 4
+const double SIN_POLY[] = {-0.16666666666666666, 0.008333333333333333, -0.0001984126984126984,
+                           2.7557319223985893e-06, -2.505210838544172e-08, 1.6059043836821613e-10,
+                           -7.647163731819816e-13, 2.8114572543455206e-15, -8.22063524662433e-18};
+const double COS_POLY[] = {-0.5, 0.041666666666666664, -0.001388888888888889,
+                           2.48015873015873e-05, -2.755731922398589e-07, 2.08767569878681e-09,
+                           -1.1470745597729725e-11, 4.779477332387385e-14, -1.5619206968586225e-16};
+
+// -------------------------------------------------------------------------------------------------
+// STATIC PROTOTYPES SECTION
+// -------------------------------------------------------------------------------------------------
+
+/// Operation which operands are being compiled, left_depth is stack depth of the left one
+struct emit_frame_t
+{
+    const tree::node_t *node;
+    size_t              left_depth;
+    bool                right;      ///< Right operand is being compiled
+};
+
+struct emit_stack_t
+{
+    emit_frame_t *frames;
+    size_t        capacity;
+    size_t        size;
+
+    emit_frame_t  inline_frames[VM_INLINE_FRAMES];
+};
+
+static void emit_stack_ctor (emit_stack_t *stack);
+static void emit_stack_dtor (emit_stack_t *stack);
+static bool emit_stack_push (emit_stack_t *stack, const tree::node_t *node, bool right);
+
+static bool count_program (const tree::node_t *node, size_t *code_size, size_t *n_consts);
+
+static bool emit_subtree (const tree::node_t *node, tree::program_t *program, size_t *depth);
+static void emit_node    (const tree::node_t *node, tree::program_t *program);
+
+static void emit (tree::program_t *program, tree::vm_op_t op, unsigned arg = 0);
+
+static double run (const tree::program_t *program, double x, double *stack);
+
+static void run_block (const tree::program_t *program, const double *xs, double *out, size_t n,
+                                                                                double *stack);
+
+struct batch_job_t
+{
+    const tree::program_t *programs;
+    size_t                 n_programs;
+
+    const double *xs;
+    double       *out;
+    size_t        n;
+
+    size_t chunk_size;
+    size_t n_chunks;        ///< Chunks per program
+
+    std::atomic<bool> oom;
+};
+
+static void batch_task (size_t task_indx, void *job_void);
+
+static size_t batch_chunk_size (size_t n, unsigned n_threads, const tree::batch_opts_t *opts);
+
+/// Kernels are written with GCC vector extensions, so the same source is built for every target
+typedef double  vd_t __attribute__ ((vector_size (VM_VECTOR_WIDTH * sizeof (double))));
+typedef int64_t vi_t __attribute__ ((vector_size (VM_VECTOR_WIDTH * sizeof (int64_t))));
+
+/// Bodies of kernels are inlined into every kernel set and compiled for its target
+#define KERNEL_BODY __attribute__ ((always_inline)) inline
+
+KERNEL_BODY static void kernel_add (double *lhs, const double *rhs, size_t n);
+KERNEL_BODY static void kernel_sub (double *lhs, const double *rhs, size_t n);
+KERNEL_BODY static void kernel_mul (double *lhs, const double *rhs, size_t n);
+KERNEL_BODY static void kernel_div (double *lhs, const double *rhs, size_t n);
+KERNEL_BODY static void kernel_pow (double *lhs, const double *rhs, size_t n);
+
+KERNEL_BODY static void kernel_exp  (double *arg, size_t n);
+KERNEL_BODY static void kernel_log  (double *arg, size_t n);
+KERNEL_BODY static void kernel_trig (double *arg, size_t n, int64_t shift);
+KERNEL_BODY static void kernel_sin  (double *arg, size_t n);
+KERNEL_BODY static void kernel_cos  (double *arg, size_t n);
+
+typedef void (*binary_kernel_f) (double *lhs, const double *rhs, size_t n);
+typedef void (*unary_kernel_f)  (double *arg, size_t n);
+
+/// Kernels built for one instruction set
+struct kernel_set_t
+{
+    binary_kernel_f add, sub, mul, div, pow;
+    unary_kernel_f  sin, cos, exp, log;
+};
+
+static const kernel_set_t *select_kernels ();
+
+// -------------------------------------------------------------------------------------------------
+// PUBLIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+tree::tree_err_t tree::compile (const tree_t *tree, program_t *program)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    return compile (tree->head_node, program);
+}
+
+tree::tree_err_t tree::compile (const node_t *node, program_t *program)
+{
+    assert (node    != nullptr && "invalid pointer");
+    assert (program != nullptr && "invalid pointer");
+
+    *program = {};
+
+    size_t code_size = 0;
+    size_t n_consts  = 0;
+    if (!count_program (node, &code_size, &n_consts)) return OOM;
+
+    program->code   = (vm_instr_t *) calloc (code_size, sizeof (vm_instr_t));
+    program->consts = (double *)     calloc (n_consts + 1, sizeof (double));
+
+    if (program->code == nullptr || program->consts == nullptr ||
+        !emit_subtree (node, program, &program->max_depth))
+    {
+        program_dtor (program);
+        return OOM;
+    }
+
+    assert (program->code_size == code_size && "Invalid program size");
+    return OK;
+}
+
+void tree::program_dtor (program_t *program)
+{
+    assert (program != nullptr && "invalid pointer");
+
+    free (program->code);
+    free (program->consts);
+
+    *program = {};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+double tree::calc_tree (const program_t *program, double x)
+{
+    assert (program       != nullptr && "invalid pointer");
+    assert (program->code != nullptr && "program is not compiled");
+
+    if (program->max_depth <= VM_STACK_SIZE)
+    {
+        double stack[VM_STACK_SIZE];
+        return run (program, x, stack);
+    }
+
+    double *stack = (double *) calloc (program->max_depth, sizeof (double));
+    if (stack == nullptr) return NAN;
+
+    double res = run (program, x, stack);
+
+    free (stack);
+    return res;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Calculate tree in every point of xs: out[i] = f(xs[i])
+ */
+tree::tree_err_t tree::calc_tree_batch (const tree_t *tree, const double *xs, double *out, size_t n)
+{
+    assert (tree != nullptr && "invalid pointer");
+
+    program_t program = {};
+    tree_err_t err = compile (tree, &program);
+    if (err != OK) return err;
+
+    err = calc_tree_batch (&program, xs, out, n);
+
+    program_dtor (&program);
+    return err;
+}
+
+tree::tree_err_t tree::calc_tree_batch (const program_t *program, const double *xs, double *out,
+                                                                                    size_t n)
+{
+    assert (program       != nullptr && "invalid pointer");
+    assert (program->code != nullptr && "program is not compiled");
+    assert (xs  != nullptr && "invalid pointer");
+    assert (out != nullptr && "invalid pointer");
+
+    // Every stack slot is a block of values
+    double *stack = (double *) aligned_alloc (64, program->max_depth * VM_BATCH_BLOCK * sizeof (double));
+    if (stack == nullptr) return OOM;
+
+    for (size_t i = 0; i < n; i += VM_BATCH_BLOCK)
+    {
+        size_t block_size = (n - i < VM_BATCH_BLOCK) ? n - i : VM_BATCH_BLOCK;
+        run_block (program, xs + i, out + i, block_size, stack);
+    }
+
+    free (stack);
+    return OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Multithreaded calc_tree_batch, points are split into chunks shared by worker threads
+ *
+ * Program is only read, so no locking is needed.
+ */
+tree::tree_err_t tree::calc_tree_batch_mt (const program_t *program, const double *xs, double *out,
+                                                            size_t n, const batch_opts_t *opts)
+{
+    return calc_trees_batch_mt (program, 1, xs, out, n, opts);
+}
+
+/**
+ * @brief Calculate several programs in every point: out[p * n + i] = f_p(xs[i])
+ */
+tree::tree_err_t tree::calc_trees_batch_mt (const program_t *programs, size_t n_programs,
+                                            const double *xs, double *out, size_t n,
+                                                                   const batch_opts_t *opts)
+{
+    assert (programs != nullptr && "invalid pointer");
+    assert (xs       != nullptr && "invalid pointer");
+    assert (out      != nullptr && "invalid pointer");
+
+    const batch_opts_t default_opts = {};
+    if (opts == nullptr) opts = &default_opts;
+
+    unsigned n_threads = (opts->n_threads) ? opts->n_threads : sched::hardware_threads ();
+
+    batch_job_t job = {};
+    job.programs   = programs;
+    job.n_programs = n_programs;
+    job.xs         = xs;
+    job.out        = out;
+    job.n          = n;
+    job.chunk_size = batch_chunk_size (n, n_threads, opts);
+    job.n_chunks   = (n + job.chunk_size - 1) / job.chunk_size;
+
+    sched::parallel_for (job.n_chunks * n_programs, batch_task, &job, n_threads);
+
+    return (job.oom.load ()) ? OOM : OK;
+}
+
+// -------------------------------------------------------------------------------------------------
+// STATIC SECTION
+// -------------------------------------------------------------------------------------------------
+
+static void batch_task (size_t task_indx, void *job_void)
+{
+    assert (job_void != nullptr && "invalid pointer");
+
+    batch_job_t *job = (batch_job_t *) job_void;
+
+    size_t program_indx = task_indx / job->n_chunks;
+    size_t begin        = (task_indx % job->n_chunks) * job->chunk_size;
+    size_t size         = (job->n - begin < job->chunk_size) ? job->n - begin : job->chunk_size;
+
+    if (tree::calc_tree_batch (job->programs + program_indx, job->xs + begin,
+                               job->out + program_indx * job->n + begin, size) != tree::OK)
+    {
+        job->oom.store (true);
+    }
+}
+
+static size_t batch_chunk_size (size_t n, unsigned n_threads, const tree::batch_opts_t *opts)
+{
+    assert (opts != nullptr && "invalid pointer");
+
+    if (opts->chunk_size != 0)  return opts->chunk_size;
+    if (opts->deterministic)    return VM_DETERMINISTIC_CHUNK;
+
+    size_t chunk_size = n / (n_threads * VM_CHUNKS_PER_THREAD);
+
+    // Round up to whole blocks
+    chunk_size = (chunk_size + VM_BATCH_BLOCK - 1) / VM_BATCH_BLOCK * VM_BATCH_BLOCK;
+
+    return (chunk_size) ? chunk_size : VM_BATCH_BLOCK;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void emit_stack_ctor (emit_stack_t *stack)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    stack->frames   = stack->inline_frames;
+    stack->capacity = VM_INLINE_FRAMES;
+    stack->size     = 0;
+}
+
+static void emit_stack_dtor (emit_stack_t *stack)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    if (stack->frames != stack->inline_frames) free (stack->frames);
+    stack->frames = nullptr;
+}
+
+static bool emit_stack_push (emit_stack_t *stack, const tree::node_t *node, bool right)
+{
+    assert (stack != nullptr && "invalid pointer");
+
+    if (stack->size == stack->capacity)
+    {
+        size_t new_capacity = 2 * stack->capacity;
+
+        emit_frame_t *new_frames = (emit_frame_t *) malloc (new_capacity * sizeof (emit_frame_t));
+        if (new_frames == nullptr) return false;
+
+        memcpy (new_frames, stack->frames, stack->size * sizeof (emit_frame_t));
+        if (stack->frames != stack->inline_frames) free (stack->frames);
+
+        stack->frames   = new_frames;
+        stack->capacity = new_capacity;
+    }
+
+    stack->frames[stack->size++] = {node, 0, right};
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @return false on OOM
+ */
+static bool count_program (const tree::node_t *node, size_t *code_size, size_t *n_consts)
+{
+    assert (node      != nullptr && "invalid pointer");
+    assert (code_size != nullptr && "invalid pointer");
+    assert (n_consts  != nullptr && "invalid pointer");
+
+    emit_stack_t stack = {};
+    emit_stack_ctor (&stack);
+
+    bool ok = emit_stack_push (&stack, node, false);
+
+    // Every node is one instruction, so order of the walk doesn't matter
+    while (ok && stack.size > 0)
+    {
+        node = stack.frames[--stack.size].node;
+
+        (*code_size)++;
+        if (node->type == tree::node_type_t::VAL) (*n_consts)++;
+
+        if (node->left  != nullptr) ok = emit_stack_push (&stack, node->left, false);
+        if (node->right != nullptr) ok = ok && emit_stack_push (&stack, node->right, false);
+    }
+
+    emit_stack_dtor (&stack);
+    return ok;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Post-order emission with explicit stack like calc_subtree: operation is emitted after
+ *        its operands, left operand stays on VM stack while the right one is calculated
+ *
+ * @param[out] depth Stack depth needed to calculate the subtree
+ *
+ * @return false on OOM
+ */
+static bool emit_subtree (const tree::node_t *node, tree::program_t *program, size_t *depth)
+{
+    assert (node    != nullptr && "invalid pointer");
+    assert (program != nullptr && "invalid pointer");
+    assert (depth   != nullptr && "invalid pointer");
+
+    emit_stack_t stack = {};
+    emit_stack_ctor (&stack);
+
+    bool ok = true;
+
+    while (true)
+    {
+        while (ok && node->type == tree::node_type_t::OP)
+        {
+            assert (node->right != nullptr && "Invalid op");
+
+            ok   = emit_stack_push (&stack, node, node->left == nullptr);
+            node = (node->left != nullptr) ? node->left : node->right;
+        }
+
+        if (!ok) break;
+
+        emit_node (node, program);
+        *depth = 1;
+
+        while (stack.size > 0 && stack.frames[stack.size - 1].right)
+        {
+            emit_frame_t *frame = stack.frames + --stack.size;
+
+            if (frame->node->left != nullptr)
+            {
+                size_t right_depth = *depth + 1;
+                *depth = (frame->left_depth > right_depth) ? frame->left_depth : right_depth;
+            }
+
+            emit_node (frame->node, program);
+        }
+
+        if (stack.size == 0) break;
+
+        emit_frame_t *frame = stack.frames + stack.size - 1;
+        frame->left_depth = *depth;
+        frame->right      = true;
+
+        node = frame->node->right;
+    }
+
+    emit_stack_dtor (&stack);
+    return ok;
+}
+
+#define OP_CASE(op_type)                                \
+    case tree::op_t::op_type:                           \
+        emit (program, tree::vm_op_t::op_type);         \
+        break;
+
+/// One instruction of node, its operands are already emitted
+static void emit_node (const tree::node_t *node, tree::program_t *program)
+{
+    assert (node    != nullptr && "invalid pointer");
+    assert (program != nullptr && "invalid pointer");
+
+    switch (node->type)
+    {
+        case tree::node_type_t::VAL:
+            program->consts[program->n_consts] = node->val;
+            emit (program, tree::vm_op_t::CONST, (unsigned) program->n_consts++);
+            return;
+
+        case tree::node_type_t::VAR:
+            emit (program, (node->var == 'x') ? tree::vm_op_t::VAR_X : tree::vm_op_t::VAR_NAN);
+            return;
+
+        case tree::node_type_t::OP:
+            break;
+
+        case tree::node_type_t::NOT_SET:
+            assert (0 && "invalid node");
+        default:
+            assert (0 && "unexpected node type");
+    }
+
+    switch (node->op)
+    {
+        OP_CASE (ADD)
+        OP_CASE (SUB)
+        OP_CASE (DIV)
+        OP_CASE (MUL)
+        OP_CASE (SIN)
+        OP_CASE (COS)
+        OP_CASE (EXP)
+        OP_CASE (POW)
+        OP_CASE (LOG)
+
+        default:
+            assert (0 && "Unexpected op type");
+    }
+}
+
+#undef OP_CASE
+
+static void emit (tree::program_t *program, tree::vm_op_t op, unsigned arg)
+{
+    assert (program != nullptr && "invalid pointer");
+
+    program->code[program->code_size++] = {op, arg};
+}
+
+// -------------------------------------------------------------------------------------------------
+
+#define BINARY_OP(op_type, expr)                \
+    case tree::vm_op_t::op_type:                \
+        top--;                                  \
+        top[-1] = expr;                         \
+        break;
+
+#define UNARY_OP(op_type, func)                 \
+    case tree::vm_op_t::op_type:                \
+        top[-1] = func (top[-1]);               \
+        break;
+
+static double run (const tree::program_t *program, double x, double *stack)
+{
+    assert (program != nullptr && "invalid pointer");
+    assert (stack   != nullptr && "invalid pointer");
+
+    const tree::vm_instr_t *instr = program->code;
+    const tree::vm_instr_t *end   = program->code + program->code_size;
+    const double *consts          = program->consts;
+
+    double *top = stack;
+
+    for (; instr != end; ++instr)
+    {
+        switch (instr->op)
+        {
+            case tree::vm_op_t::CONST:   *top++ = consts[instr->arg]; break;
+            case tree::vm_op_t::VAR_X:   *top++ = x;                  break;
+            case tree::vm_op_t::VAR_NAN: *top++ = NAN;                break;
+
+            BINARY_OP (ADD, top[-1] + top[0])
+            BINARY_OP (SUB, top[-1] - top[0])
+            BINARY_OP (DIV, top[-1] / top[0])
+            BINARY_OP (MUL, top[-1] * top[0])
+            BINARY_OP (POW, pow (top[-1], top[0]))
+
+            UNARY_OP (SIN, sin)
+            UNARY_OP (COS, cos)
+            UNARY_OP (EXP, exp)
+            UNARY_OP (LOG, log)
+
+            default:
+                assert (0 && "Unexpected instruction");
+        }
+    }
+
+    assert (top == stack + 1 && "Invalid program");
+    return stack[0];
+}
+
+#undef BINARY_OP
+#undef UNARY_OP
+
+// -------------------------------------------------------------------------------------------------
+
+#define BINARY_OP(op_type, kernel)                                  \
+    case tree::vm_op_t::op_type:                                    \
+        top -= VM_BATCH_BLOCK;                                      \
+        kernels->kernel (top - VM_BATCH_BLOCK, top, n_lanes);       \
+        break;
+
+#define UNARY_OP(op_type, kernel)                                   \
+    case tree::vm_op_t::op_type:                                    \
+        kernels->kernel (top - VM_BATCH_BLOCK, n_lanes);            \
+        break;
+
+/**
+ * @brief Block is padded up to whole vectors with the last point, so kernels
+ *        have no scalar tails and every point is computed the same way wherever it is
+ */
+static void run_block (const tree::program_t *program, const double *xs, double *out, size_t n,
+                                                                                double *stack)
+{
+    assert (program != nullptr && "invalid pointer");
+    assert (stack   != nullptr && "invalid pointer");
+    assert (0 < n && n <= VM_BATCH_BLOCK && "invalid block size");
+    assert ((uintptr_t) stack % sizeof (vd_t) == 0 && "unaligned stack");
+
+    const tree::vm_instr_t *instr = program->code;
+    const tree::vm_instr_t *end   = program->code + program->code_size;
+
+    const kernel_set_t *kernels = select_kernels ();
+
+    size_t n_lanes = (n + VM_VECTOR_WIDTH - 1) / VM_VECTOR_WIDTH * VM_VECTOR_WIDTH;
+
+    double *top = stack;
+
+    for (; instr != end; ++instr)
+    {
+        switch (instr->op)
+        {
+            case tree::vm_op_t::CONST:
+                for (size_t i = 0; i < n_lanes; ++i) top[i] = program->consts[instr->arg];
+                top += VM_BATCH_BLOCK;
+                break;
+
+            case tree::vm_op_t::VAR_X:
+                memcpy (top, xs, n * sizeof (double));
+                for (size_t i = n; i < n_lanes; ++i) top[i] = xs[n - 1];
+                top += VM_BATCH_BLOCK;
+                break;
+
+            case tree::vm_op_t::VAR_NAN:
+                for (size_t i = 0; i < n_lanes; ++i) top[i] = NAN;
+                top += VM_BATCH_BLOCK;
+                break;
+
+            BINARY_OP (ADD, add)
+            BINARY_OP (SUB, sub)
+            BINARY_OP (MUL, mul)
+            BINARY_OP (DIV, div)
+            BINARY_OP (POW, pow)
+
+            UNARY_OP (SIN, sin)
+            UNARY_OP (COS, cos)
+            UNARY_OP (EXP, exp)
+            UNARY_OP (LOG, log)
+
+            default:
+                assert (0 && "Unexpected instruction");
+        }
+    }
+
+    assert (top == stack + VM_BATCH_BLOCK && "Invalid program");
+    memcpy (out, stack, n * sizeof (double));
+}
+
+#undef BINARY_OP
+#undef UNARY_OP
+
+// -------------------------------------------------------------------------------------------------
+
+/// Vector of val in every lane
+#define BROADCAST(val) (vd_t {} + (val))
+
+/// Lanes of lhs where mask is set, lanes of rhs elsewhere
+#define SELECT(mask, lhs, rhs) ((vd_t) (((vi_t) (lhs) & (mask)) | ((vi_t) (rhs) & ~(mask))))
+
+/// Horner scheme over array of coefficients starting from the free one
+#define HORNER(res, arg, coeffs)                                                    \
+    do {                                                                            \
+        res = BROADCAST (coeffs[sizeof (coeffs) / sizeof (*coeffs) - 1]);           \
+        for (size_t j_ = sizeof (coeffs) / sizeof (*coeffs) - 1; j_-- > 0;)         \
+            res = res * (arg) + coeffs[j_];                                         \
+    } while (0)
+
+/// Lanes where mask is set are recomputed by scalar libm function
+#define LIBM_FALLBACK(res, mask, expr)                                              \
+    for (size_t lane = 0; lane < VM_VECTOR_WIDTH; ++lane)                           \
+        if (mask[lane]) res[lane] = expr;
+
+#define KERNEL(name, op)                                                            \
+    KERNEL_BODY static void name (double *lhs, const double *rhs, size_t n)       \
+    {                                                                               \
+        assert (n % VM_VECTOR_WIDTH == 0 && "partial vector");                      \
+                                                                                    \
+        vd_t       *lhs_vec = (vd_t *)       lhs;                                   \
+        const vd_t *rhs_vec = (const vd_t *) rhs;                                   \
+                                                                                    \
+        for (size_t i = 0; i < n / VM_VECTOR_WIDTH; ++i)                            \
+            lhs_vec[i] = lhs_vec[i] op rhs_vec[i];                                  \
+    }
+
+KERNEL (kernel_add, +)
+KERNEL (kernel_sub, -)
+KERNEL (kernel_mul, *)
+KERNEL (kernel_div, /)
+
+#undef KERNEL
+
+/**
+ * @brief Integer powers up to POW_FAST_MAX_EXP by squaring,
+ *        other exponents and results out of normal range go to libm
+ */
+KERNEL_BODY static void kernel_pow (double *lhs, const double *rhs, size_t n)
+{
+    assert (n % VM_VECTOR_WIDTH == 0 && "partial vector");
+
+    vd_t       *lhs_vec = (vd_t *)       lhs;
+    const vd_t *rhs_vec = (const vd_t *) rhs;
+
+    for (size_t i = 0; i < n / VM_VECTOR_WIDTH; ++i)
+    {
+        vd_t x = lhs_vec[i];
+        vd_t y = rhs_vec[i];
+
+        vd_t y_abs = (vd_t) ((vi_t) y & ~DBL_SIGN_BIT);
+        vi_t fast  = (y == (y + ROUND_MAGIC) - ROUND_MAGIC) & (y_abs <= POW_FAST_MAX_EXP);
+        vi_t y_int = (vi_t) (y_abs + ROUND_MAGIC) - ROUND_MAGIC_BITS;
+
+        vd_t res  = BROADCAST (1.0);
+        vd_t base = x;
+        for (size_t bit = 0; bit < POW_FAST_BITS; ++bit)
+        {
+            res  = SELECT (((y_int >> bit) & 1) != 0, res * base, res);
+            base = base * base;
+        }
+
+        vd_t res_abs = (vd_t) ((vi_t) res & ~DBL_SIGN_BIT);
+        fast &= (res_abs >= DBL_MIN) & (res_abs <= DBL_MAX);
+
+        res     = SELECT (y < 0, 1.0 / res, res);
+        res_abs = (vd_t) ((vi_t) res & ~DBL_SIGN_BIT);
+        fast &= (res_abs >= DBL_MIN) & (res_abs <= DBL_MAX);
+
+        LIBM_FALLBACK (res, ~fast, pow (x[lane], y[lane]))
+        lhs_vec[i] = res;
+    }
+}
+
+/**
+ * @brief exp (x) = 2^k * exp (r), |r| <= ln (2) / 2, scaling is done in exponent bits
+ */
+KERNEL_BODY static void kernel_exp (double *arg, size_t n)
+{
+    assert (n % VM_VECTOR_WIDTH == 0 && "partial vector");
+
+    vd_t *vec = (vd_t *) arg;
+
+    for (size_t i = 0; i < n / VM_VECTOR_WIDTH; ++i)
+    {
+        vd_t x = vec[i];
+
+        vd_t t = x * LOG2E + ROUND_MAGIC;
+        vd_t k = t - ROUND_MAGIC;
+        vd_t r = (x - k * LN2_HI) - k * LN2_LO;
+
+        vd_t poly;
+        HORNER (poly, r, EXP_POLY);
+
+        vi_t scale = ((vi_t) t - ROUND_MAGIC_BITS + DBL_EXP_BIAS) << DBL_MANTISSA_BITS;
+        vd_t res   = poly * (vd_t) scale;
+
+        vi_t slow = ~((x >= EXP_FAST_MIN) & (x <= EXP_FAST_MAX));
+        LIBM_FALLBACK (res, slow, exp (x[lane]))
+        vec[i] = res;
+    }
+}
+
+/**
+ * @brief log (x) = e * ln (2) + log (m), sqrt (2) / 2 < m <= sqrt (2), log (m) is series in s = f / (2 + f)
+ */
+KERNEL_BODY static void kernel_log (double *arg, size_t n)
+{
+    assert (n % VM_VECTOR_WIDTH == 0 && "partial vector");
+
+    vd_t *vec = (vd_t *) arg;
+
+    for (size_t i = 0; i < n / VM_VECTOR_WIDTH; ++i)
+    {
+        vd_t x    = vec[i];
+        vi_t bits = (vi_t) x;
+
+        vi_t e_int = (bits >> DBL_MANTISSA_BITS) - DBL_EXP_BIAS;
+        vd_t m     = (vd_t) ((bits & DBL_MANTISSA_MASK) | DBL_ONE_BITS);
+
+        vi_t big = m > SQRT2;
+        m      = SELECT (big, m * 0.5, m);
+        e_int -= big;
+
+        vd_t e = (vd_t) (e_int + ROUND_MAGIC_BITS) - ROUND_MAGIC;
+        vd_t f = m - 1.0;
+        vd_t s = f / (2.0 + f);
+        vd_t z = s * s;
+
+        vd_t poly;
+        HORNER (poly, z, LOG_POLY);
+
+        vd_t hfsq = 0.5 * f * f;
+        vd_t res  = e * LN2_HI - ((hfsq - (s * (hfsq + z * poly) + e * LN2_LO)) - f);
+
+        vi_t slow = ~((x >= DBL_MIN) & (x <= DBL_MAX));
+        LIBM_FALLBACK (res, slow, log (x[lane]))
+        vec[i] = res;
+    }
+}
+
+/**
+ * @brief x = k * pi / 2 + r, |r| <= pi / 4, quadrant (k + shift) % 4 picks +-sin (r) or +-cos (r),
+ *        shift 1 turns sine into cosine
+ */
+KERNEL_BODY static void kernel_trig (double *arg, size_t n, int64_t shift)
+{
+    assert (n % VM_VECTOR_WIDTH == 0 && "partial vector");
+
+    vd_t *vec = (vd_t *) arg;
+
+    for (size_t i = 0; i < n / VM_VECTOR_WIDTH; ++i)
+    {
+        vd_t x = vec[i];
+
+        vd_t t = x * TWO_OVER_PI + ROUND_MAGIC;
+        vd_t k = t - ROUND_MAGIC;
+        vd_t r = ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_3;
+        vd_t z = r * r;
+
+        vd_t sin_poly, cos_poly;
+        HORNER (sin_poly, z, SIN_POLY);
+        HORNER (cos_poly, z, COS_POLY);
+
+        vi_t quadrant = (vi_t) t - ROUND_MAGIC_BITS + shift;
+
+        vd_t res = SELECT ((quadrant & 1) != 0, 1.0 + z * cos_poly, r + r * z * sin_poly);
+        res = (vd_t) ((vi_t) res ^ (((quadrant & 2) != 0) & DBL_SIGN_BIT));
+
+        vi_t slow = ~((x >= -TRIG_FAST_MAX) & (x <= TRIG_FAST_MAX));
+        LIBM_FALLBACK (res, slow, shift == 0 ? sin (x[lane]) : cos (x[lane]))
+        vec[i] = res;
+    }
+}
+
+KERNEL_BODY static void kernel_sin (double *arg, size_t n)
+{
+    kernel_trig (arg, n, 0);
+}
+
+KERNEL_BODY static void kernel_cos (double *arg, size_t n)
+{
+    kernel_trig (arg, n, 1);
+}
+
+#undef BROADCAST
+#undef SELECT
+#undef HORNER
+#undef LIBM_FALLBACK
+
+// -------------------------------------------------------------------------------------------------
+
+#define KERNEL_SET(set, target)                                                                     \
+    target static void set##_add (double *lhs, const double *rhs, size_t n) { kernel_add (lhs, rhs, n); } \
+    target static void set##_sub (double *lhs, const double *rhs, size_t n) { kernel_sub (lhs, rhs, n); } \
+    target static void set##_mul (double *lhs, const double *rhs, size_t n) { kernel_mul (lhs, rhs, n); } \
+    target static void set##_div (double *lhs, const double *rhs, size_t n) { kernel_div (lhs, rhs, n); } \
+    target static void set##_pow (double *lhs, const double *rhs, size_t n) { kernel_pow (lhs, rhs, n); } \
+    target static void set##_sin (double *arg, size_t n) { kernel_sin (arg, n); }                   \
+    target static void set##_cos (double *arg, size_t n) { kernel_cos (arg, n); }                   \
+    target static void set##_exp (double *arg, size_t n) { kernel_exp (arg, n); }                   \
+    target static void set##_log (double *arg, size_t n) { kernel_log (arg, n); }                   \
+                                                                                                    \
+    static const kernel_set_t set = {set##_add, set##_sub, set##_mul, set##_div, set##_pow,         \
+                                     set##_sin, set##_cos, set##_exp, set##_log};
+
+KERNEL_SET (DEFAULT_KERNELS, )
+
+#if defined(__x86_64__)
+    KERNEL_SET (AVX2_KERNELS, __attribute__ ((target ("avx2"))))
+#endif
+
+#undef KERNEL_SET
+
+/**
+ * @brief AVX2 kernels if CPU has them, baseline ones otherwise.
+ *        No set uses FMA, so results don't depend on CPU
+ */
+static const kernel_set_t *select_kernels ()
+{
+#if defined(__x86_64__)
+    static const bool has_avx2 = (__builtin_cpu_init (), __builtin_cpu_supports ("avx2"));
+    return has_avx2 ? &AVX2_KERNELS : &DEFAULT_KERNELS;
+#else
+    return &DEFAULT_KERNELS;
+#endif
+}
@@ -0,0 +1,72 @@
+#ifndef TREE_VM_H
+#define TREE_VM_H
+
+#include "tree.h"
+
+namespace tree
+{
+    enum class vm_op_t : unsigned char
+    {
+        CONST,      ///< Push consts[arg]
+        VAR_X,      ///< Push x
+        VAR_NAN,    ///< Push NAN (any variable except x)
+        ADD,
+        SUB,
+        DIV,
+        MUL,
+        SIN,
+        COS,
+        EXP,
+        POW,
+        LOG
+    };
+
+    struct vm_instr_t
+    {
+        vm_op_t  op;
+        unsigned arg;
+    };
+
+    struct batch_opts_t
+    {
+        unsigned n_threads     = 0;       ///< 0 means all hardware threads
+        size_t   chunk_size    = 0;       ///< Points per task, 0 means automatic
+        bool     deterministic = false;   ///< Chunks don't depend on number of threads
+    };
+
+    /**
+     * @brief Tree flattened into postfix bytecode with constant pool
+     */
+    struct program_t
+    {
+        vm_instr_t *code      = nullptr;
+        size_t      code_size = 0;
+
+        double *consts   = nullptr;
+        size_t  n_consts = 0;
+
+        size_t max_depth = 0;   ///< Stack depth needed to run the program
+    };
+
+    tree_err_t compile (const tree_t *tree, program_t *program);
+    tree_err_t compile (const node_t *node, program_t *program);
+
+    void program_dtor (program_t *program);
+
+    double calc_tree (const program_t *program, double x);
+
+    /**
+     * @brief Batch functions use vector polynomial kernels for sin, cos, exp, log and small integer
+     *        powers, results may differ from calc_tree by a few ulp but don't depend on CPU or threads
+     */
+    tree_err_t calc_tree_batch (const tree_t    *tree,    const double *xs, double *out, size_t n);
+    tree_err_t calc_tree_batch (const program_t *program, const double *xs, double *out, size_t n);
+
+    tree_err_t calc_tree_batch_mt (const program_t *program, const double *xs, double *out, size_t n,
+                                                               const batch_opts_t *opts = nullptr);
+    tree_err_t calc_trees_batch_mt (const program_t *programs, size_t n_programs,
+                                    const double *xs, double *out, size_t n,
+                                                               const batch_opts_t *opts = nullptr);
+}
+
+#endif